@@ -327,9 +327,10 @@ async_nif_enqueue_req(struct async_nif_state* async_nif, struct async_nif_req_en
       q = &async_nif->queues[qid];
       enif_mutex_lock(q->reqs_mutex);
 
-      /* Try not to enqueue a request into a queue that isn't keeping up with
-         the request volume. */
-      if (q->depth <= avg_depth) break;
+      /* Requests with an affinity must land on their queue, all others
+         try not to enqueue a request into a queue that isn't keeping up
+         with the request volume. */
+      if (hint >= 0 || q->depth <= avg_depth) break;
       else {
           enif_mutex_unlock(q->reqs_mutex);
           qid = (qid + 1) % async_nif->num_queues;
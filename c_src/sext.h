@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2012 Basho Technologies, Inc. All Rights Reserved.
+ * Author: Gregory Burd <greg@basho.com> <greg@burd.me>
+ *
+ * This file is provided to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file
+ * except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef __SEXT_H__
+#define __SEXT_H__
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Just enough of the sext (sortable serialization of Erlang terms)
+ * encoding to find the elements of an encoded tuple without decoding it,
+ * and to encode and decode the binaries, atoms and small integers Riak
+ * keys are made of.  Encoded terms sort in term order, so an element can
+ * be compared with another encoded term using memcmp.  Terms in the other
+ * encodings (floats, bignums, pids, ports, refs and bitstrings) are
+ * recognised but can't be walked past, which callers are told apart from
+ * bytes that aren't a term at all, see SEXT_UNSUPPORTED.
+ */
+
+#define SEXT_NEGBIG    8
+#define SEXT_NEG4      9
+#define SEXT_POS4      10
+#define SEXT_POSBIG    11
+#define SEXT_ATOM      12
+#define SEXT_REFERENCE 13
+#define SEXT_PORT      14
+#define SEXT_PID       15
+#define SEXT_TUPLE     16
+#define SEXT_LIST      17
+#define SEXT_BINARY    18
+#define SEXT_BIN_TAIL  19
+
+#define SEXT_LIST_END  2
+
+/* sext_skip of a term in an encoding we can't find the end of. */
+#define SEXT_UNSUPPORTED ((size_t)-1)
+
+/**
+ * Skip the bit-stuffed bytes of an encoded binary or atom: each byte is
+ * nine bits, a 1 then the byte, followed by zero padding to a byte
+ * boundary and the byte 8 (or just the byte 8 when it is empty).
+ *
+ * ->   the length of the encoding, or 0 if it is truncated
+ */
+static inline size_t
+sext_skip_bin_elems(const uint8_t *p, size_t len)
+{
+    size_t bit = 0;
+
+    for (;;) {
+        if (bit / 8 >= len)
+            return 0;
+        if (!(p[bit / 8] & (0x80 >> (bit % 8))))
+            break;
+        bit += 9;
+    }
+    /* An empty binary is just the terminator, otherwise the padding runs
+       to the next byte boundary after the first 0 bit. */
+    size_t end = (bit == 0) ? 0 : (bit / 8) + 1;
+    if (end >= len || p[end] != 8)
+        return 0;
+    return end + 1;
+}
+
+/**
+ * ->   the length of n bytes once bit-stuffed, see sext_skip_bin_elems
+ */
+static inline size_t
+sext_bin_elems_size(size_t n)
+{
+    return n == 0 ? 1 : (9 * n + 8 - n % 8) / 8 + 1;
+}
+
+/**
+ * Bit-stuff n bytes into out, which must have room for
+ * sext_bin_elems_size(n) bytes.
+ *
+ * ->   the number of bytes written
+ */
+static inline size_t
+sext_encode_bin_elems(uint8_t *out, const uint8_t *p, size_t n)
+{
+    size_t size = sext_bin_elems_size(n);
+    size_t bit = 0;
+    size_t i;
+
+    memset(out, 0, size);
+    for (i = 0; i < n; i++, bit += 9) {
+        /* The 1 and the byte, lined up at this bit in a 16 bit window. */
+        unsigned int w = (0x100u | p[i]) << (7 - bit % 8);
+        out[bit / 8] |= (uint8_t)(w >> 8);
+        out[bit / 8 + 1] |= (uint8_t)(w & 0xff);
+    }
+    out[size - 1] = 8;
+    return size;
+}
+
+/**
+ * Undo sext_encode_bin_elems, writing the bytes to out unless it is NULL
+ * (to find how many there are first).
+ *
+ * ->   the length of the encoding with the number of bytes in *n, or 0 if
+ *      it is truncated
+ */
+static inline size_t
+sext_decode_bin_elems(const uint8_t *p, size_t len, uint8_t *out, size_t *n)
+{
+    size_t bit = 0;
+    size_t count = 0;
+
+    for (;;) {
+        if (bit / 8 >= len)
+            return 0;
+        if (!(p[bit / 8] & (0x80 >> (bit % 8))))
+            break;
+        if (bit / 8 + 1 >= len)
+            return 0;
+        if (out) {
+            unsigned int w = ((unsigned int)p[bit / 8] << 8) | p[bit / 8 + 1];
+            out[count] = (uint8_t)(w >> (7 - bit % 8));
+        }
+        count++;
+        bit += 9;
+    }
+    size_t end = (bit == 0) ? 0 : (bit / 8) + 1;
+    if (end >= len || p[end] != 8)
+        return 0;
+    *n = count;
+    return end + 1;
+}
+
+/**
+ * ->   the length of the encoded term at p, 0 if it is truncated or not a
+ *      term, or SEXT_UNSUPPORTED if it is (or holds) a float, bignum, pid,
+ *      port, ref or bitstring, which we don't know how to skip
+ */
+static inline size_t
+sext_skip(const uint8_t *p, size_t len)
+{
+    size_t used;
+    size_t n;
+    uint32_t arity;
+
+    if (len == 0)
+        return 0;
+    switch (p[0]) {
+    case SEXT_NEG4:
+    case SEXT_POS4:
+        /* 31 bits of integer then a flag set when a float fraction
+           follows. */
+        if (len < 5)
+            return 0;
+        return (p[4] & 1) ? SEXT_UNSUPPORTED : 5;
+    case SEXT_NEGBIG:
+    case SEXT_POSBIG:
+    case SEXT_REFERENCE:
+    case SEXT_PORT:
+    case SEXT_PID:
+    case SEXT_BIN_TAIL:
+        return SEXT_UNSUPPORTED;
+    case SEXT_ATOM:
+    case SEXT_BINARY:
+        n = sext_skip_bin_elems(p + 1, len - 1);
+        return n ? n + 1 : 0;
+    case SEXT_TUPLE:
+        if (len < 5)
+            return 0;
+        arity = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+            ((uint32_t)p[3] << 8) | (uint32_t)p[4];
+        used = 5;
+        while (arity-- > 0) {
+            if ((n = sext_skip(p + used, len - used)) == 0 || n == SEXT_UNSUPPORTED)
+                return n;
+            used += n;
+        }
+        return used;
+    case SEXT_LIST:
+        used = 1;
+        while (used < len && p[used] != SEXT_LIST_END) {
+            if ((n = sext_skip(p + used, len - used)) == 0 || n == SEXT_UNSUPPORTED)
+                return n;
+            used += n;
+        }
+        return used < len ? used + 1 : 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Find element n (1-based, as element/2) of an encoded tuple.
+ *
+ * ->   1 and the element's encoding in *elem and *elem_size, 0 if the term
+ *      isn't a tuple of at least n elements, or -1 if element n, or one
+ *      before it, is in an encoding sext_skip can't walk
+ */
+static inline int
+sext_tuple_element(const uint8_t *p, size_t len, uint32_t n,
+                   const uint8_t **elem, size_t *elem_size)
+{
+    uint32_t arity;
+    size_t used = 5;
+    size_t skip;
+
+    if (len < 5 || p[0] != SEXT_TUPLE || n == 0)
+        return 0;
+    arity = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+        ((uint32_t)p[3] << 8) | (uint32_t)p[4];
+    if (n > arity)
+        return 0;
+    while (--n > 0) {
+        if ((skip = sext_skip(p + used, len - used)) == 0)
+            return 0;
+        if (skip == SEXT_UNSUPPORTED)
+            return -1;
+        used += skip;
+    }
+    if ((skip = sext_skip(p + used, len - used)) == 0)
+        return 0;
+    if (skip == SEXT_UNSUPPORTED)
+        return -1;
+    *elem = p + used;
+    *elem_size = skip;
+    return 1;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // __SEXT_H__
@@ -25,17 +25,36 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "wiredtiger.h"
+#include "snappy-c.h"
 
 #include "common.h"
 #include "async_nif.h"
 #include "queue.h"
+#include "sext.h"
 
 #define MAX_CACHE_SIZE ASYNC_NIF_MAX_WORKERS
+#define MAX_CTX_CURSORS 16
+#define MAX_PINNED_VALUES 64
+#define MAX_LOST_SNAPSHOTS 64
+#define DROP_BACKOFF_MAX 60
+
+/* Named snapshots, shared by sessions, came in WiredTiger 2.6 and went in
+   10.0. */
+#if (WIREDTIGER_VERSION_MAJOR == 2 && WIREDTIGER_VERSION_MINOR >= 6) || \
+    (WIREDTIGER_VERSION_MAJOR > 2 && WIREDTIGER_VERSION_MAJOR < 10)
+#define WTERL_NAMED_SNAPSHOTS 1
+#endif
 
 static ErlNifResourceType *wterl_conn_RESOURCE;
 static ErlNifResourceType *wterl_cursor_RESOURCE;
+static ErlNifResourceType *wterl_session_RESOURCE;
+static ErlNifResourceType *wterl_pinned_RESOURCE;
+static ErlNifResourceType *wterl_stream_RESOURCE;
+static ErlNifResourceType *wterl_snapshot_RESOURCE;
 
 typedef char Uri[128];
 
@@ -53,19 +72,194 @@ struct wterl_ctx {
     } ci[]; // Note: must be last in struct
 };
 
+/* Options handled by wterl itself rather than passed to WiredTiger. */
+struct wterl_conn_options {
+    uint64_t zero_copy_threshold;
+    uint32_t ttl_reap_interval;  // seconds between expired key removals
+    uint32_t ttl_reap_batch;     // expired keys removed per transaction
+    uint32_t merge_compact_interval; // seconds between merge compactions
+    uint32_t session_cache_max;  // idle contexts (and sessions) kept cached
+};
+
+/* Features wterl layers over a WiredTiger table, see ttl_enable,
+   set_merge_operator and hashtree_enable. */
+struct wterl_table {
+    Uri uri;
+    int ttl;
+    int merge_op;
+    uint32_t ht_segments;        // 0 unless the table has a hashtree
+    uint32_t ht_width;
+    int merge_dirty;             // operands merged since the last compaction
+};
+
+/* A table dropped with drop_deferred.  It is truncated, then dropped, by
+   the janitor, retrying with backoff while cursors on it are still open. */
+struct wterl_drop {
+    Uri uri;
+    uint32_t attempts;
+    time_t next_attempt;
+    int truncated;
+};
+
+/* Counters reported by conn_stats, updated atomically. */
+struct wterl_conn_stats {
+    uint64_t ctx_cache_hits;     // contexts reused from the cache
+    uint64_t ctx_cache_misses;   // contexts made, each a new session
+    uint64_t ctx_cache_evicted;  // contexts (and sessions) closed by eviction
+    uint64_t cursors_opened;
+    uint64_t cursors_closed;     // closed with cursor_close
+    uint64_t cursors_collected;  // released when garbage collected
+};
+
 typedef struct wterl_conn {
     WT_CONNECTION *conn;
+    WT_EVENT_HANDLER *event_handler;
     const char *session_config;
     STAILQ_HEAD(ctxs, wterl_ctx) cache;
     ErlNifMutex *cache_mutex;
     uint32_t cache_size;
+    uint32_t next_affinity;
+    uint32_t num_pinned;
+    struct wterl_conn_options opts;
+    uint64_t merge_seq;
+    ErlNifRWLock *tables_lock;
+    uint32_t num_tables;
+    uint32_t max_tables;          // tables grows as needed, under tables_lock
+    struct wterl_table *tables;
+    uint32_t num_drops;
+    uint32_t max_drops;           // drops grows as needed, under tables_lock
+    struct wterl_drop *drops;
+    uint32_t num_lost_snapshots;  // collected unreleased, for the janitor to drop
+    char lost_snapshots[MAX_LOST_SNAPSHOTS][32];
+    ErlNifTid janitor_tid;
+    int janitor_running;
+    volatile int janitor_stop;
+    struct wterl_conn_stats stats;
+    uint32_t next_snapshot;
 } WterlConnHandle;
 
+/* A cursor drawn from the connection's context cache, its session and
+   cursor are the context's and go back to the cache when it is closed or
+   garbage collected.  Operations on a cursor are sent to one work queue,
+   chosen when it is opened, but a queue has several workers so each
+   operation also holds the cursor's mutex while it uses the cursor, see
+   __cursor_enter. */
 typedef struct {
+    WterlConnHandle *conn_handle;
+    struct wterl_ctx *ctx;
     WT_SESSION *session;
     WT_CURSOR *cursor;
+    WT_CURSOR *ttl_cursor;  // the table's expiry table, if it has TTLs
+    ErlNifMutex *mutex;
+    unsigned int affinity;
+    int streaming;  // a stream is reading it, see stream_range
+    int in_txn;  // reading a snapshot, see snapshot_cursor_open
 } WterlCursorHandle;
 
+/* A named snapshot, see snapshot_create. */
+typedef struct {
+    WterlConnHandle *conn_handle;
+    char name[32];
+    time_t created;
+    int dropped;
+} WterlSnapshotHandle;
+
+typedef struct {
+    WterlConnHandle *conn_handle;
+    WT_SESSION *session;
+    ErlNifPid owner;
+    unsigned int affinity;
+    uint32_t num_cursors;
+    struct session_cursor {
+        Uri uri;
+        WT_CURSOR *cursor;
+    } sc[MAX_CTX_CURSORS];
+} WterlSessionHandle;
+
+typedef struct {
+    WterlConnHandle *conn_handle;
+    struct wterl_ctx *ctx;
+    uint32_t worker_id;  // the worker that retained ctx
+} WterlPinnedValue;
+
+/* Where a range scan stops: at the end of the table, after a key, before
+   a key or once keys no longer share a prefix. */
+#define RANGE_LAST 0
+#define RANGE_KEY 1
+#define RANGE_PREFIX 2
+#define RANGE_BEFORE 3
+
+struct wterl_range_end {
+    int kind;
+    uint8_t *key;
+    size_t size;
+};
+
+/* A filter a record must match to be sent by a stream, see __filter_parse. */
+#define FILTER_ALL 0
+#define FILTER_PREFIX 1
+#define FILTER_RANGE 2
+#define FILTER_KEY_SIZE 3
+#define FILTER_VALUE_SIZE 4
+#define FILTER_ELEMENT 5
+#define FILTER_AND 6
+#define FILTER_OR 7
+#define FILTER_NOT 8
+
+#define FILTER_EQ 0
+#define FILTER_NE 1
+#define FILTER_LT 2
+#define FILTER_LE 3
+#define FILTER_GT 4
+#define FILTER_GE 5
+
+/* An element filter met a tuple key it can't walk (see sext_skip), reported
+   as {error, badarg}.  Outside the range WiredTiger reserves for its own
+   errors. */
+#define WTERL_UNWALKABLE (-31700)
+
+#define MAX_FILTER_DEPTH 8
+
+/* Records a stream examines per chunk, as a multiple of the chunk size. */
+#define STREAM_SCAN_FACTOR 64
+
+struct wterl_filter {
+    int op;
+    int cmp;
+    uint32_t n;
+    uint64_t min;
+    uint64_t max;
+    uint8_t *a;
+    size_t a_size;
+    uint8_t *b;
+    size_t b_size;
+    unsigned int num_children;
+    struct wterl_filter *children;
+};
+
+typedef struct {
+    WterlCursorHandle *cursor_handle;
+    ErlNifMutex *mutex;
+    ErlNifCond *cond;  // signalled when producing is cleared
+    ErlNifEnv *env;
+    ERL_NIF_TERM ref;
+    ErlNifPid pid;
+    struct wterl_range_end end;
+    struct wterl_filter filter;
+    int what;
+    int key_format;
+    int compress;  // BATCH_CHUNK only, compress chunks with snappy
+    uint32_t batch_count;
+    uint64_t batch_bytes;
+    uint32_t credits;
+    int positioned;
+    int at_end;
+    int producing;
+    int done;
+    int attached;  // holds its cursor's streaming flag
+    int close_cursor;  // close the cursor once done, see export_table
+} WterlStreamHandle;
+
 struct wterl_event_handlers {
     WT_EVENT_HANDLER handlers;
     ErlNifEnv *msg_env_error;
@@ -95,6 +289,56 @@ static ERL_NIF_TERM ATOM_PROGRESS;
 static ERL_NIF_TERM ATOM_WTERL_VSN;
 static ERL_NIF_TERM ATOM_WIREDTIGER_VSN;
 static ERL_NIF_TERM ATOM_MSG_PID;
+static ERL_NIF_TERM ATOM_PUT;
+static ERL_NIF_TERM ATOM_DELETE;
+static ERL_NIF_TERM ATOM_ZERO_COPY_THRESHOLD;
+static ERL_NIF_TERM ATOM_DUPLICATE_KEY;
+static ERL_NIF_TERM ATOM_ROLLBACK;
+static ERL_NIF_TERM ATOM_MISMATCH;
+static ERL_NIF_TERM ATOM_HASH;
+static ERL_NIF_TERM ATOM_TTL_REAP_INTERVAL;
+static ERL_NIF_TERM ATOM_TTL_REAP_BATCH;
+static ERL_NIF_TERM ATOM_MERGE_COMPACT_INTERVAL;
+static ERL_NIF_TERM ATOM_SESSION_CACHE_MAX;
+static ERL_NIF_TERM ATOM_ADD;
+static ERL_NIF_TERM ATOM_MAX;
+static ERL_NIF_TERM ATOM_APPEND;
+static ERL_NIF_TERM ATOM_DONE;
+static ERL_NIF_TERM ATOM_NEXT;
+static ERL_NIF_TERM ATOM_PREV;
+static ERL_NIF_TERM ATOM_KV;
+static ERL_NIF_TERM ATOM_KEY;
+static ERL_NIF_TERM ATOM_VALUE;
+static ERL_NIF_TERM ATOM_PREFIX;
+static ERL_NIF_TERM ATOM_BEFORE;
+static ERL_NIF_TERM ATOM_ALL;
+static ERL_NIF_TERM ATOM_RANGE;
+static ERL_NIF_TERM ATOM_KEY_SIZE;
+static ERL_NIF_TERM ATOM_VALUE_SIZE;
+static ERL_NIF_TERM ATOM_ELEMENT;
+static ERL_NIF_TERM ATOM_EQ;
+static ERL_NIF_TERM ATOM_NE;
+static ERL_NIF_TERM ATOM_LT;
+static ERL_NIF_TERM ATOM_LE;
+static ERL_NIF_TERM ATOM_GT;
+static ERL_NIF_TERM ATOM_GE;
+static ERL_NIF_TERM ATOM_AND;
+static ERL_NIF_TERM ATOM_OR;
+static ERL_NIF_TERM ATOM_NOT;
+static ERL_NIF_TERM ATOM_COUNT;
+static ERL_NIF_TERM ATOM_KEY_BYTES;
+static ERL_NIF_TERM ATOM_VALUE_BYTES;
+static ERL_NIF_TERM ATOM_MIN_KEY;
+static ERL_NIF_TERM ATOM_MAX_KEY;
+static ERL_NIF_TERM ATOM_MORE;
+static ERL_NIF_TERM ATOM_DATA;
+static ERL_NIF_TERM ATOM_WTERL_STREAM;
+static ERL_NIF_TERM ATOM_RAW;
+static ERL_NIF_TERM ATOM_SEXT;
+static ERL_NIF_TERM ATOM_OBJECT;
+static ERL_NIF_TERM ATOM_CHUNK;
+static ERL_NIF_TERM ATOM_NONE;
+static ERL_NIF_TERM ATOM_SNAPPY;
 
 /* Global init for async_nif. */
 ASYNC_NIF_INIT(wterl);
@@ -147,6 +391,35 @@ __crc32(uint32_t crc, const char *bytes, size_t len)
 #error unsupported platform
 #endif
 
+/**
+ * The zlib (IEEE 802.3) CRC-32, the same checksum as erlang:crc32/1, so
+ * that callers can compare values by hash without shipping them here.
+ * The table is filled in once by on_load.
+ */
+static uint32_t __zlib_crc32_table[256];
+
+static void
+__zlib_crc32_init(void)
+{
+    uint32_t i, j, c;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        __zlib_crc32_table[i] = c;
+    }
+}
+
+static inline uint32_t
+__zlib_crc32(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--)
+        crc = __zlib_crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
 /**
  * Calculate the log2 of 64bit unsigned integers.
  */
@@ -175,41 +448,79 @@ static inline uint32_t __log2(uint64_t x) {
 }
 #endif
 
+/**
+ * Is the table waiting to be dropped by the janitor?  New contexts on it
+ * are refused and released ones aren't cached.
+ */
+static int
+__drop_pending(WterlConnHandle *conn_handle, const char *uri)
+{
+    uint32_t i;
+    int found = 0;
+
+    if (conn_handle->num_drops == 0)
+        return 0;
+    enif_rwlock_rlock(conn_handle->tables_lock);
+    for (i = 0; i < conn_handle->num_drops; i++) {
+        if (strcmp(conn_handle->drops[i].uri, uri) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    enif_rwlock_runlock(conn_handle->tables_lock);
+    return found;
+}
+
+/**
+ * Close the least recently used contexts in the cache, and their sessions,
+ * until at most keep remain.  Contexts are returned to the tail of the
+ * cache so the oldest are at its head.
+ *
+ * Note: always call within enif_mutex_lock/unlock(conn_handle->cache_mutex)
+ *
+ * ->   number of items evicted
+ */
+static uint32_t
+__ctx_cache_trim(WterlConnHandle *conn_handle, uint32_t keep)
+{
+    uint32_t num_evicted = 0;
+    struct wterl_ctx *c;
+
+    while (conn_handle->cache_size > keep &&
+           (c = STAILQ_FIRST(&conn_handle->cache)) != NULL) {
+        STAILQ_REMOVE_HEAD(&conn_handle->cache, entries);
+        conn_handle->cache_size -= 1;
+        if (c->session)
+            c->session->close(c->session, NULL);
+        free(c);
+        num_evicted++;
+        __sync_add_and_fetch(&conn_handle->stats.ctx_cache_evicted, 1);
+    }
+    return num_evicted;
+}
+
 /**
  * Evict items from the cache.
  *
  * Evict old contexts from the cache to make space for new, more frequently
- * used contexts.
+ * used contexts.  Each cached context holds a session, and one is cached
+ * for every combination of tables and configs used, so the cache is kept
+ * within the connection's session_cache_max as tables multiply.
  *
  * ->   number of items evicted
  */
 static int
 __ctx_cache_evict(WterlConnHandle *conn_handle)
 {
-    uint32_t mean, num_evicted;
-    struct wterl_ctx *c;
+    uint32_t max = conn_handle->opts.session_cache_max;
 
 #ifndef DEBUG
-    if (conn_handle->cache_size < MAX_CACHE_SIZE)
+    if (conn_handle->cache_size < max)
         return 0;
 #endif
 
-    mean = conn_handle->cache_size / 2;
-    if (mean < 2) return 0;
-
-    num_evicted = 0;
-    while (mean--) {
-	c = STAILQ_LAST(&conn_handle->cache, wterl_ctx, entries);
-	if (c) {
-            STAILQ_REMOVE(&conn_handle->cache, c, wterl_ctx, entries);
-            if (c->session)
-                c->session->close(c->session, NULL);
-            free(c);
-            num_evicted++;
-        }
-    }
-    conn_handle->cache_size -= num_evicted;
-    return num_evicted;
+    if (conn_handle->cache_size / 2 < 2) return 0;
+    return __ctx_cache_trim(conn_handle, max / 2);
 }
 
 /**
@@ -245,8 +556,9 @@ __ctx_cache_find(WterlConnHandle *conn_handle, const uint64_t sig)
 /**
  * Add/Return an item to the cache.
  *
- * Return an item into the cache, reset the cursors it has open and put it at
- * the front of the LRU.
+ * Return an item into the cache, after making room for it, at the tail of
+ * the LRU so that it is the last to be evicted.  Its cursors were reset by
+ * __release_ctx.
  */
 static void
 __ctx_cache_add(WterlConnHandle *conn_handle, struct wterl_ctx *c)
@@ -280,11 +592,14 @@ __copy_str_into(char **p, const char *s)
 /**
  * Get a reusable cursor that was opened for a particular worker within its
  * session.
+ *
+ * pairs   an array of 2 * count strings, alternating uri and cursor config,
+ *         one pair for each cursor to open within the context's session
  */
 static int
-__retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
-             struct wterl_ctx **ctx,
-             int count, const char *session_config, ...)
+__retain_ctx_array(WterlConnHandle *conn_handle, uint32_t worker_id,
+                   struct wterl_ctx **ctx,
+                   int count, const char *session_config, const char **pairs)
 {
     UNUSED(worker_id);
     int i = 0;
@@ -292,12 +607,9 @@ __retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
     uint32_t crc = 0;
     uint64_t sig = 0;
     size_t l, sig_len = 0;
-    va_list ap;
     const char *arg;
     struct wterl_ctx *c;
 
-    arg = session_config;
-    va_start(ap, session_config);
     if (session_config) {
         l = __strlen(session_config);
         hash = __str_hash(hash, session_config, l);
@@ -308,7 +620,7 @@ __retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
         sig_len += 1;
     }
     for (i = 0; i < (2 * count); i++) {
-        arg = va_arg(ap, const char *);
+        arg = pairs[i];
         if (arg) {
             l = __strlen(arg);
             DPRINTF("sig/args: %s", arg);
@@ -321,17 +633,31 @@ __retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
     }
     sig = (uint64_t)crc << 32 | hash;
     DPRINTF("sig %llu [%u:%u]", PRIuint64(sig), crc, hash);
-    va_end(ap);
+
+    for (i = 0; i < count; i++)
+        if (pairs[2 * i] && __drop_pending(conn_handle, pairs[2 * i]))
+            return ENOENT;
 
     // check the cache
     c = __ctx_cache_find(conn_handle, sig);
     if (c == NULL) {
 	// cache miss:
 	DPRINTF("[%.4u] cache miss: %llu [cache size: %d]", worker_id, PRIuint64(sig), conn_handle->cache_size);
+	__sync_add_and_fetch(&conn_handle->stats.ctx_cache_misses, 1);
 	WT_CONNECTION *conn = conn_handle->conn;
 	WT_SESSION *session = NULL;
 	int rc = conn->open_session(conn, NULL, session_config, &session);
-	if (rc != 0) return rc;
+	if (rc != 0) {
+	    /* Likely out of sessions (session_max), close the idle ones the
+	       cache is holding and try once more. */
+	    enif_mutex_lock(conn_handle->cache_mutex);
+	    uint32_t n = __ctx_cache_trim(conn_handle, 0);
+	    enif_mutex_unlock(conn_handle->cache_mutex);
+	    if (n == 0)
+	        return rc;
+	    rc = conn->open_session(conn, NULL, session_config, &session);
+	    if (rc != 0) return rc;
+	}
 	size_t s = sizeof(struct wterl_ctx) + (count * sizeof(struct cursor_info)) + sig_len;
 	c = malloc(s); // TODO: enif_alloc_resource()
 	if (c == NULL) {
@@ -345,11 +671,9 @@ __retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
 	char *p = (char *)c + (s - sig_len);
 	c->session_config = __copy_str_into(&p, session_config);
 	c->num_cursors = count;
-	session_config = arg;
-	va_start(ap, session_config);
 	for (i = 0; i < count; i++) {
-	    const char *uri = va_arg(ap, const char *);
-	    const char *config = va_arg(ap, const char *);
+	    const char *uri = pairs[2 * i];
+	    const char *config = pairs[(2 * i) + 1];
 	    // TODO: what to do (if anything) when uri or config is NULL?
 	    c->ci[i].uri = __copy_str_into(&p, uri);
 	    c->ci[i].config = __copy_str_into(&p, config);
@@ -357,19 +681,52 @@ __retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
 	    if (rc != 0) {
 		free(c);
 		session->close(session, NULL); // this will free the cursors too
-		va_end(ap);
 		return rc;
 	    }
 	}
-	va_end(ap);
     } else {
 	// cache hit:
 	DPRINTF("[%.4u] cache hit: %llu [cache size: %d]", worker_id, PRIuint64(sig), conn_handle->cache_size);
+	__sync_add_and_fetch(&conn_handle->stats.ctx_cache_hits, 1);
     }
     *ctx = c;
     return 0;
 }
 
+/**
+ * Get a reusable cursor that was opened for a particular worker within its
+ * session.  The variable arguments are count pairs of uri and cursor config
+ * strings.
+ */
+static int
+__retain_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
+             struct wterl_ctx **ctx,
+             int count, const char *session_config, ...)
+{
+    int i;
+    va_list ap;
+    const char *pairs[2 * MAX_CTX_CURSORS];
+
+    if (count > MAX_CTX_CURSORS)
+        return EINVAL;
+    va_start(ap, session_config);
+    for (i = 0; i < (2 * count); i++)
+        pairs[i] = va_arg(ap, const char *);
+    va_end(ap);
+    return __retain_ctx_array(conn_handle, worker_id, ctx, count, session_config, pairs);
+}
+
+/**
+ * ->   1 if a cursor config opens a bulk cursor, see import_chunk
+ */
+static int
+__bulk_config(const char *config)
+{
+    const char *p = config ? strstr(config, "bulk") : NULL;
+
+    return p && strncmp(p, "bulk=false", 10) != 0 && strncmp(p, "bulk=0", 6) != 0;
+}
+
 /**
  * Return a context to the cache for reuse.
  */
@@ -381,6 +738,15 @@ __release_ctx(WterlConnHandle *conn_handle, uint32_t worker_id, struct wterl_ctx
     WT_CURSOR *cursor;
 
     for (i = 0; i < ctx->num_cursors; i++) {
+        /* Don't keep the table open when the janitor is waiting to drop
+           it, and never reuse a bulk cursor, the load ends when it is
+           closed. */
+        if (__drop_pending(conn_handle, ctx->ci[i].uri) ||
+            __bulk_config(ctx->ci[i].config)) {
+            ctx->session->close(ctx->session, NULL);
+            free(ctx);
+            return;
+        }
         cursor = ctx->ci[i].cursor;
         cursor->reset(cursor);
     }
@@ -388,6 +754,46 @@ __release_ctx(WterlConnHandle *conn_handle, uint32_t worker_id, struct wterl_ctx
     DPRINTF("[%.4u] reset %d cursors, returnd ctx to cache", worker_id, ctx->num_cursors);
 }
 
+/**
+ * Hand a value to Erlang without copying it.
+ *
+ * When the value is at least the connection's zero_copy_threshold the
+ * context (and so the positioned cursor holding the value in WiredTiger's
+ * cache) is moved into a pinned resource and the value is returned as a
+ * resource binary pointing straight at the cursor's memory.  The context
+ * is released back to the cache when the binary is garbage collected.
+ * Small values, or values past the limit on outstanding pinned values,
+ * are not pinned and the caller must copy them as usual.
+ *
+ * ->   1 if the value was pinned (ctx now belongs to the binary), else 0
+ */
+static int
+__pin_value(ErlNifEnv *env, WterlConnHandle *conn_handle, uint32_t worker_id,
+            struct wterl_ctx *ctx, WT_ITEM *item, ERL_NIF_TERM *value)
+{
+    WterlPinnedValue *pv;
+    uint64_t threshold = conn_handle->opts.zero_copy_threshold;
+
+    if (threshold == 0 || item->size < threshold)
+        return 0;
+    if (__sync_add_and_fetch(&conn_handle->num_pinned, 1) > MAX_PINNED_VALUES) {
+        __sync_sub_and_fetch(&conn_handle->num_pinned, 1);
+        return 0;
+    }
+    pv = enif_alloc_resource(wterl_pinned_RESOURCE, sizeof(WterlPinnedValue));
+    if (!pv) {
+        __sync_sub_and_fetch(&conn_handle->num_pinned, 1);
+        return 0;
+    }
+    pv->conn_handle = conn_handle;
+    pv->ctx = ctx;
+    pv->worker_id = worker_id;
+    enif_keep_resource((void*)conn_handle);
+    *value = enif_make_resource_binary(env, pv, item->data, item->size);
+    enif_release_resource(pv);
+    return 1;
+}
+
 /**
  * Close all sessions and all cursors open on any objects.
  *
@@ -572,6 +978,15 @@ __strerror_term(ErlNifEnv* env, int rc)
 {
     if (rc == WT_NOTFOUND) {
         return ATOM_NOT_FOUND;
+    } else if (rc == WTERL_UNWALKABLE) {
+        return enif_make_tuple2(env, ATOM_ERROR, enif_make_atom(env, "badarg"));
+    } else if (rc == WT_DUPLICATE_KEY) {
+        return ATOM_DUPLICATE_KEY;
+    } else if (rc == WT_ROLLBACK) {
+        /* erl_errno_id() knows nothing of WiredTiger's own error codes. */
+        return enif_make_tuple2(env, ATOM_ERROR,
+                    enif_make_tuple2(env, ATOM_ROLLBACK,
+                         enif_make_string(env, wiredtiger_strerror(rc), ERL_NIF_LATIN1)));
     } else {
         /* We return the errno value as well as the message here because the
            error message provided by strerror() for differ across platforms
@@ -587,385 +1002,7059 @@ __strerror_term(ErlNifEnv* env, int rc)
 }
 
 /**
- * Opens a WiredTiger WT_CONNECTION object.
+ * Parse the options wterl handles itself, a proplist of {Name, Value}.
+ * Unknown options are ignored.
  *
- * argv[0]    path to directory for the database files
- * argv[1]    WiredTiger connection config string as an Erlang binary
- * argv[2]    WiredTiger session config string as an Erlang binary
+ * ->   1 on success, 0 if the list is malformed
  */
-ASYNC_NIF_DECL(
-  wterl_conn_open,
-  { // struct
+static int
+__conn_options(ErlNifEnv *env, ERL_NIF_TERM list, struct wterl_conn_options *opts)
+{
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail = list;
+    const ERL_NIF_TERM *option;
+    int arity;
+    ErlNifUInt64 n;
+
+    memset(opts, 0, sizeof(struct wterl_conn_options));
+    opts->ttl_reap_interval = 60;
+    opts->ttl_reap_batch = 1000;
+    opts->merge_compact_interval = 60;
+    opts->session_cache_max = MAX_CACHE_SIZE;
+    if (!enif_is_list(env, list))
+        return 0;
+    while (enif_get_list_cell(env, tail, &head, &tail)) {
+        if (!enif_get_tuple(env, head, &arity, &option) || arity != 2)
+            return 0;
+        if (enif_is_identical(option[0], ATOM_ZERO_COPY_THRESHOLD)) {
+            if (!enif_get_uint64(env, option[1], &n))
+                return 0;
+            opts->zero_copy_threshold = n;
+        } else if (enif_is_identical(option[0], ATOM_TTL_REAP_INTERVAL)) {
+            if (!enif_get_uint64(env, option[1], &n) || n == 0)
+                return 0;
+            opts->ttl_reap_interval = (uint32_t)n;
+        } else if (enif_is_identical(option[0], ATOM_TTL_REAP_BATCH)) {
+            if (!enif_get_uint64(env, option[1], &n) || n == 0)
+                return 0;
+            opts->ttl_reap_batch = (uint32_t)n;
+        } else if (enif_is_identical(option[0], ATOM_MERGE_COMPACT_INTERVAL)) {
+            if (!enif_get_uint64(env, option[1], &n) || n == 0)
+                return 0;
+            opts->merge_compact_interval = (uint32_t)n;
+        } else if (enif_is_identical(option[0], ATOM_SESSION_CACHE_MAX)) {
+            if (!enif_get_uint64(env, option[1], &n) || n == 0)
+                return 0;
+            opts->session_cache_max = (uint32_t)n;
+        }
+    }
+    return 1;
+}
 
-    ERL_NIF_TERM config;
-    ERL_NIF_TERM session_config;
-    char homedir[4096];
-    struct wterl_priv_data *priv;
-  },
-  { // pre
+/**
+ * Find the wterl features enabled on a table.
+ *
+ * ->   1 and a copy of its entry if the table has any, otherwise 0
+ */
+static int
+__table_lookup(WterlConnHandle *conn_handle, const char *uri, struct wterl_table *table)
+{
+    uint32_t i;
+    int found = 0;
 
-    if (!(argc == 3 &&
-          (enif_get_string(env, argv[0], args->homedir, sizeof(args->homedir), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[1]) &&
-          enif_is_binary(env, argv[2]))) {
-      ASYNC_NIF_RETURN_BADARG();
+    if (conn_handle->num_tables == 0)
+        return 0;
+    enif_rwlock_rlock(conn_handle->tables_lock);
+    for (i = 0; i < conn_handle->num_tables; i++) {
+        if (strcmp(conn_handle->tables[i].uri, uri) == 0) {
+            *table = conn_handle->tables[i];
+            found = 1;
+            break;
+        }
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
-    args->session_config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-
-    args->priv = (struct wterl_priv_data *)enif_priv_data(env);
-  },
-  { // work
+    enif_rwlock_runlock(conn_handle->tables_lock);
+    return found;
+}
 
-    WT_CONNECTION *conn;
-    ErlNifBinary config;
-    ErlNifBinary session_config;
+/**
+ * Note that operands have been merged into a table (dirty set), or test and
+ * clear that for a compaction pass (dirty 0).
+ *
+ * ->   whether the table had operands merged since the last compaction
+ */
+static int
+__table_merge_dirty(WterlConnHandle *conn_handle, const char *uri, int dirty)
+{
+    uint32_t i;
+    int was = 0;
 
-    if (!enif_inspect_binary(env, args->config, &config)) {
-        ASYNC_NIF_REPLY(enif_make_badarg(env));
-        return;
-    }
-    if (!enif_inspect_binary(env, args->session_config, &session_config)) {
-        ASYNC_NIF_REPLY(enif_make_badarg(env));
-        return;
+    enif_rwlock_rlock(conn_handle->tables_lock);
+    for (i = 0; i < conn_handle->num_tables; i++) {
+        if (strcmp(conn_handle->tables[i].uri, uri) == 0) {
+            was = __sync_lock_test_and_set(&conn_handle->tables[i].merge_dirty, dirty);
+            break;
+        }
     }
+    enif_rwlock_runlock(conn_handle->tables_lock);
+    return was;
+}
 
-    int rc = wiredtiger_open(args->homedir,
-                             (WT_EVENT_HANDLER*)&args->priv->eh.handlers,
-                             (config.size > 1) ? (const char *)config.data : NULL,
-                             &conn);
-    if (rc == 0) {
-      WterlConnHandle *conn_handle = enif_alloc_resource(wterl_conn_RESOURCE, sizeof(WterlConnHandle));
-      memset(conn_handle, 0, sizeof(WterlConnHandle));
-      if (!conn_handle) {
-          ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
-          return;
-      }
-      if (session_config.size > 1) {
-          char *sc = malloc(session_config.size);
-          if (!sc) {
-              enif_release_resource(conn_handle);
-              ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
-              return;
-          }
-          memcpy(sc, session_config.data, session_config.size);
-          conn_handle->session_config = (const char *)sc;
-      } else {
-          conn_handle->session_config = NULL;
-      }
-      conn_handle->cache_mutex = enif_mutex_create("conn_handle");
-      enif_mutex_lock(conn_handle->cache_mutex);
-      conn_handle->conn = conn;
-      ERL_NIF_TERM result = enif_make_resource(env, conn_handle);
-
-      /* Init list for cache of reuseable contexts */
-      STAILQ_INIT(&conn_handle->cache);
-      conn_handle->cache_size = 0;
+/**
+ * Key expiry (TTL).
+ *
+ * Tables with TTLs enabled have a companion expiry table, "table:<name>-ttl",
+ * holding two kinds of entries:
+ *
+ *   <<"k", Key/binary>>                   -> <<Expiry:64/big>>
+ *   <<"t", Expiry:64/big, Key/binary>>    -> <<0>>
+ *
+ * The first lets reads find a key's expiry, the second keeps expiring keys
+ * in time order so the janitor thread can remove them in key-ordered batches
+ * without scanning the table.  Expiry is in seconds since the epoch.
+ */
+#define TTL_KEY 'k'
+#define TTL_TIME 't'
+#define TTL_WRITE_RETRIES 3
 
-      enif_release_resource(conn_handle);
-      enif_mutex_unlock(conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, result));
-    }
-    else
-    {
-      ASYNC_NIF_REPLY(__strerror_term(env, rc));
-    }
-  },
-  { // post
+static inline void
+__put_be64(uint8_t *p, uint64_t v)
+{
+    int i;
+    for (i = 7; i >= 0; i--, v >>= 8)
+        p[i] = (uint8_t)(v & 0xff);
+}
 
-  });
+static inline uint64_t
+__get_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
 
 /**
- * Closes a WiredTiger WT_CONNECTION object.
+ * Name the expiry table for a table, "lsm:foo" becomes "table:foo-ttl".
  *
- * argv[0]    WterlConnHandle resource
+ * ->   0 on success, EINVAL if the name won't fit
  */
-ASYNC_NIF_DECL(
-  wterl_conn_close,
-  { // struct
+static int
+__ttl_uri(const char *uri, Uri ttl_uri)
+{
+    const char *name = strchr(uri, ':');
+    name = name ? name + 1 : uri;
+    if (snprintf(ttl_uri, sizeof(Uri), "table:%s-ttl", name) >= (int)sizeof(Uri))
+        return EINVAL;
+    return 0;
+}
 
-    WterlConnHandle* conn_handle;
-    struct wterl_priv_data *priv;
-  },
-  { // pre
+/**
+ * Has the key expired?  ttl_cursor is a raw cursor on the expiry table.
+ */
+static int
+__ttl_expired(WT_CURSOR *ttl_cursor, WT_ITEM *key, uint64_t now)
+{
+    WT_ITEM item;
+    uint8_t *k = malloc(key->size + 1);
+    int expired = 0;
 
-    if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle))) {
-      ASYNC_NIF_RETURN_BADARG();
-    }
+    if (!k)
+        return 0;
+    k[0] = TTL_KEY;
+    memcpy(k + 1, key->data, key->size);
+    item.data = k;
+    item.size = key->size + 1;
+    ttl_cursor->set_key(ttl_cursor, &item);
+    if (ttl_cursor->search(ttl_cursor) == 0 &&
+        ttl_cursor->get_value(ttl_cursor, &item) == 0 && item.size == 8)
+        expired = __get_be64(item.data) <= now;
+    ttl_cursor->reset(ttl_cursor);
+    free(k);
+    return expired;
+}
+
+/**
+ * Remove the expiry entries of a key, if it has any, within the caller's
+ * transaction, so that the key never expires.
+ */
+static int
+__ttl_forget(WT_CURSOR *ttl_cursor, WT_ITEM *key)
+{
+    WT_ITEM item;
+    WT_ITEM old;
+    uint8_t *t;
+    int rc;
+
+    /* One buffer for both keys: the 'k' key is looked up in its last
+       bytes, which the expiry then overwrites to make the 't' key. */
+    if (!(t = malloc(key->size + 9)))
+        return ENOMEM;
+    t[8] = TTL_KEY;
+    memcpy(t + 9, key->data, key->size);
+    item.data = t + 8;
+    item.size = key->size + 1;
+    ttl_cursor->set_key(ttl_cursor, &item);
+    rc = ttl_cursor->search(ttl_cursor);
+    if (rc == 0 && (rc = ttl_cursor->get_value(ttl_cursor, &old)) == 0 && old.size == 8) {
+        uint8_t expiry[8];
+        memcpy(expiry, old.data, 8);
+        rc = ttl_cursor->remove(ttl_cursor);
+        if (rc == 0) {
+            t[0] = TTL_TIME;
+            memcpy(t + 1, expiry, 8);
+            item.data = t;
+            item.size = key->size + 9;
+            ttl_cursor->set_key(ttl_cursor, &item);
+            rc = ttl_cursor->remove(ttl_cursor);
+        }
+    }
+    free(t);
+    return rc == WT_NOTFOUND ? 0 : rc;
+}
+
+/**
+ * Write (value set) or remove (value NULL) a key in a TTL enabled table and
+ * replace its expiry entries, within the caller's transaction, which must
+ * use snapshot isolation so that the janitor removing the key meanwhile is
+ * a conflict.  An expiry of 0 means the key never expires.
+ */
+static int
+__ttl_update(WT_CURSOR *cursor, WT_CURSOR *ttl_cursor, WT_ITEM *key, WT_ITEM *value,
+             uint64_t expiry)
+{
+    WT_ITEM item;
+    uint8_t *k;
+    uint8_t *t;
+    uint8_t one = 0;
+    int rc;
+
+    if ((rc = __ttl_forget(ttl_cursor, key)) != 0)
+        return rc;
+
+    cursor->set_key(cursor, key);
+    if (value) {
+        cursor->set_value(cursor, value);
+        rc = cursor->insert(cursor);
+    } else {
+        rc = cursor->remove(cursor);
+    }
+    if (rc != 0 || !value || !expiry)
+        return rc;
+
+    k = malloc(key->size + 1);
+    t = malloc(key->size + 9);
+    if (!k || !t) {
+        free(k);
+        free(t);
+        return ENOMEM;
+    }
+    k[0] = TTL_KEY;
+    memcpy(k + 1, key->data, key->size);
+    t[0] = TTL_TIME;
+    __put_be64(t + 1, expiry);
+    memcpy(t + 9, key->data, key->size);
+
+    item.data = k;
+    item.size = key->size + 1;
+    ttl_cursor->set_key(ttl_cursor, &item);
+    item.data = t + 1;
+    item.size = 8;
+    ttl_cursor->set_value(ttl_cursor, &item);
+    rc = ttl_cursor->insert(ttl_cursor);
+    if (rc == 0) {
+        item.data = t;
+        item.size = key->size + 9;
+        ttl_cursor->set_key(ttl_cursor, &item);
+        item.data = &one;
+        item.size = 1;
+        ttl_cursor->set_value(ttl_cursor, &item);
+        rc = ttl_cursor->insert(ttl_cursor);
+    }
+    free(k);
+    free(t);
+    return rc;
+}
+
+/**
+ * __ttl_update in a transaction of its own, trying again a few times if
+ * the janitor was removing the key meanwhile.
+ */
+static int
+__ttl_write(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *ttl_cursor,
+            WT_ITEM *key, WT_ITEM *value, uint64_t expiry)
+{
+    int attempts = 0;
+    int rc;
+
+    do {
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc != 0)
+            return rc;
+        rc = __ttl_update(cursor, ttl_cursor, key, value, expiry);
+        /* A failed commit is rolled back by WiredTiger. */
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+    } while (rc == WT_ROLLBACK && ++attempts < TTL_WRITE_RETRIES);
+    return rc;
+}
+
+/**
+ * Insert a key in a TTL enabled table, never to expire, unless it is there
+ * and hasn't expired, in a transaction of its own as __ttl_write.
+ *
+ * ->   0, WT_DUPLICATE_KEY if the key is there, or an error
+ */
+static int
+__ttl_insert(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *ttl_cursor,
+             WT_ITEM *key, WT_ITEM *value)
+{
+    int attempts = 0;
+    int rc;
+
+    do {
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc != 0)
+            return rc;
+        cursor->set_key(cursor, key);
+        rc = cursor->search(cursor);
+        if (rc == 0)
+            rc = __ttl_expired(ttl_cursor, key, (uint64_t)time(NULL)) ?
+                0 : WT_DUPLICATE_KEY;
+        else if (rc == WT_NOTFOUND)
+            rc = 0;
+        if (rc == 0)
+            rc = __ttl_update(cursor, ttl_cursor, key, value, 0);
+        /* A failed commit is rolled back by WiredTiger. */
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+    } while (rc == WT_ROLLBACK && ++attempts < TTL_WRITE_RETRIES);
+    return rc;
+}
+
+/**
+ * Remove up to batch expired keys from one table in a single transaction.
+ *
+ * ->   number of keys removed (none after a conflict with a writer), or -1
+ *      on error
+ */
+static int
+__ttl_reap_batch(WT_SESSION *session, const char *uri, uint32_t batch, uint64_t now)
+{
+    WT_CURSOR *cursor = NULL;
+    WT_CURSOR *ttl_cursor = NULL;
+    WT_CURSOR *scan = NULL;
+    WT_ITEM item;
+    Uri ttl_uri;
+    uint8_t first = TTL_TIME;
+    uint8_t *k = NULL;
+    size_t k_size = 0;
+    uint32_t n = 0;
+    int exact;
+    int rc;
+
+    if (__ttl_uri(uri, ttl_uri) != 0)
+        return -1;
+    if ((rc = session->open_cursor(session, uri, NULL, "raw", &cursor)) != 0 ||
+        (rc = session->open_cursor(session, ttl_uri, NULL, "raw", &ttl_cursor)) != 0 ||
+        (rc = session->open_cursor(session, ttl_uri, NULL, "raw", &scan)) != 0)
+        goto out;
+    /* Snapshot isolation, so that a put changing a key's expiry meanwhile
+       is a conflict rather than having its key removed. */
+    if ((rc = session->begin_transaction(session, "isolation=snapshot")) != 0)
+        goto out;
+
+    item.data = &first;
+    item.size = 1;
+    scan->set_key(scan, &item);
+    rc = scan->search_near(scan, &exact);
+    if (rc == 0 && exact < 0)
+        rc = scan->next(scan);
+    while (rc == 0 && n < batch) {
+        if ((rc = scan->get_key(scan, &item)) != 0)
+            break;
+        const uint8_t *t = item.data;
+        if (item.size < 10 || t[0] != TTL_TIME || __get_be64(t + 1) > now)
+            break;
+
+        /* Remove the key and its expiry entries, unless its expiry has
+           changed since (a stale time entry) when only that goes. */
+        if (k_size < item.size - 8) {
+            free(k);
+            k_size = item.size - 8;
+            if (!(k = malloc(k_size))) {
+                rc = ENOMEM;
+                break;
+            }
+        }
+        k[0] = TTL_KEY;
+        memcpy(k + 1, t + 9, item.size - 9);
+        WT_ITEM key;
+        WT_ITEM expiry;
+        key.data = k;
+        key.size = item.size - 8;
+        ttl_cursor->set_key(ttl_cursor, &key);
+        rc = ttl_cursor->search(ttl_cursor);
+        if (rc == 0 && (rc = ttl_cursor->get_value(ttl_cursor, &expiry)) == 0 &&
+            expiry.size == 8 && memcmp(expiry.data, t + 1, 8) == 0) {
+            rc = ttl_cursor->remove(ttl_cursor);
+            if (rc == 0) {
+                key.data = k + 1;
+                key.size = item.size - 9;
+                cursor->set_key(cursor, &key);
+                rc = cursor->remove(cursor);
+            }
+        }
+        if (rc == 0 || rc == WT_NOTFOUND) {
+            ttl_cursor->set_key(ttl_cursor, &item);
+            rc = ttl_cursor->remove(ttl_cursor);
+        }
+        if (rc != 0)
+            break;
+        n++;
+        rc = scan->next(scan);
+    }
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+    if (rc == 0)
+        rc = session->commit_transaction(session, NULL);
+    else
+        (void)session->rollback_transaction(session, NULL);
+    /* Conflicting with a writer isn't an error, try again next time. */
+    if (rc == WT_ROLLBACK) {
+        rc = 0;
+        n = 0;
+    }
+
+  out:
+    free(k);
+    if (scan)
+        scan->close(scan);
+    if (ttl_cursor)
+        ttl_cursor->close(ttl_cursor);
+    if (cursor)
+        cursor->close(cursor);
+    return rc == 0 ? (int)n : -1;
+}
+
+/**
+ * Merge operators.
+ *
+ * Tables with a merge operator have a companion operand table,
+ * "table:<name>-merge", where merge/4 blindly appends operands keyed by
+ *
+ *   <<KeySize:32/big, Key/binary, Seq:64/big>>
+ *
+ * so all of a key's operands sort together in the order they were written.
+ * Reads fold the operands into the value in the main table, and the
+ * janitor thread (or a read that finds many operands) compacts them by
+ * writing the folded value back and removing the operands.  The add and
+ * max operators work on signed 64-bit big-endian integers, append
+ * concatenates binaries.
+ */
+#define MERGE_NONE 0
+#define MERGE_ADD 1
+#define MERGE_MAX 2
+#define MERGE_APPEND 3
+#define MERGE_COMPACT_OPERANDS 32
+#define MERGE_COMPACT_BATCH 1000
+#define MERGE_WRITE_RETRIES 3
+
+struct wterl_merge_acc {
+    int op;
+    int found;
+    int64_t n;
+    uint8_t num[8];
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+};
+
+static int
+__merge_uri(const char *uri, Uri merge_uri)
+{
+    const char *name = strchr(uri, ':');
+    name = name ? name + 1 : uri;
+    if (snprintf(merge_uri, sizeof(Uri), "table:%s-merge", name) >= (int)sizeof(Uri))
+        return EINVAL;
+    return 0;
+}
+
+/**
+ * Fold one value or operand into the accumulator.
+ */
+static int
+__merge_apply(struct wterl_merge_acc *acc, const void *data, size_t size)
+{
+    int64_t v;
+
+    if (acc->op == MERGE_APPEND) {
+        if (acc->len + size > acc->cap) {
+            size_t cap = (acc->len + size) * 2;
+            uint8_t *buf = realloc(acc->buf, cap);
+            if (!buf)
+                return ENOMEM;
+            acc->buf = buf;
+            acc->cap = cap;
+        }
+        memcpy(acc->buf + acc->len, data, size);
+        acc->len += size;
+    } else {
+        if (size != 8)
+            return EINVAL;
+        v = (int64_t)__get_be64(data);
+        if (!acc->found)
+            acc->n = v;
+        else if (acc->op == MERGE_ADD)
+            acc->n = (int64_t)((uint64_t)acc->n + (uint64_t)v);
+        else if (v > acc->n)
+            acc->n = v;
+    }
+    acc->found = 1;
+    return 0;
+}
+
+static void
+__merge_result(struct wterl_merge_acc *acc, WT_ITEM *item)
+{
+    if (acc->op == MERGE_APPEND) {
+        item->data = acc->buf;
+        item->size = acc->len;
+    } else {
+        __put_be64(acc->num, (uint64_t)acc->n);
+        item->data = acc->num;
+        item->size = 8;
+    }
+}
+
+static uint8_t *
+__merge_prefix(WT_ITEM *key, size_t *len)
+{
+    uint8_t *p = malloc(key->size + 12);
+    if (p) {
+        p[0] = (uint8_t)(key->size >> 24);
+        p[1] = (uint8_t)(key->size >> 16);
+        p[2] = (uint8_t)(key->size >> 8);
+        p[3] = (uint8_t)key->size;
+        memcpy(p + 4, key->data, key->size);
+        *len = key->size + 4;
+    }
+    return p;
+}
+
+/**
+ * Read the value for key and fold in all of its operands.  mscan is a
+ * cursor on the operand table, left positioned past the key's operands.
+ */
+static int
+__merge_read(WT_CURSOR *cursor, WT_CURSOR *mscan, WT_ITEM *key,
+             struct wterl_merge_acc *acc, uint32_t *nops)
+{
+    WT_ITEM item;
+    size_t plen;
+    int exact;
+    int rc;
+    uint8_t *p = __merge_prefix(key, &plen);
+
+    if (!p)
+        return ENOMEM;
+    *nops = 0;
+    cursor->set_key(cursor, key);
+    rc = cursor->search(cursor);
+    if (rc == 0 && (rc = cursor->get_value(cursor, &item)) == 0)
+        rc = __merge_apply(acc, item.data, item.size);
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+
+    if (rc == 0) {
+        item.data = p;
+        item.size = plen;
+        mscan->set_key(mscan, &item);
+        rc = mscan->search_near(mscan, &exact);
+        if (rc == 0 && exact < 0)
+            rc = mscan->next(mscan);
+        while (rc == 0) {
+            if ((rc = mscan->get_key(mscan, &item)) != 0)
+                break;
+            if (item.size != plen + 8 || memcmp(item.data, p, plen) != 0)
+                break;
+            if ((rc = mscan->get_value(mscan, &item)) != 0 ||
+                (rc = __merge_apply(acc, item.data, item.size)) != 0)
+                break;
+            (*nops)++;
+            rc = mscan->next(mscan);
+        }
+        if (rc == WT_NOTFOUND)
+            rc = 0;
+    }
+    free(p);
+    return rc;
+}
+
+/**
+ * Remove all the operands for key, mscan finds them and mcursor removes.
+ */
+static int
+__merge_clear(WT_CURSOR *mscan, WT_CURSOR *mcursor, WT_ITEM *key)
+{
+    WT_ITEM item;
+    size_t plen;
+    int exact;
+    int rc;
+    uint8_t *p = __merge_prefix(key, &plen);
+
+    if (!p)
+        return ENOMEM;
+    item.data = p;
+    item.size = plen;
+    mscan->set_key(mscan, &item);
+    rc = mscan->search_near(mscan, &exact);
+    if (rc == 0 && exact < 0)
+        rc = mscan->next(mscan);
+    while (rc == 0) {
+        if ((rc = mscan->get_key(mscan, &item)) != 0)
+            break;
+        if (item.size != plen + 8 || memcmp(item.data, p, plen) != 0)
+            break;
+        mcursor->set_key(mcursor, &item);
+        if ((rc = mcursor->remove(mcursor)) != 0)
+            break;
+        rc = mscan->next(mscan);
+    }
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+    mscan->reset(mscan);
+    free(p);
+    return rc;
+}
+
+/**
+ * Write (value set) or remove (value NULL) a key in a table with a merge
+ * operator, discarding its pending operands, within the caller's snapshot
+ * isolation transaction, so that an operand merged meanwhile is a conflict
+ * rather than removed without being applied.  Removing a key that has
+ * neither a value nor operands is WT_NOTFOUND.
+ */
+static int
+__merge_update(WT_CURSOR *cursor, WT_CURSOR *mcursor, WT_CURSOR *mscan,
+               WT_ITEM *key, WT_ITEM *value)
+{
+    struct wterl_merge_acc acc;
+    uint32_t nops = 0;
+    int rc;
+
+    cursor->set_key(cursor, key);
+    if (value) {
+        cursor->set_value(cursor, value);
+        rc = cursor->insert(cursor);
+    } else {
+        rc = cursor->remove(cursor);
+        if (rc == WT_NOTFOUND) {
+            /* Still there if it has operands. */
+            memset(&acc, 0, sizeof(acc));
+            acc.op = MERGE_APPEND;
+            rc = __merge_read(cursor, mscan, key, &acc, &nops);
+            free(acc.buf);
+            if (rc == 0 && nops == 0)
+                rc = WT_NOTFOUND;
+        }
+    }
+    if (rc == 0)
+        rc = __merge_clear(mscan, mcursor, key);
+    return rc;
+}
+
+/**
+ * __merge_update in a transaction of its own, trying again a few times if
+ * an operand was merged meanwhile.
+ */
+static int
+__merge_write(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *mcursor,
+              WT_CURSOR *mscan, WT_ITEM *key, WT_ITEM *value)
+{
+    int attempts = 0;
+    int rc;
+
+    do {
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc != 0)
+            return rc;
+        rc = __merge_update(cursor, mcursor, mscan, key, value);
+        if (rc == WT_NOTFOUND && !value)
+            rc = 0;
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+    } while (rc == WT_ROLLBACK && ++attempts < MERGE_WRITE_RETRIES);
+    return rc;
+}
+
+/**
+ * Insert a key in a table with a merge operator unless it has a value or
+ * operands, in a transaction of its own as __merge_write.
+ *
+ * ->   0, WT_DUPLICATE_KEY if the key is there, or an error
+ */
+static int
+__merge_insert(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *mcursor,
+               WT_CURSOR *mscan, int op, WT_ITEM *key, WT_ITEM *value)
+{
+    struct wterl_merge_acc acc;
+    uint32_t nops;
+    int attempts = 0;
+    int rc;
+
+    do {
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc != 0)
+            return rc;
+        memset(&acc, 0, sizeof(acc));
+        acc.op = op;
+        rc = __merge_read(cursor, mscan, key, &acc, &nops);
+        free(acc.buf);
+        if (rc == 0 && acc.found)
+            rc = WT_DUPLICATE_KEY;
+        if (rc == 0)
+            rc = __merge_update(cursor, mcursor, mscan, key, value);
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+    } while (rc == WT_ROLLBACK && ++attempts < MERGE_WRITE_RETRIES);
+    return rc;
+}
+
+/**
+ * Fold the operands for every key in a table into their values, at most
+ * MERGE_COMPACT_BATCH keys between pauses.
+ *
+ * ->   0 if every key's operands were folded, non-zero if some were left
+ */
+static int
+__merge_compact_table(WT_SESSION *session, const char *uri, int op, volatile int *stop)
+{
+    WT_CURSOR *cursor = NULL;
+    WT_CURSOR *keys = NULL;
+    WT_CURSOR *mscan = NULL;
+    WT_CURSOR *mcursor = NULL;
+    WT_ITEM item;
+    WT_ITEM key;
+    Uri merge_uri;
+    uint8_t *k = NULL;
+    size_t k_size = 0;
+    uint32_t nops;
+    uint32_t n = 0;
+    int exact;
+    int failed = 1;
+    int rc;
+
+    if (__merge_uri(uri, merge_uri) != 0)
+        return EINVAL;
+    if (session->open_cursor(session, uri, NULL, "raw", &cursor) != 0 ||
+        session->open_cursor(session, merge_uri, NULL, "raw", &keys) != 0 ||
+        session->open_cursor(session, merge_uri, NULL, "raw", &mscan) != 0 ||
+        session->open_cursor(session, merge_uri, NULL, "raw", &mcursor) != 0)
+        goto out;
+
+    failed = 0;
+    rc = keys->next(keys);
+    while (rc == 0 && !*stop) {
+        if ((rc = keys->get_key(keys, &item)) != 0 || item.size < 12)
+            break;
+        if (k_size < item.size) {
+            free(k);
+            k_size = item.size;
+            if (!(k = malloc(k_size)))
+                break;
+        }
+        memcpy(k, item.data, item.size);
+        key.data = k + 4;
+        key.size = item.size - 12;
+
+        struct wterl_merge_acc acc;
+        memset(&acc, 0, sizeof(acc));
+        acc.op = op;
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc == 0) {
+            rc = __merge_read(cursor, mscan, &key, &acc, &nops);
+            if (rc == 0 && acc.found) {
+                __merge_result(&acc, &item);
+                cursor->set_key(cursor, &key);
+                cursor->set_value(cursor, &item);
+                rc = cursor->insert(cursor);
+            }
+            if (rc == 0)
+                rc = __merge_clear(mscan, mcursor, &key);
+            if (rc == 0)
+                rc = session->commit_transaction(session, NULL);
+            else
+                (void)session->rollback_transaction(session, NULL);
+        }
+        free(acc.buf);
+        DPRINTF("janitor: %s compacted %u operands (%d)", uri, nops, rc);
+        if (rc != 0)
+            failed = 1;
+
+        /* Skip past this key's operands, whether or not that worked. */
+        memset(k + key.size + 4, 0xff, 8);
+        item.data = k;
+        item.size = key.size + 12;
+        keys->set_key(keys, &item);
+        rc = keys->search_near(keys, &exact);
+        if (rc == 0 && exact <= 0)
+            rc = keys->next(keys);
+        if (++n % MERGE_COMPACT_BATCH == 0)
+            usleep(10000);
+    }
+    if (*stop || rc != WT_NOTFOUND)
+        failed = 1;
+
+  out:
+    free(k);
+    if (mcursor)
+        mcursor->close(mcursor);
+    if (mscan)
+        mscan->close(mscan);
+    if (keys)
+        keys->close(keys);
+    if (cursor)
+        cursor->close(cursor);
+    return failed;
+}
+
+/**
+ * Hashtrees, for active anti-entropy.
+ *
+ * Tables with a hashtree enabled have a companion table, "table:<name>-aae",
+ * holding:
+ *
+ *   <<"k", Segment:32/big, Key/binary>>   -> <<Hash:64/big>>
+ *   <<"s", Segment:32/big>>               -> <<Hash:64/big>>
+ *   <<"m">>                               -> <<Segments:32/big, Width:32/big, Built:8>>
+ *
+ * A key falls in one of Segments segments by a hash of the key, and hashes
+ * to a 64-bit hash of its key and value.  A segment's hash is the exclusive
+ * or of its keys' hashes, so a put or delete updates it in place from the
+ * key's previous hash.  The tree over the segments has Width children per
+ * node.  Inner nodes are the exclusive or of the segments below them and
+ * are computed from the segment entries when asked for rather than stored,
+ * so that writes don't all contend for the root.  Built is set once the
+ * hashes cover the whole table.
+ *
+ * The hashes are wterl's own (FNV-1a finished with the splitmix64 mixer),
+ * cheap enough to compute on every write, not the SHA-1 based ones of
+ * riak_core's hashtree, so a tree can only be compared with another wterl
+ * tree built with the same geometry.
+ */
+#define HT_KEY 'k'
+#define HT_SEGMENT 's'
+#define HT_META 'm'
+#define HT_MAX_SEGMENTS (1 << 24)
+#define HT_MAX_WIDTH 65536
+#define HT_REBUILD_BATCH 1000
+#define HT_WRITE_RETRIES 3
+#define HT_SEED 0xcbf29ce484222325ULL
+
+static inline void
+__put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t
+__get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/**
+ * FNV-1a over the bytes, continuing from h.
+ */
+static inline uint64_t
+__hash64(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Spread the bits of a hash (the splitmix64 finalizer).
+ */
+static inline uint64_t
+__hash64_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t
+__ht_segment(const WT_ITEM *key, uint32_t segments)
+{
+    return (uint32_t)(__hash64_mix(__hash64(HT_SEED, key->data, key->size)) % segments);
+}
+
+static inline uint64_t
+__ht_hash(const WT_ITEM *key, const WT_ITEM *value)
+{
+    return __hash64_mix(__hash64(__hash64(HT_SEED, key->data, key->size),
+                                 value->data, value->size));
+}
+
+/**
+ * Name the hashtree table for a table, "lsm:foo" becomes "table:foo-aae".
+ *
+ * ->   0 on success, EINVAL if the name won't fit
+ */
+static int
+__ht_uri(const char *uri, Uri ht_uri)
+{
+    const char *name = strchr(uri, ':');
+    name = name ? name + 1 : uri;
+    if (snprintf(ht_uri, sizeof(Uri), "table:%s-aae", name) >= (int)sizeof(Uri))
+        return EINVAL;
+    return 0;
+}
+
+/**
+ * Is segments a power of width, with both in bounds?
+ *
+ * ->   the number of levels below the root, or 0 if not
+ */
+static uint32_t
+__ht_levels(uint32_t segments, uint32_t width)
+{
+    uint64_t n = 1;
+    uint32_t levels = 0;
+
+    if (width < 2 || width > HT_MAX_WIDTH || segments > HT_MAX_SEGMENTS)
+        return 0;
+    while (n < segments) {
+        n *= width;
+        levels++;
+    }
+    return n == segments ? levels : 0;
+}
+
+/**
+ * Add delta to a segment's hash (by exclusive or), removing the segment
+ * entry when its hash comes to 0.
+ */
+static int
+__ht_xor_segment(WT_CURSOR *ht_cursor, uint32_t segment, uint64_t delta)
+{
+    WT_ITEM item;
+    uint8_t k[5];
+    uint8_t v[8];
+    uint64_t hash = 0;
+    int found = 0;
+    int rc;
+
+    k[0] = HT_SEGMENT;
+    __put_be32(k + 1, segment);
+    item.data = k;
+    item.size = sizeof(k);
+    ht_cursor->set_key(ht_cursor, &item);
+    rc = ht_cursor->search(ht_cursor);
+    if (rc == 0 && (rc = ht_cursor->get_value(ht_cursor, &item)) == 0 && item.size == 8) {
+        hash = __get_be64(item.data);
+        found = 1;
+    }
+    if (rc != 0 && rc != WT_NOTFOUND)
+        return rc;
+    hash ^= delta;
+    item.data = k;
+    item.size = sizeof(k);
+    ht_cursor->set_key(ht_cursor, &item);
+    if (hash == 0)
+        return found ? ht_cursor->remove(ht_cursor) : 0;
+    __put_be64(v, hash);
+    item.data = v;
+    item.size = sizeof(v);
+    ht_cursor->set_value(ht_cursor, &item);
+    return ht_cursor->insert(ht_cursor);
+}
+
+/**
+ * Replace a key's hash with that of its new value (value set) or forget
+ * it (value NULL), and update its segment, within the caller's
+ * transaction.  When segment_too is 0 only the key's entry is written,
+ * for rebuilds which recompute the segments afterwards.
+ */
+static int
+__ht_update(WT_CURSOR *ht_cursor, uint32_t segments, const WT_ITEM *key,
+            const WT_ITEM *value, int segment_too)
+{
+    WT_ITEM item;
+    uint32_t segment = __ht_segment(key, segments);
+    uint64_t old_hash = 0;
+    uint64_t hash = value ? __ht_hash(key, value) : 0;
+    uint8_t v[8];
+    uint8_t *k;
+    int found = 0;
+    int rc;
+
+    if (!(k = malloc(key->size + 5)))
+        return ENOMEM;
+    k[0] = HT_KEY;
+    __put_be32(k + 1, segment);
+    memcpy(k + 5, key->data, key->size);
+    item.data = k;
+    item.size = key->size + 5;
+    ht_cursor->set_key(ht_cursor, &item);
+    rc = ht_cursor->search(ht_cursor);
+    if (rc == 0 && (rc = ht_cursor->get_value(ht_cursor, &item)) == 0 && item.size == 8) {
+        old_hash = __get_be64(item.data);
+        found = 1;
+    }
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+    if (rc == 0 && (value ? (!found || old_hash != hash) : found)) {
+        item.data = k;
+        item.size = key->size + 5;
+        ht_cursor->set_key(ht_cursor, &item);
+        if (value) {
+            __put_be64(v, hash);
+            item.data = v;
+            item.size = sizeof(v);
+            ht_cursor->set_value(ht_cursor, &item);
+            rc = ht_cursor->insert(ht_cursor);
+        } else {
+            rc = ht_cursor->remove(ht_cursor);
+        }
+        if (rc == 0 && segment_too)
+            rc = __ht_xor_segment(ht_cursor, segment, old_hash ^ hash);
+    }
+    free(k);
+    return rc;
+}
+
+/**
+ * Write (value set) or remove (value NULL) a key in a table with a
+ * hashtree and update its hash, all in one transaction, trying again a
+ * few times if another writer was updating the same segment.
+ */
+static int
+__ht_write(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *ht_cursor,
+           uint32_t segments, WT_ITEM *key, WT_ITEM *value)
+{
+    int attempts = 0;
+    int rc;
+
+    do {
+        /* Snapshot isolation, so that a concurrent update of the segment's
+           hash is a conflict rather than a lost update. */
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc != 0)
+            return rc;
+        rc = __ht_update(ht_cursor, segments, key, value, 1);
+        if (rc == 0) {
+            cursor->set_key(cursor, key);
+            if (value) {
+                cursor->set_value(cursor, value);
+                rc = cursor->insert(cursor);
+            } else {
+                rc = cursor->remove(cursor);
+            }
+        }
+        /* A failed commit is rolled back by WiredTiger. */
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+    } while (rc == WT_ROLLBACK && ++attempts < HT_WRITE_RETRIES);
+    return rc;
+}
+
+/**
+ * Insert a key in a table with a hashtree, and its hash, unless the key is
+ * there, in a transaction of its own as __ht_write.
+ *
+ * ->   0, WT_DUPLICATE_KEY if the key is there, or an error
+ */
+static int
+__ht_insert(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *ht_cursor,
+            uint32_t segments, WT_ITEM *key, WT_ITEM *value)
+{
+    int attempts = 0;
+    int rc;
+
+    do {
+        rc = session->begin_transaction(session, "isolation=snapshot");
+        if (rc != 0)
+            return rc;
+        cursor->set_key(cursor, key);
+        rc = cursor->search(cursor);
+        if (rc == 0)
+            rc = WT_DUPLICATE_KEY;
+        else if (rc == WT_NOTFOUND)
+            rc = __ht_update(ht_cursor, segments, key, value, 1);
+        if (rc == 0) {
+            cursor->set_key(cursor, key);
+            cursor->set_value(cursor, value);
+            rc = cursor->insert(cursor);
+        }
+        /* A failed commit is rolled back by WiredTiger. */
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+    } while (rc == WT_ROLLBACK && ++attempts < HT_WRITE_RETRIES);
+    return rc;
+}
+
+/**
+ * Does a table keep a side table that a bulk load would leave out of step,
+ * its hashtree, or operands to be folded into the loaded values?  Bulk
+ * loads are refused with ENOTSUP on such tables.
+ */
+static int
+__table_refuses_bulk(WterlConnHandle *conn_handle, const char *uri)
+{
+    struct wterl_table table;
+    return __table_lookup(conn_handle, uri, &table) &&
+        (table.ht_segments || table.merge_op != MERGE_NONE);
+}
+
+/**
+ * Does a table keep a side table, a hashtree, expiry times or operands,
+ * that each write must update?  Writes which can't (cursor writes and
+ * explicit sessions) are refused with ENOTSUP on such tables.
+ */
+static int
+__table_has_side_tables(WterlConnHandle *conn_handle, const char *uri)
+{
+    struct wterl_table table;
+    return __table_lookup(conn_handle, uri, &table) &&
+        (table.ht_segments || table.ttl || table.merge_op != MERGE_NONE);
+}
+
+/**
+ * Exclusive or the hashes of the entries tagged tag (HT_KEY or HT_SEGMENT)
+ * for count segments from first into acc, span segments to a slot.
+ */
+static int
+__ht_sum_segments(WT_CURSOR *cursor, uint8_t tag, uint32_t first, uint64_t count,
+                  uint64_t span, uint64_t *acc)
+{
+    WT_ITEM item;
+    WT_ITEM value;
+    const uint8_t *p;
+    uint8_t k[5];
+    uint32_t segment;
+    int exact;
+    int rc;
+
+    k[0] = tag;
+    __put_be32(k + 1, first);
+    item.data = k;
+    item.size = sizeof(k);
+    cursor->set_key(cursor, &item);
+    rc = cursor->search_near(cursor, &exact);
+    if (rc == 0 && exact < 0)
+        rc = cursor->next(cursor);
+    while (rc == 0) {
+        if ((rc = cursor->get_key(cursor, &item)) != 0)
+            break;
+        p = item.data;
+        if (item.size < 5 || p[0] != tag)
+            break;
+        segment = __get_be32(p + 1);
+        if ((uint64_t)segment >= (uint64_t)first + count)
+            break;
+        if ((rc = cursor->get_value(cursor, &value)) != 0)
+            break;
+        if (value.size == 8)
+            acc[(segment - first) / span] ^= __get_be64(value.data);
+        rc = cursor->next(cursor);
+    }
+    (void)cursor->reset(cursor);
+    return rc == WT_NOTFOUND ? 0 : rc;
+}
+
+/**
+ * Remember the key a cursor is on, to carry on a scan from it later.
+ */
+static int
+__ht_save_key(WT_CURSOR *cursor, uint8_t **buf, size_t *size)
+{
+    WT_ITEM item;
+    int rc = cursor->get_key(cursor, &item);
+
+    if (rc != 0)
+        return rc;
+    free(*buf);
+    if (!(*buf = malloc(item.size ? item.size : 1)))
+        return ENOMEM;
+    memcpy(*buf, item.data, item.size);
+    *size = item.size;
+    return 0;
+}
+
+/**
+ * Truncate the keys from start to stop (inclusive, NULL for the first and
+ * last keys) of a table with a hashtree, removing them one at a time with
+ * __ht_write so the hashtree stays in step with the table.  The scan
+ * searches again after each removal as a commit resets the session's
+ * cursors.
+ */
+static int
+__ht_truncate(WT_SESSION *session, const char *uri, uint32_t segments,
+              const WT_ITEM *start, const WT_ITEM *stop)
+{
+    Uri ht_uri;
+    WT_CURSOR *scan = NULL;
+    WT_CURSOR *cursor = NULL;
+    WT_CURSOR *ht_cursor = NULL;
+    WT_ITEM item;
+    uint8_t *buf = NULL;
+    size_t size = 0;
+    size_t n;
+    int exact;
+    int rc;
+
+    if (__ht_uri(uri, ht_uri) != 0)
+        return EINVAL;
+    if ((rc = session->open_cursor(session, uri, NULL, "raw", &scan)) != 0 ||
+        (rc = session->open_cursor(session, uri, NULL, "overwrite,raw", &cursor)) != 0 ||
+        (rc = session->open_cursor(session, ht_uri, NULL, "overwrite,raw", &ht_cursor)) != 0)
+        goto out;
+
+    if (start) {
+        scan->set_key(scan, start);
+        rc = scan->search_near(scan, &exact);
+        if (rc == 0 && exact < 0)
+            rc = scan->next(scan);
+    } else {
+        rc = scan->next(scan);
+    }
+    while (rc == 0) {
+        if ((rc = __ht_save_key(scan, &buf, &size)) != 0)
+            break;
+        if (stop) {
+            n = size < stop->size ? size : stop->size;
+            exact = memcmp(buf, stop->data, n);
+            if (exact > 0 || (exact == 0 && size > stop->size))
+                break;
+        }
+        (void)scan->reset(scan);
+        item.data = buf;
+        item.size = size;
+        rc = __ht_write(session, cursor, ht_cursor, segments, &item, NULL);
+        if (rc == WT_NOTFOUND)
+            rc = 0;  /* removed by another writer meanwhile */
+        if (rc != 0)
+            break;
+        scan->set_key(scan, &item);
+        rc = scan->search_near(scan, &exact);
+        if (rc == 0 && exact <= 0)
+            rc = scan->next(scan);
+    }
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+  out:
+    free(buf);
+    if (ht_cursor)
+        (void)ht_cursor->close(ht_cursor);
+    if (cursor)
+        (void)cursor->close(cursor);
+    if (scan)
+        (void)scan->close(scan);
+    return rc;
+}
+
+/* A rebuild pass, called for each record a scan visits within the batch's
+   transaction. */
+typedef int (*ht_visit_fn)(WT_CURSOR *scan, WT_CURSOR *cursor, WT_CURSOR *ht_cursor,
+                           uint32_t segments);
+
+/**
+ * Main table to hashtree: give each key the hash of its value.
+ */
+static int
+__ht_visit_record(WT_CURSOR *scan, WT_CURSOR *cursor, WT_CURSOR *ht_cursor, uint32_t segments)
+{
+    WT_ITEM key;
+    WT_ITEM value;
+    int rc;
+
+    UNUSED(cursor);
+    if ((rc = scan->get_key(scan, &key)) != 0 ||
+        (rc = scan->get_value(scan, &value)) != 0)
+        return rc;
+    return __ht_update(ht_cursor, segments, &key, &value, 0);
+}
+
+/**
+ * Hashtree to main table: forget the hashes of keys that are gone.
+ */
+static int
+__ht_visit_hash(WT_CURSOR *scan, WT_CURSOR *cursor, WT_CURSOR *ht_cursor, uint32_t segments)
+{
+    WT_ITEM item;
+    WT_ITEM key;
+    int rc;
+
+    UNUSED(segments);
+    if ((rc = scan->get_key(scan, &item)) != 0)
+        return rc;
+    if (item.size < 5 || ((const uint8_t *)item.data)[0] != HT_KEY)
+        return WT_NOTFOUND; /* past the key entries */
+    key.data = (const uint8_t *)item.data + 5;
+    key.size = item.size - 5;
+    cursor->set_key(cursor, &key);
+    rc = cursor->search(cursor);
+    (void)cursor->reset(cursor);
+    if (rc != WT_NOTFOUND)
+        return rc;
+    ht_cursor->set_key(ht_cursor, &item);
+    return ht_cursor->remove(ht_cursor);
+}
+
+/**
+ * Visit every record of scan from start (or the first) in transactions of
+ * HT_REBUILD_BATCH records, retrying a batch that conflicts with a writer.
+ */
+static int
+__ht_rebuild_pass(WT_SESSION *session, WT_CURSOR *scan, const WT_ITEM *start,
+                  ht_visit_fn visit, WT_CURSOR *cursor, WT_CURSOR *ht_cursor,
+                  uint32_t segments)
+{
+    uint8_t *last = NULL;
+    uint8_t *next_last = NULL;
+    size_t last_size = 0;
+    size_t next_last_size = 0;
+    uint32_t n;
+    int exact;
+    int done = 0;
+    int rc = 0;
+
+    while (rc == 0 && !done) {
+        if ((rc = session->begin_transaction(session, "isolation=snapshot")) != 0)
+            break;
+        if (last || start) {
+            WT_ITEM item;
+            item.data = last ? last : start->data;
+            item.size = last ? last_size : start->size;
+            scan->set_key(scan, &item);
+            rc = scan->search_near(scan, &exact);
+            if (rc == 0 && (last ? exact <= 0 : exact < 0))
+                rc = scan->next(scan);
+        } else {
+            rc = scan->next(scan);
+        }
+        for (n = 0; rc == 0; ) {
+            if ((rc = visit(scan, cursor, ht_cursor, segments)) != 0)
+                break;
+            if (++n == HT_REBUILD_BATCH) {
+                rc = __ht_save_key(scan, &next_last, &next_last_size);
+                break;
+            }
+            rc = scan->next(scan);
+        }
+        if (rc == WT_NOTFOUND) {
+            done = 1;
+            rc = 0;
+        }
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+        (void)scan->reset(scan);
+        if (rc == WT_ROLLBACK) {
+            /* Someone wrote a key in this batch, do it over. */
+            done = 0;
+            rc = 0;
+        } else if (rc == 0 && !done) {
+            free(last);
+            last = next_last;
+            last_size = next_last_size;
+            next_last = NULL;
+        }
+    }
+    free(last);
+    free(next_last);
+    return rc;
+}
+
+/**
+ * Recompute every segment's hash from its keys' hashes, HT_REBUILD_BATCH
+ * segments per transaction.
+ */
+static int
+__ht_rebuild_segments(WT_SESSION *session, WT_CURSOR *scan, WT_CURSOR *ht_cursor,
+                      uint32_t segments)
+{
+    uint64_t want[HT_REBUILD_BATCH];
+    uint64_t have[HT_REBUILD_BATCH];
+    uint32_t first;
+    uint32_t count;
+    uint32_t i;
+    int rc = 0;
+
+    for (first = 0; rc == 0 && first < segments; ) {
+        count = segments - first < HT_REBUILD_BATCH ? segments - first : HT_REBUILD_BATCH;
+        memset(want, 0, sizeof(want));
+        memset(have, 0, sizeof(have));
+        if ((rc = session->begin_transaction(session, "isolation=snapshot")) != 0)
+            break;
+        rc = __ht_sum_segments(scan, HT_KEY, first, count, 1, want);
+        if (rc == 0)
+            rc = __ht_sum_segments(scan, HT_SEGMENT, first, count, 1, have);
+        for (i = 0; rc == 0 && i < count; i++)
+            if (want[i] != have[i])
+                rc = __ht_xor_segment(ht_cursor, first + i, want[i] ^ have[i]);
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+        if (rc == WT_ROLLBACK)
+            rc = 0; /* do this batch over */
+        else if (rc == 0)
+            first += count;
+    }
+    return rc;
+}
+
+/**
+ * Read a hashtree's meta entry.
+ *
+ * ->   0 and the geometry, WT_NOTFOUND if there is none, or an error
+ */
+static int
+__ht_meta_read(WT_CURSOR *ht_cursor, uint32_t *segments, uint32_t *width, int *built)
+{
+    WT_ITEM item;
+    uint8_t k = HT_META;
+    int rc;
+
+    item.data = &k;
+    item.size = 1;
+    ht_cursor->set_key(ht_cursor, &item);
+    rc = ht_cursor->search(ht_cursor);
+    if (rc == 0 && (rc = ht_cursor->get_value(ht_cursor, &item)) == 0) {
+        if (item.size == 9) {
+            *segments = __get_be32(item.data);
+            *width = __get_be32((const uint8_t *)item.data + 4);
+            *built = ((const uint8_t *)item.data)[8];
+        } else {
+            rc = WT_NOTFOUND;
+        }
+    }
+    (void)ht_cursor->reset(ht_cursor);
+    return rc;
+}
+
+static int
+__ht_meta_write(WT_CURSOR *ht_cursor, uint32_t segments, uint32_t width, int built)
+{
+    WT_ITEM item;
+    uint8_t k = HT_META;
+    uint8_t v[9];
+
+    __put_be32(v, segments);
+    __put_be32(v + 4, width);
+    v[8] = built ? 1 : 0;
+    item.data = &k;
+    item.size = 1;
+    ht_cursor->set_key(ht_cursor, &item);
+    item.data = v;
+    item.size = sizeof(v);
+    ht_cursor->set_value(ht_cursor, &item);
+    return ht_cursor->insert(ht_cursor);
+}
+
+/**
+ * The wterl features enabled on tables are saved in a table of their own
+ * so that opening the connection again registers them before anything
+ * writes to the tables:
+ *
+ *   Uri/binary -> <<TTL:8, MergeOp:8, Segments:32/big, Width:32/big>>
+ */
+#define TABLES_URI "table:wterl-tables"
+#define TABLES_VALUE_SIZE 10
+
+/**
+ * Save the features registered on a table, see __table_register.
+ */
+static int
+__table_save(WterlConnHandle *conn_handle, const char *uri)
+{
+    struct wterl_table table;
+    WT_SESSION *session = NULL;
+    WT_CURSOR *cursor = NULL;
+    WT_ITEM item;
+    uint8_t v[TABLES_VALUE_SIZE];
+    int rc;
+
+    if (!__table_lookup(conn_handle, uri, &table))
+        return 0;
+    v[0] = (uint8_t)table.ttl;
+    v[1] = (uint8_t)table.merge_op;
+    __put_be32(v + 2, table.ht_segments);
+    __put_be32(v + 6, table.ht_width);
+    rc = conn_handle->conn->open_session(conn_handle->conn, NULL,
+                                         conn_handle->session_config, &session);
+    if (rc != 0)
+        return rc;
+    rc = session->create(session, TABLES_URI, "key_format=u,value_format=u");
+    if (rc == 0)
+        rc = session->open_cursor(session, TABLES_URI, NULL, "overwrite,raw", &cursor);
+    if (rc == 0) {
+        item.data = table.uri;
+        item.size = strlen(table.uri);
+        cursor->set_key(cursor, &item);
+        item.data = v;
+        item.size = sizeof(v);
+        cursor->set_value(cursor, &item);
+        rc = cursor->insert(cursor);
+    }
+    (void)session->close(session, NULL);
+    return rc;
+}
+
+/**
+ * Forget the saved features of a table that has been dropped.
+ */
+static int
+__table_forget(WT_SESSION *session, const char *uri)
+{
+    WT_CURSOR *cursor = NULL;
+    WT_ITEM item;
+    int rc = session->open_cursor(session, TABLES_URI, NULL, "raw", &cursor);
+
+    if (rc == ENOENT || rc == WT_NOTFOUND)
+        return 0;  /* no features were ever saved */
+    if (rc != 0)
+        return rc;
+    item.data = uri;
+    item.size = strlen(uri);
+    cursor->set_key(cursor, &item);
+    rc = cursor->remove(cursor);
+    (void)cursor->close(cursor);
+    return rc == WT_NOTFOUND ? 0 : rc;
+}
+
+/**
+ * Remove every record of a table with a cursor range truncate which, unlike
+ * truncating it by name, works while other cursors have the table open.
+ */
+static int
+__truncate_all(WT_SESSION *session, const char *uri)
+{
+    WT_CURSOR *start = NULL;
+    int rc = session->open_cursor(session, uri, NULL, "raw", &start);
+
+    if (rc != 0)
+        return rc;
+    rc = start->next(start);
+    if (rc == 0)
+        rc = session->truncate(session, NULL, start, NULL, NULL);
+    else if (rc == WT_NOTFOUND)
+        rc = 0;
+    (void)start->close(start);
+    return rc;
+}
+
+/**
+ * Drop one of the side tables of a dropped table, or if it is busy at least
+ * empty it, so that a table made anew by the name doesn't inherit it.
+ */
+static void
+__drop_side_table(WterlConnHandle *conn_handle, WT_SESSION *session, const char *uri)
+{
+    enif_mutex_lock(conn_handle->cache_mutex);
+    __close_cursors_on(conn_handle, uri);
+    enif_mutex_unlock(conn_handle->cache_mutex);
+    if (session->drop(session, uri, "force") != 0)
+        (void)__truncate_all(session, uri);
+}
+
+/**
+ * A pending drop is done (or the table was dropped some other way): forget
+ * it, and the wterl features enabled on the table, dropping their side
+ * tables.
+ */
+static void
+__drop_done(WterlConnHandle *conn_handle, WT_SESSION *session, const char *uri)
+{
+    struct wterl_table table;
+    Uri side;
+    uint32_t i;
+
+    if (__table_lookup(conn_handle, uri, &table)) {
+        if (table.ttl && __ttl_uri(uri, side) == 0)
+            __drop_side_table(conn_handle, session, side);
+        if (table.merge_op != MERGE_NONE && __merge_uri(uri, side) == 0)
+            __drop_side_table(conn_handle, session, side);
+        if (table.ht_segments && __ht_uri(uri, side) == 0)
+            __drop_side_table(conn_handle, session, side);
+    }
+    (void)__table_forget(session, uri);
+
+    enif_rwlock_rwlock(conn_handle->tables_lock);
+    for (i = 0; i < conn_handle->num_drops; i++) {
+        if (strcmp(conn_handle->drops[i].uri, uri) == 0) {
+            conn_handle->drops[i] = conn_handle->drops[--conn_handle->num_drops];
+            break;
+        }
+    }
+    for (i = 0; i < conn_handle->num_tables; i++) {
+        if (strcmp(conn_handle->tables[i].uri, uri) == 0) {
+            conn_handle->tables[i] = conn_handle->tables[--conn_handle->num_tables];
+            break;
+        }
+    }
+    enif_rwlock_rwunlock(conn_handle->tables_lock);
+}
+
+/**
+ * Remove the expiry entries of the keys from start to stop (inclusive, NULL
+ * for the first and last keys) of a TTL enabled table, after the keys were
+ * truncated.  Only the 'k' entries are in key order, the 't' ones left
+ * behind are stale and the janitor drops them as they come due.
+ */
+static int
+__ttl_truncate(WT_SESSION *session, const char *uri, const WT_ITEM *start,
+               const WT_ITEM *stop)
+{
+    Uri ttl_uri;
+    WT_CURSOR *first = NULL;
+    WT_CURSOR *last = NULL;
+    WT_ITEM item;
+    uint8_t *buf = NULL;
+    uint8_t tag;
+    int rc;
+
+    if (__ttl_uri(uri, ttl_uri) != 0)
+        return EINVAL;
+    if (!start && !stop)
+        return __truncate_all(session, ttl_uri);
+    if (!(buf = malloc(1 + (start ? start->size : 0) + 1 + (stop ? stop->size : 0))))
+        return ENOMEM;
+    if ((rc = session->open_cursor(session, ttl_uri, NULL, "raw", &first)) != 0 ||
+        (rc = session->open_cursor(session, ttl_uri, NULL, "raw", &last)) != 0)
+        goto out;
+
+    /* Every 'k' entry sorts between <<"k">> and <<"t">>. */
+    buf[0] = TTL_KEY;
+    if (start)
+        memcpy(buf + 1, start->data, start->size);
+    item.data = buf;
+    item.size = 1 + (start ? start->size : 0);
+    first->set_key(first, &item);
+    if (stop) {
+        uint8_t *s = buf + item.size;
+        s[0] = TTL_KEY;
+        memcpy(s + 1, stop->data, stop->size);
+        item.data = s;
+        item.size = 1 + stop->size;
+    } else {
+        tag = TTL_TIME;
+        item.data = &tag;
+        item.size = 1;
+    }
+    last->set_key(last, &item);
+    rc = session->truncate(session, NULL, first, last, NULL);
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+  out:
+    if (last)
+        (void)last->close(last);
+    if (first)
+        (void)first->close(first);
+    free(buf);
+    return rc;
+}
+
+/**
+ * Remove the pending operands of the keys from start to stop (inclusive,
+ * NULL for the first and last keys) of a table with a merge operator,
+ * after the keys were truncated.  Operands are ordered by the size of
+ * their key first, so a range has to be found by a scan of them all.
+ */
+static int
+__merge_truncate(WT_SESSION *session, const char *uri, const WT_ITEM *start,
+                 const WT_ITEM *stop)
+{
+    Uri merge_uri;
+    WT_CURSOR *scan = NULL;
+    WT_CURSOR *mcursor = NULL;
+    WT_ITEM item;
+    const uint8_t *p;
+    size_t size;
+    size_t n;
+    int cmp;
+    int rc;
+
+    if (__merge_uri(uri, merge_uri) != 0)
+        return EINVAL;
+    if (!start && !stop)
+        return __truncate_all(session, merge_uri);
+    if ((rc = session->open_cursor(session, merge_uri, NULL, "raw", &scan)) != 0 ||
+        (rc = session->open_cursor(session, merge_uri, NULL, "overwrite,raw", &mcursor)) != 0)
+        goto out;
+    while ((rc = scan->next(scan)) == 0) {
+        if ((rc = scan->get_key(scan, &item)) != 0)
+            break;
+        /* <<KeySize:32, Key, Seq:64>> */
+        p = item.data;
+        if (item.size < 12 || item.size - 12 != __get_be32(p))
+            continue;
+        size = item.size - 12;
+        if (start) {
+            n = size < start->size ? size : start->size;
+            cmp = memcmp(p + 4, start->data, n);
+            if (cmp < 0 || (cmp == 0 && size < start->size))
+                continue;
+        }
+        if (stop) {
+            n = size < stop->size ? size : stop->size;
+            cmp = memcmp(p + 4, stop->data, n);
+            if (cmp > 0 || (cmp == 0 && size > stop->size))
+                continue;
+        }
+        mcursor->set_key(mcursor, &item);
+        if ((rc = mcursor->remove(mcursor)) != 0 && rc != WT_NOTFOUND)
+            break;
+    }
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+  out:
+    if (mcursor)
+        (void)mcursor->close(mcursor);
+    if (scan)
+        (void)scan->close(scan);
+    return rc;
+}
+
+/**
+ * Try to drop a table now, closing the cached cursors on it first.  The
+ * cache mutex is only held while they are closed, not during the drop.
+ * Cursors still in use make the drop fail with EBUSY.
+ */
+static int
+__drop_now(WterlConnHandle *conn_handle, WT_SESSION *session, const char *uri)
+{
+    int rc;
+
+    enif_mutex_lock(conn_handle->cache_mutex);
+    __close_cursors_on(conn_handle, uri);
+    enif_mutex_unlock(conn_handle->cache_mutex);
+    rc = session->drop(session, uri, "force");
+    if (rc == 0)
+        __drop_done(conn_handle, session, uri);
+    return rc;
+}
+
+/**
+ * Work on the drops that are due: truncate each table the first time, so
+ * its space comes back even while the drop has to wait, then try to drop
+ * it.  A drop that fails is tried again after 1, 2, 4... seconds, up to
+ * DROP_BACKOFF_MAX.
+ */
+static void
+__janitor_drops(WterlConnHandle *conn_handle, WT_SESSION *session)
+{
+    struct wterl_drop *drops;
+    uint32_t i, j, num;
+    time_t now = time(NULL);
+    int truncated;
+    int rc;
+
+    if (conn_handle->num_drops == 0)
+        return;
+    enif_rwlock_rlock(conn_handle->tables_lock);
+    num = conn_handle->num_drops;
+    drops = malloc(num * sizeof(struct wterl_drop));
+    if (drops)
+        memcpy(drops, conn_handle->drops, num * sizeof(struct wterl_drop));
+    enif_rwlock_runlock(conn_handle->tables_lock);
+    if (!drops)
+        return;  /* next time */
+
+    for (i = 0; i < num && !conn_handle->janitor_stop; i++) {
+        if (drops[i].next_attempt > now)
+            continue;
+        truncated = drops[i].truncated;
+        if (!truncated)
+            truncated = (__truncate_all(session, drops[i].uri) == 0);
+        rc = __drop_now(conn_handle, session, drops[i].uri);
+        DPRINTF("janitor: drop %s attempt %u (%d)", drops[i].uri, drops[i].attempts, rc);
+        if (rc == 0)
+            continue;
+        enif_rwlock_rwlock(conn_handle->tables_lock);
+        for (j = 0; j < conn_handle->num_drops; j++) {
+            struct wterl_drop *d = &conn_handle->drops[j];
+            if (strcmp(d->uri, drops[i].uri) == 0) {
+                d->truncated = truncated;
+                d->next_attempt = now + (d->attempts < 6 ? (1 << d->attempts) : DROP_BACKOFF_MAX);
+                d->attempts++;
+                break;
+            }
+        }
+        enif_rwlock_rwunlock(conn_handle->tables_lock);
+    }
+    free(drops);
+}
+
+/**
+ * Drop the named snapshots that were garbage collected without being
+ * released, see __wterl_snapshot_dtor.
+ */
+static void
+__janitor_snapshots(WterlConnHandle *conn_handle, WT_SESSION *session)
+{
+    char names[MAX_LOST_SNAPSHOTS][32];
+    char config[64];
+    uint32_t i, num;
+
+    if (conn_handle->num_lost_snapshots == 0)
+        return;
+    enif_rwlock_rwlock(conn_handle->tables_lock);
+    num = conn_handle->num_lost_snapshots;
+    memcpy(names, conn_handle->lost_snapshots, sizeof(names[0]) * num);
+    conn_handle->num_lost_snapshots = 0;
+    enif_rwlock_rwunlock(conn_handle->tables_lock);
+
+    for (i = 0; i < num; i++) {
+        snprintf(config, sizeof(config), "drop=(names=[%s])", names[i]);
+#ifdef WTERL_NAMED_SNAPSHOTS
+        int rc = session->snapshot(session, config);
+        DPRINTF("janitor: dropped snapshot %s (%d)", names[i], rc);
+        UNUSED(rc);
+#else
+        UNUSED(session);
+#endif
+    }
+}
+
+/**
+ * The janitor, one thread per connection started when the first table has
+ * TTLs or a merge operator enabled, is dropped with drop_deferred, or a
+ * snapshot is garbage collected without being released.
+ * Every ttl_reap_interval seconds it removes expired keys, ttl_reap_batch
+ * keys per transaction, and every merge_compact_interval seconds it
+ * compacts merge operands, yielding between batches so it never
+ * monopolises the cache or the log.  Deferred drops are worked on every
+ * second.
+ */
+static void *
+__janitor_thread(void *arg)
+{
+    WterlConnHandle *conn_handle = (WterlConnHandle *)arg;
+    WT_SESSION *session = NULL;
+    struct wterl_table *tables = NULL;
+    uint32_t max = 0;
+    uint32_t i;
+    uint32_t num;
+    uint32_t ticks;
+    time_t now;
+    time_t next_reap = 0;
+    time_t next_compact = 0;
+    int n;
+    int rc;
+
+    /* Without a session there is nothing the janitor can do, report it and
+       keep trying rather than leave expired keys and drops behind. */
+    while ((rc = conn_handle->conn->open_session(conn_handle->conn, NULL, NULL, &session)) != 0) {
+        (void)__wterl_error_handler(conn_handle->event_handler, NULL, rc,
+                                    "wterl janitor: can't open a session, retrying");
+        for (ticks = 100; ticks > 0 && !conn_handle->janitor_stop; ticks--)
+            usleep(100000);
+        if (conn_handle->janitor_stop)
+            return NULL;
+    }
+
+    while (!conn_handle->janitor_stop) {
+        enif_rwlock_rlock(conn_handle->tables_lock);
+        num = conn_handle->num_tables;
+        if (num > max) {
+            struct wterl_table *more = realloc(tables, num * sizeof(struct wterl_table));
+            if (more) {
+                tables = more;
+                max = num;
+            } else {
+                num = max;  /* the rest next time */
+            }
+        }
+        if (num)
+            memcpy(tables, conn_handle->tables, num * sizeof(struct wterl_table));
+        enif_rwlock_runlock(conn_handle->tables_lock);
+
+        now = time(NULL);
+        if (now >= next_reap) {
+            for (i = 0; i < num && !conn_handle->janitor_stop; i++) {
+                if (!tables[i].ttl)
+                    continue;
+                do {
+                    n = __ttl_reap_batch(session, tables[i].uri, conn_handle->opts.ttl_reap_batch,
+                                         (uint64_t)time(NULL));
+                    DPRINTF("janitor: %s removed %d expired keys", tables[i].uri, n);
+                    if (n > 0)
+                        usleep(10000);
+                } while (n == (int)conn_handle->opts.ttl_reap_batch && !conn_handle->janitor_stop);
+            }
+            next_reap = now + conn_handle->opts.ttl_reap_interval;
+        }
+        if (now >= next_compact) {
+            /* Only tables merged into since their last pass are scanned,
+               and they are marked again if operands were left behind. */
+            for (i = 0; i < num && !conn_handle->janitor_stop; i++)
+                if (tables[i].merge_op != MERGE_NONE &&
+                    __table_merge_dirty(conn_handle, tables[i].uri, 0) &&
+                    __merge_compact_table(session, tables[i].uri, tables[i].merge_op,
+                                          &conn_handle->janitor_stop) != 0)
+                    (void)__table_merge_dirty(conn_handle, tables[i].uri, 1);
+            next_compact = now + conn_handle->opts.merge_compact_interval;
+        }
+        __janitor_drops(conn_handle, session);
+        __janitor_snapshots(conn_handle, session);
+
+        /* Sleep in short naps so closing the connection isn't held up. */
+        for (ticks = 10; ticks > 0 && !conn_handle->janitor_stop; ticks--)
+            usleep(100000);
+    }
+    session->close(session, NULL);
+    free(tables);
+    return NULL;
+}
+
+/**
+ * Start the janitor thread if it isn't running.
+ *
+ * Note: always call with conn_handle->tables_lock write locked
+ */
+static int
+__janitor_start(WterlConnHandle *conn_handle)
+{
+    int rc = 0;
+
+    if (!conn_handle->janitor_running) {
+        conn_handle->janitor_stop = 0;
+        rc = enif_thread_create("wterl_janitor", &conn_handle->janitor_tid,
+                                __janitor_thread, conn_handle, NULL);
+        if (rc == 0)
+            conn_handle->janitor_running = 1;
+    }
+    return rc;
+}
+
+/**
+ * Record a feature on a table and make sure the janitor is running.  A
+ * table may have one of TTLs, a merge operator or a hashtree (segments
+ * and width set).  Enabling a hashtree again changes its geometry.
+ */
+static int
+__table_register(WterlConnHandle *conn_handle, const char *uri, int ttl, int merge_op,
+                 uint32_t ht_segments, uint32_t ht_width)
+{
+    struct wterl_table *t;
+    struct wterl_table want;
+    uint32_t i;
+    int rc = 0;
+
+    enif_rwlock_rwlock(conn_handle->tables_lock);
+    for (i = 0; i < conn_handle->num_tables; i++)
+        if (strcmp(conn_handle->tables[i].uri, uri) == 0)
+            break;
+    if (i == conn_handle->num_tables && i == conn_handle->max_tables) {
+        uint32_t max = i ? 2 * i : 16;
+        struct wterl_table *tables = realloc(conn_handle->tables, max * sizeof(struct wterl_table));
+        if (tables) {
+            conn_handle->tables = tables;
+            conn_handle->max_tables = max;
+        } else {
+            rc = ENOMEM;
+        }
+    }
+    if (rc == 0) {
+        t = &conn_handle->tables[i];
+        if (i == conn_handle->num_tables) {
+            memset(t, 0, sizeof(struct wterl_table));
+            snprintf(t->uri, sizeof(Uri), "%s", uri);
+            conn_handle->num_tables++;
+        }
+        want = *t;
+        if (ttl) {
+            want.ttl = 1;
+        } else if (merge_op != MERGE_NONE) {
+            want.merge_op = merge_op;
+            want.merge_dirty = 1;  /* operands may be left from before */
+        } else {
+            want.ht_segments = ht_segments;
+            want.ht_width = ht_width;
+        }
+        if ((want.ttl != 0) + (want.merge_op != MERGE_NONE) + (want.ht_segments != 0) > 1 ||
+            (merge_op != MERGE_NONE && t->merge_op != MERGE_NONE && t->merge_op != merge_op))
+            rc = EINVAL;
+        else
+            *t = want;
+    }
+    /* Hashtrees are kept up to date by the writers, not the janitor. */
+    if (rc == 0 && !ht_segments)
+        rc = __janitor_start(conn_handle);
+    enif_rwlock_rwunlock(conn_handle->tables_lock);
+    return rc;
+}
+
+/**
+ * Register the features saved on tables, see __table_save, when the
+ * connection is opened.
+ */
+static int
+__tables_load(WterlConnHandle *conn_handle)
+{
+    WT_SESSION *session = NULL;
+    WT_CURSOR *cursor = NULL;
+    WT_ITEM key;
+    WT_ITEM value;
+    const uint8_t *v;
+    Uri uri;
+    int rc;
+
+    rc = conn_handle->conn->open_session(conn_handle->conn, NULL,
+                                         conn_handle->session_config, &session);
+    if (rc != 0)
+        return rc;
+    rc = session->open_cursor(session, TABLES_URI, NULL, "raw", &cursor);
+    if (rc == ENOENT || rc == WT_NOTFOUND) {
+        (void)session->close(session, NULL);
+        return 0;  /* no features were ever saved */
+    }
+    while (rc == 0 && (rc = cursor->next(cursor)) == 0) {
+        if ((rc = cursor->get_key(cursor, &key)) != 0 ||
+            (rc = cursor->get_value(cursor, &value)) != 0)
+            break;
+        if (key.size >= sizeof(Uri) || value.size != TABLES_VALUE_SIZE) {
+            rc = EINVAL;
+            break;
+        }
+        memcpy(uri, key.data, key.size);
+        uri[key.size] = '\0';
+        v = value.data;
+        rc = __table_register(conn_handle, uri, v[0], v[1], __get_be32(v + 2), __get_be32(v + 6));
+    }
+    if (rc == WT_NOTFOUND)
+        rc = 0;
+    (void)session->close(session, NULL);
+    return rc;
+}
+
+/**
+ * Stop the janitor thread, if running, and wait for it to exit.  Must be
+ * called before the WT_CONNECTION is closed.
+ */
+static void
+__janitor_stop(WterlConnHandle *conn_handle)
+{
+    void *exit_value;
+
+    if (conn_handle->janitor_running) {
+        conn_handle->janitor_stop = 1;
+        enif_thread_join(conn_handle->janitor_tid, &exit_value);
+        conn_handle->janitor_running = 0;
+    }
+}
+
+/**
+ * Retain a context for reading or writing single keys in a table, with the
+ * cursors its wterl features need: the table alone, the table and its
+ * expiry or hashtree table, or the table and two cursors on its operand
+ * table.
+ */
+static int
+__retain_table_ctx(WterlConnHandle *conn_handle, uint32_t worker_id,
+                   struct wterl_ctx **ctx, const char *uri, struct wterl_table *table)
+{
+    Uri side;
+
+    if (!__table_lookup(conn_handle, uri, table)) {
+        memset(table, 0, sizeof(struct wterl_table));
+        return __retain_ctx(conn_handle, worker_id, ctx, 1,
+                            conn_handle->session_config,
+                            uri, "overwrite,raw");
+    }
+    if (table->ttl) {
+        if (__ttl_uri(uri, side) != 0)
+            return EINVAL;
+        return __retain_ctx(conn_handle, worker_id, ctx, 2,
+                            conn_handle->session_config,
+                            uri, "overwrite,raw", side, "overwrite,raw");
+    }
+    if (table->ht_segments) {
+        if (__ht_uri(uri, side) != 0)
+            return EINVAL;
+        return __retain_ctx(conn_handle, worker_id, ctx, 2,
+                            conn_handle->session_config,
+                            uri, "overwrite,raw", side, "overwrite,raw");
+    }
+    if (__merge_uri(uri, side) != 0)
+        return EINVAL;
+    return __retain_ctx(conn_handle, worker_id, ctx, 3,
+                        conn_handle->session_config,
+                        uri, "overwrite,raw", side, "overwrite,raw", side, "raw");
+}
+
+/**
+ * Opens a WiredTiger WT_CONNECTION object.
+ *
+ * argv[0]    path to directory for the database files
+ * argv[1]    WiredTiger connection config string as an Erlang binary
+ * argv[2]    WiredTiger session config string as an Erlang binary
+ * argv[3]    wterl options as a proplist
+ */
+ASYNC_NIF_DECL(
+  wterl_conn_open,
+  { // struct
+
+    ERL_NIF_TERM config;
+    ERL_NIF_TERM session_config;
+    char homedir[4096];
+    struct wterl_conn_options opts;
+    struct wterl_priv_data *priv;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          (enif_get_string(env, argv[0], args->homedir, sizeof(args->homedir), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[1]) &&
+          enif_is_binary(env, argv[2]) &&
+          __conn_options(env, argv[3], &args->opts))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->session_config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+
+    args->priv = (struct wterl_priv_data *)enif_priv_data(env);
+  },
+  { // work
+
+    WT_CONNECTION *conn;
+    ErlNifBinary config;
+    ErlNifBinary session_config;
+
+    if (!enif_inspect_binary(env, args->config, &config)) {
+        ASYNC_NIF_REPLY(enif_make_badarg(env));
+        return;
+    }
+    if (!enif_inspect_binary(env, args->session_config, &session_config)) {
+        ASYNC_NIF_REPLY(enif_make_badarg(env));
+        return;
+    }
+
+    int rc = wiredtiger_open(args->homedir,
+                             (WT_EVENT_HANDLER*)&args->priv->eh.handlers,
+                             (config.size > 1) ? (const char *)config.data : NULL,
+                             &conn);
+    if (rc == 0) {
+      WterlConnHandle *conn_handle = enif_alloc_resource(wterl_conn_RESOURCE, sizeof(WterlConnHandle));
+      memset(conn_handle, 0, sizeof(WterlConnHandle));
+      if (!conn_handle) {
+          ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+          return;
+      }
+      if (session_config.size > 1) {
+          char *sc = malloc(session_config.size);
+          if (!sc) {
+              enif_release_resource(conn_handle);
+              ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+              return;
+          }
+          memcpy(sc, session_config.data, session_config.size);
+          conn_handle->session_config = (const char *)sc;
+      } else {
+          conn_handle->session_config = NULL;
+      }
+      conn_handle->cache_mutex = enif_mutex_create("conn_handle");
+      conn_handle->tables_lock = enif_rwlock_create("conn_handle_tables");
+      conn_handle->merge_seq = (uint64_t)time(NULL) << 24;
+      enif_mutex_lock(conn_handle->cache_mutex);
+      conn_handle->conn = conn;
+      conn_handle->event_handler = (WT_EVENT_HANDLER*)&args->priv->eh.handlers;
+      conn_handle->opts = args->opts;
+      ERL_NIF_TERM result = enif_make_resource(env, conn_handle);
+
+      /* Init list for cache of reuseable contexts */
+      STAILQ_INIT(&conn_handle->cache);
+      conn_handle->cache_size = 0;
+
+      enif_release_resource(conn_handle);
+      enif_mutex_unlock(conn_handle->cache_mutex);
+
+      /* Features enabled on tables before are back before anyone writes.
+         On failure the result is dropped, and with it the connection. */
+      rc = __tables_load(conn_handle);
+      if (rc != 0) {
+          ASYNC_NIF_REPLY(__strerror_term(env, rc));
+          return;
+      }
+      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, result));
+    }
+    else
+    {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+    }
+  },
+  { // post
+
+  });
+
+/**
+ * Closes a WiredTiger WT_CONNECTION object.
+ *
+ * argv[0]    WterlConnHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_conn_close,
+  { // struct
+
+    WterlConnHandle* conn_handle;
+    struct wterl_priv_data *priv;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+
+    args->priv = (struct wterl_priv_data *)enif_priv_data(env);
+  },
+  { // work
+
+    /* Free up the shared sessions and cursors. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    if (args->conn_handle->num_pinned > 0) {
+        /* Closing would free memory still referenced by zero-copy binaries. */
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, EBUSY));
+        return;
+    }
+    __janitor_stop(args->conn_handle);
+    __close_all_sessions(args->conn_handle);
+    /* Nothing can have the tables waiting to be dropped open now. */
+    if (args->conn_handle->num_drops > 0) {
+        WT_SESSION *session = NULL;
+        uint32_t i;
+        if (args->conn_handle->conn->open_session(args->conn_handle->conn, NULL, NULL, &session) == 0) {
+            for (i = 0; i < args->conn_handle->num_drops; i++)
+                if (session->drop(session, args->conn_handle->drops[i].uri, "force") == 0)
+                    (void)__table_forget(session, args->conn_handle->drops[i].uri);
+            session->close(session, NULL);
+        }
+        args->conn_handle->num_drops = 0;
+    }
+    free(args->conn_handle->drops);
+    args->conn_handle->drops = NULL;
+    args->conn_handle->max_drops = 0;
+    free(args->conn_handle->tables);
+    args->conn_handle->tables = NULL;
+    args->conn_handle->num_tables = 0;
+    args->conn_handle->max_tables = 0;
+    if (args->conn_handle->session_config) {
+        free((char *)args->conn_handle->session_config);
+        args->conn_handle->session_config = NULL;
+    }
+    WT_CONNECTION* conn = args->conn_handle->conn;
+    int rc = conn->close(conn, NULL);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    enif_mutex_destroy(args->conn_handle->cache_mutex);
+    enif_rwlock_destroy(args->conn_handle->tables_lock);
+    memset(args->conn_handle, 0, sizeof(WterlConnHandle));
+
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+static ERL_NIF_TERM
+__conn_stats(ErlNifEnv *env, WterlConnHandle *conn_handle)
+{
+    struct wterl_conn_stats *stats = &conn_handle->stats;
+    uint64_t gone = stats->cursors_closed + stats->cursors_collected;
+    const char *names[] = { "ctx_cache_size", "ctx_cache_hits", "ctx_cache_misses",
+                            "ctx_cache_evicted", "cursors_open", "cursors_opened",
+                            "cursors_closed", "cursors_collected", "pinned_values",
+                            "drops_pending" };
+    uint64_t values[] = { conn_handle->cache_size, stats->ctx_cache_hits, stats->ctx_cache_misses,
+                          stats->ctx_cache_evicted, stats->cursors_opened - gone, stats->cursors_opened,
+                          stats->cursors_closed, stats->cursors_collected, conn_handle->num_pinned,
+                          conn_handle->num_drops };
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    int i;
+
+    for (i = (sizeof(values) / sizeof(values[0])) - 1; i >= 0; i--)
+        list = enif_make_list_cell(env, enif_make_tuple2(env, enif_make_atom(env, names[i]),
+                                                         enif_make_uint64(env, values[i])), list);
+    return enif_make_tuple2(env, ATOM_OK, list);
+}
+
+/**
+ * Report wterl's own counters for a connection: the context (session)
+ * cache and the cursors drawn from it.
+ *
+ * argv[0]    WterlConnHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_conn_stats,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ASYNC_NIF_REPLY(__conn_stats(env, args->conn_handle));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/* Cursor config asking for only the statistics that are cheap to gather. */
+#if WIREDTIGER_VERSION_MAJOR >= 2
+#define STATS_FAST_CONFIG "statistics=(fast)"
+#else
+#define STATS_FAST_CONFIG "statistics_fast=true"
+#endif
+
+/**
+ * Is a statistic's description one of those asked for, does it start with
+ * any of the binaries in prefixes (an empty list asks for all of them)?
+ */
+static int
+__stat_wanted(ErlNifEnv *env, const char *desc, ERL_NIF_TERM prefixes)
+{
+    ERL_NIF_TERM head, tail = prefixes;
+    ErlNifBinary prefix;
+    size_t len;
+
+    if (enif_is_empty_list(env, prefixes))
+        return 1;
+    len = __strlen(desc);
+    while (enif_get_list_cell(env, tail, &head, &tail)) {
+        if (enif_inspect_binary(env, head, &prefix) &&
+            prefix.size <= len && memcmp(desc, prefix.data, prefix.size) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Read a statistics cursor into a list of {Description, Value}, in the
+ * cursor's order.
+ */
+static ERL_NIF_TERM
+__stats(ErlNifEnv *env, WterlConnHandle *conn_handle, const char *uri, int fast,
+        ERL_NIF_TERM prefixes)
+{
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    WT_CURSOR *cursor = NULL;
+    const char *desc;
+    const char *pvalue;
+    int64_t value;
+    ERL_NIF_TERM name, list = enif_make_list(env, 0);
+    unsigned char *p;
+    int rc;
+
+    if (!conn)
+        return __strerror_term(env, EINVAL);
+    if ((rc = conn->open_session(conn, NULL, NULL, &session)) != 0)
+        return __strerror_term(env, rc);
+    rc = session->open_cursor(session, uri, NULL, fast ? STATS_FAST_CONFIG : NULL, &cursor);
+    if (rc != 0) {
+        session->close(session, NULL);
+        return __strerror_term(env, rc);
+    }
+    while ((rc = cursor->next(cursor)) == 0) {
+        if ((rc = cursor->get_value(cursor, &desc, &pvalue, &value)) != 0)
+            break;
+        if (!__stat_wanted(env, desc, prefixes))
+            continue;
+        p = enif_make_new_binary(env, __strlen(desc), &name);
+        memcpy(p, desc, __strlen(desc));
+        list = enif_make_list_cell(env, enif_make_tuple2(env, name, enif_make_int64(env, value)), list);
+    }
+    session->close(session, NULL); // closes the cursor too
+    if (rc != WT_NOTFOUND)
+        return __strerror_term(env, rc);
+    enif_make_reverse_list(env, list, &list);
+    return enif_make_tuple2(env, ATOM_OK, list);
+}
+
+/**
+ * Read WiredTiger's statistics for the connection, or for one table.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string, or "" for the connection's statistics
+ * argv[2]    true to read only the statistics that are cheap to gather
+ * argv[3]    a list of binaries, only statistics whose descriptions start
+ *            with one of them are returned (all of them when empty)
+ */
+ASYNC_NIF_DECL(
+  wterl_stats,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    int fast;
+    ERL_NIF_TERM prefixes;
+  },
+  { // pre
+
+    static const char statistics[] = "statistics:";
+    memcpy(args->uri, statistics, sizeof(statistics) - 1);
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri + sizeof(statistics) - 1,
+                           sizeof(args->uri) - (sizeof(statistics) - 1), ERL_NIF_LATIN1) > 0) &&
+          enif_is_atom(env, argv[2]) &&
+          enif_is_list(env, argv[3]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->fast = enif_is_identical(argv[2], enif_make_atom(env, "true"));
+    args->prefixes = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ASYNC_NIF_REPLY(__stats(env, args->conn_handle, args->uri, args->fast, args->prefixes));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Create a WiredTiger table, column group, index or file.
+ *
+ * We create, use and discard a WT_SESSION here because table creation is not
+ * too performance sensitive.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_create,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* We create, use and discard a WT_SESSION here because a) we don't need a
+       cursor and b) we don't anticipate doing this operation frequently enough
+       to impact performance. */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    /* A table waiting to be dropped must be gone before it is made anew,
+       or the janitor would drop the new one.  While cursors still hold it
+       open it is emptied instead, and kept as the new table. */
+    if (__drop_pending(args->conn_handle, args->uri)) {
+        rc = __drop_now(args->conn_handle, session, args->uri);
+        if (rc == EBUSY && (rc = __truncate_all(session, args->uri)) == 0)
+            __drop_done(args->conn_handle, session, args->uri);
+    }
+    if (rc == 0)
+        rc = session->create(session, args->uri, (const char*)config.data);
+    (void)session->close(session, NULL);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Set the merge operator for a table, creating its operand table if need
+ * be and starting the connection's janitor thread.  The operator is saved
+ * with the table's features and set again when the connection is next
+ * opened, so operands merged before a restart are still folded on reads.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    the operator, one of the atoms add, max or append
+ */
+ASYNC_NIF_DECL(
+  wterl_set_merge_operator,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    int op;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    if (enif_is_identical(argv[2], ATOM_ADD))
+        args->op = MERGE_ADD;
+    else if (enif_is_identical(argv[2], ATOM_MAX))
+        args->op = MERGE_MAX;
+    else if (enif_is_identical(argv[2], ATOM_APPEND))
+        args->op = MERGE_APPEND;
+    else
+        ASYNC_NIF_RETURN_BADARG();
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    WterlConnHandle *conn_handle = args->conn_handle;
+    Uri merge_uri;
+    int rc = __merge_uri(args->uri, merge_uri);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    rc = conn->open_session(conn, NULL, conn_handle->session_config, &session);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    rc = session->create(session, merge_uri, "key_format=u,value_format=u");
+    (void)session->close(session, NULL);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    rc = __table_register(conn_handle, args->uri, 0, args->op, 0, 0);
+    if (rc == 0)
+        rc = __table_save(conn_handle, args->uri);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Merge an operand into the value for a key without reading it.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    operand, an integer for add and max or a binary for append
+ */
+ASYNC_NIF_DECL(
+  wterl_merge,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM operand;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->operand = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary key;
+    ErlNifBinary operand;
+    ErlNifSInt64 n;
+    uint8_t num[8];
+    struct wterl_table table;
+    Uri merge_uri;
+
+    if (!enif_inspect_binary(env, args->key, &key) || key.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (!__table_lookup(args->conn_handle, args->uri, &table) ||
+        table.merge_op == MERGE_NONE || __merge_uri(args->uri, merge_uri) != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+    if (table.merge_op == MERGE_APPEND) {
+        if (!enif_inspect_binary(env, args->operand, &operand)) {
+            ASYNC_NIF_REPLY(enif_make_badarg(env));
+            return;
+        }
+    } else {
+        if (!enif_get_int64(env, args->operand, &n)) {
+            ASYNC_NIF_REPLY(enif_make_badarg(env));
+            return;
+        }
+        __put_be64(num, (uint64_t)n);
+        operand.data = num;
+        operand.size = 8;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
+                          args->conn_handle->session_config,
+                          merge_uri, "overwrite,raw");
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WT_CURSOR *cursor = ctx->ci[0].cursor;
+
+    size_t plen;
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    uint8_t *p = __merge_prefix(&item_key, &plen);
+    if (!p) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+        return;
+    }
+    __put_be64(p + plen, __sync_fetch_and_add(&args->conn_handle->merge_seq, 1));
+    item_key.data = p;
+    item_key.size = plen + 8;
+    cursor->set_key(cursor, &item_key);
+    item_value.data = operand.data;
+    item_value.size = operand.size;
+    cursor->set_value(cursor, &item_value);
+    rc = cursor->insert(cursor);
+    free(p);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    if (rc == 0)
+        (void)__table_merge_dirty(args->conn_handle, args->uri, 1);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Enable key expiry on a table, creating its expiry table if need be and
+ * starting the connection's janitor thread.  The setting is saved with
+ * the table's features and enabled again when the connection is next
+ * opened.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ */
+ASYNC_NIF_DECL(
+  wterl_ttl_enable,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+  },
+  { // pre
+
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    WterlConnHandle *conn_handle = args->conn_handle;
+    Uri ttl_uri;
+    int rc = __ttl_uri(args->uri, ttl_uri);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    rc = conn->open_session(conn, NULL, conn_handle->session_config, &session);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    rc = session->create(session, ttl_uri, "key_format=u,value_format=u");
+    (void)session->close(session, NULL);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    rc = __table_register(conn_handle, args->uri, 1, MERGE_NONE, 0, 0);
+    if (rc == 0)
+        rc = __table_save(conn_handle, args->uri);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Enable a hashtree on a table, creating its hashtree table if need be.
+ * The hashtree is saved with the table's features and enabled again when
+ * the connection is next opened.  When the geometry differs from the
+ * hashtree table's the hashes are thrown away.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    number of segments, a power of the width
+ * argv[3]    width, the number of children of each node of the tree
+ * ->         {ok, Built}, Built is false until hashtree_rebuild has hashed
+ *            the keys already in the table (true if it was empty)
+ */
+ASYNC_NIF_DECL(
+  wterl_hashtree_enable,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    unsigned int segments;
+    unsigned int width;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_get_uint(env, argv[2], &args->segments) &&
+          enif_get_uint(env, argv[3], &args->width) &&
+          __ht_levels(args->segments, args->width) > 0)) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    WterlConnHandle *conn_handle = args->conn_handle;
+    Uri ht_uri;
+    int rc = __ht_uri(args->uri, ht_uri);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    rc = conn->open_session(conn, NULL, conn_handle->session_config, &session);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WT_CURSOR *ht_cursor = NULL;
+    WT_CURSOR *cursor = NULL;
+    uint32_t segments = 0;
+    uint32_t width = 0;
+    int built = 0;
+    int empty = 0;
+    rc = session->open_cursor(session, args->uri, NULL, "raw", &cursor);
+    if (rc == 0) {
+        rc = cursor->next(cursor);
+        empty = (rc == WT_NOTFOUND);
+        if (rc == WT_NOTFOUND)
+            rc = 0;
+    }
+    if (rc == 0)
+        rc = session->create(session, ht_uri, "key_format=u,value_format=u");
+    if (rc == 0)
+        rc = session->open_cursor(session, ht_uri, NULL, "overwrite,raw", &ht_cursor);
+    if (rc == 0)
+        rc = __ht_meta_read(ht_cursor, &segments, &width, &built);
+    if (rc == WT_NOTFOUND ||
+        (rc == 0 && (empty || segments != args->segments || width != args->width))) {
+        /* New, the geometry changed, or the table was emptied (dropped and
+           created again, say): start over.  The hashes of an empty table
+           are built. */
+        rc = ht_cursor->next(ht_cursor);
+        if (rc == 0)
+            rc = session->truncate(session, NULL, ht_cursor, NULL, NULL);
+        built = empty;
+        if (rc == 0 || rc == WT_NOTFOUND)
+            rc = __ht_meta_write(ht_cursor, args->segments, args->width, built);
+    }
+    (void)session->close(session, NULL);
+    if (rc == 0)
+        rc = __table_register(conn_handle, args->uri, 0, MERGE_NONE, args->segments, args->width);
+    if (rc == 0)
+        rc = __table_save(conn_handle, args->uri);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, built ? "true" : "false")));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Bring a table's hashtree up to date with its contents: hash every key,
+ * forget the hashes of keys that are gone, then recompute the segments.
+ * Each step works in small transactions so writers carry on meanwhile.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ */
+ASYNC_NIF_DECL(
+  wterl_hashtree_rebuild,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+  },
+  { // pre
+
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    WterlConnHandle *conn_handle = args->conn_handle;
+    struct wterl_table table;
+    Uri ht_uri;
+    if (!__table_lookup(conn_handle, args->uri, &table) || !table.ht_segments ||
+        __ht_uri(args->uri, ht_uri) != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+        return;
+    }
+
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, conn_handle->session_config, &session);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WT_CURSOR *cursor = NULL;
+    WT_CURSOR *scan = NULL;
+    WT_CURSOR *ht_cursor = NULL;
+    WT_CURSOR *ht_scan = NULL;
+    uint8_t k = HT_KEY;
+    WT_ITEM start;
+    start.data = &k;
+    start.size = 1;
+    if ((rc = session->open_cursor(session, args->uri, NULL, "raw", &cursor)) == 0 &&
+        (rc = session->open_cursor(session, args->uri, NULL, "raw", &scan)) == 0 &&
+        (rc = session->open_cursor(session, ht_uri, NULL, "overwrite,raw", &ht_cursor)) == 0 &&
+        (rc = session->open_cursor(session, ht_uri, NULL, "raw", &ht_scan)) == 0 &&
+        (rc = __ht_meta_write(ht_cursor, table.ht_segments, table.ht_width, 0)) == 0 &&
+        (rc = __ht_rebuild_pass(session, scan, NULL, __ht_visit_record,
+                                NULL, ht_cursor, table.ht_segments)) == 0 &&
+        (rc = __ht_rebuild_pass(session, ht_scan, &start, __ht_visit_hash,
+                                cursor, ht_cursor, table.ht_segments)) == 0 &&
+        (rc = __ht_rebuild_segments(session, ht_scan, ht_cursor, table.ht_segments)) == 0)
+        rc = __ht_meta_write(ht_cursor, table.ht_segments, table.ht_width, 1);
+    (void)session->close(session, NULL);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Read the hashes of the children of one node of a table's hashtree, as
+ * Riak's hashtree:get_bucket/3.  Level 1 is the root (Bucket 0), at the
+ * last level the children are segments.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    level
+ * argv[3]    bucket, the node at that level
+ * ->         {ok, [{Child, Hash}]} for the children that have keys
+ */
+ASYNC_NIF_DECL(
+  wterl_hashtree_bucket,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    unsigned int level;
+    unsigned int bucket;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_get_uint(env, argv[2], &args->level) && args->level > 0 &&
+          enif_get_uint(env, argv[3], &args->bucket))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    struct wterl_table table;
+    Uri ht_uri;
+    if (!__table_lookup(args->conn_handle, args->uri, &table) || !table.ht_segments ||
+        __ht_uri(args->uri, ht_uri) != 0 ||
+        args->level > __ht_levels(table.ht_segments, table.ht_width)) {
+        ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+        return;
+    }
+    /* The children are nodes of the next level down, each over span
+       segments. */
+    uint64_t nodes = 1;
+    uint32_t i;
+    for (i = 1; i < args->level; i++)
+        nodes *= table.ht_width;
+    if (args->bucket >= nodes) {
+        ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+        return;
+    }
+    uint64_t span = table.ht_segments / (nodes * table.ht_width);
+    uint64_t *acc = calloc(table.ht_width, sizeof(uint64_t));
+    if (!acc) {
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+        return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
+                          args->conn_handle->session_config, ht_uri, "raw");
+    if (rc == 0) {
+        rc = __ht_sum_segments(ctx->ci[0].cursor, HT_SEGMENT,
+                               (uint32_t)(args->bucket * table.ht_width * span),
+                               table.ht_width * span, span, acc);
+        __release_ctx(args->conn_handle, worker_id, ctx);
+    }
+    if (rc != 0) {
+        free(acc);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (i = table.ht_width; i > 0; i--)
+        if (acc[i - 1])
+            list = enif_make_list_cell(env, enif_make_tuple2(env, enif_make_uint(env, i - 1),
+                                                             enif_make_uint64(env, acc[i - 1])),
+                                       list);
+    free(acc);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, list));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Read the hash of every key in one segment of a table's hashtree, to find
+ * which keys differ once an exchange has narrowed things down to it.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    segment
+ * ->         {ok, [{Key, Hash}]} in key order
+ */
+ASYNC_NIF_DECL(
+  wterl_hashtree_key_hashes,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    unsigned int segment;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_get_uint(env, argv[2], &args->segment))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    struct wterl_table table;
+    Uri ht_uri;
+    if (!__table_lookup(args->conn_handle, args->uri, &table) || !table.ht_segments ||
+        __ht_uri(args->uri, ht_uri) != 0 || args->segment >= table.ht_segments) {
+        ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+        return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
+                          args->conn_handle->session_config, ht_uri, "raw");
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WT_CURSOR *cursor = ctx->ci[0].cursor;
+    WT_ITEM item;
+    WT_ITEM value;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM list;
+    ERL_NIF_TERM items = enif_make_list(env, 0);
+    uint8_t prefix[5];
+    int exact;
+    prefix[0] = HT_KEY;
+    __put_be32(prefix + 1, args->segment);
+    item.data = prefix;
+    item.size = sizeof(prefix);
+    cursor->set_key(cursor, &item);
+    rc = cursor->search_near(cursor, &exact);
+    if (rc == 0 && exact < 0)
+        rc = cursor->next(cursor);
+    while (rc == 0) {
+        if ((rc = cursor->get_key(cursor, &item)) != 0)
+            break;
+        if (item.size < sizeof(prefix) || memcmp(item.data, prefix, sizeof(prefix)) != 0)
+            break;
+        if ((rc = cursor->get_value(cursor, &value)) != 0)
+            break;
+        if (value.size == 8) {
+            memcpy(enif_make_new_binary(env, item.size - sizeof(prefix), &key),
+                   (const uint8_t *)item.data + sizeof(prefix), item.size - sizeof(prefix));
+            items = enif_make_list_cell(env, enif_make_tuple2(env, key,
+                                                              enif_make_uint64(env, __get_be64(value.data))),
+                                        items);
+        }
+        rc = cursor->next(cursor);
+    }
+    (void)cursor->reset(cursor);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    if (rc != 0 && rc != WT_NOTFOUND) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    enif_make_reverse_list(env, items, &list);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, list));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Drop (remove) a WiredTiger table, column group, index or file.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_drop,
+  { // struct
+
+    Uri uri;
+    ERL_NIF_TERM config;
+    WterlConnHandle *conn_handle;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    /* This call requires that there be no open cursors referencing the object. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    __close_cursors_on(args->conn_handle, args->uri);
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* We create, use and discard a WT_SESSION here because a) we don't need a
+       cursor and b) we don't anticipate doing this operation frequently enough
+       to impact performance. */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    /* Note: we locked the context mutex and called __close_cursors_on()
+       earlier so that we are sure that before we call into WiredTiger we have
+       first closed all open cursors referencing this object.  Failure to do
+       this will result in EBUSY(16) "Device or resource busy". */
+    rc = session->drop(session, args->uri, (const char*)config.data);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    if (rc == 0)
+        __drop_done(args->conn_handle, session, args->uri);
+    (void)session->close(session, NULL);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Drop a table in the background.  From now on operations that open the
+ * table fail with enoent and its cached cursors are closed.  The janitor
+ * truncates the table, then drops it, retrying with backoff until the
+ * cursors still in use on it are closed.  Pending drops left when the
+ * connection is closed are done then, they are not remembered across
+ * restarts.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ */
+ASYNC_NIF_DECL(
+  wterl_drop_deferred,
+  { // struct
+
+    Uri uri;
+    WterlConnHandle *conn_handle;
+  },
+  { // pre
+
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    WterlConnHandle *conn_handle = args->conn_handle;
+    uint32_t i;
+    int rc = 0;
+
+    enif_rwlock_rwlock(conn_handle->tables_lock);
+    for (i = 0; i < conn_handle->num_drops; i++)
+        if (strcmp(conn_handle->drops[i].uri, args->uri) == 0)
+            break;
+    if (i == conn_handle->num_drops) {
+        if (i == conn_handle->max_drops) {
+            uint32_t max = i ? 2 * i : 16;
+            struct wterl_drop *drops = realloc(conn_handle->drops, max * sizeof(struct wterl_drop));
+            if (drops) {
+                conn_handle->drops = drops;
+                conn_handle->max_drops = max;
+            } else {
+                rc = ENOMEM;
+            }
+        }
+        if (rc == 0) {
+            memset(&conn_handle->drops[i], 0, sizeof(struct wterl_drop));
+            snprintf(conn_handle->drops[i].uri, sizeof(Uri), "%s", args->uri);
+            conn_handle->num_drops++;
+        }
+    }
+    if (rc == 0)
+        rc = __janitor_start(conn_handle);
+    enif_rwlock_rwunlock(conn_handle->tables_lock);
+    if (rc == 0) {
+        enif_mutex_lock(conn_handle->cache_mutex);
+        __close_cursors_on(conn_handle, args->uri);
+        enif_mutex_unlock(conn_handle->cache_mutex);
+    }
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Rename a WiredTiger table, column group, index or file.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    old object name URI string
+ * argv[2]    new object name URI string
+ * argv[3]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_rename,
+  { // struct
+
+    Uri oldname;
+    Uri newname;
+    ERL_NIF_TERM config;
+    WterlConnHandle *conn_handle;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->oldname, sizeof(args->oldname), ERL_NIF_LATIN1) > 0) &&
+          (enif_get_string(env, argv[2], args->newname, sizeof(args->newname), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[3]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    /* This call requires that there be no open cursors referencing the object. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    __close_cursors_on(args->conn_handle, args->oldname);
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* We create, use and discard a WT_SESSION here because a) we don't need a
+       cursor and b) we don't anticipate doing this operation frequently enough
+       to impact performance. */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      return;
+    }
+
+    /* Note: we locked the context mutex and called __close_cursors_on()
+       earlier so that we are sure that before we call into WiredTiger we have
+       first closed all open cursors referencing this object.  Failure to do
+       this will result in EBUSY(16) "Device or resource busy". */
+    rc = session->rename(session, args->oldname, args->newname, (const char*)config.data);
+    (void)session->close(session, NULL);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+
+/**
+ * Salvage rebuilds the file, or files of which a table is comprised,
+ * discarding any corrupted file blocks.  Use this as a fallback if
+ * an attempt to open a WiredTiger database object fails.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_salvage,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    /* This call requires that there be no open cursors referencing the object. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    __close_cursors_on(args->conn_handle, args->uri);
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* We create, use and discard a WT_SESSION here because a) we don't need a
+       cursor and b) we don't anticipate doing this operation frequently enough
+       to impact performance. */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      return;
+    }
+
+    rc = session->salvage(session, args->uri, (const char*)config.data);
+    (void)session->close(session, NULL);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Checkpoint writes a transactionally consistent snapshot of a database or set
+ * of objects specified.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_checkpoint,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          enif_is_binary(env, argv[1]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    rc = session->checkpoint(session, (const char*)config.data);
+    (void)session->close(session, NULL);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Truncate a file, table or cursor range.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    start key as an Erlang binary
+ * argv[3]    stop key as an Erlang binary
+ * argv[4]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_truncate,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    int from_first;
+    int to_last;
+    ERL_NIF_TERM start;
+    ERL_NIF_TERM stop;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 5 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[4]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    if (enif_is_binary(env, argv[2])) {
+        args->from_first = 0;
+        args->start = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    } else if (enif_is_atom(env, argv[2])) { // TODO && argv[2] == ATOM_FIRST) {
+        args->from_first = 1;
+        args->start = 0;
+    } else {
+        ASYNC_NIF_RETURN_BADARG();
+    }
+    if (enif_is_binary(env, argv[3])) {
+        args->to_last = 0;
+        args->stop = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    } else if (enif_is_atom(env, argv[3])) { // TODO && argv[3] == ATOM_LAST) {
+        args->to_last = 1;
+        args->stop = 0;
+    } else {
+        ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[4]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    /* Tables with a hashtree are truncated a key at a time, keeping their
+       hashtree in step, rather than by WT_SESSION::truncate. */
+    struct wterl_table table;
+    if (!__table_lookup(args->conn_handle, args->uri, &table))
+        memset(&table, 0, sizeof(table));
+    if (table.ht_segments) {
+        ErlNifBinary bin;
+        WT_ITEM start_item;
+        WT_ITEM stop_item;
+        WT_SESSION *session = NULL;
+        if (!args->from_first) {
+            if (!enif_inspect_binary(env, args->start, &bin)) {
+                ASYNC_NIF_REPLY(enif_make_badarg(env));
+                return;
+            }
+            start_item.data = bin.data;
+            start_item.size = bin.size;
+        }
+        if (!args->to_last) {
+            if (!enif_inspect_binary(env, args->stop, &bin)) {
+                ASYNC_NIF_REPLY(enif_make_badarg(env));
+                return;
+            }
+            stop_item.data = bin.data;
+            stop_item.size = bin.size;
+        }
+        WT_CONNECTION *conn = args->conn_handle->conn;
+        int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+        if (rc == 0) {
+            rc = __ht_truncate(session, args->uri, table.ht_segments,
+                               args->from_first ? NULL : &start_item,
+                               args->to_last ? NULL : &stop_item);
+            (void)session->close(session, NULL);
+        }
+        ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+        return;
+    }
+
+    /* This call requires that there be no open cursors referencing the object. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    __close_cursors_on(args->conn_handle, args->uri);
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* Note: we locked the context mutex and called __close_cursors_on()
+       earlier so that we are sure that before we call into WiredTiger we have
+       first closed all open cursors referencing this object.  Failure to do
+       this will result in EBUSY(16) "Device or resource busy". */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    ErlNifBinary start_key;
+    ErlNifBinary stop_key;
+    WT_CURSOR *start = NULL;
+    WT_CURSOR *stop = NULL;
+
+    /* The truncate method should be passed either a URI or start/stop cursors,
+       but not both.  So we simply open cursors no matter what to avoid the
+       mess. */
+    if (!args->from_first) {
+        if (!enif_inspect_binary(env, args->start, &start_key)) {
+            enif_mutex_unlock(args->conn_handle->cache_mutex);
+            ASYNC_NIF_REPLY(enif_make_badarg(env));
+            return;
+        }
+    }
+    rc = session->open_cursor(session, args->uri, NULL, "raw", &start);
+    if (rc != 0) {
+        session->close(session, NULL);
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    /* Position the start cursor at the first record or the specified record. */
+    if (args->from_first) {
+        rc = start->next(start);
+        if (rc != 0) {
+            start->close(start);
+            session->close(session, NULL);
+            enif_mutex_unlock(args->conn_handle->cache_mutex);
+            ASYNC_NIF_REPLY(__strerror_term(env, rc));
+            return;
+        }
+    } else {
+        WT_ITEM item_start;
+        item_start.data = start_key.data;
+        item_start.size = start_key.size;
+        start->set_key(start, item_start);
+    }
+
+    if (!args->to_last) {
+        if (!enif_inspect_binary(env, args->stop, &stop_key)) {
+            start->close(start);
+            session->close(session, NULL);
+            enif_mutex_unlock(args->conn_handle->cache_mutex);
+            ASYNC_NIF_REPLY(enif_make_badarg(env));
+            return;
+        }
+    }
+    rc = session->open_cursor(session, args->uri, NULL, "raw", &stop);
+    if (rc != 0) {
+        start->close(start);
+        session->close(session, NULL);
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    /* Position the stop cursor at the last record or the specified record. */
+    if (args->to_last) {
+        rc = stop->prev(stop);
+        if (rc != 0) {
+            start->close(start);
+            stop->close(stop);
+            session->close(session, NULL);
+            enif_mutex_unlock(args->conn_handle->cache_mutex);
+            ASYNC_NIF_REPLY(__strerror_term(env, rc));
+            return;
+        }
+    } else {
+        WT_ITEM item_stop;
+        item_stop.data = stop_key.data;
+        item_stop.size = stop_key.size;
+        stop->set_key(stop, item_stop);
+    }
+
+    /* Always pass NULL for URI here because we always specify the range with the
+       start and stop cursors which were opened referencing that URI. */
+    rc = session->truncate(session, NULL, start, stop, (const char*)config.data);
+
+    /* The expiry times or pending operands of the keys truncated go with
+       them. */
+    if (rc == 0 && (table.ttl || table.merge_op != MERGE_NONE)) {
+        WT_ITEM first;
+        WT_ITEM last;
+        if (!args->from_first) {
+            first.data = start_key.data;
+            first.size = start_key.size;
+        }
+        if (!args->to_last) {
+            last.data = stop_key.data;
+            last.size = stop_key.size;
+        }
+        if (table.ttl)
+            rc = __ttl_truncate(session, args->uri, args->from_first ? NULL : &first,
+                                args->to_last ? NULL : &last);
+        else
+            rc = __merge_truncate(session, args->uri, args->from_first ? NULL : &first,
+                                  args->to_last ? NULL : &last);
+    }
+
+    start->close(start);
+    stop->close(stop);
+    session->close(session, NULL);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Upgrade upgrades a file or table, if upgrade is required.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_upgrade,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    /* This call requires that there be no open cursors referencing the object. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    __close_cursors_on(args->conn_handle, args->uri);
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* We create, use and discard a WT_SESSION here because a) we don't need a
+       cursor and b) we don't anticipate doing this operation frequently enough
+       to impact performance. */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    rc = session->upgrade(session, args->uri, (const char*)config.data);
+    (void)session->close(session, NULL);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Verify reports if a file, or the files of which a table is comprised, have
+ * been corrupted.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_verify,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    /* This call requires that there be no open cursors referencing the object. */
+    enif_mutex_lock(args->conn_handle->cache_mutex);
+    __close_all_sessions(args->conn_handle);
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      enif_mutex_unlock(args->conn_handle->cache_mutex);
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    /* We create, use and discard a WT_SESSION here because a) we don't need a
+       cursor and b) we don't anticipate doing this operation frequently enough
+       to impact performance. */
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    if (rc != 0) {
+        enif_mutex_unlock(args->conn_handle->cache_mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    rc = session->verify(session, args->uri, (const char*)config.data);
+    (void)session->close(session, NULL);
+    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Delete a key's value from the specified table or index.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_delete,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+    //affinity = __str_hash(0, args->uri, __strlen(args->uri));
+  },
+  { // work
+
+    ErlNifBinary key;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (key.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    WT_CURSOR *cursor = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    cursor = ctx->ci[0].cursor;
+
+    WT_ITEM item_key;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    if (table.ttl) {
+        rc = __ttl_write(ctx->session, cursor, ctx->ci[1].cursor, &item_key, NULL, 0);
+    } else if (table.ht_segments) {
+        rc = __ht_write(ctx->session, cursor, ctx->ci[1].cursor, table.ht_segments,
+                        &item_key, NULL);
+    } else if (table.merge_op != MERGE_NONE) {
+        rc = __merge_write(ctx->session, cursor, ctx->ci[1].cursor, ctx->ci[2].cursor,
+                           &item_key, NULL);
+    } else {
+        cursor->set_key(cursor, &item_key);
+        rc = cursor->remove(cursor);
+    }
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    __release_ctx(args->conn_handle, worker_id, ctx);
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Read a key from a table with a merge operator, folding in its operands
+ * and compacting them if there are many.  ctx is from __retain_table_ctx.
+ *
+ * ->   the reply for get/3
+ */
+static ERL_NIF_TERM
+__merge_get(ErlNifEnv *env, struct wterl_ctx *ctx, int op, WT_ITEM *key)
+{
+    WT_SESSION *session = ctx->session;
+    WT_CURSOR *cursor = ctx->ci[0].cursor;
+    WT_CURSOR *mcursor = ctx->ci[1].cursor;
+    WT_CURSOR *mscan = ctx->ci[2].cursor;
+    struct wterl_merge_acc acc;
+    WT_ITEM item;
+    ERL_NIF_TERM value;
+    uint32_t nops;
+    int rc;
+
+    memset(&acc, 0, sizeof(acc));
+    acc.op = op;
+    rc = session->begin_transaction(session, "isolation=snapshot");
+    if (rc != 0)
+        return __strerror_term(env, rc);
+    rc = __merge_read(cursor, mscan, key, &acc, &nops);
+    if (rc != 0 || !acc.found) {
+        (void)session->rollback_transaction(session, NULL);
+        free(acc.buf);
+        return rc != 0 ? __strerror_term(env, rc) : ATOM_NOT_FOUND;
+    }
+    __merge_result(&acc, &item);
+    unsigned char *bin = enif_make_new_binary(env, item.size, &value);
+    memcpy(bin, item.data, item.size);
+
+    /* Fold a long run of operands into the value while we have it, if that
+       conflicts with another writer the janitor will get to it later. */
+    if (nops >= MERGE_COMPACT_OPERANDS) {
+        cursor->set_key(cursor, key);
+        cursor->set_value(cursor, &item);
+        rc = cursor->insert(cursor);
+        if (rc == 0)
+            rc = __merge_clear(mscan, mcursor, key);
+    }
+    if (rc == 0)
+        (void)session->commit_transaction(session, NULL);
+    else
+        (void)session->rollback_transaction(session, NULL);
+    free(acc.buf);
+    return enif_make_tuple2(env, ATOM_OK, value);
+}
+
+/**
+ * Get the value for the key's value from the specified table or index.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_get,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+    //affinity = __str_hash(0, args->uri, __strlen(args->uri));
+  },
+  { // work
+
+    ErlNifBinary key;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (key.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    WT_CURSOR *cursor = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    cursor = ctx->ci[0].cursor;
+
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    item_key.data = key.data;
+    item_key.size = key.size;
+
+    /* Expired keys read as missing until the janitor gets to them. */
+    if (table.ttl && __ttl_expired(ctx->ci[1].cursor, &item_key, (uint64_t)time(NULL))) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(ATOM_NOT_FOUND);
+        return;
+    }
+
+    if (table.merge_op != MERGE_NONE) {
+        ERL_NIF_TERM reply = __merge_get(env, ctx, table.merge_op, &item_key);
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(reply);
+        return;
+    }
+
+    cursor->set_key(cursor, &item_key);
+    rc = cursor->search(cursor);
+    if (rc != 0) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    rc = cursor->get_value(cursor, &item_value);
+    if (rc != 0) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    ERL_NIF_TERM value;
+    if (__pin_value(env, args->conn_handle, worker_id, ctx, &item_value, &value)) {
+        ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, value));
+        return;
+    }
+    unsigned char *bin = enif_make_new_binary(env, item_value.size, &value);
+    memcpy(bin, item_value.data, item_value.size);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, value));
+    __release_ctx(args->conn_handle, worker_id, ctx);
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Store a value for the key's value from the specified table or index.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    value as an Erlang binary
+ * argv[4]    seconds until the key expires, 0 for never
+ */
+ASYNC_NIF_DECL(
+  wterl_put,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+    ErlNifUInt64 ttl;
+  },
+  { // pre
+
+    if (!(argc == 5 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]) &&
+          enif_is_binary(env, argv[3]) &&
+          enif_get_uint64(env, argv[4], &args->ttl))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+    //affinity = __str_hash(0, args->uri, __strlen(args->uri));
+  },
+  { // work
+
+    ErlNifBinary key;
+    ErlNifBinary value;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (!enif_inspect_binary(env, args->value, &value)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (key.size == 0 || value.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    WT_CURSOR *cursor = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    if (args->ttl && !table.ttl) {
+        /* TTLs must be enabled on the table first. */
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+        return;
+    }
+    cursor = ctx->ci[0].cursor;
+
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    item_value.data = value.data;
+    item_value.size = value.size;
+    if (table.ttl) {
+        /* A put without a TTL on a TTL enabled table clears any expiry. */
+        uint64_t expiry = args->ttl ? (uint64_t)time(NULL) + args->ttl : 0;
+        rc = __ttl_write(ctx->session, cursor, ctx->ci[1].cursor,
+                         &item_key, &item_value, expiry);
+    } else if (table.ht_segments) {
+        rc = __ht_write(ctx->session, cursor, ctx->ci[1].cursor, table.ht_segments,
+                        &item_key, &item_value);
+    } else if (table.merge_op != MERGE_NONE) {
+        /* A put replaces the value and any operands not yet folded in. */
+        rc = __merge_write(ctx->session, cursor, ctx->ci[1].cursor, ctx->ci[2].cursor,
+                           &item_key, &item_value);
+    } else {
+        cursor->set_key(cursor, &item_key);
+        cursor->set_value(cursor, &item_value);
+        rc = cursor->insert(cursor);
+    }
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Store a value for a key only if the key is not already present.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    value as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_put_new,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]) &&
+          enif_is_binary(env, argv[3]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary key;
+    ErlNifBinary value;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (!enif_inspect_binary(env, args->value, &value)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (key.size == 0 || value.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    WT_CURSOR *cursor = NULL;
+    struct wterl_table table;
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    int rc;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    item_value.data = value.data;
+    item_value.size = value.size;
+
+    if (__table_lookup(args->conn_handle, args->uri, &table)) {
+        /* Write the table's side table too.  An expired key is missing,
+           so may be written again, a key with only operands is there. */
+        rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+        if (rc != 0) {
+            ASYNC_NIF_REPLY(__strerror_term(env, rc));
+            return;
+        }
+        if (table.ttl)
+            rc = __ttl_insert(ctx->session, ctx->ci[0].cursor, ctx->ci[1].cursor,
+                              &item_key, &item_value);
+        else if (table.ht_segments)
+            rc = __ht_insert(ctx->session, ctx->ci[0].cursor, ctx->ci[1].cursor,
+                             table.ht_segments, &item_key, &item_value);
+        else
+            rc = __merge_insert(ctx->session, ctx->ci[0].cursor, ctx->ci[1].cursor,
+                                ctx->ci[2].cursor, table.merge_op, &item_key, &item_value);
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+        return;
+    }
+
+    rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
+                      args->conn_handle->session_config,
+                      args->uri, "overwrite=false,raw");
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    cursor = ctx->ci[0].cursor;
+    cursor->set_key(cursor, &item_key);
+    cursor->set_value(cursor, &item_value);
+    rc = cursor->insert(cursor);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+enum cas_expect { EXPECT_ABSENT, EXPECT_VALUE, EXPECT_HASH };
+#define CAS_RETRIES 3
+
+/**
+ * Replace (or delete) the value for a key only if the current value is the
+ * one the caller expects.  The read, the comparison and the write all run
+ * in a single snapshot isolation transaction in the worker thread, tried
+ * again from the read when it conflicts with another writer.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    expected value: a binary, not_found or {hash, erlang:crc32(V)}
+ * argv[4]    new value as an Erlang binary, or the atom delete
+ */
+ASYNC_NIF_DECL(
+  wterl_compare_and_swap,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM expected;
+    ERL_NIF_TERM value;
+    enum cas_expect expect;
+    unsigned int hash;
+    int delete;
+  },
+  { // pre
+
+    int arity;
+    const ERL_NIF_TERM *tuple;
+
+    if (!(argc == 5 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    if (enif_is_identical(argv[3], ATOM_NOT_FOUND)) {
+        args->expect = EXPECT_ABSENT;
+    } else if (enif_is_binary(env, argv[3])) {
+        args->expect = EXPECT_VALUE;
+        args->expected = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    } else if (enif_get_tuple(env, argv[3], &arity, &tuple) && arity == 2 &&
+               enif_is_identical(tuple[0], ATOM_HASH) &&
+               enif_get_uint(env, tuple[1], &args->hash)) {
+        args->expect = EXPECT_HASH;
+    } else {
+        ASYNC_NIF_RETURN_BADARG();
+    }
+    if (enif_is_identical(argv[4], ATOM_DELETE)) {
+        args->delete = 1;
+    } else if (enif_is_binary(env, argv[4])) {
+        args->delete = 0;
+        args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[4]);
+    } else {
+        ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary key;
+    ErlNifBinary expected;
+    ErlNifBinary value;
+    if (!enif_inspect_binary(env, args->key, &key) || key.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (args->expect == EXPECT_VALUE &&
+        !enif_inspect_binary(env, args->expected, &expected)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (!args->delete &&
+        (!enif_inspect_binary(env, args->value, &value) || value.size == 0)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    WT_CURSOR *cursor = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    if (table.ht_segments) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        return;
+    }
+    cursor = ctx->ci[0].cursor;
+    WT_SESSION *session = ctx->session;
+    struct wterl_merge_acc acc;
+    int attempts = 0;
+  again:
+    /* Snapshot isolation, so that another writer changing the key between
+       our read and our write is a conflict (WT_ROLLBACK), which is retried
+       reading the new value, rather than a lost update. */
+    rc = session->begin_transaction(session, "isolation=snapshot");
+    if (rc != 0) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    memset(&acc, 0, sizeof(acc));
+    int found;
+    if (table.merge_op != MERGE_NONE) {
+        /* The value with its operands folded in, as get reads it. */
+        uint32_t nops;
+        acc.op = table.merge_op;
+        rc = __merge_read(cursor, ctx->ci[2].cursor, &item_key, &acc, &nops);
+        found = (rc == 0 && acc.found);
+        if (found)
+            __merge_result(&acc, &item_value);
+    } else {
+        cursor->set_key(cursor, &item_key);
+        rc = cursor->search(cursor);
+        found = (rc == 0);
+        if (found)
+            rc = cursor->get_value(cursor, &item_value);
+        else if (rc == WT_NOTFOUND)
+            rc = 0;
+    }
+    /* An expired key is missing, as it is to get. */
+    if (rc == 0 && found && table.ttl &&
+        __ttl_expired(ctx->ci[1].cursor, &item_key, (uint64_t)time(NULL)))
+        found = 0;
+    if (rc != 0) {
+        (void)session->rollback_transaction(session, NULL);
+        free(acc.buf);
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+
+    int match;
+    switch (args->expect) {
+    case EXPECT_ABSENT:
+        match = !found;
+        break;
+    case EXPECT_VALUE:
+        match = found && item_value.size == expected.size &&
+            memcmp(item_value.data, expected.data, expected.size) == 0;
+        break;
+    default:
+        match = found && __zlib_crc32(item_value.data, item_value.size) == args->hash;
+        break;
+    }
+    if (!match) {
+        /* Copy the current value out before the rollback invalidates it. */
+        ERL_NIF_TERM current = ATOM_NOT_FOUND;
+        if (found) {
+            unsigned char *bin = enif_make_new_binary(env, item_value.size, &current);
+            memcpy(bin, item_value.data, item_value.size);
+        }
+        (void)session->rollback_transaction(session, NULL);
+        free(acc.buf);
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_ERROR,
+                                         enif_make_tuple2(env, ATOM_MISMATCH, current)));
+        return;
+    }
+
+    if (table.ttl) {
+        /* The new value never expires, and an expired one is cleared. */
+        if (!args->delete) {
+            item_value.data = value.data;
+            item_value.size = value.size;
+        }
+        rc = __ttl_update(cursor, ctx->ci[1].cursor, &item_key,
+                          args->delete ? NULL : &item_value, 0);
+        if (rc == WT_NOTFOUND && args->delete)
+            rc = 0;
+    } else if (table.merge_op != MERGE_NONE) {
+        /* The new value replaces the old and its operands. */
+        if (!args->delete) {
+            item_value.data = value.data;
+            item_value.size = value.size;
+        }
+        rc = __merge_update(cursor, ctx->ci[1].cursor, ctx->ci[2].cursor, &item_key,
+                            args->delete ? NULL : &item_value);
+        if (rc == WT_NOTFOUND && args->delete)
+            rc = 0;
+    } else if (args->delete) {
+        cursor->set_key(cursor, &item_key);
+        if (found)
+            rc = cursor->remove(cursor);
+    } else {
+        cursor->set_key(cursor, &item_key);
+        item_value.data = value.data;
+        item_value.size = value.size;
+        cursor->set_value(cursor, &item_value);
+        rc = cursor->insert(cursor);
+    }
+
+    /* A failed commit is rolled back by WiredTiger. */
+    if (rc == 0)
+        rc = session->commit_transaction(session, NULL);
+    else
+        (void)session->rollback_transaction(session, NULL);
+    free(acc.buf);
+    if (rc == WT_ROLLBACK && ++attempts < CAS_RETRIES)
+        goto again;
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * One change to a value: replace size bytes at offset with data.  The same
+ * semantics as WT_MODIFY, kept separate so the fallback below works with
+ * releases of WiredTiger that predate WT_CURSOR::modify.
+ */
+struct wterl_modify {
+    const void *data;
+    size_t data_size;
+    size_t offset;
+    size_t size;
+};
+
+/* The largest value a change may make, WiredTiger's items are at most 4GB. */
+#define MODIFY_MAX_VALUE_SIZE ((size_t)UINT32_MAX)
+
+/**
+ * Decode a list of {Offset, Size, Data} into an array of changes.
+ *
+ * ->   number of changes, or -1 if the list is malformed or empty, or an
+ *      offset and size don't fit in a size_t
+ */
+static int
+__modify_list(ErlNifEnv *env, ERL_NIF_TERM list, struct wterl_modify **mods)
+{
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail = list;
+    const ERL_NIF_TERM *mod;
+    int arity;
+    unsigned int i;
+    unsigned int n;
+    ErlNifUInt64 offset;
+    ErlNifUInt64 size;
+    ErlNifBinary data;
+
+    if (!enif_get_list_length(env, list, &n) || n == 0)
+        return -1;
+    *mods = malloc(n * sizeof(struct wterl_modify));
+    if (!*mods)
+        return -1;
+    for (i = 0; enif_get_list_cell(env, tail, &head, &tail); i++) {
+        if (!(enif_get_tuple(env, head, &arity, &mod) && arity == 3 &&
+              enif_get_uint64(env, mod[0], &offset) &&
+              enif_get_uint64(env, mod[1], &size) &&
+              enif_inspect_binary(env, mod[2], &data) &&
+              offset <= SIZE_MAX && size <= SIZE_MAX - offset)) {
+            free(*mods);
+            *mods = NULL;
+            return -1;
+        }
+        (*mods)[i].data = data.data;
+        (*mods)[i].data_size = data.size;
+        (*mods)[i].offset = (size_t)offset;
+        (*mods)[i].size = (size_t)size;
+    }
+    return (int)n;
+}
+
+/**
+ * Apply changes to the value stored under key within a transaction.  With
+ * append set there is a single change which is placed at the end of the
+ * current value, or which becomes the value if the key is missing.
+ *
+ * On a TTL enabled table (ttl_cursor set) an expired key is missing, and
+ * the changed key never expires, as after a put without a TTL.
+ *
+ * Where WiredTiger supports it the changes are handed to
+ * WT_CURSOR::modify so only the changed bytes are logged, otherwise the
+ * new value is built here and written in full.
+ */
+static int
+__modify_value(WT_SESSION *session, WT_CURSOR *cursor, WT_CURSOR *ttl_cursor,
+               WT_ITEM *key, struct wterl_modify *mods, int nmods, int append)
+{
+    WT_ITEM value;
+    int i;
+    int rc;
+
+    rc = session->begin_transaction(session, "isolation=snapshot");
+    if (rc != 0)
+        return rc;
+
+    cursor->set_key(cursor, key);
+    rc = cursor->search(cursor);
+    if (rc == 0 && ttl_cursor && __ttl_expired(ttl_cursor, key, (uint64_t)time(NULL)))
+        rc = WT_NOTFOUND;
+    if (rc == WT_NOTFOUND && append) {
+        value.data = mods[0].data;
+        value.size = mods[0].data_size;
+        cursor->set_key(cursor, key);
+        cursor->set_value(cursor, &value);
+        rc = cursor->insert(cursor);
+        goto done;
+    }
+    if (rc == 0)
+        rc = cursor->get_value(cursor, &value);
+    if (rc != 0)
+        goto done;
+    if (append)
+        mods[0].offset = value.size;
+
+    /* Bound the length the value can reach as each change is applied,
+       padding to its offset then adding its data, so a huge offset is
+       refused here rather than overflowing the sizes below. */
+    size_t bound = value.size;
+    for (i = 0; i < nmods; i++) {
+        if (mods[i].offset > bound)
+            bound = mods[i].offset;
+        if (bound > MODIFY_MAX_VALUE_SIZE ||
+            mods[i].data_size > MODIFY_MAX_VALUE_SIZE - bound) {
+            rc = EINVAL;
+            goto done;
+        }
+        bound += mods[i].data_size;
+    }
+
+#if WIREDTIGER_VERSION_MAJOR >= 3
+    WT_MODIFY *entries = malloc(nmods * sizeof(WT_MODIFY));
+    if (!entries) {
+        rc = ENOMEM;
+        goto done;
+    }
+    for (i = 0; i < nmods; i++) {
+        entries[i].data.data = mods[i].data;
+        entries[i].data.size = mods[i].data_size;
+        entries[i].offset = mods[i].offset;
+        entries[i].size = mods[i].size;
+    }
+    rc = cursor->modify(cursor, entries, nmods);
+    free(entries);
+#else
+    size_t len = value.size;
+    size_t tail;
+    size_t new_len;
+    uint8_t *buf = malloc(bound ? bound : 1);
+    if (!buf) {
+        rc = ENOMEM;
+        goto done;
+    }
+    memcpy(buf, value.data, len);
+    for (i = 0; i < nmods; i++) {
+        /* Like WT_MODIFY, writing past the end pads the value with nuls. */
+        if (mods[i].offset > len) {
+            memset(buf + len, 0, mods[i].offset - len);
+            len = mods[i].offset;
+        }
+        tail = (mods[i].offset + mods[i].size < len) ? len - (mods[i].offset + mods[i].size) : 0;
+        new_len = mods[i].offset + mods[i].data_size + tail;
+        memmove(buf + mods[i].offset + mods[i].data_size, buf + len - tail, tail);
+        memcpy(buf + mods[i].offset, mods[i].data, mods[i].data_size);
+        len = new_len;
+    }
+    value.data = buf;
+    value.size = len;
+    cursor->set_key(cursor, key);
+    cursor->set_value(cursor, &value);
+    rc = cursor->insert(cursor);
+    free(buf);
+#endif
+
+  done:
+    if (rc == 0 && ttl_cursor)
+        rc = __ttl_forget(ttl_cursor, key);
+    /* A failed commit is rolled back by WiredTiger. */
+    if (rc == 0)
+        rc = session->commit_transaction(session, NULL);
+    else
+        (void)session->rollback_transaction(session, NULL);
+    return rc;
+}
+
+/**
+ * Change part of the value stored under a key.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    a list of {Offset, Size, Data} changes, applied in order
+ */
+ASYNC_NIF_DECL(
+  wterl_modify,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM mods;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]) &&
+          enif_is_list(env, argv[3]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->mods = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary key;
+    struct wterl_modify *mods = NULL;
+    if (!enif_inspect_binary(env, args->key, &key) || key.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    int nmods = __modify_list(env, args->mods, &mods);
+    if (nmods < 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        free(mods);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    if (table.ht_segments || table.merge_op != MERGE_NONE) {
+        free(mods);
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        return;
+    }
+
+    WT_ITEM item_key;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    rc = __modify_value(ctx->session, ctx->ci[0].cursor,
+                        table.ttl ? ctx->ci[1].cursor : NULL, &item_key, mods, nmods, 0);
+    free(mods);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Append data to the value stored under a key, creating it if missing.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    data to append as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_append,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM data;
+  },
+  { // pre
+
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]) &&
+          enif_is_binary(env, argv[3]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->data = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary key;
+    ErlNifBinary data;
+    if (!enif_inspect_binary(env, args->key, &key) || key.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    if (!enif_inspect_binary(env, args->data, &data) || data.size == 0) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    if (table.ht_segments || table.merge_op != MERGE_NONE) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        return;
+    }
+
+    struct wterl_modify mod;
+    mod.data = data.data;
+    mod.data_size = data.size;
+    mod.offset = 0;
+    mod.size = 0;
+    WT_ITEM item_key;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    rc = __modify_value(ctx->session, ctx->ci[0].cursor,
+                        table.ttl ? ctx->ci[1].cursor : NULL, &item_key, &mod, 1, 1);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Decode one operation of a write batch, either {put, Uri, Key, Value} or
+ * {delete, Uri, Key}.
+ *
+ * ->   1 when the term is a well formed operation, otherwise 0
+ */
+static int
+__batch_op(ErlNifEnv *env, ERL_NIF_TERM term, int *is_put, Uri uri,
+           ErlNifBinary *key, ErlNifBinary *value)
+{
+    int arity;
+    const ERL_NIF_TERM *op;
+
+    if (!enif_get_tuple(env, term, &arity, &op))
+        return 0;
+    if (arity == 4 && enif_is_identical(op[0], ATOM_PUT)) {
+        *is_put = 1;
+        if (!enif_inspect_binary(env, op[3], value) || value->size == 0)
+            return 0;
+    } else if (arity == 3 && enif_is_identical(op[0], ATOM_DELETE)) {
+        *is_put = 0;
+    } else {
+        return 0;
+    }
+    if (enif_get_string(env, op[1], uri, sizeof(Uri), ERL_NIF_LATIN1) <= 0)
+        return 0;
+    if (!enif_inspect_binary(env, op[2], key) || key->size == 0)
+        return 0;
+    return 1;
+}
+
+/**
+ * Apply a list of puts and deletes, possibly spanning several tables, within
+ * a single transaction using one session from the context cache.  Either all
+ * operations are committed or none are.  The hashes of tables with a
+ * hashtree, the expiry times of TTL enabled tables (a key written here
+ * never expires) and the operands of tables with a merge operator (which
+ * a write replaces) are updated in the same transaction.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    list of {put, Uri, Key, Value} and {delete, Uri, Key} tuples
+ */
+ASYNC_NIF_DECL(
+  wterl_write_batch,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    ERL_NIF_TERM ops;
+    int num_tables;
+    Uri uris[MAX_CTX_CURSORS];
+  },
+  { // pre
+
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail;
+    ErlNifBinary key;
+    ErlNifBinary value;
+    int i;
+    int is_put;
+    Uri uri;
+
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          enif_is_list(env, argv[1]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    /* Validate the operations and collect the distinct set of tables they
+       touch, we'll open one cursor per table in a shared session. */
+    args->num_tables = 0;
+    tail = argv[1];
+    while (enif_get_list_cell(env, tail, &head, &tail)) {
+      if (!__batch_op(env, head, &is_put, uri, &key, &value)) {
+        ASYNC_NIF_RETURN_BADARG();
+      }
+      for (i = 0; i < args->num_tables; i++)
+        if (!strcmp(args->uris[i], uri))
+          break;
+      if (i == args->num_tables) {
+        if (args->num_tables == MAX_CTX_CURSORS) {
+          ASYNC_NIF_RETURN_BADARG();
+        }
+        memcpy(args->uris[args->num_tables++], uri, sizeof(Uri));
+      }
+    }
+    args->ops = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail;
+    ErlNifBinary key;
+    ErlNifBinary value;
+    int i;
+    int is_put;
+    int num_cursors = args->num_tables;
+    int attempts = 0;
+    int rc = 0;
+    Uri uri;
+    Uri side_uris[MAX_CTX_CURSORS];
+    int side_cursor[MAX_CTX_CURSORS];
+    struct wterl_table tables[MAX_CTX_CURSORS];
+    const char *pairs[2 * MAX_CTX_CURSORS];
+
+    if (args->num_tables == 0) {
+        ASYNC_NIF_REPLY(ATOM_OK);
+        return;
+    }
+    for (i = 0; i < args->num_tables; i++) {
+        pairs[2 * i] = args->uris[i];
+        pairs[(2 * i) + 1] = "overwrite,raw";
+    }
+    /* Tables with a hashtree or expiry times need a cursor on that side
+       table too, after the tables', and tables with a merge operator two
+       on their operands as __retain_table_ctx opens them. */
+    for (i = 0; i < args->num_tables; i++) {
+        int merge;
+        side_cursor[i] = -1;
+        if (!__table_lookup(args->conn_handle, args->uris[i], &tables[i])) {
+            memset(&tables[i], 0, sizeof(tables[i]));
+            continue;
+        }
+        merge = (tables[i].merge_op != MERGE_NONE);
+        if (tables[i].ht_segments)
+            rc = __ht_uri(args->uris[i], side_uris[i]);
+        else if (tables[i].ttl)
+            rc = __ttl_uri(args->uris[i], side_uris[i]);
+        else if (merge)
+            rc = __merge_uri(args->uris[i], side_uris[i]);
+        else
+            continue;
+        if (num_cursors + merge >= MAX_CTX_CURSORS || rc != 0) {
+            ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+            return;
+        }
+        side_cursor[i] = num_cursors;
+        pairs[2 * num_cursors] = side_uris[i];
+        pairs[(2 * num_cursors) + 1] = "overwrite,raw";
+        num_cursors++;
+        if (merge) {
+            pairs[2 * num_cursors] = side_uris[i];
+            pairs[(2 * num_cursors) + 1] = "raw";
+            num_cursors++;
+        }
+    }
+
+    struct wterl_ctx *ctx = NULL;
+    rc = __retain_ctx_array(args->conn_handle, worker_id, &ctx, num_cursors,
+                            args->conn_handle->session_config, pairs);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WT_SESSION *session = ctx->session;
+    do {
+        /* Read-modify-writes of side tables need snapshot isolation to
+           see each other's updates as conflicts, see __ht_write. */
+        rc = session->begin_transaction(session, num_cursors > args->num_tables ?
+                                        "isolation=snapshot" : NULL);
+        if (rc != 0)
+            break;
+
+        tail = args->ops;
+        while (rc == 0 && enif_get_list_cell(env, tail, &head, &tail)) {
+            __batch_op(env, head, &is_put, uri, &key, &value);
+            for (i = 0; strcmp(args->uris[i], uri); i++)
+                ;
+            WT_CURSOR *cursor = ctx->ci[i].cursor;
+            WT_ITEM item_key;
+            WT_ITEM item_value;
+            item_key.data = key.data;
+            item_key.size = key.size;
+            if (is_put) {
+                item_value.data = value.data;
+                item_value.size = value.size;
+            }
+            if (tables[i].ttl) {
+                rc = __ttl_update(cursor, ctx->ci[side_cursor[i]].cursor, &item_key,
+                                  is_put ? &item_value : NULL, 0);
+            } else if (tables[i].merge_op != MERGE_NONE) {
+                rc = __merge_update(cursor, ctx->ci[side_cursor[i]].cursor,
+                                    ctx->ci[side_cursor[i] + 1].cursor, &item_key,
+                                    is_put ? &item_value : NULL);
+            } else {
+                if (tables[i].ht_segments) {
+                    rc = __ht_update(ctx->ci[side_cursor[i]].cursor, tables[i].ht_segments,
+                                     &item_key, is_put ? &item_value : NULL, 1);
+                    if (rc != 0)
+                        break;
+                }
+                cursor->set_key(cursor, &item_key);
+                if (is_put) {
+                    cursor->set_value(cursor, &item_value);
+                    rc = cursor->insert(cursor);
+                } else {
+                    rc = cursor->remove(cursor);
+                }
+            }
+            /* Deleting a key that isn't there is not a reason to abort. */
+            if (rc == WT_NOTFOUND && !is_put)
+                rc = 0;
+        }
+
+        /* A failed commit is rolled back by WiredTiger. */
+        if (rc == 0)
+            rc = session->commit_transaction(session, NULL);
+        else
+            (void)session->rollback_transaction(session, NULL);
+        /* Only retry conflicts over a side table's entries. */
+    } while (rc == WT_ROLLBACK && num_cursors > args->num_tables &&
+             ++attempts < HT_WRITE_RETRIES);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Pick the next work queue affinity for a resource whose operations should
+ * all be handled by the same queue.  Zero means "no affinity" to async_nif,
+ * so we never return it.
+ */
+static inline unsigned int
+__next_affinity(WterlConnHandle *conn_handle)
+{
+    unsigned int a = __sync_add_and_fetch(&conn_handle->next_affinity, 1);
+    return a ? a : __sync_add_and_fetch(&conn_handle->next_affinity, 1);
+}
+
+/**
+ * Take a cursor for the length of an operation.  WiredTiger cursors (and
+ * their sessions) must only be used by one thread at a time, and two
+ * workers of the cursor's queue may be handed operations on it at once,
+ * so the operation holds the cursor's mutex until __cursor_leave.
+ *
+ * A cursor that a stream is reading belongs to the stream until it is
+ * done or closed, other operations on it are refused.
+ *
+ * ->   0 with the mutex held and the cursor in *cursor, or (with the
+ *      mutex released) EINVAL if the cursor is closed or EBUSY while it
+ *      is streaming
+ */
+static int
+__cursor_enter(WterlCursorHandle *cursor_handle, WT_CURSOR **cursor)
+{
+    enif_mutex_lock(cursor_handle->mutex);
+    if (!cursor_handle->cursor || cursor_handle->streaming) {
+        enif_mutex_unlock(cursor_handle->mutex);
+        return cursor_handle->cursor ? EBUSY : EINVAL;
+    }
+    *cursor = cursor_handle->cursor;
+    return 0;
+}
+
+static inline void
+__cursor_leave(WterlCursorHandle *cursor_handle)
+{
+    enif_mutex_unlock(cursor_handle->mutex);
+}
+
+/**
+ * Is the record under the cursor live, rather than expired and waiting for
+ * the janitor to remove it?
+ */
+static int
+__cursor_live(WterlCursorHandle *cursor_handle, WT_CURSOR *cursor)
+{
+    WT_ITEM key;
+
+    return !cursor_handle->ttl_cursor || cursor->get_key(cursor, &key) != 0 ||
+        !__ttl_expired(cursor_handle->ttl_cursor, &key, (uint64_t)time(NULL));
+}
+
+/**
+ * Move a cursor with step (its next or prev) to the next live record.
+ */
+static int
+__cursor_step(WterlCursorHandle *cursor_handle, WT_CURSOR *cursor, int (*step)(WT_CURSOR *))
+{
+    int rc;
+
+    while ((rc = step(cursor)) == 0 && !__cursor_live(cursor_handle, cursor))
+        ;
+    return rc;
+}
+
+/**
+ * WT_CURSOR::search_near, but landing on a live record.  When the nearest
+ * record has expired the nearest live one is after it (a larger key) or,
+ * failing that, before it (a smaller key).
+ */
+static int
+__cursor_search_near(WterlCursorHandle *cursor_handle, WT_CURSOR *cursor,
+                     WT_ITEM *key, int *exact)
+{
+    int rc;
+
+    cursor->set_key(cursor, key);
+    if ((rc = cursor->search_near(cursor, exact)) != 0 || __cursor_live(cursor_handle, cursor))
+        return rc;
+    if ((rc = __cursor_step(cursor_handle, cursor, cursor->next)) != WT_NOTFOUND) {
+        *exact = 1;
+        return rc;
+    }
+    cursor->set_key(cursor, key);
+    if ((rc = cursor->search_near(cursor, exact)) != 0 || __cursor_live(cursor_handle, cursor))
+        return rc;
+    *exact = -1;
+    return __cursor_step(cursor_handle, cursor, cursor->prev);
+}
+
+/**
+ * Give a cursor's context back to the cache, or free it if the connection
+ * has been closed (closing the connection closed its session).
+ */
+static void
+__cursor_release(WterlCursorHandle *cursor_handle, uint32_t worker_id)
+{
+    WterlConnHandle *conn_handle = cursor_handle->conn_handle;
+
+    if (conn_handle->conn) {
+        if (cursor_handle->in_txn)
+            cursor_handle->session->rollback_transaction(cursor_handle->session, NULL);
+        __release_ctx(conn_handle, worker_id, cursor_handle->ctx);
+    } else
+        free(cursor_handle->ctx);
+    cursor_handle->ctx = NULL;
+    cursor_handle->session = NULL;
+    cursor_handle->cursor = NULL;
+    cursor_handle->ttl_cursor = NULL;
+}
+
+/**
+ * Open a cursor on a table or index.
+ *
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    config string as an Erlang binary
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_open,
+  { // struct
+
+    WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM config;
+  },
+  { // pre
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->conn_handle);
+  },
+  { // work
+
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    /* A bulk load fills the table's pages directly, around its side tables. */
+    if (__bulk_config((const char *)config.data) &&
+        __table_refuses_bulk(args->conn_handle, args->uri)) {
+      ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+      return;
+    }
+
+    /* Each cursor has a session of its own so that operations are thread
+       safe, both come from the connection's context cache.  On a table
+       with TTLs it reads the expiry table too, to skip expired keys. */
+    struct wterl_ctx *ctx = NULL;
+    struct wterl_table table;
+    Uri ttl_uri;
+    int ttl = __table_lookup(args->conn_handle, args->uri, &table) && table.ttl &&
+        __ttl_uri(args->uri, ttl_uri) == 0;
+    int rc = ttl ?
+        __retain_ctx(args->conn_handle, worker_id, &ctx, 2,
+                     args->conn_handle->session_config, args->uri,
+                     (config.data[0] != 0) ? (char *)config.data : "raw",
+                     ttl_uri, "raw") :
+        __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
+                     args->conn_handle->session_config, args->uri,
+                     (config.data[0] != 0) ? (char *)config.data : "raw");
+    if (rc != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      return;
+    }
+
+    WterlCursorHandle* cursor_handle = enif_alloc_resource(wterl_cursor_RESOURCE, sizeof(WterlCursorHandle));
+    if (!cursor_handle) {
+      __release_ctx(args->conn_handle, worker_id, ctx);
+      ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+      return;
+    }
+    memset(cursor_handle, 0, sizeof(WterlCursorHandle));
+    if (!(cursor_handle->mutex = enif_mutex_create("wterl_cursor"))) {
+      enif_release_resource(cursor_handle);
+      __release_ctx(args->conn_handle, worker_id, ctx);
+      ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+      return;
+    }
+    cursor_handle->conn_handle = args->conn_handle;
     enif_keep_resource((void*)args->conn_handle);
+    cursor_handle->ctx = ctx;
+    cursor_handle->session = ctx->session;
+    cursor_handle->cursor = ctx->ci[0].cursor;
+    cursor_handle->ttl_cursor = ttl ? ctx->ci[1].cursor : NULL;
+    cursor_handle->affinity = __next_affinity(args->conn_handle);
+    __sync_add_and_fetch(&args->conn_handle->stats.cursors_opened, 1);
+    ERL_NIF_TERM result = enif_make_resource(env, cursor_handle);
+    enif_release_resource(cursor_handle);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, result));
+  },
+  { // post
+
+    enif_release_resource((void*)args->conn_handle);
+  });
+
+/**
+ * Close a cursor, returning its session and cursor to the connection's
+ * context cache.  Closing a cursor twice is harmless, using it after it
+ * is closed is an error.  A cursor can't be closed (EBUSY) while a stream
+ * is reading it, close the stream first.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_close,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WterlCursorHandle *cursor_handle = args->cursor_handle;
+    enif_mutex_lock(cursor_handle->mutex);
+    if (cursor_handle->streaming) {
+        enif_mutex_unlock(cursor_handle->mutex);
+        ASYNC_NIF_REPLY(__strerror_term(env, EBUSY));
+        return;
+    }
+    if (cursor_handle->ctx) {
+        __cursor_release(cursor_handle, worker_id);
+        __sync_add_and_fetch(&cursor_handle->conn_handle->stats.cursors_closed, 1);
+    }
+    enif_mutex_unlock(cursor_handle->mutex);
+    ASYNC_NIF_REPLY(ATOM_OK);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+static ERL_NIF_TERM
+__cursor_key_ret(ErlNifEnv *env, WT_CURSOR *cursor, int rc)
+{
+    if (rc == 0) {
+        WT_ITEM item_key;
+        rc = cursor->get_key(cursor, &item_key);
+        if (rc == 0) {
+            ERL_NIF_TERM key;
+            memcpy(enif_make_new_binary(env, item_key.size, &key), item_key.data, item_key.size);
+            return enif_make_tuple2(env, ATOM_OK, key);
+        }
+    }
+    return __strerror_term(env, rc);
+}
+
+static ERL_NIF_TERM
+__cursor_kv_ret(ErlNifEnv *env, WT_CURSOR *cursor, int rc)
+{
+    if (rc == 0) {
+        WT_ITEM item_key, item_value;
+        rc = cursor->get_key(cursor, &item_key);
+        if (rc == 0) {
+            rc = cursor->get_value(cursor, &item_value);
+            if (rc == 0) {
+                ERL_NIF_TERM key, value;
+                memcpy(enif_make_new_binary(env, item_key.size, &key), item_key.data, item_key.size);
+                memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
+                return enif_make_tuple3(env, ATOM_OK, key, value);
+            }
+        }
+    }
+    return __strerror_term(env, rc);
+}
+
+static ERL_NIF_TERM
+__cursor_value_ret(ErlNifEnv* env, WT_CURSOR *cursor, int rc)
+{
+    if (rc == 0) {
+        WT_ITEM item_value;
+        rc = cursor->get_value(cursor, &item_value);
+        if (rc == 0) {
+            ERL_NIF_TERM value;
+            memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
+            return enif_make_tuple2(env, ATOM_OK, value);
+        }
+    }
+    return __strerror_term(env, rc);
+}
+
+/**
+ * Use a cursor to fetch the next key/value pair from the table or index.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_next,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(__cursor_kv_ret(env, cursor, __cursor_step(args->cursor_handle, cursor, cursor->next)));
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Use a cursor to fetch the next key from the table or index.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_next_key,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(__cursor_key_ret(env, cursor, __cursor_step(args->cursor_handle, cursor, cursor->next)));
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Use a cursor to fetch the next value from the table or index.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_next_value,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(__cursor_value_ret(env, cursor, __cursor_step(args->cursor_handle, cursor, cursor->next)));
+    DPRINTF("env: %p cursor: %p", env, cursor);
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Use a cursor to fetch the previous key/value pair from the table or index.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_prev,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(__cursor_kv_ret(env, cursor, __cursor_step(args->cursor_handle, cursor, cursor->prev)));
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Use a cursor to fetch the previous key from the table or index.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_prev_key,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(__cursor_key_ret(env, cursor, __cursor_step(args->cursor_handle, cursor, cursor->prev)));
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Use a cursor to fetch the previous value from the table or index.
+ *
+ * argv[0]    WterlCursorHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_prev_value,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ASYNC_NIF_REPLY(__cursor_value_ret(env, cursor, __cursor_step(args->cursor_handle, cursor, cursor->prev)));
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+#define SEXT_MAX_DEPTH 8
+#define SEXT_MAX_ARITY 16
+
+/* sext:prefix({o, '_', '_'}), the start of every Riak object key. */
+static const uint8_t SEXT_OBJECT_PREFIX[] = {SEXT_TUPLE, 0, 0, 0, 3, SEXT_ATOM, 0xb7, 0x80, 8};
+
+/**
+ * Is this atom a match spec wildcard, '_' or '$N'?
+ */
+static int
+__sext_is_wild(const char *name, unsigned int len)
+{
+    unsigned int i;
+
+    if (len == 1 && name[0] == '_')
+        return 1;
+    if (len < 2 || name[0] != '$')
+        return 0;
+    for (i = 1; i < len; i++)
+        if (name[i] < '0' || name[i] > '9')
+            return 0;
+    return 1;
+}
+
+/**
+ * Encode a term made of tuples, atoms, binaries and integers from 0 to
+ * 2^31-1 as sext:encode/1 does, or as sext:prefix/1 does when prefix is
+ * set, up to the first wildcard.  Call with out NULL to find the size
+ * needed, *pos is advanced by the length of the encoding either way.
+ *
+ * ->   1 when encoded, 2 when a prefix stopped at a wildcard, or 0 if the
+ *      term holds something else
+ */
+static int
+__sext_encode(ErlNifEnv *env, ERL_NIF_TERM term, int prefix, int depth,
+              uint8_t *out, size_t *pos)
+{
+    ErlNifBinary bin;
+    const ERL_NIF_TERM *elems;
+    char name[256];
+    int arity;
+    int i;
+    int n;
+    int rc;
+
+    if (depth > SEXT_MAX_DEPTH)
+        return 0;
+    if (enif_get_int(env, term, &n)) {
+        if (n < 0)
+            return 0;
+        if (out) {
+            out[*pos] = SEXT_POS4;
+            out[*pos + 1] = (uint8_t)((uint32_t)n >> 23);
+            out[*pos + 2] = (uint8_t)((uint32_t)n >> 15);
+            out[*pos + 3] = (uint8_t)((uint32_t)n >> 7);
+            out[*pos + 4] = (uint8_t)((uint32_t)n << 1);
+        }
+        *pos += 5;
+        return 1;
+    }
+    if ((n = enif_get_atom(env, term, name, sizeof(name), ERL_NIF_LATIN1)) > 0) {
+        if (prefix && __sext_is_wild(name, n - 1))
+            return 2;
+        if (out) {
+            out[*pos] = SEXT_ATOM;
+            sext_encode_bin_elems(out + *pos + 1, (const uint8_t *)name, n - 1);
+        }
+        *pos += 1 + sext_bin_elems_size(n - 1);
+        return 1;
+    }
+    if (enif_inspect_binary(env, term, &bin)) {
+        if (out) {
+            out[*pos] = SEXT_BINARY;
+            sext_encode_bin_elems(out + *pos + 1, bin.data, bin.size);
+        }
+        *pos += 1 + sext_bin_elems_size(bin.size);
+        return 1;
+    }
+    if (enif_get_tuple(env, term, &arity, &elems)) {
+        if (out) {
+            out[*pos] = SEXT_TUPLE;
+            out[*pos + 1] = (uint8_t)((uint32_t)arity >> 24);
+            out[*pos + 2] = (uint8_t)((uint32_t)arity >> 16);
+            out[*pos + 3] = (uint8_t)((uint32_t)arity >> 8);
+            out[*pos + 4] = (uint8_t)arity;
+        }
+        *pos += 5;
+        for (i = 0; i < arity; i++)
+            if ((rc = __sext_encode(env, elems[i], prefix, depth + 1, out, pos)) != 1)
+                return rc;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Decode the sext encoded term at p, the inverse of __sext_encode.
+ *
+ * ->   the length of its encoding, or 0 if it is truncated or holds
+ *      something __sext_encode wouldn't produce
+ */
+static size_t
+__sext_decode(ErlNifEnv *env, const uint8_t *p, size_t len, int depth, ERL_NIF_TERM *term)
+{
+    ERL_NIF_TERM elems[SEXT_MAX_ARITY];
+    char name[256];
+    uint32_t arity;
+    uint32_t i;
+    size_t used;
+    size_t n;
+
+    if (len == 0 || depth > SEXT_MAX_DEPTH)
+        return 0;
+    switch (p[0]) {
+    case SEXT_POS4:
+        if (len < 5 || (p[4] & 1))
+            return 0;
+        *term = enif_make_int(env, (int)((((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+                                          ((uint32_t)p[3] << 8) | (uint32_t)p[4]) >> 1));
+        return 5;
+    case SEXT_ATOM:
+        if ((used = sext_decode_bin_elems(p + 1, len - 1, NULL, &n)) == 0 || n >= sizeof(name))
+            return 0;
+        sext_decode_bin_elems(p + 1, len - 1, (uint8_t *)name, &n);
+        *term = enif_make_atom_len(env, name, n);
+        return used + 1;
+    case SEXT_BINARY:
+        if ((used = sext_decode_bin_elems(p + 1, len - 1, NULL, &n)) == 0)
+            return 0;
+        sext_decode_bin_elems(p + 1, len - 1, enif_make_new_binary(env, n, term), &n);
+        return used + 1;
+    case SEXT_TUPLE:
+        if (len < 5)
+            return 0;
+        arity = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+            ((uint32_t)p[3] << 8) | (uint32_t)p[4];
+        if (arity > SEXT_MAX_ARITY)
+            return 0;
+        used = 5;
+        for (i = 0; i < arity; i++) {
+            if ((n = __sext_decode(env, p + used, len - used, depth + 1, &elems[i])) == 0)
+                return 0;
+            used += n;
+        }
+        *term = enif_make_tuple_from_array(env, elems, arity);
+        return used;
+    default:
+        return 0;
+    }
+}
+
+#define KEYS_RAW 0
+#define KEYS_SEXT 1
+#define KEYS_OBJECT 2
+
+/**
+ * Decode the atom raw, sext or object naming how keys are returned.
+ */
+static int
+__key_format(ERL_NIF_TERM term, int *key_format)
+{
+    if (enif_is_identical(term, ATOM_RAW))
+        *key_format = KEYS_RAW;
+    else if (enif_is_identical(term, ATOM_SEXT))
+        *key_format = KEYS_SEXT;
+    else if (enif_is_identical(term, ATOM_OBJECT))
+        *key_format = KEYS_OBJECT;
+    else
+        return 0;
+    return 1;
+}
 
-    args->priv = (struct wterl_priv_data *)enif_priv_data(env);
+/**
+ * Make the term for a key read from a table: the binary as is (KEYS_RAW),
+ * the term it encodes (KEYS_SEXT), or that but {Bucket, Key} for a Riak
+ * object key {o, Bucket, Key} (KEYS_OBJECT).  Keys that can't be decoded
+ * are returned as binaries.
+ */
+static ERL_NIF_TERM
+__make_key(ErlNifEnv *env, const WT_ITEM *item, int key_format)
+{
+    const uint8_t *p = item->data;
+    ERL_NIF_TERM bucket;
+    ERL_NIF_TERM key;
+    size_t used;
+    size_t n;
+
+    if (key_format == KEYS_OBJECT && item->size > sizeof(SEXT_OBJECT_PREFIX) &&
+        memcmp(p, SEXT_OBJECT_PREFIX, sizeof(SEXT_OBJECT_PREFIX)) == 0) {
+        used = sizeof(SEXT_OBJECT_PREFIX);
+        if ((n = __sext_decode(env, p + used, item->size - used, 1, &bucket)) != 0 &&
+            __sext_decode(env, p + used + n, item->size - used - n, 1, &key) == item->size - used - n)
+            return enif_make_tuple2(env, bucket, key);
+    }
+    if (key_format != KEYS_RAW) {
+        if (__sext_decode(env, p, item->size, 0, &key) == item->size)
+            return key;
+    }
+    memcpy(enif_make_new_binary(env, item->size, &key), item->data, item->size);
+    return key;
+}
+
+/**
+ * Encode a term with __sext_encode into a new binary.
+ */
+static ERL_NIF_TERM
+__sext_encode_term(ErlNifEnv *env, ERL_NIF_TERM term, int prefix)
+{
+    ERL_NIF_TERM bin;
+    size_t size = 0;
+
+    if (!__sext_encode(env, term, prefix, 0, NULL, &size))
+        return enif_make_badarg(env);
+    uint8_t *out = enif_make_new_binary(env, size, &bin);
+    size = 0;
+    __sext_encode(env, term, prefix, 0, out, &size);
+    return bin;
+}
+
+/**
+ * sext:encode/1 for the tuples of binaries, atoms and small integers
+ * Riak keys are made of, badarg for anything else.
+ *
+ * argv[0]    the term
+ */
+static ERL_NIF_TERM
+wterl_sext_encode(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (argc != 1)
+        return enif_make_badarg(env);
+    return __sext_encode_term(env, argv[0], 0);
+}
+
+/**
+ * sext:prefix/1, the encoding of a term up to its first wildcard ('_' or
+ * '$N'), which all the keys it matches start with.
+ *
+ * argv[0]    the pattern
+ */
+static ERL_NIF_TERM
+wterl_sext_prefix(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (argc != 1)
+        return enif_make_badarg(env);
+    return __sext_encode_term(env, argv[0], 1);
+}
+
+/**
+ * sext:decode/1 for the terms wterl_sext_encode makes, badarg for
+ * anything else.
+ *
+ * argv[0]    the encoded term
+ */
+static ERL_NIF_TERM
+wterl_sext_decode(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary bin;
+    ERL_NIF_TERM term;
+
+    if (!(argc == 1 && enif_inspect_binary(env, argv[0], &bin)) ||
+        __sext_decode(env, bin.data, bin.size, 0, &term) != bin.size || bin.size == 0)
+        return enif_make_badarg(env);
+    return term;
+}
+
+#define BATCH_KV 0
+#define BATCH_KEY 1
+#define BATCH_VALUE 2
+#define BATCH_CHUNK 3
+
+/* A chunk, see stream_range and import_chunk, is <<Format:8, Count:32,
+   Records/binary>> where each record is <<KeySize:32, Key, ValueSize:32,
+   Value>> in key order and Format says whether Records is compressed. */
+#define CHUNK_RAW 0
+#define CHUNK_SNAPPY 1
+#define CHUNK_HEADER_SIZE 5
+#define CHUNK_INITIAL_SIZE (64 * 1024)
+
+/**
+ * Append a record to the chunk being built in bin, which holds used bytes.
+ *
+ * ->   0 or ENOMEM
+ */
+static int
+__chunk_append(ErlNifBinary *bin, size_t *used, WT_ITEM *key, WT_ITEM *value)
+{
+    size_t need = *used + 8 + key->size + value->size;
+    size_t size = bin->size;
+    uint8_t *p;
+
+    if (need > size) {
+        while (size < need)
+            size *= 2;
+        if (!enif_realloc_binary(bin, size))
+            return ENOMEM;
+    }
+    p = bin->data + *used;
+    __put_be32(p, (uint32_t)key->size);
+    memcpy(p + 4, key->data, key->size);
+    p += 4 + key->size;
+    __put_be32(p, (uint32_t)value->size);
+    memcpy(p + 4, value->data, value->size);
+    *used = need;
+    return 0;
+}
+
+/**
+ * Turn the records in bin into a chunk, compressing them with snappy when
+ * asked to and when that makes them smaller.  bin is released either way.
+ *
+ * ->   0 and the chunk in *chunk, or ENOMEM
+ */
+static int
+__chunk_finish(ErlNifEnv *env, ErlNifBinary *bin, size_t used, uint32_t count,
+               int compress, ERL_NIF_TERM *chunk)
+{
+    ErlNifBinary packed;
+    size_t records = used - CHUNK_HEADER_SIZE;
+    size_t size;
+
+    if (compress && records > 0 &&
+        enif_alloc_binary(CHUNK_HEADER_SIZE + snappy_max_compressed_length(records), &packed)) {
+        size = packed.size - CHUNK_HEADER_SIZE;
+        if (snappy_compress((const char *)bin->data + CHUNK_HEADER_SIZE, records,
+                            (char *)packed.data + CHUNK_HEADER_SIZE, &size) == SNAPPY_OK &&
+            size < records && enif_realloc_binary(&packed, CHUNK_HEADER_SIZE + size)) {
+            enif_release_binary(bin);
+            packed.data[0] = CHUNK_SNAPPY;
+            __put_be32(packed.data + 1, count);
+            *chunk = enif_make_binary(env, &packed);
+            return 0;
+        }
+        enif_release_binary(&packed);
+    }
+    if (!enif_realloc_binary(bin, used)) {
+        enif_release_binary(bin);
+        return ENOMEM;
+    }
+    bin->data[0] = CHUNK_RAW;
+    __put_be32(bin->data + 1, count);
+    *chunk = enif_make_binary(env, bin);
+    return 0;
+}
+
+/**
+ * Step a cursor forward (or back) collecting up to max_count records, or
+ * fewer once max_bytes of keys and values have been read, into one list.
+ * At least one record is returned if there is one.
+ *
+ * what   BATCH_KV for {Key, Value} pairs, BATCH_KEY or BATCH_VALUE
+ * key_format  how keys are returned, see __make_key
+ * ->     {ok, Items} when there may be more to read, {done, Items} when
+ *        the cursor ran off the end of the table (after which WiredTiger
+ *        resets it, the next step would start over), or an error
+ */
+static ERL_NIF_TERM
+__cursor_batch(ErlNifEnv *env, WterlCursorHandle *cursor_handle, WT_CURSOR *cursor,
+               int prev, int what, int key_format, uint32_t max_count, uint64_t max_bytes)
+{
+    ERL_NIF_TERM items = enif_make_list(env, 0);
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+    ERL_NIF_TERM list;
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    uint64_t bytes = 0;
+    uint32_t count = 0;
+    int rc = 0;
+
+    while (count < max_count && bytes < max_bytes) {
+        rc = __cursor_step(cursor_handle, cursor, prev ? cursor->prev : cursor->next);
+        if (rc != 0)
+            break;
+        if (what != BATCH_VALUE) {
+            if ((rc = cursor->get_key(cursor, &item_key)) != 0)
+                break;
+            key = __make_key(env, &item_key, key_format);
+            bytes += item_key.size;
+        }
+        if (what != BATCH_KEY) {
+            if ((rc = cursor->get_value(cursor, &item_value)) != 0)
+                break;
+            memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
+            bytes += item_value.size;
+        }
+        switch (what) {
+        case BATCH_KEY:
+            items = enif_make_list_cell(env, key, items);
+            break;
+        case BATCH_VALUE:
+            items = enif_make_list_cell(env, value, items);
+            break;
+        default:
+            items = enif_make_list_cell(env, enif_make_tuple2(env, key, value), items);
+            break;
+        }
+        count++;
+    }
+    if (rc != 0 && rc != WT_NOTFOUND)
+        return __strerror_term(env, rc);
+    enif_make_reverse_list(env, items, &list);
+    return enif_make_tuple2(env, rc == WT_NOTFOUND ? ATOM_DONE : ATOM_OK, list);
+}
+
+/**
+ * Use a cursor to fetch a batch of records from the table or index in one
+ * round trip.
+ *
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    direction, the atom next or prev
+ * argv[2]    what to return, the atom kv, key or value
+ * argv[3]    maximum number of records
+ * argv[4]    maximum number of bytes of keys and values (soft limit)
+ * argv[5]    how to return keys, the atom raw, sext or object
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_batch,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+    int prev;
+    int what;
+    int key_format;
+    unsigned int max_count;
+    ErlNifUInt64 max_bytes;
+  },
+  { // pre
+
+    if (!(argc == 6 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          (enif_is_identical(argv[1], ATOM_NEXT) || enif_is_identical(argv[1], ATOM_PREV)) &&
+          enif_get_uint(env, argv[3], &args->max_count) && args->max_count > 0 &&
+          enif_get_uint64(env, argv[4], &args->max_bytes) && args->max_bytes > 0 &&
+          __key_format(argv[5], &args->key_format))) {
+      ASYNC_NIF_RETURN_BADARG();
+    }
+    args->prev = enif_is_identical(argv[1], ATOM_PREV);
+    if (enif_is_identical(argv[2], ATOM_KV))
+        args->what = BATCH_KV;
+    else if (enif_is_identical(argv[2], ATOM_KEY))
+        args->what = BATCH_KEY;
+    else if (enif_is_identical(argv[2], ATOM_VALUE))
+        args->what = BATCH_VALUE;
+    else
+        ASYNC_NIF_RETURN_BADARG();
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    /* Free up the shared sessions and cursors. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_all_sessions(args->conn_handle);
-    if (args->conn_handle->session_config) {
-        free((char *)args->conn_handle->session_config);
-        args->conn_handle->session_config = NULL;
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
     }
-    WT_CONNECTION* conn = args->conn_handle->conn;
-    int rc = conn->close(conn, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
-    enif_mutex_destroy(args->conn_handle->cache_mutex);
-    memset(args->conn_handle, 0, sizeof(WterlConnHandle));
+    ASYNC_NIF_REPLY(__cursor_batch(env, args->cursor_handle, cursor, args->prev, args->what, args->key_format,
+                                   args->max_count, args->max_bytes));
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Decode the end of a range: last, a key (inclusive), {before, Key}
+ * (exclusive) or {prefix, Prefix}.
+ * The key is copied, free it with __range_end_free().
+ */
+static int
+__range_end(ErlNifEnv *env, ERL_NIF_TERM term, struct wterl_range_end *end)
+{
+    ErlNifBinary bin;
+    const ERL_NIF_TERM *tuple;
+    int arity;
+
+    memset(end, 0, sizeof(struct wterl_range_end));
+    if (enif_is_identical(term, ATOM_LAST)) {
+        end->kind = RANGE_LAST;
+        return 1;
+    }
+    if (enif_inspect_binary(env, term, &bin)) {
+        end->kind = RANGE_KEY;
+    } else if (enif_get_tuple(env, term, &arity, &tuple) && arity == 2 &&
+               enif_inspect_binary(env, tuple[1], &bin)) {
+        if (enif_is_identical(tuple[0], ATOM_PREFIX))
+            end->kind = RANGE_PREFIX;
+        else if (enif_is_identical(tuple[0], ATOM_BEFORE))
+            end->kind = RANGE_BEFORE;
+        else
+            return 0;
+    } else {
+        return 0;
+    }
+    end->key = malloc(bin.size ? bin.size : 1);
+    if (!end->key)
+        return 0;
+    memcpy(end->key, bin.data, bin.size);
+    end->size = bin.size;
+    return 1;
+}
+
+static void
+__range_end_free(struct wterl_range_end *end)
+{
+    free(end->key);
+    end->key = NULL;
+}
+
+/**
+ * Is the key before the end of the range?  Keys compare as WiredTiger
+ * orders raw items, bytewise with shorter keys first on a tie.
+ */
+static int
+__range_contains(struct wterl_range_end *end, WT_ITEM *key)
+{
+    int cmp;
+
+    switch (end->kind) {
+    case RANGE_KEY:
+        cmp = memcmp(key->data, end->key, key->size < end->size ? key->size : end->size);
+        return cmp < 0 || (cmp == 0 && key->size <= end->size);
+    case RANGE_BEFORE:
+        cmp = memcmp(key->data, end->key, key->size < end->size ? key->size : end->size);
+        return cmp < 0 || (cmp == 0 && key->size < end->size);
+    case RANGE_PREFIX:
+        return key->size >= end->size && memcmp(key->data, end->key, end->size) == 0;
+    default:
+        return 1;
+    }
+}
+
+static int
+__filter_copy(ErlNifEnv *env, ERL_NIF_TERM term, uint8_t **data, size_t *size)
+{
+    ErlNifBinary bin;
+
+    if (!enif_inspect_binary(env, term, &bin))
+        return 0;
+    if (!(*data = malloc(bin.size ? bin.size : 1)))
+        return 0;
+    memcpy(*data, bin.data, bin.size);
+    *size = bin.size;
+    return 1;
+}
+
+static void
+__filter_free(struct wterl_filter *filter)
+{
+    unsigned int i;
+
+    for (i = 0; i < filter->num_children; i++)
+        __filter_free(&filter->children[i]);
+    free(filter->children);
+    free(filter->a);
+    free(filter->b);
+    memset(filter, 0, sizeof(struct wterl_filter));
+}
+
+/**
+ * Decode a filter, one of:
+ *   all
+ *   {prefix, Prefix}
+ *   {range, Low, High}               keys between Low and High inclusive
+ *   {key_size, Min, Max}             key sizes between Min and Max bytes
+ *   {value_size, Min, Max}           value sizes between Min and Max bytes
+ *   {element, N, Cmp, Encoded}       element N of a sext encoded tuple key
+ *                                    compared with a sext encoded term,
+ *                                    Cmp is eq, ne, lt, le, gt or ge
+ *   {'and', Filters} | {'or', Filters} | {'not', Filter}
+ * Free the result with __filter_free(), even on failure.
+ */
+static int
+__filter_parse(ErlNifEnv *env, ERL_NIF_TERM term, struct wterl_filter *filter, int depth)
+{
+    const ERL_NIF_TERM *tuple;
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail;
+    unsigned int len;
+    unsigned int i;
+    int arity;
+
+    memset(filter, 0, sizeof(struct wterl_filter));
+    if (enif_is_identical(term, ATOM_ALL))
+        return 1;
+    if (depth > MAX_FILTER_DEPTH || !enif_get_tuple(env, term, &arity, &tuple) || arity < 2)
+        return 0;
+    if (arity == 2 && enif_is_identical(tuple[0], ATOM_PREFIX)) {
+        filter->op = FILTER_PREFIX;
+        return __filter_copy(env, tuple[1], &filter->a, &filter->a_size);
+    }
+    if (arity == 3 && enif_is_identical(tuple[0], ATOM_RANGE)) {
+        filter->op = FILTER_RANGE;
+        return __filter_copy(env, tuple[1], &filter->a, &filter->a_size) &&
+            __filter_copy(env, tuple[2], &filter->b, &filter->b_size);
+    }
+    if (arity == 3 && (enif_is_identical(tuple[0], ATOM_KEY_SIZE) ||
+                       enif_is_identical(tuple[0], ATOM_VALUE_SIZE))) {
+        filter->op = enif_is_identical(tuple[0], ATOM_KEY_SIZE) ? FILTER_KEY_SIZE : FILTER_VALUE_SIZE;
+        return enif_get_uint64(env, tuple[1], &filter->min) &&
+            enif_get_uint64(env, tuple[2], &filter->max);
+    }
+    if (arity == 4 && enif_is_identical(tuple[0], ATOM_ELEMENT)) {
+        static const ERL_NIF_TERM *cmps[] = { &ATOM_EQ, &ATOM_NE, &ATOM_LT, &ATOM_LE, &ATOM_GT, &ATOM_GE };
+        filter->op = FILTER_ELEMENT;
+        filter->cmp = -1;
+        for (i = 0; i < sizeof(cmps) / sizeof(cmps[0]); i++)
+            if (enif_is_identical(tuple[2], *cmps[i]))
+                filter->cmp = i;
+        return filter->cmp >= 0 &&
+            enif_get_uint(env, tuple[1], &filter->n) && filter->n > 0 &&
+            __filter_copy(env, tuple[3], &filter->a, &filter->a_size);
+    }
+    if (arity == 2 && enif_is_identical(tuple[0], ATOM_NOT)) {
+        filter->op = FILTER_NOT;
+        if (!(filter->children = calloc(1, sizeof(struct wterl_filter))))
+            return 0;
+        filter->num_children = 1;
+        return __filter_parse(env, tuple[1], filter->children, depth + 1);
+    }
+    if (arity == 2 && (enif_is_identical(tuple[0], ATOM_AND) ||
+                       enif_is_identical(tuple[0], ATOM_OR))) {
+        filter->op = enif_is_identical(tuple[0], ATOM_AND) ? FILTER_AND : FILTER_OR;
+        if (!enif_get_list_length(env, tuple[1], &len) ||
+            !(filter->children = calloc(len ? len : 1, sizeof(struct wterl_filter))))
+            return 0;
+        tail = tuple[1];
+        for (i = 0; i < len && enif_get_list_cell(env, tail, &head, &tail); i++) {
+            filter->num_children++;
+            if (!__filter_parse(env, head, &filter->children[i], depth + 1))
+                return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int
+__filter_memcmp(const uint8_t *a, size_t a_size, const uint8_t *b, size_t b_size)
+{
+    int cmp = memcmp(a, b, a_size < b_size ? a_size : b_size);
+    if (cmp == 0)
+        cmp = (a_size < b_size) ? -1 : (a_size > b_size);
+    return cmp;
+}
+
+/**
+ * Does the record under the cursor match the filter?  The value is only
+ * read when a value_size filter needs it.  Keys that aren't tuples never
+ * match an element filter, tuples with an element before or at the one
+ * compared that sext_skip can't walk make the whole filter fail, rather
+ * than match or not depending on how the filter is phrased.
+ *
+ * ->   1 if it matches, 0 if not, or -1 if the key can't be walked
+ */
+static int
+__filter_match(struct wterl_filter *filter, WT_CURSOR *cursor, WT_ITEM *key)
+{
+    WT_ITEM item_value;
+    const uint8_t *elem;
+    size_t elem_size;
+    unsigned int i;
+    int cmp;
+    int m;
+
+    switch (filter->op) {
+    case FILTER_PREFIX:
+        return key->size >= filter->a_size && memcmp(key->data, filter->a, filter->a_size) == 0;
+    case FILTER_RANGE:
+        return __filter_memcmp(key->data, key->size, filter->a, filter->a_size) >= 0 &&
+            __filter_memcmp(key->data, key->size, filter->b, filter->b_size) <= 0;
+    case FILTER_KEY_SIZE:
+        return key->size >= filter->min && key->size <= filter->max;
+    case FILTER_VALUE_SIZE:
+        if (cursor->get_value(cursor, &item_value) != 0)
+            return 0;
+        return item_value.size >= filter->min && item_value.size <= filter->max;
+    case FILTER_ELEMENT:
+        if ((m = sext_tuple_element(key->data, key->size, filter->n, &elem, &elem_size)) != 1)
+            return m;
+        cmp = __filter_memcmp(elem, elem_size, filter->a, filter->a_size);
+        switch (filter->cmp) {
+        case FILTER_EQ: return cmp == 0;
+        case FILTER_NE: return cmp != 0;
+        case FILTER_LT: return cmp < 0;
+        case FILTER_LE: return cmp <= 0;
+        case FILTER_GT: return cmp > 0;
+        default:        return cmp >= 0;
+        }
+    case FILTER_AND:
+        for (i = 0; i < filter->num_children; i++)
+            if ((m = __filter_match(&filter->children[i], cursor, key)) != 1)
+                return m;
+        return 1;
+    case FILTER_OR:
+        for (i = 0; i < filter->num_children; i++)
+            if ((m = __filter_match(&filter->children[i], cursor, key)) != 0)
+                return m;
+        return 0;
+    case FILTER_NOT:
+        m = __filter_match(filter->children, cursor, key);
+        return m < 0 ? m : !m;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * Read the next chunk of a stream into a list, as __cursor_batch() but
+ * stopping at the end of the stream's range and skipping records that
+ * don't match its filter.  A BATCH_CHUNK stream packs the records into
+ * one binary instead, see __chunk_finish.  The caller holds the cursor,
+ * see __cursor_enter.
+ *
+ * ->   0 or a WiredTiger error, *done is set when the range is exhausted
+ */
+static int
+__stream_chunk(ErlNifEnv *env, WterlStreamHandle *sh, ERL_NIF_TERM *list, int *done)
+{
+    WT_CURSOR *cursor = sh->cursor_handle->cursor;
+    ERL_NIF_TERM items = enif_make_list(env, 0);
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    ErlNifBinary chunk;
+    size_t used = CHUNK_HEADER_SIZE;
+    uint64_t bytes = 0;
+    uint32_t count = 0;
+    uint64_t scanned = 0;
+    int rc = 0;
+
+    if (!cursor)
+        return EINVAL;
+    if (sh->what == BATCH_CHUNK && !enif_alloc_binary(CHUNK_INITIAL_SIZE, &chunk))
+        return ENOMEM;
+
+    /* Give up the worker after a while, even if few records matched. */
+    *done = sh->at_end;
+    while (!*done && count < sh->batch_count && bytes < sh->batch_bytes &&
+           scanned++ < (uint64_t)sh->batch_count * STREAM_SCAN_FACTOR) {
+        if (sh->positioned) {
+            sh->positioned = 0;
+        } else if ((rc = cursor->next(cursor)) != 0) {
+            break;
+        }
+        if ((rc = cursor->get_key(cursor, &item_key)) != 0)
+            break;
+        if (!__range_contains(&sh->end, &item_key)) {
+            *done = 1;
+            break;
+        }
+        if (sh->filter.op != FILTER_ALL) {
+            int m = __filter_match(&sh->filter, cursor, &item_key);
+            if (m < 0) {
+                rc = WTERL_UNWALKABLE;
+                break;
+            }
+            if (!m)
+                continue;
+        }
+        if (!__cursor_live(sh->cursor_handle, cursor))
+            continue;
+        if (sh->what == BATCH_CHUNK) {
+            if ((rc = cursor->get_value(cursor, &item_value)) != 0 ||
+                (rc = __chunk_append(&chunk, &used, &item_key, &item_value)) != 0)
+                break;
+            bytes += item_key.size + item_value.size;
+            count++;
+            continue;
+        }
+        if (sh->what != BATCH_VALUE) {
+            key = __make_key(env, &item_key, sh->key_format);
+            bytes += item_key.size;
+        }
+        if (sh->what != BATCH_KEY) {
+            if ((rc = cursor->get_value(cursor, &item_value)) != 0)
+                break;
+            memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
+            bytes += item_value.size;
+        }
+        switch (sh->what) {
+        case BATCH_KEY:
+            items = enif_make_list_cell(env, key, items);
+            break;
+        case BATCH_VALUE:
+            items = enif_make_list_cell(env, value, items);
+            break;
+        default:
+            items = enif_make_list_cell(env, enif_make_tuple2(env, key, value), items);
+            break;
+        }
+        count++;
+    }
+    if (rc == WT_NOTFOUND) {
+        rc = 0;
+        *done = 1;
+    }
+    if (*done)
+        sh->at_end = 1;
+    if (sh->what == BATCH_CHUNK) {
+        if (rc != 0) {
+            enif_release_binary(&chunk);
+            return rc;
+        }
+        return __chunk_finish(env, &chunk, used, count, sh->compress, list);
+    }
+    enif_make_reverse_list(env, items, list);
+    return rc;
+}
+
+/**
+ * Give a stream's cursor back to its owner, who may use or close it again.
+ */
+static void
+__stream_detach(WterlStreamHandle *sh)
+{
+    WterlCursorHandle *cursor_handle = sh->cursor_handle;
+
+    enif_mutex_lock(cursor_handle->mutex);
+    if (sh->attached) {
+        cursor_handle->streaming = 0;
+        sh->attached = 0;
+    }
+    enif_mutex_unlock(cursor_handle->mutex);
+}
+
+/**
+ * A stream is done or closed: give its cursor back, or close the cursor
+ * if the stream was asked to.
+ */
+static void
+__stream_finish(WterlStreamHandle *sh, uint32_t worker_id)
+{
+    WterlCursorHandle *cursor_handle = sh->cursor_handle;
+
+    __stream_detach(sh);
+    if (!sh->close_cursor)
+        return;
+    enif_mutex_lock(cursor_handle->mutex);
+    if (!cursor_handle->streaming && cursor_handle->ctx) {
+        __cursor_release(cursor_handle, worker_id);
+        __sync_add_and_fetch(&cursor_handle->conn_handle->stats.cursors_closed, 1);
+    }
+    enif_mutex_unlock(cursor_handle->mutex);
+}
+
+/**
+ * Stop producing, waking a stream_close waiting for us.
+ */
+static void
+__stream_idle(WterlStreamHandle *sh, int done)
+{
+    enif_mutex_lock(sh->mutex);
+    if (done)
+        sh->done = 1;
+    sh->producing = 0;
+    enif_cond_broadcast(sh->cond);
+    enif_mutex_unlock(sh->mutex);
+}
 
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
-  },
-  { // post
+/**
+ * Push chunks to the stream's owner for as long as it has credit, each as
+ * {wterl_stream, Ref, {data, Items}} and the last as {wterl_stream, Ref,
+ * {done, Items}} (or {wterl_stream, Ref, {error, Reason}}).  Only one
+ * worker produces for a stream at a time, see stream_ack.  The cursor is
+ * given back (or closed) before the last chunk is sent, so the owner may
+ * close it as soon as that arrives.
+ */
+static void
+__stream_produce(WterlStreamHandle *sh, uint32_t worker_id)
+{
+    ErlNifEnv *msg_env = enif_alloc_env();
+    ERL_NIF_TERM items;
+    ERL_NIF_TERM reply;
+    int done;
+    int rc;
 
-    enif_release_resource((void*)args->conn_handle);
-  });
+    if (!msg_env) {
+        __stream_idle(sh, 0);
+        return;
+    }
+    for (;;) {
+        enif_mutex_lock(sh->mutex);
+        if (sh->done || sh->credits == 0) {
+            enif_mutex_unlock(sh->mutex);
+            __stream_idle(sh, 0);
+            break;
+        }
+        sh->credits--;
+        enif_mutex_unlock(sh->mutex);
+
+        /* The stream owns the cursor, so take it without __cursor_enter. */
+        enif_mutex_lock(sh->cursor_handle->mutex);
+        rc = sh->cursor_handle->cursor ? __stream_chunk(msg_env, sh, &items, &done) : EINVAL;
+        enif_mutex_unlock(sh->cursor_handle->mutex);
+        if (rc != 0) {
+            reply = __strerror_term(msg_env, rc);
+            done = 1;
+        } else {
+            reply = enif_make_tuple2(msg_env, done ? ATOM_DONE : ATOM_DATA, items);
+        }
+        if (done)
+            __stream_finish(sh, worker_id);
+        enif_send(NULL, &sh->pid, msg_env,
+                  enif_make_tuple3(msg_env, ATOM_WTERL_STREAM, enif_make_copy(msg_env, sh->ref), reply));
+        enif_clear_env(msg_env);
+        if (done) {
+            __stream_idle(sh, 1);
+            break;
+        }
+    }
+    enif_free_env(msg_env);
+}
 
 /**
- * Create a WiredTiger table, column group, index or file.
- *
- * We create, use and discard a WT_SESSION here because table creation is not
- * too performance sensitive.
+ * Stream a range of a table to the calling process.  The cursor is moved
+ * to the first key at or after Start and chunks are sent, as credit
+ * allows, until the end of the range.  Don't use the cursor for anything
+ * else until the stream is done or closed.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    config string as an Erlang binary
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    a reference to tag the stream's messages with
+ * argv[2]    start of the range, first or a key
+ * argv[3]    end of the range, last, a key (inclusive), {before, Key} or
+ *            {prefix, Prefix}
+ * argv[4]    what to send, the atom kv, key, value or chunk
+ * argv[5]    initial credit, the number of chunks to send before an ack
+ * argv[6]    maximum number of records per chunk
+ * argv[7]    maximum number of bytes of keys and values per chunk
+ * argv[8]    a filter records must match to be sent, see __filter_parse
+ * argv[9]    how to send keys, the atom raw, sext or object
+ * argv[10]   how to compress chunks, the atom none or snappy
+ * argv[11]   true to close the cursor when the stream is done or closed
  */
 ASYNC_NIF_DECL(
-  wterl_create,
+  wterl_stream_range,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
-    ERL_NIF_TERM config;
+    WterlCursorHandle *cursor_handle;
+    ERL_NIF_TERM ref;
+    ERL_NIF_TERM start;
+    ERL_NIF_TERM end;
+    ERL_NIF_TERM filter;
+    int what;
+    int key_format;
+    int compress;
+    unsigned int credits;
+    unsigned int batch_count;
+    ErlNifUInt64 batch_bytes;
+    int close_cursor;
   },
   { // pre
 
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]))) {
+    if (!(argc == 12 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_ref(env, argv[1]) &&
+          (enif_is_identical(argv[2], ATOM_FIRST) || enif_is_binary(env, argv[2])) &&
+          enif_get_uint(env, argv[5], &args->credits) &&
+          enif_get_uint(env, argv[6], &args->batch_count) && args->batch_count > 0 &&
+          enif_get_uint64(env, argv[7], &args->batch_bytes) && args->batch_bytes > 0 &&
+          __key_format(argv[9], &args->key_format))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->conn_handle);
+    if (enif_is_identical(argv[4], ATOM_KV))
+        args->what = BATCH_KV;
+    else if (enif_is_identical(argv[4], ATOM_KEY))
+        args->what = BATCH_KEY;
+    else if (enif_is_identical(argv[4], ATOM_VALUE))
+        args->what = BATCH_VALUE;
+    else if (enif_is_identical(argv[4], ATOM_CHUNK))
+        args->what = BATCH_CHUNK;
+    else
+        ASYNC_NIF_RETURN_BADARG();
+    if (enif_is_identical(argv[10], ATOM_SNAPPY))
+        args->compress = 1;
+    else if (!enif_is_identical(argv[10], ATOM_NONE))
+        ASYNC_NIF_RETURN_BADARG();
+    args->close_cursor = enif_is_identical(argv[11], enif_make_atom(env, "true"));
+    args->ref = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->start = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->end = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    args->filter = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[8]);
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
+    WT_CURSOR *cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WterlStreamHandle *sh = enif_alloc_resource(wterl_stream_RESOURCE, sizeof(WterlStreamHandle));
+    if (!sh) {
+        __cursor_leave(args->cursor_handle);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+        return;
+    }
+    memset(sh, 0, sizeof(WterlStreamHandle));
+    sh->mutex = enif_mutex_create("wterl_stream");
+    sh->cond = enif_cond_create("wterl_stream");
+    sh->env = enif_alloc_env();
+    if (!sh->mutex || !sh->cond || !sh->env || !__range_end(env, args->end, &sh->end) ||
+        !__filter_parse(env, args->filter, &sh->filter, 0)) {
+        __cursor_leave(args->cursor_handle);
+        enif_release_resource(sh);
+        ASYNC_NIF_REPLY(enif_make_badarg(env));
+        return;
+    }
+    sh->cursor_handle = args->cursor_handle;
+    enif_keep_resource((void*)sh->cursor_handle);
+    sh->ref = enif_make_copy(sh->env, args->ref);
+    sh->pid = *pid;
+    sh->what = args->what;
+    sh->key_format = args->key_format;
+    sh->compress = args->compress;
+    sh->batch_count = args->batch_count;
+    sh->batch_bytes = args->batch_bytes;
+    sh->credits = args->credits;
+    sh->close_cursor = args->close_cursor;
+
+    /* Seek to the start of the range. */
+    ErlNifBinary start;
+    if (enif_inspect_binary(env, args->start, &start)) {
+        int exact;
+        WT_ITEM item_key;
+        item_key.data = start.data;
+        item_key.size = start.size;
+        cursor->set_key(cursor, &item_key);
+        rc = cursor->search_near(cursor, &exact);
+        if (rc == 0 && exact < 0)
+            rc = cursor->next(cursor);
+        sh->positioned = (rc == 0);
+    } else {
+        rc = cursor->reset(cursor);
+    }
+    if (rc == WT_NOTFOUND) {
+        sh->at_end = 1;
+        rc = 0;
     }
-
-    /* We create, use and discard a WT_SESSION here because a) we don't need a
-       cursor and b) we don't anticipate doing this operation frequently enough
-       to impact performance. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
     if (rc != 0) {
+        __cursor_leave(args->cursor_handle);
+        enif_release_resource(sh);
         ASYNC_NIF_REPLY(__strerror_term(env, rc));
         return;
     }
-
-    rc = session->create(session, args->uri, (const char*)config.data);
-    (void)session->close(session, NULL);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    args->cursor_handle->streaming = 1;
+    sh->attached = 1;
+    __cursor_leave(args->cursor_handle);
+
+    sh->producing = 1;
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_resource(env, sh)));
+    __stream_produce(sh, worker_id);
+    enif_release_resource(sh);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
 /**
- * Drop (remove) a WiredTiger table, column group, index or file.
+ * Grant a stream more credit, resuming it if it had run out.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    config string as an Erlang binary
+ * argv[0]    WterlStreamHandle resource
+ * argv[1]    number of additional chunks the owner will accept
  */
 ASYNC_NIF_DECL(
-  wterl_drop,
+  wterl_stream_ack,
   { // struct
 
-    Uri uri;
-    ERL_NIF_TERM config;
-    WterlConnHandle *conn_handle;
+    WterlStreamHandle *stream_handle;
+    unsigned int credits;
   },
   { // pre
 
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_stream_RESOURCE, (void**)&args->stream_handle) &&
+          enif_get_uint(env, argv[1], &args->credits))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->conn_handle);
+    /* Resumed chunks are read on the cursor's queue like any other use. */
+    affinity = args->stream_handle->cursor_handle->affinity;
+    enif_keep_resource((void*)args->stream_handle);
   },
   { // work
 
-    /* This call requires that there be no open cursors referencing the object. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_cursors_on(args->conn_handle, args->uri);
+    WterlStreamHandle *sh = args->stream_handle;
+    int start;
+
+    enif_mutex_lock(sh->mutex);
+    sh->credits += args->credits;
+    start = !sh->producing && !sh->done;
+    if (start)
+        sh->producing = 1;
+    enif_mutex_unlock(sh->mutex);
+    ASYNC_NIF_REPLY(ATOM_OK);
+    if (start)
+        __stream_produce(sh, worker_id);
+  },
+  { // post
 
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
-    }
+    enif_release_resource((void*)args->stream_handle);
+  });
 
-    /* We create, use and discard a WT_SESSION here because a) we don't need a
-       cursor and b) we don't anticipate doing this operation frequently enough
-       to impact performance. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
-    if (rc != 0) {
-        enif_mutex_unlock(args->conn_handle->cache_mutex);
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
-        return;
+/**
+ * Stop a stream early.  Waits for a chunk being read to be sent, so no
+ * more arrive once this replies, then gives the cursor back to its owner
+ * (or closes it).
+ *
+ * argv[0]    WterlStreamHandle resource
+ */
+ASYNC_NIF_DECL(
+  wterl_stream_close,
+  { // struct
+
+    WterlStreamHandle *stream_handle;
+  },
+  { // pre
+
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_stream_RESOURCE, (void**)&args->stream_handle))) {
+      ASYNC_NIF_RETURN_BADARG();
     }
-    /* Note: we locked the context mutex and called __close_cursors_on()
-       earlier so that we are sure that before we call into WiredTiger we have
-       first closed all open cursors referencing this object.  Failure to do
-       this will result in EBUSY(16) "Device or resource busy". */
-    rc = session->drop(session, args->uri, (const char*)config.data);
-    (void)session->close(session, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    enif_keep_resource((void*)args->stream_handle);
+  },
+  { // work
+
+    WterlStreamHandle *sh = args->stream_handle;
+
+    enif_mutex_lock(sh->mutex);
+    sh->done = 1;
+    while (sh->producing)
+        enif_cond_wait(sh->cond, sh->mutex);
+    enif_mutex_unlock(sh->mutex);
+    __stream_finish(sh, worker_id);
+    ASYNC_NIF_REPLY(ATOM_OK);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->stream_handle);
   });
 
+/* Aggregates computed by aggregate_nif, as bits in a mask. */
+#define AGG_COUNT (1 << 0)
+#define AGG_KEY_BYTES (1 << 1)
+#define AGG_VALUE_BYTES (1 << 2)
+#define AGG_MIN_KEY (1 << 3)
+#define AGG_MAX_KEY (1 << 4)
+
+static int
+__agg_flag(ERL_NIF_TERM term)
+{
+    if (enif_is_identical(term, ATOM_COUNT))
+        return AGG_COUNT;
+    if (enif_is_identical(term, ATOM_KEY_BYTES))
+        return AGG_KEY_BYTES;
+    if (enif_is_identical(term, ATOM_VALUE_BYTES))
+        return AGG_VALUE_BYTES;
+    if (enif_is_identical(term, ATOM_MIN_KEY))
+        return AGG_MIN_KEY;
+    if (enif_is_identical(term, ATOM_MAX_KEY))
+        return AGG_MAX_KEY;
+    return 0;
+}
+
 /**
- * Rename a WiredTiger table, column group, index or file.
+ * Move the cursor to the first key at or after start (or the first key
+ * when start is NULL).
+ */
+static int
+__range_seek_first(WT_CURSOR *cursor, ErlNifBinary *start)
+{
+    WT_ITEM item_key;
+    int exact;
+    int rc;
+
+    if (!start) {
+        cursor->reset(cursor);
+        return cursor->next(cursor);
+    }
+    item_key.data = start->data;
+    item_key.size = start->size;
+    cursor->set_key(cursor, &item_key);
+    rc = cursor->search_near(cursor, &exact);
+    if (rc == 0 && exact < 0)
+        rc = cursor->next(cursor);
+    return rc;
+}
+
+/**
+ * Move the cursor to the last key within the end of a range, without
+ * scanning.  A prefix end seeks to the smallest key after every key with
+ * the prefix, and steps back.
+ *
+ * ->   0, WT_NOTFOUND if the range holds no keys, or a WiredTiger error
+ */
+static int
+__range_seek_last(WT_CURSOR *cursor, struct wterl_range_end *end, ErlNifBinary *start)
+{
+    WT_ITEM item_key;
+    uint8_t *after = NULL;
+    size_t after_size = 0;
+    int exact;
+    int rc;
+
+    if (end->kind == RANGE_PREFIX) {
+        /* The successor of the prefix: drop trailing 0xff bytes and bump
+           the last byte, or nothing when the prefix is all 0xff. */
+        after_size = end->size;
+        while (after_size > 0 && end->key[after_size - 1] == 0xff)
+            after_size--;
+        if (after_size > 0) {
+            if (!(after = malloc(after_size)))
+                return ENOMEM;
+            memcpy(after, end->key, after_size);
+            after[after_size - 1]++;
+        }
+    }
+    if (end->kind == RANGE_LAST || (end->kind == RANGE_PREFIX && !after)) {
+        cursor->reset(cursor);
+        rc = cursor->prev(cursor);
+    } else {
+        item_key.data = after ? after : end->key;
+        item_key.size = after ? after_size : end->size;
+        cursor->set_key(cursor, &item_key);
+        rc = cursor->search_near(cursor, &exact);
+        if (rc == 0 && (exact > 0 || (exact == 0 && end->kind != RANGE_KEY)))
+            rc = cursor->prev(cursor);
+    }
+    free(after);
+    if (rc != 0)
+        return rc;
+    if ((rc = cursor->get_key(cursor, &item_key)) != 0)
+        return rc;
+    if (!__range_contains(end, &item_key))
+        return WT_NOTFOUND;
+    if (start && __filter_memcmp(item_key.data, item_key.size, start->data, start->size) < 0)
+        return WT_NOTFOUND;
+    return 0;
+}
+
+static ERL_NIF_TERM
+__agg_key(ErlNifEnv *env, WT_CURSOR *cursor)
+{
+    WT_ITEM item_key;
+    ERL_NIF_TERM key;
+
+    if (cursor->get_key(cursor, &item_key) != 0)
+        return ATOM_NOT_FOUND;
+    memcpy(enif_make_new_binary(env, item_key.size, &key), item_key.data, item_key.size);
+    return key;
+}
+
+/**
+ * Compute aggregates over the records of a range that match a filter.
+ * The first and last keys alone are found by seeking, anything else
+ * needs a scan of the range.  When ttl_cursor isn't NULL expired records
+ * are skipped, so the range is always scanned, stopping at the first live
+ * record when min_key is all that's wanted.
+ *
+ * ->   {ok, [{Aggregate, Value}]} in the order asked for, min_key and
+ *      max_key are not_found for an empty range
+ */
+static ERL_NIF_TERM
+__aggregate(ErlNifEnv *env, WT_CURSOR *cursor, WT_CURSOR *ttl_cursor,
+            ErlNifBinary *start, struct wterl_range_end *end,
+            struct wterl_filter *filter, ERL_NIF_TERM aggs, int wanted)
+{
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    ERL_NIF_TERM min_key = ATOM_NOT_FOUND;
+    ERL_NIF_TERM max_key = ATOM_NOT_FOUND;
+    ERL_NIF_TERM results = enif_make_list(env, 0);
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM value;
+    uint64_t count = 0;
+    uint64_t key_bytes = 0;
+    uint64_t value_bytes = 0;
+    uint8_t *last = NULL;
+    size_t last_size = 0;
+    size_t last_cap = 0;
+    uint64_t now = (uint64_t)time(NULL);
+    int flag;
+    int rc;
+
+    if (filter->op == FILTER_ALL && !ttl_cursor &&
+        !(wanted & (AGG_COUNT | AGG_KEY_BYTES | AGG_VALUE_BYTES))) {
+        if (wanted & AGG_MIN_KEY) {
+            rc = __range_seek_first(cursor, start);
+            if (rc == 0 && (rc = cursor->get_key(cursor, &item_key)) == 0 &&
+                __range_contains(end, &item_key))
+                min_key = __agg_key(env, cursor);
+            if (rc != 0 && rc != WT_NOTFOUND)
+                return __strerror_term(env, rc);
+        }
+        if (wanted & AGG_MAX_KEY) {
+            rc = __range_seek_last(cursor, end, start);
+            if (rc == 0)
+                max_key = __agg_key(env, cursor);
+            else if (rc != WT_NOTFOUND)
+                return __strerror_term(env, rc);
+        }
+    } else {
+        for (rc = __range_seek_first(cursor, start); rc == 0; rc = cursor->next(cursor)) {
+            if ((rc = cursor->get_key(cursor, &item_key)) != 0)
+                break;
+            if (!__range_contains(end, &item_key))
+                break;
+            if (filter->op != FILTER_ALL) {
+                int m = __filter_match(filter, cursor, &item_key);
+                if (m < 0) {
+                    rc = WTERL_UNWALKABLE;
+                    break;
+                }
+                if (!m)
+                    continue;
+            }
+            if (ttl_cursor && __ttl_expired(ttl_cursor, &item_key, now))
+                continue;
+            if (count == 0 && (wanted & AGG_MIN_KEY)) {
+                min_key = __agg_key(env, cursor);
+                if (wanted == AGG_MIN_KEY)
+                    break;
+            }
+            count++;
+            key_bytes += item_key.size;
+            if (wanted & AGG_VALUE_BYTES) {
+                if ((rc = cursor->get_value(cursor, &item_value)) != 0)
+                    break;
+                value_bytes += item_value.size;
+            }
+            if (wanted & AGG_MAX_KEY) {
+                /* Copy the last match aside rather than making a term for
+                   every record. */
+                if (item_key.size > last_cap) {
+                    uint8_t *p = realloc(last, item_key.size);
+                    if (!p) {
+                        rc = ENOMEM;
+                        break;
+                    }
+                    last = p;
+                    last_cap = item_key.size;
+                }
+                memcpy(last, item_key.data, item_key.size);
+                last_size = item_key.size;
+            }
+        }
+        if (count > 0 && (wanted & AGG_MAX_KEY))
+            memcpy(enif_make_new_binary(env, last_size, &max_key), last, last_size);
+        free(last);
+        if (rc != 0 && rc != WT_NOTFOUND)
+            return __strerror_term(env, rc);
+    }
+
+    while (enif_get_list_cell(env, aggs, &head, &aggs)) {
+        flag = __agg_flag(head);
+        switch (flag) {
+        case AGG_COUNT:
+            value = enif_make_uint64(env, count);
+            break;
+        case AGG_KEY_BYTES:
+            value = enif_make_uint64(env, key_bytes);
+            break;
+        case AGG_VALUE_BYTES:
+            value = enif_make_uint64(env, value_bytes);
+            break;
+        case AGG_MIN_KEY:
+            value = min_key;
+            break;
+        default:
+            value = max_key;
+            break;
+        }
+        results = enif_make_list_cell(env, enif_make_tuple2(env, head, value), results);
+    }
+    enif_make_reverse_list(env, results, &value);
+    return enif_make_tuple2(env, ATOM_OK, value);
+}
+
+/**
+ * Compute aggregates over a range of a table in one request, without
+ * sending the records to Erlang.  Expired records are skipped, merge
+ * operands are not taken into account.
  *
  * argv[0]    WterlConnHandle resource
- * argv[1]    old object name URI string
- * argv[2]    new object name URI string
- * argv[3]    config string as an Erlang binary
+ * argv[1]    object name URI string
+ * argv[2]    start of the range, first or a key
+ * argv[3]    end of the range, as for stream_range_nif
+ * argv[4]    a filter records must match to be counted, see __filter_parse
+ * argv[5]    list of aggregates: count, key_bytes, value_bytes, min_key
+ *            and max_key
  */
 ASYNC_NIF_DECL(
-  wterl_rename,
+  wterl_aggregate,
   { // struct
 
-    Uri oldname;
-    Uri newname;
-    ERL_NIF_TERM config;
     WterlConnHandle *conn_handle;
+    Uri uri;
+    ERL_NIF_TERM start;
+    ERL_NIF_TERM end;
+    ERL_NIF_TERM filter;
+    ERL_NIF_TERM aggs;
+    int wanted;
   },
   { // pre
 
-    if (!(argc == 4 &&
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM tail;
+    int flag;
+
+    if (!(argc == 6 &&
           enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->oldname, sizeof(args->oldname), ERL_NIF_LATIN1) > 0) &&
-          (enif_get_string(env, argv[2], args->newname, sizeof(args->newname), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[3]))) {
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          (enif_is_identical(argv[2], ATOM_FIRST) || enif_is_binary(env, argv[2])) &&
+          enif_is_list(env, argv[5]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    args->wanted = 0;
+    tail = argv[5];
+    while (enif_get_list_cell(env, tail, &head, &tail)) {
+        if ((flag = __agg_flag(head)) == 0)
+            ASYNC_NIF_RETURN_BADARG();
+        args->wanted |= flag;
+    }
+    args->start = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->end = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    args->filter = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[4]);
+    args->aggs = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[5]);
     enif_keep_resource((void*)args->conn_handle);
   },
   { // work
 
-    /* This call requires that there be no open cursors referencing the object. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_cursors_on(args->conn_handle, args->oldname);
-
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
-    }
+    struct wterl_range_end end;
+    struct wterl_filter filter;
+    ErlNifBinary start;
+    int has_start = enif_inspect_binary(env, args->start, &start);
 
-    /* We create, use and discard a WT_SESSION here because a) we don't need a
-       cursor and b) we don't anticipate doing this operation frequently enough
-       to impact performance. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
-    if (rc != 0) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(__strerror_term(env, rc));
-      return;
+    memset(&filter, 0, sizeof(struct wterl_filter));
+    if (!__range_end(env, args->end, &end) ||
+        !__filter_parse(env, args->filter, &filter, 0)) {
+        __range_end_free(&end);
+        __filter_free(&filter);
+        ASYNC_NIF_REPLY(enif_make_badarg(env));
+        return;
     }
 
-    /* Note: we locked the context mutex and called __close_cursors_on()
-       earlier so that we are sure that before we call into WiredTiger we have
-       first closed all open cursors referencing this object.  Failure to do
-       this will result in EBUSY(16) "Device or resource busy". */
-    rc = session->rename(session, args->oldname, args->newname, (const char*)config.data);
-    (void)session->close(session, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    struct wterl_ctx *ctx = NULL;
+    struct wterl_table table;
+    int rc = __retain_table_ctx(args->conn_handle, worker_id, &ctx, args->uri, &table);
+    if (rc != 0) {
+        __range_end_free(&end);
+        __filter_free(&filter);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ERL_NIF_TERM reply = __aggregate(env, ctx->ci[0].cursor,
+                                     table.ttl ? ctx->ci[1].cursor : NULL,
+                                     has_start ? &start : NULL,
+                                     &end, &filter, args->aggs, args->wanted);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    __range_end_free(&end);
+    __filter_free(&filter);
+    ASYNC_NIF_REPLY(reply);
   },
   { // post
 
     enif_release_resource((void*)args->conn_handle);
   });
 
+/**
+ * Skip-scan a range of keys that are sext encoded tuples for the distinct
+ * values of element n: read a key, then seek past every key sharing its
+ * encoding up to the end of that element.  The work is a seek for each
+ * distinct value rather than a step for each key.  Keys that aren't
+ * tuples are stepped over one at a time, a tuple with an element before or
+ * at n that can't be walked is an error (badarg).
+ *
+ * ->   {ok, Elements}, the sext encoding of each value, in key order
+ */
+static ERL_NIF_TERM
+__distinct_elements(ErlNifEnv *env, WT_CURSOR *cursor, ErlNifBinary *start,
+                    struct wterl_range_end *end, uint32_t n)
+{
+    WT_ITEM item_key;
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    ERL_NIF_TERM elem_term;
+    const uint8_t *key;
+    const uint8_t *elem;
+    size_t elem_size;
+    uint8_t *after = NULL;
+    size_t after_size;
+    size_t after_cap = 0;
+    int exact;
+    int rc;
+
+    for (rc = __range_seek_first(cursor, start); rc == 0; ) {
+        if ((rc = cursor->get_key(cursor, &item_key)) != 0)
+            break;
+        if (!__range_contains(end, &item_key))
+            break;
+        key = item_key.data;
+        int found = sext_tuple_element(key, item_key.size, n, &elem, &elem_size);
+        if (found < 0) {
+            rc = WTERL_UNWALKABLE;
+            break;
+        }
+        if (!found) {
+            rc = cursor->next(cursor);
+            continue;
+        }
+        memcpy(enif_make_new_binary(env, elem_size, &elem_term), elem, elem_size);
+        list = enif_make_list_cell(env, elem_term, list);
+
+        /* Seek to the successor of the key up to the end of the element:
+           drop trailing 0xff bytes and bump the last byte. */
+        after_size = (size_t)((elem + elem_size) - key);
+        while (after_size > 0 && key[after_size - 1] == 0xff)
+            after_size--;
+        if (after_size == 0) {
+            rc = WT_NOTFOUND;
+            break;
+        }
+        if (after_size > after_cap) {
+            uint8_t *p = realloc(after, after_size);
+            if (!p) {
+                rc = ENOMEM;
+                break;
+            }
+            after = p;
+            after_cap = after_size;
+        }
+        memcpy(after, key, after_size);
+        after[after_size - 1]++;
+        item_key.data = after;
+        item_key.size = after_size;
+        cursor->set_key(cursor, &item_key);
+        rc = cursor->search_near(cursor, &exact);
+        if (rc == 0 && exact < 0)
+            rc = cursor->next(cursor);
+    }
+    free(after);
+    if (rc != 0 && rc != WT_NOTFOUND)
+        return __strerror_term(env, rc);
+    enif_make_reverse_list(env, list, &list);
+    return enif_make_tuple2(env, ATOM_OK, list);
+}
 
 /**
- * Salvage rebuilds the file, or files of which a table is comprised,
- * discarding any corrupted file blocks.  Use this as a fallback if
- * an attempt to open a WiredTiger database object fails.
+ * List the distinct values of one element of the sext encoded tuples that
+ * are the keys of a range of a table, e.g. the buckets of {o, Bucket, Key}
+ * keys, by skip-scanning it.
  *
  * argv[0]    WterlConnHandle resource
  * argv[1]    object name URI string
- * argv[2]    config string as an Erlang binary
+ * argv[2]    start of the range, first or a key
+ * argv[3]    end of the range, as for stream_range_nif
+ * argv[4]    the element, 1-based as for element/2
  */
 ASYNC_NIF_DECL(
-  wterl_salvage,
+  wterl_distinct_elements,
   { // struct
 
     WterlConnHandle *conn_handle;
     Uri uri;
-    ERL_NIF_TERM config;
+    ERL_NIF_TERM start;
+    ERL_NIF_TERM end;
+    unsigned int n;
   },
   { // pre
 
-    if (!(argc == 3 &&
+    if (!(argc == 5 &&
           enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
           (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]))) {
+          (enif_is_identical(argv[2], ATOM_FIRST) || enif_is_binary(env, argv[2])) &&
+          enif_get_uint(env, argv[4], &args->n) && args->n > 0)) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->start = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->end = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
     enif_keep_resource((void*)args->conn_handle);
   },
   { // work
 
-    /* This call requires that there be no open cursors referencing the object. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_cursors_on(args->conn_handle, args->uri);
+    struct wterl_range_end end;
+    ErlNifBinary start;
+    int has_start = enif_inspect_binary(env, args->start, &start);
 
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
+    if (!__range_end(env, args->end, &end)) {
+        __range_end_free(&end);
+        ASYNC_NIF_REPLY(enif_make_badarg(env));
+        return;
     }
 
-    /* We create, use and discard a WT_SESSION here because a) we don't need a
-       cursor and b) we don't anticipate doing this operation frequently enough
-       to impact performance. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    struct wterl_ctx *ctx = NULL;
+    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
+                          args->conn_handle->session_config,
+                          args->uri, "overwrite,raw");
     if (rc != 0) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(__strerror_term(env, rc));
-      return;
+        __range_end_free(&end);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
     }
-
-    rc = session->salvage(session, args->uri, (const char*)config.data);
-    (void)session->close(session, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    ERL_NIF_TERM reply = __distinct_elements(env, ctx->ci[0].cursor, has_start ? &start : NULL,
+                                             &end, args->n);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    __range_end_free(&end);
+    ASYNC_NIF_REPLY(reply);
   },
   { // post
 
@@ -973,46 +8062,138 @@ ASYNC_NIF_DECL(
   });
 
 /**
- * Checkpoint writes a transactionally consistent snapshot of a database or set
- * of objects specified.
+ * Walk a range of an index table whose values are keys in an object
+ * table, and look each of those up in the object table.  Index entries
+ * whose object is missing are skipped.
+ *
+ * ->   {done, Items} or {more, Items, Next} where Items are {IndexKey,
+ *      ObjectKey, Object} and Next is the index key to continue from
+ */
+static ERL_NIF_TERM
+__index_join(ErlNifEnv *env, WT_CURSOR *index, WT_CURSOR *objects, ErlNifBinary *start,
+             struct wterl_range_end *end, uint32_t max_count, uint64_t max_bytes)
+{
+    ERL_NIF_TERM items = enif_make_list(env, 0);
+    ERL_NIF_TERM index_key;
+    ERL_NIF_TERM object_key;
+    ERL_NIF_TERM object;
+    ERL_NIF_TERM list;
+    WT_ITEM item_key;
+    WT_ITEM item_pkey;
+    WT_ITEM item_object;
+    uint64_t bytes = 0;
+    uint32_t count = 0;
+    int more = 0;
+    int rc;
+
+    for (rc = __range_seek_first(index, start); rc == 0; rc = index->next(index)) {
+        if ((rc = index->get_key(index, &item_key)) != 0)
+            break;
+        if (!__range_contains(end, &item_key))
+            break;
+        if (count >= max_count || bytes >= max_bytes) {
+            more = 1;
+            break;
+        }
+        if ((rc = index->get_value(index, &item_pkey)) != 0)
+            break;
+        objects->set_key(objects, &item_pkey);
+        rc = objects->search(objects);
+        if (rc == WT_NOTFOUND)
+            continue;
+        if (rc != 0 || (rc = objects->get_value(objects, &item_object)) != 0)
+            break;
+        memcpy(enif_make_new_binary(env, item_key.size, &index_key), item_key.data, item_key.size);
+        memcpy(enif_make_new_binary(env, item_pkey.size, &object_key), item_pkey.data, item_pkey.size);
+        memcpy(enif_make_new_binary(env, item_object.size, &object), item_object.data, item_object.size);
+        items = enif_make_list_cell(env, enif_make_tuple3(env, index_key, object_key, object), items);
+        bytes += item_key.size + item_pkey.size + item_object.size;
+        count++;
+    }
+    if (rc != 0 && rc != WT_NOTFOUND)
+        return __strerror_term(env, rc);
+    enif_make_reverse_list(env, items, &list);
+    if (!more)
+        return enif_make_tuple2(env, ATOM_DONE, list);
+    memcpy(enif_make_new_binary(env, item_key.size, &index_key), item_key.data, item_key.size);
+    return enif_make_tuple3(env, ATOM_MORE, list, index_key);
+}
+
+/**
+ * Resolve a range of index entries to the objects they refer to, reading
+ * both tables in one session and one snapshot.
  *
  * argv[0]    WterlConnHandle resource
- * argv[1]    config string as an Erlang binary
+ * argv[1]    index table URI string, its values are object table keys
+ * argv[2]    object table URI string
+ * argv[3]    start of the index range, first or a key
+ * argv[4]    end of the index range, as for stream_range_nif
+ * argv[5]    maximum number of objects to return
+ * argv[6]    maximum number of bytes to return (soft limit)
  */
 ASYNC_NIF_DECL(
-  wterl_checkpoint,
+  wterl_index_join,
   { // struct
 
     WterlConnHandle *conn_handle;
-    ERL_NIF_TERM config;
+    Uri index_uri;
+    Uri object_uri;
+    ERL_NIF_TERM start;
+    ERL_NIF_TERM end;
+    unsigned int max_count;
+    ErlNifUInt64 max_bytes;
   },
   { // pre
 
-    if (!(argc == 2 &&
+    if (!(argc == 7 &&
           enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          enif_is_binary(env, argv[1]))) {
+          (enif_get_string(env, argv[1], args->index_uri, sizeof(args->index_uri), ERL_NIF_LATIN1) > 0) &&
+          (enif_get_string(env, argv[2], args->object_uri, sizeof(args->object_uri), ERL_NIF_LATIN1) > 0) &&
+          (enif_is_identical(argv[3], ATOM_FIRST) || enif_is_binary(env, argv[3])) &&
+          enif_get_uint(env, argv[5], &args->max_count) && args->max_count > 0 &&
+          enif_get_uint64(env, argv[6], &args->max_bytes) && args->max_bytes > 0)) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->start = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    args->end = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[4]);
     enif_keep_resource((void*)args->conn_handle);
   },
   { // work
 
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
+    struct wterl_range_end end;
+    ErlNifBinary start;
+    int has_start = enif_inspect_binary(env, args->start, &start);
+
+    if (!__range_end(env, args->end, &end)) {
+        ASYNC_NIF_REPLY(enif_make_badarg(env));
+        return;
     }
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+
+    struct wterl_ctx *ctx = NULL;
+    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 2,
+                          args->conn_handle->session_config,
+                          args->index_uri, "raw",
+                          args->object_uri, "overwrite,raw");
     if (rc != 0) {
+        __range_end_free(&end);
         ASYNC_NIF_REPLY(__strerror_term(env, rc));
         return;
     }
-    rc = session->checkpoint(session, (const char*)config.data);
-    (void)session->close(session, NULL);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    WT_SESSION *session = ctx->session;
+    rc = session->begin_transaction(session, "isolation=snapshot");
+    if (rc != 0) {
+        __release_ctx(args->conn_handle, worker_id, ctx);
+        __range_end_free(&end);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ERL_NIF_TERM reply = __index_join(env, ctx->ci[0].cursor, ctx->ci[1].cursor,
+                                      has_start ? &start : NULL, &end,
+                                      args->max_count, args->max_bytes);
+    (void)session->rollback_transaction(session, NULL);
+    __release_ctx(args->conn_handle, worker_id, ctx);
+    __range_end_free(&end);
+    ASYNC_NIF_REPLY(reply);
   },
   { // post
 
@@ -1020,575 +8201,742 @@ ASYNC_NIF_DECL(
   });
 
 /**
- * Truncate a file, table or cursor range.
+ * Position the cursor at the record matching the key.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    start key as an Erlang binary
- * argv[3]    stop key as an Erlang binary
- * argv[4]    config string as an Erlang binary
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    key as an Erlang binary
+ * argv[2]    boolean, when false the cursor will be reset
  */
 ASYNC_NIF_DECL(
-  wterl_truncate,
+  wterl_cursor_search,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
-    int from_first;
-    int to_last;
-    ERL_NIF_TERM start;
-    ERL_NIF_TERM stop;
-    ERL_NIF_TERM config;
+    WterlCursorHandle *cursor_handle;
+    ERL_NIF_TERM key;
+    int scanning;
   },
   { // pre
 
-    if (!(argc == 5 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[4]))) {
+    static ERL_NIF_TERM ATOM_TRUE = 0;
+    if (ATOM_TRUE == 0)
+        enif_make_atom(env, "true");
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_binary(env, argv[1]) &&
+          enif_is_atom(env, argv[2]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    if (enif_is_binary(env, argv[2])) {
-        args->from_first = 0;
-        args->start = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    } else if (enif_is_atom(env, argv[2])) { // TODO && argv[2] == ATOM_FIRST) {
-        args->from_first = 1;
-        args->start = 0;
-    } else {
-        ASYNC_NIF_RETURN_BADARG();
-    }
-    if (enif_is_binary(env, argv[3])) {
-        args->to_last = 0;
-        args->stop = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
-    } else if (enif_is_atom(env, argv[3])) { // TODO && argv[3] == ATOM_LAST) {
-        args->to_last = 1;
-        args->stop = 0;
-    } else {
-        ASYNC_NIF_RETURN_BADARG();
-    }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[4]);
-    enif_keep_resource((void*)args->conn_handle);
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->scanning = (enif_is_identical(argv[2], ATOM_TRUE)) ? 1 : 0;
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    /* This call requires that there be no open cursors referencing the object. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_cursors_on(args->conn_handle, args->uri);
-
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
-    }
-
-    /* Note: we locked the context mutex and called __close_cursors_on()
-       earlier so that we are sure that before we call into WiredTiger we have
-       first closed all open cursors referencing this object.  Failure to do
-       this will result in EBUSY(16) "Device or resource busy". */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
     if (rc != 0) {
-        enif_mutex_unlock(args->conn_handle->cache_mutex);
         ASYNC_NIF_REPLY(__strerror_term(env, rc));
         return;
     }
+    ErlNifBinary key;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
+      return;
+    }
 
-    ErlNifBinary start_key;
-    ErlNifBinary stop_key;
-    WT_CURSOR *start = NULL;
-    WT_CURSOR *stop = NULL;
+    WT_ITEM item_key;
+    item_key.data = key.data;
+    item_key.size = key.size;
+    cursor->set_key(cursor, &item_key);
 
-    /* The truncate method should be passed either a URI or start/stop cursors,
-       but not both.  So we simply open cursors no matter what to avoid the
-       mess. */
-    if (!args->from_first) {
-        if (!enif_inspect_binary(env, args->start, &start_key)) {
-            enif_mutex_unlock(args->conn_handle->cache_mutex);
-            ASYNC_NIF_REPLY(enif_make_badarg(env));
-            return;
-        }
+    rc = cursor->search(cursor);
+    if (rc == 0 && !__cursor_live(args->cursor_handle, cursor))
+      rc = WT_NOTFOUND;
+    ERL_NIF_TERM reply = __cursor_value_ret(env, cursor, rc);
+    if (!args->scanning)
+      (void)cursor->reset(cursor);
+    ASYNC_NIF_REPLY(reply);
+    __cursor_leave(args->cursor_handle);
+  },
+  { // post
+
+    enif_release_resource((void*)args->cursor_handle);
+  });
+
+/**
+ * Position the cursor at the record matching the key if it exists, or a record
+ * that would be adjacent.
+ *
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    key as an Erlang binary
+ * argv[2]    boolean, when false the cursor will be reset
+ */
+ASYNC_NIF_DECL(
+  wterl_cursor_search_near,
+  { // struct
+
+    WterlCursorHandle *cursor_handle;
+    ERL_NIF_TERM key;
+    int scanning;
+  },
+  { // pre
+
+    static ERL_NIF_TERM ATOM_TRUE = 0;
+    if (ATOM_TRUE == 0)
+        enif_make_atom(env, "true");
+
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_binary(env, argv[1]) &&
+          enif_is_atom(env, argv[2]))) {
+      ASYNC_NIF_RETURN_BADARG();
     }
-    rc = session->open_cursor(session, args->uri, NULL, "raw", &start);
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->scanning = (enif_is_identical(argv[2], ATOM_TRUE)) ? 1 : 0;
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
+  },
+  { // work
+
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
     if (rc != 0) {
-        session->close(session, NULL);
-        enif_mutex_unlock(args->conn_handle->cache_mutex);
         ASYNC_NIF_REPLY(__strerror_term(env, rc));
         return;
     }
-    /* Position the start cursor at the first record or the specified record. */
-    if (args->from_first) {
-        rc = start->next(start);
-        if (rc != 0) {
-            start->close(start);
-            session->close(session, NULL);
-            enif_mutex_unlock(args->conn_handle->cache_mutex);
-            ASYNC_NIF_REPLY(__strerror_term(env, rc));
-            return;
-        }
-    } else {
-        WT_ITEM item_start;
-        item_start.data = start_key.data;
-        item_start.size = start_key.size;
-        start->set_key(start, item_start);
+    ErlNifBinary key;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
+      return;
     }
+    WT_ITEM item_key;
+    int exact = 0;
 
-    if (!args->to_last) {
-        if (!enif_inspect_binary(env, args->stop, &stop_key)) {
-            start->close(start);
-            session->close(session, NULL);
-            enif_mutex_unlock(args->conn_handle->cache_mutex);
-            ASYNC_NIF_REPLY(enif_make_badarg(env));
-            return;
-        }
-    }
-    rc = session->open_cursor(session, args->uri, NULL, "raw", &stop);
+    item_key.data = key.data;
+    item_key.size = key.size;
+    rc = __cursor_search_near(args->cursor_handle, cursor, &item_key, &exact);
     if (rc != 0) {
-        start->close(start);
-        session->close(session, NULL);
-        enif_mutex_unlock(args->conn_handle->cache_mutex);
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
-        return;
-    }
-    /* Position the stop cursor at the last record or the specified record. */
-    if (args->to_last) {
-        rc = stop->prev(stop);
-        if (rc != 0) {
-            start->close(start);
-            stop->close(stop);
-            session->close(session, NULL);
-            enif_mutex_unlock(args->conn_handle->cache_mutex);
-            ASYNC_NIF_REPLY(__strerror_term(env, rc));
-            return;
-        }
-    } else {
-        WT_ITEM item_stop;
-        item_stop.data = stop_key.data;
-        item_stop.size = stop_key.size;
-        stop->set_key(stop, item_stop);
+      (void)cursor->reset(cursor);
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      __cursor_leave(args->cursor_handle);
+      return;
     }
 
-    /* Always pass NULL for URI here because we always specify the range with the
-       start and stop cursors which were opened referencing that URI. */
-    rc = session->truncate(session, NULL, start, stop, (const char*)config.data);
+    if (!args->scanning)
+        (void)cursor->reset(cursor);
 
-    start->close(start);
-    stop->close(stop);
-    session->close(session, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    if (exact == 0) {
+      /* an exact match */
+      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, "match")));
+    } else if (exact < 0) {
+      /* cursor now positioned at the next smaller key */
+      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, "lt")));
+    } else if (exact > 0) {
+      /* cursor now positioned at the next larger key */
+      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, "gt")));
+    }
+    __cursor_leave(args->cursor_handle);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
 /**
- * Upgrade upgrades a file or table, if upgrade is required.
+ * Reset the position of the cursor.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    config string as an Erlang binary
+ * Any resources held by the cursor are released, and the cursor's key and
+ * position are no longer valid. A subsequent iteration with wterl_cursor_next
+ * will move to the first record, or with wterl_cursor_prev will move to the
+ * last record.
+ *
+ * argv[0]    WterlCursorHandle resource
  */
 ASYNC_NIF_DECL(
-  wterl_upgrade,
+  wterl_cursor_reset,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
-    ERL_NIF_TERM config;
+    WterlCursorHandle *cursor_handle;
   },
   { // pre
 
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]))) {
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->conn_handle);
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    /* This call requires that there be no open cursors referencing the object. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_cursors_on(args->conn_handle, args->uri);
-
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
-    }
-
-    /* We create, use and discard a WT_SESSION here because a) we don't need a
-       cursor and b) we don't anticipate doing this operation frequently enough
-       to impact performance. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
     if (rc != 0) {
-        enif_mutex_unlock(args->conn_handle->cache_mutex);
         ASYNC_NIF_REPLY(__strerror_term(env, rc));
         return;
     }
-
-    rc = session->upgrade(session, args->uri, (const char*)config.data);
-    (void)session->close(session, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    rc = cursor->reset(cursor);
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    __cursor_leave(args->cursor_handle);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
 /**
- * Verify reports if a file, or the files of which a table is comprised, have
- * been corrupted.
+ * Insert, or overwrite, a record using a cursor.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    config string as an Erlang binary
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    key as an Erlang binary
+ * argv[2]    value as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_verify,
+  wterl_cursor_insert,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
-    ERL_NIF_TERM config;
+    WterlCursorHandle *cursor_handle;
+    ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+    int rc;
   },
   { // pre
 
     if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_binary(env, argv[1]) &&
           enif_is_binary(env, argv[2]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->conn_handle);
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    /* This call requires that there be no open cursors referencing the object. */
-    enif_mutex_lock(args->conn_handle->cache_mutex);
-    __close_all_sessions(args->conn_handle);
-
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      enif_mutex_unlock(args->conn_handle->cache_mutex);
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
-    }
-
-    /* We create, use and discard a WT_SESSION here because a) we don't need a
-       cursor and b) we don't anticipate doing this operation frequently enough
-       to impact performance. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
     if (rc != 0) {
-        enif_mutex_unlock(args->conn_handle->cache_mutex);
         ASYNC_NIF_REPLY(__strerror_term(env, rc));
         return;
     }
+    if (__table_has_side_tables(args->cursor_handle->conn_handle,
+                                args->cursor_handle->ctx->ci[0].uri)) {
+        __cursor_leave(args->cursor_handle);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        return;
+    }
+    ErlNifBinary key;
+    ErlNifBinary value;
+    if (!enif_inspect_binary(env, args->key, &key)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
+      return;
+    }
+    if (!enif_inspect_binary(env, args->value, &value)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
+      return;
+    }
+    WT_ITEM item_key;
+    WT_ITEM item_value;
 
-    rc = session->verify(session, args->uri, (const char*)config.data);
-    (void)session->close(session, NULL);
-    enif_mutex_unlock(args->conn_handle->cache_mutex);
+    item_key.data = key.data;
+    item_key.size = key.size;
+    cursor->set_key(cursor, &item_key);
+    item_value.data = value.data;
+    item_value.size = value.size;
+    cursor->set_value(cursor, &item_value);
+    rc = cursor->insert(cursor);
+    if (rc == 0)
+        rc = cursor->reset(cursor);
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    __cursor_leave(args->cursor_handle);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
 /**
- * Delete a key's value from the specified table or index.
+ * Insert the records of a chunk made by a chunk stream, see
+ * __chunk_finish.  The whole chunk is checked before any record is
+ * inserted.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    key as an Erlang binary
+ * bulk       the cursor is a bulk cursor, which isn't reset between chunks
+ * ht_cursor  the table's hashtree (with segments), or NULL if it has none
+ * ->         0 and the number of records in *count, EINVAL when the chunk
+ *            is malformed, or a WiredTiger error
+ */
+static int
+__chunk_import(WT_CURSOR *cursor, int bulk, WT_CURSOR *ht_cursor, uint32_t segments,
+               const uint8_t *data, size_t size, uint32_t *count)
+{
+    const uint8_t *records = data + CHUNK_HEADER_SIZE;
+    size_t len = size - CHUNK_HEADER_SIZE;
+    uint8_t *buf = NULL;
+    size_t off;
+    uint32_t n = 0;
+    uint32_t i;
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    int rc = 0;
+
+    if (size < CHUNK_HEADER_SIZE || data[0] > CHUNK_SNAPPY)
+        return EINVAL;
+    if (data[0] == CHUNK_SNAPPY) {
+        if (snappy_uncompressed_length((const char *)records, len, &off) != SNAPPY_OK)
+            return EINVAL;
+        if ((buf = enif_alloc(off ? off : 1)) == NULL)
+            return ENOMEM;
+        if (snappy_uncompress((const char *)records, len, (char *)buf, &off) != SNAPPY_OK) {
+            enif_free(buf);
+            return EINVAL;
+        }
+        records = buf;
+        len = off;
+    }
+
+    /* Walk the records once to be sure they are all there. */
+    for (off = 0; off < len; n++) {
+        if (len - off < 4 || len - off - 4 < __get_be32(records + off))
+            break;
+        off += 4 + __get_be32(records + off);
+        if (len - off < 4 || len - off - 4 < __get_be32(records + off))
+            break;
+        off += 4 + __get_be32(records + off);
+    }
+    if (off != len || n != __get_be32(data + 1)) {
+        enif_free(buf);
+        return EINVAL;
+    }
+
+    for (off = 0, i = 0; i < n; i++) {
+        item_key.size = __get_be32(records + off);
+        item_key.data = records + off + 4;
+        off += 4 + item_key.size;
+        item_value.size = __get_be32(records + off);
+        item_value.data = records + off + 4;
+        off += 4 + item_value.size;
+        if (ht_cursor) {
+            rc = __ht_write(cursor->session, cursor, ht_cursor, segments,
+                            &item_key, &item_value);
+        } else {
+            cursor->set_key(cursor, &item_key);
+            cursor->set_value(cursor, &item_value);
+            rc = cursor->insert(cursor);
+        }
+        if (rc != 0)
+            break;
+    }
+    if (rc == 0 && !bulk)
+        rc = cursor->reset(cursor);
+    enif_free(buf);
+    *count = n;
+    return rc;
+}
+
+/**
+ * Insert the records of a chunk, as sent by stream_range with {items,
+ * chunk}, using a cursor.  When the cursor was opened with bulk=true on an
+ * empty table the records are loaded directly into the table's pages.
+ *
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    the chunk as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_delete,
+  wterl_cursor_import,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
-    ERL_NIF_TERM key;
+    WterlCursorHandle *cursor_handle;
+    ERL_NIF_TERM chunk;
   },
   { // pre
 
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_binary(env, argv[1]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->conn_handle);
-    //affinity = __str_hash(0, args->uri, __strlen(args->uri));
+    args->chunk = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    ErlNifBinary key;
-    if (!enif_inspect_binary(env, args->key, &key)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
     }
-    if (key.size == 0) {
+    ErlNifBinary chunk;
+    if (!enif_inspect_binary(env, args->chunk, &chunk)) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
       return;
     }
-
-    struct wterl_ctx *ctx = NULL;
-    WT_CURSOR *cursor = NULL;
-    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
-                          args->conn_handle->session_config,
-                          args->uri, "overwrite,raw");
-    if (rc != 0) {
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+    /* Into a table with a hashtree each record is written with its hash,
+       through a cursor on the hashtree table in the cursor's session.  A
+       TTL enabled table can only be bulk loaded, and a table with a merge
+       operator not at all, as the expiry times or operands of the keys
+       overwritten would be left behind. */
+    struct wterl_table table;
+    WT_CURSOR *ht_cursor = NULL;
+    const char *uri = args->cursor_handle->ctx->ci[0].uri;
+    int bulk = __bulk_config(args->cursor_handle->ctx->ci[0].config);
+    if (!__table_lookup(args->cursor_handle->conn_handle, uri, &table))
+        memset(&table, 0, sizeof(table));
+    if ((table.ttl || table.merge_op != MERGE_NONE) && !bulk) {
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        __cursor_leave(args->cursor_handle);
         return;
     }
-    cursor = ctx->ci[0].cursor;
-
-    WT_ITEM item_key;
-    item_key.data = key.data;
-    item_key.size = key.size;
-    cursor->set_key(cursor, &item_key);
-    rc = cursor->remove(cursor);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
-    __release_ctx(args->conn_handle, worker_id, ctx);
+    if (table.ht_segments) {
+        Uri ht_uri;
+        WT_SESSION *session = args->cursor_handle->session;
+        rc = __ht_uri(uri, ht_uri);
+        if (rc == 0)
+            rc = session->open_cursor(session, ht_uri, NULL, "overwrite,raw", &ht_cursor);
+        if (rc != 0) {
+          ASYNC_NIF_REPLY(__strerror_term(env, rc));
+          __cursor_leave(args->cursor_handle);
+          return;
+        }
+    }
+    uint32_t count = 0;
+    rc = __chunk_import(cursor, bulk, ht_cursor, ht_cursor ? table.ht_segments : 0,
+                        chunk.data, chunk.size, &count);
+    if (ht_cursor)
+        (void)ht_cursor->close(ht_cursor);
+    if (rc != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      __cursor_leave(args->cursor_handle);
+      return;
+    }
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_uint(env, count)));
+    __cursor_leave(args->cursor_handle);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
 /**
- * Get the value for the key's value from the specified table or index.
+ * Update an existing record using a cursor.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    key as an Erlang binary
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    key as an Erlang binary
+ * argv[2]    value as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_get,
+  wterl_cursor_update,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
+    WterlCursorHandle *cursor_handle;
     ERL_NIF_TERM key;
+    ERL_NIF_TERM value;
+    int rc;
   },
   { // pre
 
     if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_binary(env, argv[1]) &&
           enif_is_binary(env, argv[2]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->conn_handle);
-    //affinity = __str_hash(0, args->uri, __strlen(args->uri));
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    if (__table_has_side_tables(args->cursor_handle->conn_handle,
+                                args->cursor_handle->ctx->ci[0].uri)) {
+        __cursor_leave(args->cursor_handle);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        return;
+    }
     ErlNifBinary key;
+    ErlNifBinary value;
     if (!enif_inspect_binary(env, args->key, &key)) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
       return;
     }
-    if (key.size == 0) {
+    if (!enif_inspect_binary(env, args->value, &value)) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
       return;
     }
-
-    struct wterl_ctx *ctx = NULL;
-    WT_CURSOR *cursor = NULL;
-    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
-                          args->conn_handle->session_config,
-                          args->uri, "overwrite,raw");
-    if (rc != 0) {
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
-        return;
-    }
-    cursor = ctx->ci[0].cursor;
-
     WT_ITEM item_key;
     WT_ITEM item_value;
+
     item_key.data = key.data;
     item_key.size = key.size;
     cursor->set_key(cursor, &item_key);
-    rc = cursor->search(cursor);
-    if (rc != 0) {
-        __release_ctx(args->conn_handle, worker_id, ctx);
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
-        return;
-    }
-
-    rc = cursor->get_value(cursor, &item_value);
-    if (rc != 0) {
-        __release_ctx(args->conn_handle, worker_id, ctx);
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
-        return;
-    }
-
-    ERL_NIF_TERM value;
-    unsigned char *bin = enif_make_new_binary(env, item_value.size, &value);
-    memcpy(bin, item_value.data, item_value.size);
-    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, value));
-    __release_ctx(args->conn_handle, worker_id, ctx);
+    item_value.data = value.data;
+    item_value.size = value.size;
+    cursor->set_value(cursor, &item_value);
+    rc = cursor->update(cursor);
+    if (rc == 0)
+        rc = cursor->reset(cursor);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    __cursor_leave(args->cursor_handle);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
 /**
- * Store a value for the key's value from the specified table or index.
+ * Remove a record using a cursor.
  *
- * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    key as an Erlang binary
- * argv[3]    value as an Erlang binary
+ * argv[0]    WterlCursorHandle resource
+ * argv[1]    key as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_put,
+  wterl_cursor_remove,
   { // struct
 
-    WterlConnHandle *conn_handle;
-    Uri uri;
+    WterlCursorHandle *cursor_handle;
     ERL_NIF_TERM key;
-    ERL_NIF_TERM value;
+    int rc;
   },
   { // pre
 
-    if (!(argc == 4 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]) &&
-          enif_is_binary(env, argv[3]))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
+          enif_is_binary(env, argv[1]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
-    enif_keep_resource((void*)args->conn_handle);
-    //affinity = __str_hash(0, args->uri, __strlen(args->uri));
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    affinity = args->cursor_handle->affinity;
+    enif_keep_resource((void*)args->cursor_handle);
   },
   { // work
 
-    ErlNifBinary key;
-    ErlNifBinary value;
-    if (!enif_inspect_binary(env, args->key, &key)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
+    WT_CURSOR* cursor;
+    int rc = __cursor_enter(args->cursor_handle, &cursor);
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
     }
-    if (!enif_inspect_binary(env, args->value, &value)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
+    if (__table_has_side_tables(args->cursor_handle->conn_handle,
+                                args->cursor_handle->ctx->ci[0].uri)) {
+        __cursor_leave(args->cursor_handle);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+        return;
     }
-    if (key.size == 0 || value.size == 0) {
+    ErlNifBinary key;
+    if (!enif_inspect_binary(env, args->key, &key)) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
+      __cursor_leave(args->cursor_handle);
       return;
     }
-
-    struct wterl_ctx *ctx = NULL;
-    WT_CURSOR *cursor = NULL;
-    int rc = __retain_ctx(args->conn_handle, worker_id, &ctx, 1,
-                          args->conn_handle->session_config,
-                          args->uri, "overwrite,raw");
-    if (rc != 0) {
-        ASYNC_NIF_REPLY(__strerror_term(env, rc));
-        return;
-    }
-    cursor = ctx->ci[0].cursor;
-
     WT_ITEM item_key;
-    WT_ITEM item_value;
+
     item_key.data = key.data;
     item_key.size = key.size;
     cursor->set_key(cursor, &item_key);
-    item_value.data = value.data;
-    item_value.size = value.size;
-    cursor->set_value(cursor, &item_value);
-    rc = cursor->insert(cursor);
-    __release_ctx(args->conn_handle, worker_id, ctx);
+    rc = cursor->remove(cursor);
+    if (rc == 0)
+        rc = cursor->reset(cursor);
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+    __cursor_leave(args->cursor_handle);
   },
   { // post
 
-    enif_release_resource((void*)args->conn_handle);
+    enif_release_resource((void*)args->cursor_handle);
   });
 
+
 /**
- * Open a cursor on a table or index.
+ * Retain a context with one cursor on the uri and start a transaction in
+ * its session that reads the snapshot.  The caller must roll it back
+ * before releasing the context.
+ */
+static int
+__snapshot_begin(WterlSnapshotHandle *snap, uint32_t worker_id,
+                 struct wterl_ctx **ctx, const char *uri, const char *config)
+{
+    WterlConnHandle *conn_handle = snap->conn_handle;
+    char txn_config[64];
+    int rc;
+
+    if (snap->dropped || !conn_handle->conn)
+        return EINVAL;
+    rc = __retain_ctx(conn_handle, worker_id, ctx, 1,
+                      conn_handle->session_config, uri, config);
+    if (rc != 0)
+        return rc;
+    snprintf(txn_config, sizeof(txn_config), "snapshot=%s", snap->name);
+    rc = (*ctx)->session->begin_transaction((*ctx)->session, txn_config);
+    if (rc != 0) {
+        __release_ctx(conn_handle, worker_id, *ctx);
+        *ctx = NULL;
+    }
+    return rc;
+}
+
+/**
+ * Look up each key of a list with the cursor.
+ *
+ * ->   {ok, [{ok, Value} | not_found]} in the order of the keys
+ */
+static ERL_NIF_TERM
+__multi_get(ErlNifEnv *env, WT_CURSOR *cursor, ERL_NIF_TERM keys)
+{
+    ERL_NIF_TERM results = enif_make_list(env, 0);
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM value;
+    ErlNifBinary key;
+    WT_ITEM item_key;
+    WT_ITEM item_value;
+    int rc;
+
+    while (enif_get_list_cell(env, keys, &head, &keys)) {
+        if (!enif_inspect_binary(env, head, &key))
+            return enif_make_badarg(env);
+        item_key.data = key.data;
+        item_key.size = key.size;
+        cursor->set_key(cursor, &item_key);
+        rc = cursor->search(cursor);
+        if (rc == 0)
+            rc = cursor->get_value(cursor, &item_value);
+        if (rc == 0) {
+            memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
+            value = enif_make_tuple2(env, ATOM_OK, value);
+        } else if (rc == WT_NOTFOUND) {
+            value = ATOM_NOT_FOUND;
+        } else {
+            return __strerror_term(env, rc);
+        }
+        results = enif_make_list_cell(env, value, results);
+    }
+    enif_make_reverse_list(env, results, &value);
+    return enif_make_tuple2(env, ATOM_OK, value);
+}
+
+/**
+ * Open a session, run a snapshot operation in it and close it again.
+ * Creating and dropping snapshots is rare enough not to cache sessions.
+ */
+static int
+__snapshot_op(WterlConnHandle *conn_handle, const char *config)
+{
+#ifdef WTERL_NAMED_SNAPSHOTS
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc;
+
+    if (!conn)
+        return EINVAL;
+    if ((rc = conn->open_session(conn, NULL, conn_handle->session_config, &session)) != 0)
+        return rc;
+    rc = session->snapshot(session, config);
+    session->close(session, NULL);
+    return rc;
+#else
+    UNUSED(conn_handle);
+    UNUSED(config);
+    return ENOTSUP;
+#endif
+}
+
+/**
+ * How far back the oldest named snapshot holds history, as the number of
+ * transaction IDs it pins, when WiredTiger reports it.
+ *
+ * ->   1 and *range, or 0 if unknown
+ */
+static int
+__snapshot_pinned_range(WterlConnHandle *conn_handle, int64_t *range)
+{
+#if defined(WTERL_NAMED_SNAPSHOTS) && defined(WT_STAT_CONN_TXN_PINNED_SNAPSHOT_RANGE)
+    WT_CONNECTION *conn = conn_handle->conn;
+    WT_SESSION *session = NULL;
+    WT_CURSOR *cursor = NULL;
+    const char *desc;
+    const char *pvalue;
+    int found = 0;
+
+    if (!conn || conn->open_session(conn, NULL, NULL, &session) != 0)
+        return 0;
+    if (session->open_cursor(session, "statistics:", NULL, "statistics=(fast)", &cursor) == 0) {
+        cursor->set_key(cursor, WT_STAT_CONN_TXN_PINNED_SNAPSHOT_RANGE);
+        if (cursor->search(cursor) == 0 &&
+            cursor->get_value(cursor, &desc, &pvalue, range) == 0)
+            found = 1;
+    }
+    session->close(session, NULL);
+    return found;
+#else
+    UNUSED(conn_handle);
+    UNUSED(range);
+    return 0;
+#endif
+}
+
+/**
+ * Create a named snapshot of the connection's current state.  Cursors and
+ * gets opened against it, on any session or worker, all read the state as
+ * of this moment.  Writers aren't blocked, but the history the snapshot
+ * needs is kept until it is released.
  *
  * argv[0]    WterlConnHandle resource
- * argv[1]    object name URI string
- * argv[2]    config string as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_open,
+  wterl_snapshot_create,
   { // struct
 
     WterlConnHandle *conn_handle;
-    Uri uri;
-    ERL_NIF_TERM config;
   },
   { // pre
 
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
-          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
-          enif_is_binary(env, argv[2]))) {
+    if (!(argc == 1 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
     enif_keep_resource((void*)args->conn_handle);
   },
   { // work
 
-    ErlNifBinary config;
-    if (!enif_inspect_binary(env, args->config, &config)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
-      return;
-    }
-
-    /* We create a separate session here to ensure that operations are thread safe. */
-    WT_CONNECTION *conn = args->conn_handle->conn;
-    WT_SESSION *session = NULL;
-    int rc = conn->open_session(conn, NULL, args->conn_handle->session_config, &session);
-    if (rc != 0) {
-      ASYNC_NIF_REPLY(__strerror_term(env, rc));
-      return;
+    WterlSnapshotHandle *snap = enif_alloc_resource(wterl_snapshot_RESOURCE, sizeof(WterlSnapshotHandle));
+    if (!snap) {
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+        return;
     }
+    memset(snap, 0, sizeof(WterlSnapshotHandle));
+    snprintf(snap->name, sizeof(snap->name), "wterl-%u",
+             __sync_add_and_fetch(&args->conn_handle->next_snapshot, 1));
 
-    WT_CURSOR* cursor;
-    rc = session->open_cursor(session, args->uri, NULL, (config.data[0] != 0) ? (char *)config.data : "raw", &cursor);
+    char config[64];
+    snprintf(config, sizeof(config), "name=%s", snap->name);
+    int rc = __snapshot_op(args->conn_handle, config);
     if (rc != 0) {
-      session->close(session, NULL);
-      ASYNC_NIF_REPLY(__strerror_term(env, rc));
-      return;
-    }
-
-    WterlCursorHandle* cursor_handle = enif_alloc_resource(wterl_cursor_RESOURCE, sizeof(WterlCursorHandle));
-    if (!cursor_handle) {
-      cursor->close(cursor);
-      session->close(session, NULL);
-      ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
-      return;
+        enif_release_resource(snap);
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
     }
-    memset(cursor_handle, 0, sizeof(WterlCursorHandle));
-    cursor_handle->session = session;
-    cursor_handle->cursor = cursor;
-    ERL_NIF_TERM result = enif_make_resource(env, cursor_handle);
-    enif_release_resource(cursor_handle);
+    snap->conn_handle = args->conn_handle;
+    enif_keep_resource((void*)snap->conn_handle);
+    snap->created = time(NULL);
+    ERL_NIF_TERM result = enif_make_resource(env, snap);
+    enif_release_resource(snap);
     ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, result));
   },
   { // post
@@ -1597,595 +8945,692 @@ ASYNC_NIF_DECL(
   });
 
 /**
- * Close a cursor releasing resources it held.
+ * Drop a snapshot, letting WiredTiger discard the history it held.
+ * Cursors already opened against it keep reading it until closed.
  *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlSnapshotHandle resource
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_close,
+  wterl_snapshot_release,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSnapshotHandle *snap;
   },
   { // pre
 
     if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+          enif_get_resource(env, argv[0], wterl_snapshot_RESOURCE, (void**)&args->snap))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    enif_keep_resource((void*)args->snap);
   },
   { // work
 
-    /* Note: session->close() will cause all open cursors in the session to be
-       closed first, so we don't have explicitly to do that here.
-
-       WT_CURSOR *cursor = args->cursor_handle->cursor;
-       rc = cursor->close(cursor);
-     */
-    WT_SESSION *session = args->cursor_handle->session;
-    int rc = session->close(session, NULL);
+    int rc = 0;
+    if (!__sync_lock_test_and_set(&args->snap->dropped, 1)) {
+        char config[64];
+        snprintf(config, sizeof(config), "drop=(names=[%s])", args->snap->name);
+        rc = __snapshot_op(args->snap->conn_handle, config);
+    }
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->snap);
   });
 
-static ERL_NIF_TERM
-__cursor_key_ret(ErlNifEnv *env, WT_CURSOR *cursor, int rc)
-{
-    if (rc == 0) {
-        WT_ITEM item_key;
-        rc = cursor->get_key(cursor, &item_key);
-        if (rc == 0) {
-            ERL_NIF_TERM key;
-            memcpy(enif_make_new_binary(env, item_key.size, &key), item_key.data, item_key.size);
-            return enif_make_tuple2(env, ATOM_OK, key);
-        }
-    }
-    return __strerror_term(env, rc);
-}
-
-static ERL_NIF_TERM
-__cursor_kv_ret(ErlNifEnv *env, WT_CURSOR *cursor, int rc)
-{
-    if (rc == 0) {
-        WT_ITEM item_key, item_value;
-        rc = cursor->get_key(cursor, &item_key);
-        if (rc == 0) {
-            rc = cursor->get_value(cursor, &item_value);
-            if (rc == 0) {
-                ERL_NIF_TERM key, value;
-                memcpy(enif_make_new_binary(env, item_key.size, &key), item_key.data, item_key.size);
-                memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
-                return enif_make_tuple3(env, ATOM_OK, key, value);
-            }
-        }
-    }
-    return __strerror_term(env, rc);
-}
-
-static ERL_NIF_TERM
-__cursor_value_ret(ErlNifEnv* env, WT_CURSOR *cursor, int rc)
-{
-    if (rc == 0) {
-        WT_ITEM item_value;
-        rc = cursor->get_value(cursor, &item_value);
-        if (rc == 0) {
-            ERL_NIF_TERM value;
-            memcpy(enif_make_new_binary(env, item_value.size, &value), item_value.data, item_value.size);
-            return enif_make_tuple2(env, ATOM_OK, value);
-        }
-    }
-    return __strerror_term(env, rc);
-}
-
 /**
- * Use a cursor to fetch the next key/value pair from the table or index.
+ * Report a snapshot's age in seconds and the range of transaction IDs
+ * pinned by named snapshots, or unknown when WiredTiger doesn't track it.
+ * WiredTiger keeps no count of the bytes of history a snapshot holds, so
+ * the range, how many transactions' updates can't be discarded, is the
+ * measure of its cost there is.
  *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlSnapshotHandle resource
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_next,
+  wterl_snapshot_info,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSnapshotHandle *snap;
   },
   { // pre
 
     if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+          enif_get_resource(env, argv[0], wterl_snapshot_RESOURCE, (void**)&args->snap))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    enif_keep_resource((void*)args->snap);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ASYNC_NIF_REPLY(__cursor_kv_ret(env, cursor, cursor->next(cursor)));
+    WterlSnapshotHandle *snap = args->snap;
+    ERL_NIF_TERM info = enif_make_list(env, 0);
+    int64_t range;
+
+    info = enif_make_list_cell(env, enif_make_tuple2(env, enif_make_atom(env, "pinned_range"),
+                                   __snapshot_pinned_range(snap->conn_handle, &range) ?
+                                       enif_make_int64(env, range) :
+                                       enif_make_atom(env, "unknown")), info);
+    info = enif_make_list_cell(env, enif_make_tuple2(env, enif_make_atom(env, "released"),
+                                                     enif_make_atom(env, snap->dropped ? "true" : "false")), info);
+    info = enif_make_list_cell(env, enif_make_tuple2(env, enif_make_atom(env, "age"),
+                                                     enif_make_uint64(env, (uint64_t)(time(NULL) - snap->created))), info);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, info));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->snap);
   });
 
 /**
- * Use a cursor to fetch the next key from the table or index.
+ * Open a cursor that reads a snapshot.  The cursor's session comes from
+ * the context cache as usual and runs a read transaction on the snapshot
+ * until the cursor is closed.
  *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlSnapshotHandle resource
+ * argv[1]    object name URI string
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_next_key,
+  wterl_snapshot_cursor_open,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSnapshotHandle *snap;
+    Uri uri;
   },
   { // pre
 
-    if (!(enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_snapshot_RESOURCE, (void**)&args->snap) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    enif_keep_resource((void*)args->snap);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ASYNC_NIF_REPLY(__cursor_key_ret(env, cursor, cursor->next(cursor)));
+    WterlConnHandle *conn_handle = args->snap->conn_handle;
+    struct wterl_ctx *ctx = NULL;
+    int rc = __snapshot_begin(args->snap, worker_id, &ctx, args->uri, "raw");
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    WterlCursorHandle* cursor_handle = enif_alloc_resource(wterl_cursor_RESOURCE, sizeof(WterlCursorHandle));
+    if (!cursor_handle) {
+        ctx->session->rollback_transaction(ctx->session, NULL);
+        __release_ctx(conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+        return;
+    }
+    memset(cursor_handle, 0, sizeof(WterlCursorHandle));
+    if (!(cursor_handle->mutex = enif_mutex_create("wterl_cursor"))) {
+        enif_release_resource(cursor_handle);
+        ctx->session->rollback_transaction(ctx->session, NULL);
+        __release_ctx(conn_handle, worker_id, ctx);
+        ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+        return;
+    }
+    cursor_handle->conn_handle = conn_handle;
+    enif_keep_resource((void*)conn_handle);
+    cursor_handle->ctx = ctx;
+    cursor_handle->session = ctx->session;
+    cursor_handle->cursor = ctx->ci[0].cursor;
+    cursor_handle->affinity = __next_affinity(conn_handle);
+    cursor_handle->in_txn = 1;
+    __sync_add_and_fetch(&conn_handle->stats.cursors_opened, 1);
+    ERL_NIF_TERM result = enif_make_resource(env, cursor_handle);
+    enif_release_resource(cursor_handle);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, result));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->snap);
   });
 
 /**
- * Use a cursor to fetch the next value from the table or index.
+ * Read several keys from a table as of a snapshot, in one request.
  *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlSnapshotHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    list of keys as Erlang binaries
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_next_value,
+  wterl_snapshot_get,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSnapshotHandle *snap;
+    Uri uri;
+    ERL_NIF_TERM keys;
   },
   { // pre
 
-    if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_snapshot_RESOURCE, (void**)&args->snap) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_list(env, argv[2]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    args->keys = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    enif_keep_resource((void*)args->snap);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ASYNC_NIF_REPLY(__cursor_value_ret(env, cursor, cursor->next(cursor)));
-    DPRINTF("env: %p cursor: %p", env, cursor);
+    struct wterl_ctx *ctx = NULL;
+    int rc = __snapshot_begin(args->snap, worker_id, &ctx, args->uri, "overwrite,raw");
+    if (rc != 0) {
+        ASYNC_NIF_REPLY(__strerror_term(env, rc));
+        return;
+    }
+    ERL_NIF_TERM reply = __multi_get(env, ctx->ci[0].cursor, args->keys);
+    ctx->session->rollback_transaction(ctx->session, NULL);
+    __release_ctx(args->snap->conn_handle, worker_id, ctx);
+    ASYNC_NIF_REPLY(reply);
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->snap);
   });
 
 /**
- * Use a cursor to fetch the previous key/value pair from the table or index.
- *
- * argv[0]    WterlCursorHandle resource
+ * Is the calling process the one that opened the session?  Sessions are
+ * single threaded so only their owner may use them.
  */
-ASYNC_NIF_DECL(
-  wterl_cursor_prev,
-  { // struct
-
-    WterlCursorHandle *cursor_handle;
-  },
-  { // pre
+static int
+__session_owner(ErlNifEnv *env, WterlSessionHandle *session_handle)
+{
+    ErlNifPid self;
 
-    if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
-      ASYNC_NIF_RETURN_BADARG();
-    }
-    enif_keep_resource((void*)args->cursor_handle);
-  },
-  { // work
+    enif_self(env, &self);
+    return enif_is_identical(enif_make_pid(env, &self),
+                             enif_make_pid(env, &session_handle->owner));
+}
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ASYNC_NIF_REPLY(__cursor_kv_ret(env, cursor, cursor->prev(cursor)));
-  },
-  { // post
+/**
+ * Find, or open, the "overwrite,raw" cursor for a table within an explicit
+ * session.  Cursors remain open until the session is closed.
+ */
+static int
+__session_cursor(WterlSessionHandle *session_handle, const char *uri, WT_CURSOR **cursor)
+{
+    uint32_t i;
+    int rc;
 
-    enif_release_resource((void*)args->cursor_handle);
-  });
+    for (i = 0; i < session_handle->num_cursors; i++) {
+        if (!strcmp(session_handle->sc[i].uri, uri)) {
+            *cursor = session_handle->sc[i].cursor;
+            return 0;
+        }
+    }
+    if (session_handle->num_cursors == MAX_CTX_CURSORS)
+        return EMFILE;
+    WT_SESSION *session = session_handle->session;
+    rc = session->open_cursor(session, uri, NULL, "overwrite,raw", cursor);
+    if (rc != 0)
+        return rc;
+    i = session_handle->num_cursors++;
+    strncpy(session_handle->sc[i].uri, uri, sizeof(Uri) - 1);
+    session_handle->sc[i].cursor = *cursor;
+    return 0;
+}
 
 /**
- * Use a cursor to fetch the previous key from the table or index.
+ * Open an explicit session, owned by the calling process, used to group
+ * operations into transactions.  All operations on the session are sent to
+ * the same work queue.
  *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlConnHandle resource
+ * argv[1]    session config string as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_prev_key,
+  wterl_session_open,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlConnHandle *conn_handle;
+    ERL_NIF_TERM config;
+    ErlNifPid owner;
   },
   { // pre
 
-    if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_conn_RESOURCE, (void**)&args->conn_handle) &&
+          enif_is_binary(env, argv[1]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    enif_self(env, &args->owner);
+    enif_keep_resource((void*)args->conn_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ASYNC_NIF_REPLY(__cursor_key_ret(env, cursor, cursor->prev(cursor)));
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+
+    WT_CONNECTION *conn = args->conn_handle->conn;
+    WT_SESSION *session = NULL;
+    int rc = conn->open_session(conn, NULL,
+                                (config.size > 1) ? (const char *)config.data : args->conn_handle->session_config,
+                                &session);
+    if (rc != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      return;
+    }
+
+    WterlSessionHandle *session_handle = enif_alloc_resource(wterl_session_RESOURCE, sizeof(WterlSessionHandle));
+    if (!session_handle) {
+      session->close(session, NULL);
+      ASYNC_NIF_REPLY(__strerror_term(env, ENOMEM));
+      return;
+    }
+    memset(session_handle, 0, sizeof(WterlSessionHandle));
+    session_handle->conn_handle = args->conn_handle;
+    enif_keep_resource((void*)args->conn_handle);
+    session_handle->session = session;
+    session_handle->owner = args->owner;
+    session_handle->affinity = __next_affinity(args->conn_handle);
+    ERL_NIF_TERM result = enif_make_resource(env, session_handle);
+    enif_release_resource(session_handle);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, result));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->conn_handle);
   });
 
 /**
- * Use a cursor to fetch the previous value from the table or index.
+ * Close an explicit session, any transaction in progress is rolled back.
  *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlSessionHandle resource
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_prev_value,
+  wterl_session_close,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSessionHandle *session_handle;
   },
   { // pre
 
     if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ASYNC_NIF_REPLY(__cursor_value_ret(env, cursor, cursor->prev(cursor)));
+    WT_SESSION *session = args->session_handle->session;
+    if (!session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+    /* Note: session->close() closes the session's cursors too. */
+    int rc = session->close(session, NULL);
+    args->session_handle->session = NULL;
+    args->session_handle->num_cursors = 0;
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
 /**
- * Position the cursor at the record matching the key.
+ * Begin a transaction on an explicit session.
  *
- * argv[0]    WterlCursorHandle resource
- * argv[1]    key as an Erlang binary
- * argv[2]    boolean, when false the cursor will be reset
+ * Transactions are isolated according to the "isolation" config (or that of
+ * the session) and the "sync" config controls durability at commit time.
+ *
+ * argv[0]    WterlSessionHandle resource
+ * argv[1]    transaction config string as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_search,
+  wterl_txn_begin,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
-    ERL_NIF_TERM key;
-    int scanning;
+    WterlSessionHandle *session_handle;
+    ERL_NIF_TERM config;
   },
   { // pre
 
-    static ERL_NIF_TERM ATOM_TRUE = 0;
-    if (ATOM_TRUE == 0)
-        enif_make_atom(env, "true");
-
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
-          enif_is_binary(env, argv[1]) &&
-          enif_is_atom(env, argv[2]))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle) &&
+          enif_is_binary(env, argv[1]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
-    args->scanning = (enif_is_identical(argv[2], ATOM_TRUE)) ? 1 : 0;
-    enif_keep_resource((void*)args->cursor_handle);
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ErlNifBinary key;
-    if (!enif_inspect_binary(env, args->key, &key)) {
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
       return;
     }
-
-    WT_ITEM item_key;
-    item_key.data = key.data;
-    item_key.size = key.size;
-    cursor->set_key(cursor, &item_key);
-
-    ERL_NIF_TERM reply = __cursor_value_ret(env, cursor, cursor->search(cursor));
-    if (!args->scanning)
-      (void)cursor->reset(cursor);
-    ASYNC_NIF_REPLY(reply);
+    WT_SESSION *session = args->session_handle->session;
+    if (!session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+    int rc = session->begin_transaction(session, (config.size > 1) ? (const char *)config.data : NULL);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
 /**
- * Position the cursor at the record matching the key if it exists, or a record
- * that would be adjacent.
+ * Commit the transaction in progress on an explicit session.
  *
- * argv[0]    WterlCursorHandle resource
- * argv[1]    key as an Erlang binary
- * argv[2]    boolean, when false the cursor will be reset
+ * argv[0]    WterlSessionHandle resource
+ * argv[1]    transaction config string as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_search_near,
+  wterl_txn_commit,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
-    ERL_NIF_TERM key;
-    int scanning;
+    WterlSessionHandle *session_handle;
+    ERL_NIF_TERM config;
   },
   { // pre
 
-    static ERL_NIF_TERM ATOM_TRUE = 0;
-    if (ATOM_TRUE == 0)
-        enif_make_atom(env, "true");
-
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
-          enif_is_binary(env, argv[1]) &&
-          enif_is_atom(env, argv[2]))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle) &&
+          enif_is_binary(env, argv[1]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
-    args->scanning = (enif_is_identical(argv[2], ATOM_TRUE)) ? 1 : 0;
-    enif_keep_resource((void*)args->cursor_handle);
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    ErlNifBinary key;
-    if (!enif_inspect_binary(env, args->key, &key)) {
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
       return;
     }
-    WT_ITEM item_key;
-    int exact = 0;
-
-    item_key.data = key.data;
-    item_key.size = key.size;
-    cursor->set_key(cursor, &item_key);
-
-    int rc = cursor->search_near(cursor, &exact);
-    if (rc != 0) {
-      (void)cursor->reset(cursor);
-      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+    WT_SESSION *session = args->session_handle->session;
+    if (!session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
       return;
     }
-
-    if (!args->scanning)
-        (void)cursor->reset(cursor);
-
-    if (exact == 0) {
-      /* an exact match */
-      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, "match")));
-    } else if (exact < 0) {
-      /* cursor now positioned at the next smaller key */
-      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, "lt")));
-    } else if (exact > 0) {
-      /* cursor now positioned at the next larger key */
-      ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, enif_make_atom(env, "gt")));
-    }
+    int rc = session->commit_transaction(session, (config.size > 1) ? (const char *)config.data : NULL);
+    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
 /**
- * Reset the position of the cursor.
+ * Roll back the transaction in progress on an explicit session.
  *
- * Any resources held by the cursor are released, and the cursor's key and
- * position are no longer valid. A subsequent iteration with wterl_cursor_next
- * will move to the first record, or with wterl_cursor_prev will move to the
- * last record.
- *
- * argv[0]    WterlCursorHandle resource
+ * argv[0]    WterlSessionHandle resource
+ * argv[1]    transaction config string as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_reset,
+  wterl_txn_abort,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSessionHandle *session_handle;
+    ERL_NIF_TERM config;
   },
   { // pre
 
-    if (!(argc == 1 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle))) {
+    if (!(argc == 2 &&
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle) &&
+          enif_is_binary(env, argv[1]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    enif_keep_resource((void*)args->cursor_handle);
+    args->config = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
-    int rc = cursor->reset(cursor);
+    ErlNifBinary config;
+    if (!enif_inspect_binary(env, args->config, &config)) {
+      ASYNC_NIF_REPLY(enif_make_badarg(env));
+      return;
+    }
+    WT_SESSION *session = args->session_handle->session;
+    if (!session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+    int rc = session->rollback_transaction(session, (config.size > 1) ? (const char *)config.data : NULL);
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
 /**
- * Insert, or overwrite, a record using a cursor.
+ * Get a value using an explicit session, within its transaction if one has
+ * been started.
  *
- * argv[0]    WterlCursorHandle resource
- * argv[1]    key as an Erlang binary
- * argv[2]    value as an Erlang binary
+ * argv[0]    WterlSessionHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_insert,
+  wterl_session_get,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSessionHandle *session_handle;
+    Uri uri;
     ERL_NIF_TERM key;
-    ERL_NIF_TERM value;
-    int rc;
   },
   { // pre
 
     if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
-          enif_is_binary(env, argv[1]) &&
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
           enif_is_binary(env, argv[2]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
-    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->cursor_handle);
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
     ErlNifBinary key;
-    ErlNifBinary value;
-    if (!enif_inspect_binary(env, args->key, &key)) {
+    if (!enif_inspect_binary(env, args->key, &key) || key.size == 0) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
       return;
     }
-    if (!enif_inspect_binary(env, args->value, &value)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
+    if (!args->session_handle->session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+
+    WT_CURSOR *cursor = NULL;
+    int rc = __session_cursor(args->session_handle, args->uri, &cursor);
+    if (rc != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
       return;
     }
+
     WT_ITEM item_key;
     WT_ITEM item_value;
-
     item_key.data = key.data;
     item_key.size = key.size;
     cursor->set_key(cursor, &item_key);
-    item_value.data = value.data;
-    item_value.size = value.size;
-    cursor->set_value(cursor, &item_value);
-    int rc = cursor->insert(cursor);
+    rc = cursor->search(cursor);
     if (rc == 0)
-        rc = cursor->reset(cursor);
-    ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
+      rc = cursor->get_value(cursor, &item_value);
+    if (rc != 0) {
+      (void)cursor->reset(cursor);
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      return;
+    }
+
+    ERL_NIF_TERM value;
+    unsigned char *bin = enif_make_new_binary(env, item_value.size, &value);
+    memcpy(bin, item_value.data, item_value.size);
+    (void)cursor->reset(cursor);
+    ASYNC_NIF_REPLY(enif_make_tuple2(env, ATOM_OK, value));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
 /**
- * Update an existing record using a cursor.
+ * Store a value using an explicit session, within its transaction if one
+ * has been started.
  *
- * argv[0]    WterlCursorHandle resource
- * argv[1]    key as an Erlang binary
- * argv[2]    value as an Erlang binary
+ * argv[0]    WterlSessionHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
+ * argv[3]    value as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_update,
+  wterl_session_put,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSessionHandle *session_handle;
+    Uri uri;
     ERL_NIF_TERM key;
     ERL_NIF_TERM value;
-    int rc;
   },
   { // pre
 
-    if (!(argc == 3 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
-          enif_is_binary(env, argv[1]) &&
-          enif_is_binary(env, argv[2]))) {
+    if (!(argc == 4 &&
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]) &&
+          enif_is_binary(env, argv[3]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
-    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
-    enif_keep_resource((void*)args->cursor_handle);
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    args->value = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[3]);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
     ErlNifBinary key;
     ErlNifBinary value;
-    if (!enif_inspect_binary(env, args->key, &key)) {
+    if (!enif_inspect_binary(env, args->key, &key) ||
+        !enif_inspect_binary(env, args->value, &value) ||
+        key.size == 0 || value.size == 0) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
       return;
     }
-    if (!enif_inspect_binary(env, args->value, &value)) {
-      ASYNC_NIF_REPLY(enif_make_badarg(env));
+    if (!args->session_handle->session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+
+    if (__table_has_side_tables(args->session_handle->conn_handle, args->uri)) {
+      ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+      return;
+    }
+
+    WT_CURSOR *cursor = NULL;
+    int rc = __session_cursor(args->session_handle, args->uri, &cursor);
+    if (rc != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
       return;
     }
+
     WT_ITEM item_key;
     WT_ITEM item_value;
-
     item_key.data = key.data;
     item_key.size = key.size;
     cursor->set_key(cursor, &item_key);
     item_value.data = value.data;
     item_value.size = value.size;
     cursor->set_value(cursor, &item_value);
-    int rc = cursor->update(cursor);
-    if (rc == 0)
-        rc = cursor->reset(cursor);
+    rc = cursor->insert(cursor);
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
 /**
- * Remove a record using a cursor.
+ * Delete a key using an explicit session, within its transaction if one has
+ * been started.
  *
- * argv[0]    WterlCursorHandle resource
- * argv[1]    key as an Erlang binary
+ * argv[0]    WterlSessionHandle resource
+ * argv[1]    object name URI string
+ * argv[2]    key as an Erlang binary
  */
 ASYNC_NIF_DECL(
-  wterl_cursor_remove,
+  wterl_session_delete,
   { // struct
 
-    WterlCursorHandle *cursor_handle;
+    WterlSessionHandle *session_handle;
+    Uri uri;
     ERL_NIF_TERM key;
-    int rc;
   },
   { // pre
 
-    if (!(argc == 2 &&
-          enif_get_resource(env, argv[0], wterl_cursor_RESOURCE, (void**)&args->cursor_handle) &&
-          enif_is_binary(env, argv[1]))) {
+    if (!(argc == 3 &&
+          enif_get_resource(env, argv[0], wterl_session_RESOURCE, (void**)&args->session_handle) &&
+          __session_owner(env, args->session_handle) &&
+          (enif_get_string(env, argv[1], args->uri, sizeof(args->uri), ERL_NIF_LATIN1) > 0) &&
+          enif_is_binary(env, argv[2]))) {
       ASYNC_NIF_RETURN_BADARG();
     }
-    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[1]);
-    enif_keep_resource((void*)args->cursor_handle);
+    args->key = enif_make_copy(ASYNC_NIF_WORK_ENV, argv[2]);
+    affinity = args->session_handle->affinity;
+    enif_keep_resource((void*)args->session_handle);
   },
   { // work
 
-    WT_CURSOR* cursor = args->cursor_handle->cursor;
     ErlNifBinary key;
-    if (!enif_inspect_binary(env, args->key, &key)) {
+    if (!enif_inspect_binary(env, args->key, &key) || key.size == 0) {
       ASYNC_NIF_REPLY(enif_make_badarg(env));
       return;
     }
-    WT_ITEM item_key;
+    if (!args->session_handle->session) {
+      ASYNC_NIF_REPLY(__strerror_term(env, EINVAL));
+      return;
+    }
+
+    if (__table_has_side_tables(args->session_handle->conn_handle, args->uri)) {
+      ASYNC_NIF_REPLY(__strerror_term(env, ENOTSUP));
+      return;
+    }
+
+    WT_CURSOR *cursor = NULL;
+    int rc = __session_cursor(args->session_handle, args->uri, &cursor);
+    if (rc != 0) {
+      ASYNC_NIF_REPLY(__strerror_term(env, rc));
+      return;
+    }
 
+    WT_ITEM item_key;
     item_key.data = key.data;
     item_key.size = key.size;
     cursor->set_key(cursor, &item_key);
-    int rc = cursor->remove(cursor);
-    if (rc == 0)
-        rc = cursor->reset(cursor);
+    rc = cursor->remove(cursor);
     ASYNC_NIF_REPLY(rc == 0 ? ATOM_OK : __strerror_term(env, rc));
   },
   { // post
 
-    enif_release_resource((void*)args->cursor_handle);
+    enif_release_resource((void*)args->session_handle);
   });
 
-
 /**
  * Called by wterl_event_handler to set the pid for message delivery.
  */
@@ -2228,13 +9673,114 @@ static void __wterl_conn_dtor(ErlNifEnv* env, void* obj)
     if (conn_handle->cache_mutex) {
         DPRINTF("conn_handle dtor free'ing (%p)", obj);
         enif_mutex_lock(conn_handle->cache_mutex);
+        __janitor_stop(conn_handle);
         __close_all_sessions(conn_handle);
         conn_handle->conn->close(conn_handle->conn, NULL);
         enif_mutex_unlock(conn_handle->cache_mutex);
         enif_mutex_destroy(conn_handle->cache_mutex);
+        enif_rwlock_destroy(conn_handle->tables_lock);
+        free(conn_handle->drops);
+        free(conn_handle->tables);
+    }
+}
+
+
+/**
+ * Called when an explicit session is free'd, closing the WT_SESSION rolls
+ * back any transaction that was left open.
+ */
+static void __wterl_session_dtor(ErlNifEnv* env, void* obj)
+{
+    UNUSED(env);
+    WterlSessionHandle *session_handle = (WterlSessionHandle *)obj;
+
+    if (session_handle->session && session_handle->conn_handle->conn) {
+        DPRINTF("session_handle dtor closing (%p)", obj);
+        session_handle->session->close(session_handle->session, NULL);
+    }
+    session_handle->session = NULL;
+    if (session_handle->conn_handle)
+        enif_release_resource((void*)session_handle->conn_handle);
+}
+
+static void __wterl_pinned_dtor(ErlNifEnv* env, void* obj)
+{
+    UNUSED(env);
+    WterlPinnedValue *pv = (WterlPinnedValue *)obj;
+    WterlConnHandle *conn_handle = pv->conn_handle;
+
+    if (pv->ctx) {
+        if (conn_handle->conn)
+            __release_ctx(conn_handle, pv->worker_id, pv->ctx);
+        else
+            free(pv->ctx);
+        pv->ctx = NULL;
+    }
+    __sync_sub_and_fetch(&conn_handle->num_pinned, 1);
+    enif_release_resource((void*)conn_handle);
+}
+
+static void __wterl_cursor_dtor(ErlNifEnv* env, void* obj)
+{
+    UNUSED(env);
+    WterlCursorHandle *cursor_handle = (WterlCursorHandle *)obj;
+
+    if (cursor_handle->mutex)
+        enif_mutex_destroy(cursor_handle->mutex);
+    if (!cursor_handle->conn_handle)
+        return;
+    if (cursor_handle->ctx) {
+        __cursor_release(cursor_handle, 0);
+        __sync_add_and_fetch(&cursor_handle->conn_handle->stats.cursors_collected, 1);
+    }
+    enif_release_resource((void*)cursor_handle->conn_handle);
+}
+
+/**
+ * Have the janitor drop a snapshot that was never released, so that its
+ * history isn't held for the life of the connection.  Opening a session
+ * here would do WiredTiger work on the garbage collector's thread.  Past
+ * MAX_LOST_SNAPSHOTS waiting, the rest are held until the connection is
+ * closed.
+ */
+static void __wterl_snapshot_dtor(ErlNifEnv* env, void* obj)
+{
+    UNUSED(env);
+    WterlSnapshotHandle *snap = (WterlSnapshotHandle *)obj;
+    WterlConnHandle *conn_handle = snap->conn_handle;
+
+    if (!conn_handle)
+        return;
+    if (!snap->dropped && conn_handle->conn) {
+        enif_rwlock_rwlock(conn_handle->tables_lock);
+        if (conn_handle->num_lost_snapshots < MAX_LOST_SNAPSHOTS &&
+            __janitor_start(conn_handle) == 0) {
+            snprintf(conn_handle->lost_snapshots[conn_handle->num_lost_snapshots++],
+                     sizeof(conn_handle->lost_snapshots[0]), "%s", snap->name);
+        }
+        enif_rwlock_rwunlock(conn_handle->tables_lock);
     }
+    enif_release_resource((void*)conn_handle);
 }
 
+static void __wterl_stream_dtor(ErlNifEnv* env, void* obj)
+{
+    UNUSED(env);
+    WterlStreamHandle *sh = (WterlStreamHandle *)obj;
+
+    __range_end_free(&sh->end);
+    __filter_free(&sh->filter);
+    if (sh->env)
+        enif_free_env(sh->env);
+    if (sh->cond)
+        enif_cond_destroy(sh->cond);
+    if (sh->mutex)
+        enif_mutex_destroy(sh->mutex);
+    if (sh->cursor_handle) {
+        __stream_detach(sh);
+        enif_release_resource((void*)sh->cursor_handle);
+    }
+}
 
 /**
  * Called as this driver is loaded by the Erlang BEAM runtime triggered by the
@@ -2257,7 +9803,15 @@ on_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
     wterl_conn_RESOURCE = enif_open_resource_type(env, NULL, "wterl_conn_resource",
                                                   __wterl_conn_dtor, flags, NULL);
     wterl_cursor_RESOURCE = enif_open_resource_type(env, NULL, "wterl_cursor_resource",
-                                                    NULL, flags, NULL);
+                                                    __wterl_cursor_dtor, flags, NULL);
+    wterl_session_RESOURCE = enif_open_resource_type(env, NULL, "wterl_session_resource",
+                                                     __wterl_session_dtor, flags, NULL);
+    wterl_pinned_RESOURCE = enif_open_resource_type(env, NULL, "wterl_pinned_resource",
+                                                    __wterl_pinned_dtor, flags, NULL);
+    wterl_stream_RESOURCE = enif_open_resource_type(env, NULL, "wterl_stream_resource",
+                                                    __wterl_stream_dtor, flags, NULL);
+    wterl_snapshot_RESOURCE = enif_open_resource_type(env, NULL, "wterl_snapshot_resource",
+                                                      __wterl_snapshot_dtor, flags, NULL);
 
     ATOM_ERROR = enif_make_atom(env, "error");
     ATOM_OK = enif_make_atom(env, "ok");
@@ -2269,6 +9823,57 @@ on_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
     ATOM_WTERL_VSN = enif_make_atom(env, "wterl_vsn");
     ATOM_WIREDTIGER_VSN = enif_make_atom(env, "wiredtiger_vsn");
     ATOM_MSG_PID = enif_make_atom(env, "message_pid");
+    ATOM_PUT = enif_make_atom(env, "put");
+    ATOM_ZERO_COPY_THRESHOLD = enif_make_atom(env, "zero_copy_threshold");
+    ATOM_DUPLICATE_KEY = enif_make_atom(env, "duplicate_key");
+    ATOM_ROLLBACK = enif_make_atom(env, "rollback");
+    ATOM_MISMATCH = enif_make_atom(env, "mismatch");
+    ATOM_HASH = enif_make_atom(env, "hash");
+    ATOM_TTL_REAP_INTERVAL = enif_make_atom(env, "ttl_reap_interval");
+    ATOM_TTL_REAP_BATCH = enif_make_atom(env, "ttl_reap_batch");
+    ATOM_MERGE_COMPACT_INTERVAL = enif_make_atom(env, "merge_compact_interval");
+    ATOM_SESSION_CACHE_MAX = enif_make_atom(env, "session_cache_max");
+    ATOM_ADD = enif_make_atom(env, "add");
+    ATOM_MAX = enif_make_atom(env, "max");
+    ATOM_APPEND = enif_make_atom(env, "append");
+    ATOM_DONE = enif_make_atom(env, "done");
+    ATOM_NEXT = enif_make_atom(env, "next");
+    ATOM_PREV = enif_make_atom(env, "prev");
+    ATOM_KV = enif_make_atom(env, "kv");
+    ATOM_KEY = enif_make_atom(env, "key");
+    ATOM_VALUE = enif_make_atom(env, "value");
+    ATOM_PREFIX = enif_make_atom(env, "prefix");
+    ATOM_BEFORE = enif_make_atom(env, "before");
+    ATOM_ALL = enif_make_atom(env, "all");
+    ATOM_RANGE = enif_make_atom(env, "range");
+    ATOM_KEY_SIZE = enif_make_atom(env, "key_size");
+    ATOM_VALUE_SIZE = enif_make_atom(env, "value_size");
+    ATOM_ELEMENT = enif_make_atom(env, "element");
+    ATOM_EQ = enif_make_atom(env, "eq");
+    ATOM_NE = enif_make_atom(env, "ne");
+    ATOM_LT = enif_make_atom(env, "lt");
+    ATOM_LE = enif_make_atom(env, "le");
+    ATOM_GT = enif_make_atom(env, "gt");
+    ATOM_GE = enif_make_atom(env, "ge");
+    ATOM_AND = enif_make_atom(env, "and");
+    ATOM_OR = enif_make_atom(env, "or");
+    ATOM_NOT = enif_make_atom(env, "not");
+    ATOM_COUNT = enif_make_atom(env, "count");
+    ATOM_KEY_BYTES = enif_make_atom(env, "key_bytes");
+    ATOM_VALUE_BYTES = enif_make_atom(env, "value_bytes");
+    ATOM_MIN_KEY = enif_make_atom(env, "min_key");
+    ATOM_MAX_KEY = enif_make_atom(env, "max_key");
+    ATOM_MORE = enif_make_atom(env, "more");
+    ATOM_DATA = enif_make_atom(env, "data");
+    ATOM_WTERL_STREAM = enif_make_atom(env, "wterl_stream");
+    ATOM_RAW = enif_make_atom(env, "raw");
+    ATOM_SEXT = enif_make_atom(env, "sext");
+    ATOM_OBJECT = enif_make_atom(env, "object");
+    ATOM_CHUNK = enif_make_atom(env, "chunk");
+    ATOM_NONE = enif_make_atom(env, "none");
+    ATOM_SNAPPY = enif_make_atom(env, "snappy");
+    __zlib_crc32_init();
+    ATOM_DELETE = enif_make_atom(env, "delete");
 
     struct wterl_priv_data *priv = malloc(sizeof(struct wterl_priv_data));
     if (!priv)
@@ -2364,30 +9969,63 @@ on_upgrade(ErlNifEnv *env, void **priv_data, void **old_priv_data, ERL_NIF_TERM
 
 static ErlNifFunc nif_funcs[] =
 {
+    {"append_nif", 5, wterl_append},
     {"checkpoint_nif", 3, wterl_checkpoint},
     {"conn_close_nif", 2, wterl_conn_close},
-    {"conn_open_nif", 4, wterl_conn_open},
+    {"conn_open_nif", 5, wterl_conn_open},
+    {"conn_stats_nif", 2, wterl_conn_stats},
+    {"stats_nif", 5, wterl_stats},
+    {"compare_and_swap_nif", 6, wterl_compare_and_swap},
     {"create_nif", 4, wterl_create},
     {"delete_nif", 4, wterl_delete},
     {"drop_nif", 4, wterl_drop},
+    {"drop_deferred_nif", 3, wterl_drop_deferred},
     {"get_nif", 4, wterl_get},
-    {"put_nif", 5, wterl_put},
+    {"merge_nif", 5, wterl_merge},
+    {"modify_nif", 5, wterl_modify},
+    {"put_new_nif", 5, wterl_put_new},
+    {"put_nif", 6, wterl_put},
     {"rename_nif", 5, wterl_rename},
     {"salvage_nif", 4, wterl_salvage},
-    // TODO: {"txn_begin", 3, wterl_txn_begin},
-    // TODO: {"txn_commit", 3, wterl_txn_commit},
-    // TODO: {"txn_abort", 3, wterl_txn_abort},
+    {"set_merge_operator_nif", 4, wterl_set_merge_operator},
+    {"stream_ack_nif", 3, wterl_stream_ack},
+    {"stream_close_nif", 2, wterl_stream_close},
+    {"stream_range_nif", 13, wterl_stream_range},
+    {"aggregate_nif", 7, wterl_aggregate},
+    {"index_join_nif", 8, wterl_index_join},
+    {"distinct_elements_nif", 6, wterl_distinct_elements},
+    {"snapshot_create_nif", 2, wterl_snapshot_create},
+    {"snapshot_release_nif", 2, wterl_snapshot_release},
+    {"snapshot_info_nif", 2, wterl_snapshot_info},
+    {"snapshot_cursor_open_nif", 3, wterl_snapshot_cursor_open},
+    {"snapshot_get_nif", 4, wterl_snapshot_get},
+    {"session_close_nif", 2, wterl_session_close},
+    {"session_delete_nif", 4, wterl_session_delete},
+    {"session_get_nif", 4, wterl_session_get},
+    {"session_open_nif", 3, wterl_session_open},
+    {"session_put_nif", 5, wterl_session_put},
+    {"txn_abort_nif", 3, wterl_txn_abort},
+    {"txn_begin_nif", 3, wterl_txn_begin},
+    {"txn_commit_nif", 3, wterl_txn_commit},
     {"truncate_nif", 6, wterl_truncate},
+    {"ttl_enable_nif", 3, wterl_ttl_enable},
+    {"hashtree_enable_nif", 5, wterl_hashtree_enable},
+    {"hashtree_rebuild_nif", 3, wterl_hashtree_rebuild},
+    {"hashtree_bucket_nif", 5, wterl_hashtree_bucket},
+    {"hashtree_key_hashes_nif", 4, wterl_hashtree_key_hashes},
     {"upgrade_nif", 4, wterl_upgrade},
     {"verify_nif", 4, wterl_verify},
+    {"write_batch_nif", 3, wterl_write_batch},
     // TODO: {"cursor_get_key_nif", 2, wterl_cursor_get_key},
     // TODO: {"cursor_get_value_nif", 2, wterl_cursor_get_value},
     // TODO: {"cursor_get_nif", 2, wterl_cursor_get},
     // TODO: {"cursor_set_key_nif", 2, wterl_cursor_set_key},
     // TODO: {"cursor_set_value_nif", 2, wterl_cursor_set_value},
     // TODO: {"cursor_set_nif", 2, wterl_cursor_set},
+    {"cursor_batch_nif", 7, wterl_cursor_batch},
     {"cursor_close_nif", 2, wterl_cursor_close},
     {"cursor_insert_nif", 4, wterl_cursor_insert},
+    {"cursor_import_nif", 3, wterl_cursor_import},
     {"cursor_next_key_nif", 2, wterl_cursor_next_key},
     {"cursor_next_nif", 2, wterl_cursor_next},
     {"cursor_next_value_nif", 2, wterl_cursor_next_value},
@@ -2401,6 +10039,9 @@ static ErlNifFunc nif_funcs[] =
     {"cursor_search_nif", 4, wterl_cursor_search},
     {"cursor_update_nif", 4, wterl_cursor_update},
     {"set_event_handler_pid", 1, wterl_set_event_handler_pid},
+    {"sext_encode", 1, wterl_sext_encode},
+    {"sext_prefix", 1, wterl_sext_prefix},
+    {"sext_decode", 1, wterl_sext_decode},
 };
 
 ERL_NIF_INIT(wterl, nif_funcs, &on_load, &on_reload, &on_upgrade, &on_unload);
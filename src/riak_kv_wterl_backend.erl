@@ -34,6 +34,12 @@
          put/5,
          delete/4,
          drop/1,
+         drop_bucket/2,
+         hashtree_rebuild/1,
+         hashtree_bucket/3,
+         hashtree_key_hashes/2,
+         handoff_export/2,
+         handoff_import_open/2,
          fold_buckets/4,
          fold_keys/4,
          fold_objects/4,
@@ -47,13 +53,30 @@
 -endif.
 
 -define(API_VERSION, 1).
-%% TODO: for when this backend supports 2i
-%%-define(CAPABILITIES, [async_fold, indexes]).
--define(CAPABILITIES, [async_fold]).
+-define(CAPABILITIES, [async_fold, indexes]).
 
+%% The value of an entry in the <<bucket/key>> index, which is all key.
+-define(BUCKET_INDEX_VALUE, <<0>>).
+
+%% The key of the table_per_bucket setting in the meta table.
+-define(LAYOUT_KEY, <<"layout">>).
+
+%% With table_per_bucket each bucket's objects are kept in a table of
+%% their own and `table' is a <<bucket/key>> index of them, so that
+%% folds across buckets and the list of buckets read one table.  With
+%% hashtree the NIF keeps a hashtree of `table' for active anti-entropy.
+%% Its hashes are wterl's own rather than riak_core hashtree's SHA-1, so
+%% it is compared with other wterl backends' trees through
+%% hashtree_bucket/3 and hashtree_key_hashes/2, it doesn't stand in for
+%% riak_kv_index_hashtree.
 -record(state, {table :: string(),
+                index_table :: string(),
                 type :: string(),
-                connection :: wterl:connection()}).
+                connection :: wterl:connection(),
+                table_opts :: config(),
+                table_per_bucket = false :: boolean(),
+                bucket_tables = sets:new(),
+                hashtree = false :: boolean()}).
 
 -type state() :: #state{}.
 -type config() :: [{atom(), term()}].
@@ -132,10 +155,22 @@ start(Partition, Config) ->
                     "table" ->
                         Compressor
                 end,
-            case wterl:create(Connection, Table, TableOpts) of
+            %% Secondary index entries live in their own table so that a
+            %% 2i query seeks straight to its range of the index.
+            IndexTable = Table ++ "-2i",
+            TablePerBucket =
+                app_helper:get_prop_or_env(table_per_bucket, Config, wterl, false),
+            State = #state{table=Table, index_table=IndexTable, type=Type,
+                           connection=Connection, table_opts=TableOpts,
+                           table_per_bucket=(TablePerBucket =:= true)},
+            case create_tables(Connection, [Table, IndexTable], TableOpts) of
                 ok ->
-		    {ok, #state{table=Table, type=Type,
-				connection=Connection}};
+                    case check_layout(State) of
+                        ok ->
+                            enable_hashtree(Config, State);
+                        {error, Reason4} ->
+                            {error, Reason4}
+                    end;
                 {error, Reason3} ->
                     {error, Reason3}
                 end
@@ -151,71 +186,85 @@ stop(_State) ->
                  {ok, any(), state()} |
                  {ok, not_found, state()} |
                  {error, term(), state()}.
-get(Bucket, Key, #state{connection=Connection, table=Table}=State) ->
+get(Bucket, Key, #state{connection=Connection}=State) ->
     WTKey = to_object_key(Bucket, Key),
-    case wterl:get(Connection, Table, WTKey) of
+    case wterl:get(Connection, object_table(Bucket, State), WTKey) of
         {ok, Value} ->
             {ok, Value, State};
         not_found  ->
             {error, not_found, State};
+        {error, {enoent, _}} -> %% a bucket with no table yet
+            {error, not_found, State};
         {error, Reason} ->
             {error, Reason, State}
     end.
 
-%% @doc Insert an object into the wterl backend.
-%% NOTE: The wterl backend does not currently support
-%% secondary indexing and the_IndexSpecs parameter
-%% is ignored.
+%% @doc Insert an object into the wterl backend.  The index entries
+%% added or removed by IndexSpecs are written in the same transaction
+%% as the object.
 -type index_spec() :: {add, Index, SecondaryKey} | {remove, Index, SecondaryKey}.
 -spec put(riak_object:bucket(), riak_object:key(), [index_spec()], binary(), state()) ->
                  {ok, state()} |
                  {error, term(), state()}.
-put(Bucket, PrimaryKey, _IndexSpecs, Val, #state{connection=Connection, table=Table}=State) ->
-    case wterl:put(Connection, Table, to_object_key(Bucket, PrimaryKey), Val) of
-        ok ->
-            {ok, State};
+put(Bucket, PrimaryKey, IndexSpecs, Val, #state{connection=Connection}=State) ->
+    ObjectKey = to_object_key(Bucket, PrimaryKey),
+    case ensure_object_table(Bucket, State) of
+        {ok, State1} ->
+            Ops = [{put, object_table(Bucket, State1), ObjectKey, Val} |
+                   bucket_index_ops(put, ObjectKey, State1) ++
+                       index_ops(Bucket, PrimaryKey, ObjectKey, IndexSpecs, State1)],
+            case write_ops(Connection, Ops) of
+                ok ->
+                    {ok, State1};
+                {error, Reason} ->
+                    {error, Reason, State1}
+            end;
         {error, Reason} ->
             {error, Reason, State}
     end.
 
-%% @doc Delete an object from the wterl backend
-%% NOTE: The wterl backend does not currently support
-%% secondary indexing and the_IndexSpecs parameter
-%% is ignored.
+%% @doc Delete an object, and the index entries IndexSpecs removes, from
+%% the wterl backend in one transaction.
 -spec delete(riak_object:bucket(), riak_object:key(), [index_spec()], state()) ->
                     {ok, state()} |
                     {error, term(), state()}.
-delete(Bucket, Key, _IndexSpecs, #state{connection=Connection, table=Table}=State) ->
-    case wterl:delete(Connection, Table, to_object_key(Bucket, Key)) of
-        ok ->
-            {ok, State};
+delete(Bucket, Key, IndexSpecs, #state{connection=Connection}=State) ->
+    ObjectKey = to_object_key(Bucket, Key),
+    case ensure_object_table(Bucket, State) of
+        {ok, State1} ->
+            Ops = [{delete, object_table(Bucket, State1), ObjectKey} |
+                   bucket_index_ops(delete, ObjectKey, State1) ++
+                       index_ops(Bucket, Key, ObjectKey, IndexSpecs, State1)],
+            case write_ops(Connection, Ops) of
+                ok ->
+                    {ok, State1};
+                {error, Reason} ->
+                    {error, Reason, State1}
+            end;
         {error, Reason} ->
             {error, Reason, State}
     end.
 
-%% @doc Fold over all the buckets
+%% @doc Fold over all the buckets.  The NIF skip-scans the table, seeking
+%% past each bucket's keys, so the work grows with the number of buckets
+%% rather than keys.
 -spec fold_buckets(riak_kv_backend:fold_buckets_fun(),
                    any(),
                    [],
                    state()) -> {ok, any()} | {async, fun()}.
 fold_buckets(FoldBucketsFun, Acc, Opts, #state{connection=Connection, table=Table}) ->
-    FoldFun = fold_buckets_fun(FoldBucketsFun),
+    {Start, End, all} = fold_range_limits(undefined),
     BucketFolder =
         fun() ->
-                case wterl:cursor_open(Connection, Table) of
+                case wterl:distinct_elements(Connection, Table, Start, End, 2) of
+                    {ok, Buckets} ->
+                        lists:foldl(fun(Bucket, Acc0) ->
+                                            FoldBucketsFun(decode_key(Bucket), Acc0)
+                                    end, Acc, Buckets);
                     {error, {enoent, _Message}} ->
                         Acc;
-                    {ok, Cursor} ->
-                        try
-                            {FoldResult, _} =
-                                wterl:fold_keys(Cursor, FoldFun, {Acc, []}),
-                            FoldResult
-                        catch
-                            {break, AccFinal} ->
-                                AccFinal
-                        after
-                            ok = wterl:cursor_close(Cursor)
-                        end
+                    {error, _}=E ->
+                        E
                 end
         end,
     case lists:member(async_fold, Opts) of
@@ -225,12 +274,17 @@ fold_buckets(FoldBucketsFun, Acc, Opts, #state{connection=Connection, table=Tabl
             {ok, BucketFolder()}
     end.
 
-%% @doc Fold over all the keys for one or all buckets.
+%% @doc Fold over all the keys for one or all buckets, or over the keys
+%% matching a 2i query.  Index queries also take the options
+%% `{return_terms, true}' to fold over `{Term, Key}' rather than keys,
+%% `{continuation, Last}' to resume after the last key (or `{Term, Key}',
+%% which range queries need) returned by an earlier page and
+%% `{max_results, N}' to stop after N.
 -spec fold_keys(riak_kv_backend:fold_keys_fun(),
                 any(),
                 [{atom(), term()}],
                 state()) -> {ok, term()} | {async, fun()}.
-fold_keys(FoldKeysFun, Acc, Opts, #state{connection=Connection, table=Table}) ->
+fold_keys(FoldKeysFun, Acc, Opts, #state{connection=Connection}=State) ->
     %% Figure out how we should limit the fold: by bucket, by
     %% secondary index, or neither (fold across everything.)
     Bucket = lists:keyfind(bucket, 1, Opts),
@@ -244,21 +298,21 @@ fold_keys(FoldKeysFun, Acc, Opts, #state{connection=Connection, table=Table}) ->
         end,
 
     %% Set up the fold...
-    FoldFun = fold_keys_fun(FoldKeysFun, Limiter),
+    FoldFun = fold_keys_fun(FoldKeysFun, Limiter,
+                            proplists:get_bool(return_terms, Opts)),
+    Range = continue_range(fold_range_limits(Limiter), Limiter,
+                           proplists:get_value(continuation, Opts)),
+    Table = fold_table(Limiter, State),
     KeyFolder =
-        fun() ->
-                case wterl:cursor_open(Connection, Table) of
-                    {error, {enoent, _Message}} ->
-                        Acc;
-                    {ok, Cursor} ->
-                        try
-                            wterl:fold_keys(Cursor, FoldFun, Acc)
-                        catch
-                            {break, AccFinal} ->
-                                AccFinal
-                        after
-                            ok = wterl:cursor_close(Cursor)
-                        end
+        case proplists:get_value(max_results, Opts) of
+            undefined ->
+                fun() ->
+                        range_fold(Connection, Table, Range, key, FoldFun, Acc)
+                end;
+            MaxResults ->
+                fun() ->
+                        limited_range_fold(Connection, Table, Range, key,
+                                           FoldFun, Acc, MaxResults)
                 end
         end,
     case lists:member(async_fold, Opts) of
@@ -268,35 +322,38 @@ fold_keys(FoldKeysFun, Acc, Opts, #state{connection=Connection, table=Table}) ->
             {ok, KeyFolder()}
     end.
 
-%% @doc Fold over all the objects for one or all buckets.
+%% @doc Fold over all the objects for one or all buckets, or over the
+%% objects matching a 2i query, which are read by joining their index
+%% entries to the objects in the NIF.
 -spec fold_objects(riak_kv_backend:fold_objects_fun(),
                    any(),
                    [{atom(), term()}],
                    state()) -> {ok, any()} | {async, fun()}.
-fold_objects(FoldObjectsFun, Acc, Opts, #state{connection=Connection, table=Table}) ->
+fold_objects(FoldObjectsFun, Acc, Opts, #state{connection=Connection,
+                                               index_table=IndexTable}=State) ->
     Bucket =  proplists:get_value(bucket, Opts),
-    FoldFun = fold_objects_fun(FoldObjectsFun, Bucket),
+    Index = lists:keyfind(index, 1, Opts),
+    Limiter =
+        if Index /= false     -> Index;
+           Bucket /= undefined -> {bucket, Bucket};
+           true               -> undefined
+        end,
+    Range = fold_range_limits(Limiter),
     ObjectFolder =
-        fun() ->
-                case wterl:cursor_open(Connection, Table) of
-                    {error, {enoent, _Message}} ->
-                        Acc;
-                    {ok, Cursor} ->
-                        try
-                            wterl:fold(Cursor, FoldFun, Acc)
-                        catch
-                            {break, AccFinal} ->
-                                AccFinal
-                        after
-                            case wterl:cursor_close(Cursor) of
-                                ok ->
-                                    ok;
-                                {error, {eperm, _}} -> %% TODO: review/fix
-                                    ok;
-                                {error, _}=E ->
-                                    E
-                            end
-                        end
+        case {fold_table(Limiter, State), limiter_bucket(Limiter)} of
+            {IndexTable, FilterBucket} ->
+                fun() ->
+                        index_fold(Connection, IndexTable, object_table(FilterBucket, State),
+                                   Range, FoldObjectsFun, Acc)
+                end;
+            {_, undefined} when State#state.table_per_bucket ->
+                fun() ->
+                        fold_bucket_tables(FoldObjectsFun, Acc, State)
+                end;
+            {_, FilterBucket} ->
+                fun() ->
+                        range_fold(Connection, object_table(FilterBucket, State), Range, kv,
+                                   fold_objects_fun(FoldObjectsFun), Acc)
                 end
         end,
     case lists:member(async_fold, Opts) of
@@ -306,59 +363,146 @@ fold_objects(FoldObjectsFun, Acc, Opts, #state{connection=Connection, table=Tabl
             {ok, ObjectFolder()}
     end.
 
-%% @doc Delete all objects from this wterl backend
+%% @doc Delete all objects from this wterl backend.  The tables are
+%% dropped in the background (see wterl:drop_deferred/2) so this returns
+%% at once, even while folds still have them open.
 -spec drop(state()) -> {ok, state()} | {error, term(), state()}.
-drop(#state{connection=Connection, table=Table}=State) ->
-    case wterl:drop(Connection, Table) of
+drop(#state{connection=Connection, table=Table, index_table=IndexTable}=State) ->
+    %% wterl drops the table's hashtree with it.
+    case drop_tables(Connection, bucket_tables(State) ++ [Table, IndexTable, meta_table(Table)]) of
         ok ->
-            {ok, State};
-        {error, {ebusy, _}} -> %% TODO: review/fix
-            {ok, State};
+            {ok, State#state{bucket_tables=sets:new()}};
         Error ->
             {error, Error, State}
     end.
 
+%% @doc Delete all the objects in a bucket, and their index entries.
+%% With table_per_bucket the bucket's table is dropped, otherwise its
+%% range of the table is truncated.
+-spec drop_bucket(riak_object:bucket(), state()) -> {ok, state()} | {error, term(), state()}.
+drop_bucket(Bucket, #state{connection=Connection, table=Table, index_table=IndexTable,
+                           bucket_tables=BucketTables}=State) ->
+    DropObjects =
+        case State#state.table_per_bucket of
+            true ->
+                drop_tables(Connection, [object_table(Bucket, State)]);
+            false ->
+                ok
+        end,
+    Truncated =
+        case DropObjects of
+            ok ->
+                truncate_prefixes(Connection,
+                                  [{Table, prefix_key({o, Bucket, '_'})},
+                                   {IndexTable, prefix_key({i, Bucket, '_', '_', '_'})}]);
+            _ ->
+                DropObjects
+        end,
+    State1 = State#state{bucket_tables=sets:del_element(object_table(Bucket, State),
+                                                        BucketTables)},
+    %% wterl:truncate/4 removes the keys' hashes from the hashtree too.
+    case Truncated of
+        ok ->
+            {ok, State1};
+        {error, Reason} ->
+            {error, Reason, State1};
+        Error ->
+            {error, Error, State1}
+    end.
+
+%% @doc Bring the hashtree of this backend's objects up to date with them,
+%% needed once after enabling it on a backend that already held objects.
+-spec hashtree_rebuild(state()) -> ok | {error, term()}.
+hashtree_rebuild(#state{connection=Connection, table=Table, hashtree=true}) ->
+    wterl:hashtree_rebuild(Connection, Table);
+hashtree_rebuild(#state{}) ->
+    {error, hashtree_disabled}.
+
+%% @doc Return the hashes of the children of a node of the hashtree, see
+%% wterl:hashtree_bucket/4.
+-spec hashtree_bucket(pos_integer(), non_neg_integer(), state()) ->
+                             {ok, [{non_neg_integer(), non_neg_integer()}]} | {error, term()}.
+hashtree_bucket(Level, Bucket, #state{connection=Connection, table=Table, hashtree=true}) ->
+    wterl:hashtree_bucket(Connection, Table, Level, Bucket);
+hashtree_bucket(_Level, _Bucket, #state{}) ->
+    {error, hashtree_disabled}.
+
+%% @doc Return the {{Bucket, Key}, Hash} of each object in a segment of the
+%% hashtree.
+-spec hashtree_key_hashes(non_neg_integer(), state()) ->
+                                 {ok, [{{riak_object:bucket(), riak_object:key()}, non_neg_integer()}]} |
+                                 {error, term()}.
+hashtree_key_hashes(Segment, #state{connection=Connection, table=Table, hashtree=true}) ->
+    case wterl:hashtree_key_hashes(Connection, Table, Segment) of
+        {ok, KeyHashes} ->
+            {ok, [{from_object_key(K), H} || {K, H} <- KeyHashes]};
+        {error, _}=E ->
+            E
+    end;
+hashtree_key_hashes(_Segment, #state{}) ->
+    {error, hashtree_disabled}.
+
+%% @doc Start streaming this backend's object and index tables as chunks,
+%% see wterl:export_table/3, to move a partition in a few thousand
+%% messages rather than a fold and a put per object.  The receiver loads
+%% each table with handoff_import_open/2 and wterl:import_chunk/2, which
+%% keeps its hashtree up to date.
+-spec handoff_export(config(), state()) -> {ok, [{string(), wterl:stream()}]} | {error, term()}.
+handoff_export(_Options, #state{table_per_bucket=true}) ->
+    {error, table_per_bucket};
+handoff_export(Options, #state{connection=Connection, table=Table, index_table=IndexTable}) ->
+    handoff_export(Connection, [Table, IndexTable], Options, []).
+
+%% @private
+handoff_export(_Connection, [], _Options, Acc) ->
+    {ok, lists:reverse(Acc)};
+handoff_export(Connection, [Table | Tables], Options, Acc) ->
+    case wterl:export_table(Connection, Table, Options) of
+        {ok, Stream} ->
+            handoff_export(Connection, Tables, Options, [{Table, Stream} | Acc]);
+        Error ->
+            [wterl:stream_close(S) || {_, S} <- Acc],
+            Error
+    end.
+
+%% @doc Open a cursor to import chunks from handoff_export/2 into one of
+%% this backend's tables, see wterl:import_open/2.
+-spec handoff_import_open(string(), state()) -> {ok, wterl:cursor()} | {error, term()}.
+handoff_import_open(Table, #state{connection=Connection, table=Table}) ->
+    wterl:import_open(Connection, Table);
+handoff_import_open(Table, #state{connection=Connection, index_table=Table}) ->
+    wterl:import_open(Connection, Table);
+handoff_import_open(_Table, #state{}) ->
+    {error, badarg}.
+
 %% @doc Returns true if this wterl backend contains any
 %% non-tombstone values; otherwise returns false.
 -spec is_empty(state()) -> boolean().
 is_empty(#state{connection=Connection, table=Table}) ->
-    case wterl:cursor_open(Connection, Table) of
-        {ok, Cursor} ->
-	    IsEmpty =
-		case wterl:cursor_next(Cursor) of
-		    not_found ->
-			true;
-		    {error, {eperm, _}} ->
-			false; % TODO: review/fix this logic
-		    _ ->
-			false
-		end,
-	    wterl:cursor_close(Cursor),
-	    IsEmpty;
-        {error, Reason2} ->
-            {error, Reason2}
-    end.
+    wterl:is_empty(Connection, Table).
 
-%% @doc Get the status information for this wterl backend
+%% @doc Get the status information for this wterl backend: the cheap
+%% subset of WiredTiger's statistics (cache, eviction, LSM merges and
+%% checkpoints) for the connection and this vnode's tables (each bucket's
+%% with table_per_bucket), and wterl's own session and cursor counters.
 -spec status(state()) -> [{atom(), term()}].
-status(#state{connection=Connection, table=Table}) ->
-    [].
-%%     case wterl:cursor_open(Connection, "statistics:" ++ Table, [{statistics_fast, true}]) of
-%%         {ok, Cursor} ->
-%% 	    TheStats =
-%% 		case fetch_status(Cursor) of
-%% 		    {ok, Stats} ->
-%% 			Stats;
-%% 		    {error, {eperm, _}} -> % TODO: review/fix this logic
-%% 			{ok, []};
-%% 		    _ ->
-%% 			{ok, []}
-%% 		end,
-%% 	    wterl:cursor_close(Cursor),
-%% 	    TheStats;
-%%         {error, Reason2} ->
-%%             {error, Reason2}
-%%    end.
+status(#state{connection=Connection, table=Table, index_table=IndexTable}=State) ->
+    Stats = fun(Uri) ->
+                    case wterl:stats(Connection, Uri, [fast]) of
+                        {ok, S} -> S;
+                        {error, _} -> []
+                    end
+            end,
+    Counters = case wterl:connection_stats(Connection) of
+                   {ok, C} -> C;
+                   {error, _} -> []
+               end,
+    [{connection_stats, Stats("")},
+     {table_stats, Stats(Table)},
+     {index_stats, Stats(IndexTable)},
+     {wterl_stats, Counters}] ++
+        [{bucket_table_stats, [{T, Stats(T)} || T <- bucket_tables(State)]}
+         || State#state.table_per_bucket].
 
 %% @doc Register an asynchronous callback
 -spec callback(reference(), any(), state()) -> {ok, state()}.
@@ -370,6 +514,174 @@ callback(_Ref, _Msg, State) ->
 %% Internal functions
 %% ===================================================================
 
+%% @private
+create_tables(_Connection, [], _TableOpts) ->
+    ok;
+create_tables(Connection, [Table | Tables], TableOpts) ->
+    case wterl:create(Connection, Table, TableOpts) of
+        ok ->
+            create_tables(Connection, Tables, TableOpts);
+        {error, _}=Error ->
+            Error
+    end.
+
+%% @private
+%% Where objects live depends on table_per_bucket, so the setting a
+%% vnode's tables were written with is kept beside them and a start with
+%% the other one is refused, rather than seeing none of the objects.
+check_layout(#state{connection=Connection, table=Table}=State) ->
+    MetaTable = meta_table(Table),
+    Layout = case State#state.table_per_bucket of
+                 true -> table_per_bucket;
+                 false -> single_table
+             end,
+    case wterl:create(Connection, MetaTable, []) of
+        ok ->
+            case wterl:get(Connection, MetaTable, ?LAYOUT_KEY) of
+                {ok, Stored} ->
+                    case binary_to_term(Stored) of
+                        Layout ->
+                            ok;
+                        Other ->
+                            lager:error("wterl: ~s was written with ~p, not ~p",
+                                        [Table, Other, Layout]),
+                            {error, {layout_mismatch, Other}}
+                    end;
+                not_found ->
+                    wterl:put(Connection, MetaTable, ?LAYOUT_KEY, term_to_binary(Layout));
+                {error, _}=Error ->
+                    Error
+            end;
+        {error, _}=Error ->
+            Error
+    end.
+
+%% @private
+%% The table of settings kept with a vnode's tables, see check_layout/1.
+meta_table(Table) ->
+    [_Type, Name] = string:tokens(Table, ":"),
+    "table:" ++ Name ++ "-meta".
+
+%% @private
+%% Keep a hashtree of the objects when the hashtree setting is on.  With
+%% table_per_bucket the objects are spread over many tables, which isn't
+%% supported.
+enable_hashtree(Config, #state{connection=Connection, table=Table}=State) ->
+    case app_helper:get_prop_or_env(hashtree, Config, wterl, false) of
+        true when State#state.table_per_bucket ->
+            lager:warning("wterl: hashtree is not supported with table_per_bucket, ignoring it"),
+            {ok, State};
+        true ->
+            Opts = [{segments, app_helper:get_prop_or_env(hashtree_segments, Config, wterl, 1048576)},
+                    {width, app_helper:get_prop_or_env(hashtree_width, Config, wterl, 1024)}],
+            case wterl:hashtree_enable(Connection, Table, Opts) of
+                {ok, Built} ->
+                    Built orelse lager:info("wterl: ~s needs a hashtree rebuild", [Table]),
+                    {ok, State#state{hashtree=true}};
+                {error, _}=Error ->
+                    Error
+            end;
+        _ ->
+            {ok, State}
+    end.
+
+%% @private
+drop_tables(_Connection, []) ->
+    ok;
+drop_tables(Connection, [Table | Tables]) ->
+    case wterl:drop_deferred(Connection, Table) of
+        ok ->
+            drop_tables(Connection, Tables);
+        Error ->
+            Error
+    end.
+
+%% @private
+%% Truncate each table's range of keys starting with a prefix.
+truncate_prefixes(_Connection, []) ->
+    ok;
+truncate_prefixes(Connection, [{Table, Prefix} | Rest]) ->
+    case wterl:truncate(Connection, Table, Prefix, next_prefix(Prefix)) of
+        ok ->
+            truncate_prefixes(Connection, Rest);
+        not_found -> %% nothing in the range
+            truncate_prefixes(Connection, Rest);
+        {error, _}=Error ->
+            Error
+    end.
+
+%% @private
+%% Apply a list of writes, in one transaction when there is more than one.
+write_ops(Connection, [{put, Table, Key, Value}]) ->
+    wterl:put(Connection, Table, Key, Value);
+write_ops(Connection, [{delete, Table, Key}]) ->
+    wterl:delete(Connection, Table, Key);
+write_ops(Connection, Ops) ->
+    wterl:write_batch(Connection, Ops).
+
+%% @private
+%% The table holding a bucket's objects.  Bucket tables are named for a
+%% hash of the bucket to keep URIs short and free of odd characters;
+%% keys still carry the bucket so a collision couldn't mix two buckets.
+object_table(_Bucket, #state{table_per_bucket=false, table=Table}) ->
+    Table;
+object_table(undefined, #state{table=Table}) ->
+    Table;
+object_table(Bucket, #state{table=Table}) ->
+    Table ++ "-b" ++ lists:flatten([io_lib:format("~2.16.0b", [X])
+                                    || <<X>> <= erlang:md5(encode_key(Bucket))]).
+
+%% @private
+%% Create a bucket's table the first time it is written.
+ensure_object_table(_Bucket, #state{table_per_bucket=false}=State) ->
+    {ok, State};
+ensure_object_table(Bucket, #state{connection=Connection, table_opts=TableOpts,
+                                   bucket_tables=BucketTables}=State) ->
+    BucketTable = object_table(Bucket, State),
+    case sets:is_element(BucketTable, BucketTables) of
+        true ->
+            {ok, State};
+        false ->
+            case wterl:create(Connection, BucketTable, TableOpts) of
+                ok ->
+                    {ok, State#state{bucket_tables=sets:add_element(BucketTable, BucketTables)}};
+                {error, _}=Error ->
+                    Error
+            end
+    end.
+
+%% @private
+%% The tables of all the buckets with objects, and any created since.
+bucket_tables(#state{table_per_bucket=false}) ->
+    [];
+bucket_tables(#state{bucket_tables=BucketTables}=State) ->
+    {ok, Buckets} = fold_buckets(fun(Bucket, Acc) -> [Bucket | Acc] end, [], [], State),
+    Listed = case Buckets of
+                 {error, _} -> [];
+                 _ -> [object_table(Bucket, State) || Bucket <- Buckets]
+             end,
+    sets:to_list(sets:union(sets:from_list(Listed), BucketTables)).
+
+%% @private
+%% Keep the <<bucket/key>> index in step with the bucket tables.
+bucket_index_ops(put, ObjectKey, #state{table_per_bucket=true, table=Table}) ->
+    [{put, Table, ObjectKey, ?BUCKET_INDEX_VALUE}];
+bucket_index_ops(delete, ObjectKey, #state{table_per_bucket=true, table=Table}) ->
+    [{delete, Table, ObjectKey}];
+bucket_index_ops(_Op, _ObjectKey, _State) ->
+    [].
+
+%% @private
+%% The writes to the index table that apply IndexSpecs to an object.  An
+%% index entry's value is the storage key of its object.
+index_ops(Bucket, Key, ObjectKey, IndexSpecs, #state{index_table=IndexTable}) ->
+    [index_op(IndexTable, Bucket, Key, ObjectKey, Spec) || Spec <- IndexSpecs].
+
+index_op(IndexTable, Bucket, Key, ObjectKey, {add, Field, Term}) ->
+    {put, IndexTable, to_index_key(Bucket, Field, Term, Key), ObjectKey};
+index_op(IndexTable, Bucket, Key, _ObjectKey, {remove, Field, Term}) ->
+    {delete, IndexTable, to_index_key(Bucket, Field, Term, Key)}.
+
 %% @private
 max_sessions(Config) ->
     RingSize =
@@ -425,9 +737,13 @@ establish_connection(Config, Type) ->
                     wterl:config_value(mmap, Config, false),
                     wterl:config_value(checkpoint, Config, CheckpointSetting),
                     wterl:config_value(session_max, Config, max_sessions(Config)),
+                    %% Each cached session holds cursors on one set of
+                    %% tables, leave room for those in use.
+                    wterl:config_value(session_cache_max, Config, max_sessions(Config) div 2),
                     wterl:config_value(cache_size, Config, size_cache(RequestedCacheSize)),
-                    wterl:config_value(statistics, Config, [ "fast", "clear"]),
+                    wterl:config_value(statistics, Config, ["fast"]),
                     wterl:config_value(statistics_log, Config, [{wait, 600}]), % in seconds
+                    wterl:config_value(zero_copy_threshold, Config, 0), % bytes, 0 disables
                     wterl:config_value(verbose, Config, [ "salvage", "verify"
                          % Note: for some unknown reason, if you add these additional
                          % verbose flags Erlang SEGV's "size_object: bad tag for 0x80"
@@ -450,121 +766,264 @@ establish_connection(Config, Type) ->
     end.
 
 %% @private
-%% Return a function to fold over the buckets on this backend
-fold_buckets_fun(FoldBucketsFun) ->
-    fun(BK, {Acc, LastBucket}) ->
-            case from_object_key(BK) of
-                {LastBucket, _} ->
-                    {Acc, LastBucket};
-                {Bucket, _} ->
-                    {FoldBucketsFun(Bucket, Acc), Bucket};
-                _ ->
-                    throw({break, Acc})
+%% Fold over one range of the table, seeking to its start and letting the
+%% NIF stop the stream at its end so that a limited fold only reads the
+%% keys it returns.  The NIF decodes the keys, object keys arrive as
+%% {Bucket, Key} and index keys as {i, ...} tuples.
+range_fold(Connection, Table, {Start, End, Filter}, Items, FoldFun, Acc) ->
+    case wterl:cursor_open(Connection, Table) of
+        {error, {enoent, _Message}} ->
+            Acc;
+        {ok, Cursor} ->
+            try
+                wterl:fold_range(Cursor, Start, End, FoldFun, Acc,
+                                 [{items, Items}, {filter, Filter}, {key_format, object}])
+            after
+                case wterl:cursor_close(Cursor) of
+                    ok ->
+                        ok;
+                    {error, {eperm, _}} -> %% TODO: review/fix
+                        ok;
+                    {error, _}=E ->
+                        E
+                end
             end
     end.
 
 %% @private
-%% Return a function to fold over keys on this backend
-fold_keys_fun(FoldKeysFun, undefined) ->
-    %% Fold across everything...
-    fun(StorageKey, Acc) ->
-            case from_object_key(StorageKey) of
-                {Bucket, Key} ->
-                    FoldKeysFun(Bucket, Key, Acc);
-                _ ->
-                    throw({break, Acc})
-            end
-    end;
-fold_keys_fun(FoldKeysFun, {bucket, FilterBucket}) ->
-    %% Fold across a specific bucket...
+%% A range_fold that stops after MaxResults items, none when it is 0.
+limited_range_fold(_Connection, _Table, _Range, _Items, _FoldFun, Acc, 0) ->
+    Acc;
+limited_range_fold(Connection, Table, Range, Items, FoldFun, Acc, MaxResults)
+  when is_integer(MaxResults), MaxResults > 0 ->
+    LimitedFun =
+        fun(Item, {Count, Acc0}) ->
+                Acc1 = FoldFun(Item, Acc0),
+                case Count + 1 of
+                    Count1 when Count1 >= MaxResults ->
+                        throw({break, Acc1});
+                    Count1 ->
+                        {Count1, Acc1}
+                end
+        end,
+    try range_fold(Connection, Table, Range, Items, LimitedFun, {0, Acc}) of
+        {error, _}=E ->
+            E;
+        {_Count, FoldResult} ->
+            FoldResult
+    catch
+        throw:{break, FoldResult} ->
+            FoldResult
+    end.
+
+%% @private
+%% Fold over the objects an index range refers to, a page of index entries
+%% joined to their objects at a time.
+index_fold(Connection, IndexTable, Table, {Start, End, _Filter}, FoldObjectsFun, Acc) ->
+    case wterl:index_join(Connection, IndexTable, Table, Start, End, []) of
+        {done, Items} ->
+            fold_joined(FoldObjectsFun, Acc, Items);
+        {more, Items, Next} ->
+            index_fold(Connection, IndexTable, Table, {Next, End, all}, FoldObjectsFun,
+                       fold_joined(FoldObjectsFun, Acc, Items));
+        {error, {enoent, _Message}} ->
+            Acc;
+        {error, _}=E ->
+            E
+    end.
+
+%% @private
+%% Fold over the objects of every bucket, a bucket table at a time, in
+%% bucket order.
+fold_bucket_tables(FoldObjectsFun, Acc, #state{connection=Connection}=State) ->
+    case fold_buckets(fun(Bucket, Bs) -> [Bucket | Bs] end, [], [], State) of
+        {ok, {error, _}=E} ->
+            E;
+        {ok, Buckets} ->
+            lists:foldl(
+              fun(_Bucket, {error, _}=E) ->
+                      E;
+                 (Bucket, Acc0) ->
+                      range_fold(Connection, object_table(Bucket, State),
+                                 fold_range_limits({bucket, Bucket}), kv,
+                                 fold_objects_fun(FoldObjectsFun), Acc0)
+              end, Acc, lists:reverse(Buckets))
+    end.
+
+%% @private
+limiter_bucket({bucket, Bucket}) ->
+    Bucket;
+limiter_bucket({index, Bucket, _Query}) ->
+    Bucket;
+limiter_bucket(undefined) ->
+    undefined.
+
+fold_joined(FoldObjectsFun, Acc, Items) ->
+    lists:foldl(fun({_IndexKey, ObjectKey, Value}, Acc0) ->
+                        {Bucket, Key} = from_object_key(ObjectKey),
+                        FoldObjectsFun(Bucket, Key, Value, Acc0)
+                end, Acc, Items).
+
+%% @private
+%% Return the table a fold limited by Limiter reads: 2i field queries are
+%% answered from the index table, everything else from the objects.
+fold_table({index, _FilterBucket, {eq, <<"$bucket">>, _}}, #state{table=Table}) ->
+    Table;
+fold_table({index, _FilterBucket, {range, <<"$key">>, _StartKey, _EndKey}}, #state{table=Table}) ->
+    Table;
+fold_table({index, _FilterBucket, _Query}, #state{index_table=IndexTable}) ->
+    IndexTable;
+fold_table(_Limiter, #state{table=Table}) ->
+    Table.
+
+%% @private
+%% Move the start of a 2i query's range to just after the entry a previous
+%% page ended with.  Appending a zero byte gives the smallest key that
+%% sorts after it.
+continue_range(Range, _Limiter, undefined) ->
+    Range;
+continue_range({Start, End, Filter}, {index, FilterBucket, {eq, <<"$bucket">>, _}}, Key) ->
+    After = <<(to_object_key(FilterBucket, Key))/binary, 0>>,
+    {erlang:max(Start, After), End, Filter};
+continue_range(Range, {index, FilterBucket, {eq, FilterField, FilterTerm}}, Key) when is_binary(Key) ->
+    %% A page of an equality query without its terms ends with a bare key.
+    continue_range(Range, {index, FilterBucket, {eq, FilterField, FilterTerm}}, {FilterTerm, Key});
+continue_range(Range, {index, FilterBucket, {eq, FilterField, FilterTerm}}, Continuation) ->
+    continue_range(Range, {index, FilterBucket, {range, FilterField, FilterTerm, FilterTerm}},
+                   Continuation);
+continue_range({Start, End, Filter}, {index, FilterBucket, {range, <<"$key">>, _, _}}, Key) ->
+    After = <<(to_object_key(FilterBucket, Key))/binary, 0>>,
+    {erlang:max(Start, After), End, Filter};
+continue_range({Start, End, Filter}, {index, FilterBucket, {range, FilterField, _, _}}, {Term, Key}) ->
+    After = <<(to_index_key(FilterBucket, FilterField, Term, Key))/binary, 0>>,
+    {erlang:max(Start, After), End, Filter};
+continue_range(_Range, Limiter, Continuation) ->
+    throw({bad_continuation, Limiter, Continuation}).
+
+%% @private
+%% The smallest key greater than every key that starts with Prefix.
+next_prefix(Prefix) ->
+    Len = byte_size(Prefix) - 1,
+    <<Head:Len/binary, Last>> = Prefix,
+    case Last of
+        255 -> next_prefix(Head);
+        _ -> <<Head/binary, (Last + 1)>>
+    end.
+
+%% @private
+%% Return the {Start, End, Filter} of the range of storage keys a fold
+%% limited by a bucket or 2i query has to visit, and the filter the NIF
+%% applies to the keys it reads.
+fold_range_limits(undefined) ->
+    Prefix = prefix_key({o, '_', '_'}),
+    {Prefix, {prefix, Prefix}, all};
+fold_range_limits({bucket, FilterBucket}) ->
+    Prefix = prefix_key({o, FilterBucket, '_'}),
+    {Prefix, {prefix, Prefix}, all};
+fold_range_limits({index, FilterBucket, {eq, <<"$bucket">>, _}}) ->
+    fold_range_limits({bucket, FilterBucket});
+fold_range_limits({index, FilterBucket, {eq, FilterField, FilterTerm}}) ->
+    fold_range_limits({index, FilterBucket, {range, FilterField, FilterTerm, FilterTerm}});
+fold_range_limits({index, FilterBucket, {range, <<"$key">>, StartKey, EndKey}}) ->
+    {to_object_key(FilterBucket, StartKey), to_object_key(FilterBucket, EndKey), all};
+fold_range_limits({index, FilterBucket, {range, FilterField, StartTerm, EndTerm}}) ->
+    %% Index keys sort by term then key, so the query's entries run from
+    %% the first entry for StartTerm up to the first key past EndTerm's.
+    {prefix_key({i, FilterBucket, FilterField, StartTerm, '_'}),
+     {before, next_prefix(prefix_key({i, FilterBucket, FilterField, EndTerm, '_'}))},
+     all};
+fold_range_limits(Other) ->
+    throw({unknown_limiter, Other}).
+
+%% @private
+%% Return a function to fold over keys on this backend.  The range the
+%% fold streams (see fold_range_limits/1) already holds only keys that
+%% match the limiter.  With ReturnTerms an index query folds over
+%% {Term, Key}.
+fold_keys_fun(FoldKeysFun, undefined, _ReturnTerms) ->
     fun(StorageKey, Acc) ->
-            case from_object_key(StorageKey) of
-                {Bucket, Key} when Bucket == FilterBucket ->
-                    FoldKeysFun(Bucket, Key, Acc);
-                _ ->
-                    throw({break, Acc})
-            end
+            {Bucket, Key} = from_object_key(StorageKey),
+            FoldKeysFun(Bucket, Key, Acc)
     end;
-fold_keys_fun(FoldKeysFun, {index, FilterBucket, {eq, <<"$bucket">>, _}}) ->
-    %% 2I exact match query on special $bucket field...
-    fold_keys_fun(FoldKeysFun, {bucket, FilterBucket});
-fold_keys_fun(FoldKeysFun, {index, FilterBucket, {eq, FilterField, FilterTerm}}) ->
+fold_keys_fun(FoldKeysFun, {bucket, _FilterBucket}, ReturnTerms) ->
+    fold_keys_fun(FoldKeysFun, undefined, ReturnTerms);
+fold_keys_fun(FoldKeysFun, {index, _FilterBucket, {eq, <<"$bucket">>, _}}, ReturnTerms) ->
+    fold_keys_fun(FoldKeysFun, undefined, ReturnTerms);
+fold_keys_fun(FoldKeysFun, {index, FilterBucket, {eq, FilterField, FilterTerm}}, ReturnTerms) ->
     %% Rewrite 2I exact match query as a range...
     NewQuery = {range, FilterField, FilterTerm, FilterTerm},
-    fold_keys_fun(FoldKeysFun, {index, FilterBucket, NewQuery});
-fold_keys_fun(FoldKeysFun, {index, FilterBucket, {range, <<"$key">>, StartKey, EndKey}}) ->
-    %% 2I range query on special $key field...
+    fold_keys_fun(FoldKeysFun, {index, FilterBucket, NewQuery}, ReturnTerms);
+fold_keys_fun(FoldKeysFun, {index, _FilterBucket, {range, <<"$key">>, _StartKey, _EndKey}}, false) ->
+    fold_keys_fun(FoldKeysFun, undefined, false);
+fold_keys_fun(FoldKeysFun, {index, _FilterBucket, {range, <<"$key">>, _StartKey, _EndKey}}, true) ->
     fun(StorageKey, Acc) ->
-            case from_object_key(StorageKey) of
-                {Bucket, Key} when FilterBucket == Bucket,
-                                   StartKey =< Key,
-                                   EndKey >= Key ->
-                    FoldKeysFun(Bucket, Key, Acc);
-                _ ->
-                    throw({break, Acc})
-            end
+            {Bucket, Key} = from_object_key(StorageKey),
+            FoldKeysFun(Bucket, {Key, Key}, Acc)
     end;
-fold_keys_fun(FoldKeysFun, {index, FilterBucket, {range, FilterField, StartTerm, EndTerm}}) ->
+fold_keys_fun(FoldKeysFun, {index, _FilterBucket, {range, _FilterField, _StartTerm, _EndTerm}}, false) ->
     %% 2I range query...
     fun(StorageKey, Acc) ->
-            case from_index_key(StorageKey) of
-                {Bucket, Key, Field, Term} when FilterBucket == Bucket,
-                                                FilterField == Field,
-                                                StartTerm =< Term,
-                                                EndTerm >= Term ->
-                    FoldKeysFun(Bucket, Key, Acc);
-                _ ->
-                    throw({break, Acc})
-            end
+            {Bucket, Key, _Field, _Term} = from_index_key(StorageKey),
+            FoldKeysFun(Bucket, Key, Acc)
     end;
-fold_keys_fun(_FoldKeysFun, Other) ->
+fold_keys_fun(FoldKeysFun, {index, _FilterBucket, {range, _FilterField, _StartTerm, _EndTerm}}, true) ->
+    fun(StorageKey, Acc) ->
+            {Bucket, Key, _Field, Term} = from_index_key(StorageKey),
+            FoldKeysFun(Bucket, {Term, Key}, Acc)
+    end;
+fold_keys_fun(_FoldKeysFun, Other, _ReturnTerms) ->
     throw({unknown_limiter, Other}).
 
 %% @private
 %% Return a function to fold over the objects on this backend
-fold_objects_fun(FoldObjectsFun, FilterBucket) ->
-    %% 2I does not support fold objects at this time, so this is much
-    %% simpler than fold_keys_fun.
+fold_objects_fun(FoldObjectsFun) ->
     fun({StorageKey, Value}, Acc) ->
-            case from_object_key(StorageKey) of
-                {Bucket, Key} when FilterBucket == undefined;
-                                   Bucket == FilterBucket ->
-                    FoldObjectsFun(Bucket, Key, Value, Acc);
-                _ ->
-                    throw({break, Acc})
-            end
+            {Bucket, Key} = from_object_key(StorageKey),
+            FoldObjectsFun(Bucket, Key, Value, Acc)
     end.
 
 to_object_key(Bucket, Key) ->
-    sext:encode({o, Bucket, Key}).
+    encode_key({o, Bucket, Key}).
 
+%% Keys read by range_fold/6 are already decoded.
+from_object_key({Bucket, Key}) ->
+    {Bucket, Key};
 from_object_key(LKey) ->
-    case sext:decode(LKey) of
+    case decode_key(LKey) of
         {o, Bucket, Key} ->
             {Bucket, Key};
         _ ->
             undefined
     end.
 
-from_index_key(LKey) ->
-    case sext:decode(LKey) of
-        {i, Bucket, Field, Term, Key} ->
-            {Bucket, Key, Field, Term};
-        _ ->
-            undefined
-    end.
+to_index_key(Bucket, Field, Term, Key) ->
+    encode_key({i, Bucket, Field, Term, Key}).
+
+from_index_key({i, Bucket, Field, Term, Key}) ->
+    {Bucket, Key, Field, Term};
+from_index_key(LKey) when is_binary(LKey) ->
+    from_index_key(decode_key(LKey));
+from_index_key(_) ->
+    undefined.
 
 %% @private
-%% Return all status from wterl statistics cursor
-%% fetch_status(Cursor) ->
-%%    {ok, fetch_status(Cursor, wterl:cursor_next_value(Cursor), [])}.
-%% fetch_status(_Cursor, {error, _}, Acc) ->
-%%     lists:reverse(Acc);
-%% fetch_status(_Cursor, not_found, Acc) ->
-%%     lists:reverse(Acc);
-%% fetch_status(Cursor, {ok, Stat}, Acc) ->
-%%     [What,Val|_] = [binary_to_list(B) || B <- binary:split(Stat, [<<0>>], [global])],
-%%     fetch_status(Cursor, wterl:cursor_next_value(Cursor), [{What,Val}|Acc]).
+%% sext encode, prefix and decode in the NIF, which handles the binaries,
+%% atoms and small integers keys are usually made of, and in Erlang for
+%% anything else.
+encode_key(Term) ->
+    try wterl:sext_encode(Term)
+    catch error:badarg -> sext:encode(Term)
+    end.
+
+prefix_key(Pattern) ->
+    try wterl:sext_prefix(Pattern)
+    catch error:badarg -> sext:prefix(Pattern)
+    end.
+
+decode_key(LKey) ->
+    try wterl:sext_decode(LKey)
+    catch error:badarg -> sext:decode(LKey)
+    end.
 
 size_cache(RequestedSize) ->
     Size =
@@ -621,4 +1080,153 @@ custom_config_test_() ->
     application:set_env(wterl, data_root, ""),
     temp_riak_kv_backend:standard_test(?MODULE, [{data_root, "test/wterl-backend"}]).
 
+index_test_() ->
+    {ok, CWD} = file:get_cwd(),
+    rmdir:path(filename:join([CWD, "test/wterl-backend"])), %?assertCmd("rm -rf test/wterl-backend"),
+    application:set_env(wterl, data_root, "test/wterl-backend"),
+    {setup,
+     fun() -> temp_riak_kv_backend:setup({?MODULE, []}) end,
+     fun temp_riak_kv_backend:cleanup/1,
+     fun({_, State}) ->
+             Fold = fun(Opts) ->
+                            {ok, Keys} = fold_keys(fun(_B, K, Acc) -> [K | Acc] end,
+                                                   [], Opts, State),
+                            lists:reverse(Keys)
+                    end,
+             Query = fun(Q) -> {index, <<"b">>, Q} end,
+             [?_test(
+                 begin
+                     [?assertMatch({ok, _},
+                                   put(<<"b">>, K, [{add, <<"age_int">>, Age}], <<"v">>, State))
+                      || {K, Age} <- [{<<"k1">>, 10}, {<<"k2">>, 20}, {<<"k3">>, 20},
+                                      {<<"k4">>, 30}]],
+                     ?assertMatch({ok, _},
+                                  put(<<"other">>, <<"k1">>, [{add, <<"age_int">>, 20}],
+                                      <<"v">>, State)),
+                     ?assertEqual([<<"k2">>, <<"k3">>],
+                                  Fold([Query({eq, <<"age_int">>, 20})])),
+                     ?assertEqual([<<"k3">>],
+                                  Fold([Query({eq, <<"age_int">>, 20}),
+                                        {continuation, <<"k2">>}])),
+                     ?assertEqual([<<"k3">>],
+                                  Fold([Query({eq, <<"age_int">>, 20}),
+                                        {continuation, {20, <<"k2">>}}])),
+                     ?assertEqual([<<"k1">>, <<"k2">>, <<"k3">>],
+                                  Fold([Query({range, <<"age_int">>, 0, 20})])),
+                     ?assertEqual([{20, <<"k3">>}, {30, <<"k4">>}],
+                                  Fold([Query({range, <<"age_int">>, 15, 40}),
+                                        {return_terms, true},
+                                        {continuation, {20, <<"k2">>}}])),
+                     ?assertEqual([<<"k2">>],
+                                  Fold([Query({range, <<"age_int">>, 15, 40}),
+                                        {max_results, 1}])),
+                     ?assertEqual([], Fold([Query({range, <<"age_int">>, 15, 40}),
+                                            {max_results, 0}])),
+                     ?assertEqual([<<"k2">>, <<"k3">>, <<"k4">>],
+                                  Fold([Query({range, <<"age_int">>, 15, 40}),
+                                        {max_results, undefined}])),
+                     %% Moving k2 to a new term removes its old index entry.
+                     ?assertMatch({ok, _},
+                                  put(<<"b">>, <<"k2">>,
+                                      [{remove, <<"age_int">>, 20}, {add, <<"age_int">>, 40}],
+                                      <<"v2">>, State)),
+                     ?assertEqual([<<"k3">>], Fold([Query({eq, <<"age_int">>, 20})])),
+                     ?assertMatch({ok, _},
+                                  delete(<<"b">>, <<"k3">>, [{remove, <<"age_int">>, 20}], State)),
+                     ?assertEqual([], Fold([Query({eq, <<"age_int">>, 20})])),
+                     {ok, Objects} = fold_objects(fun(_B, K, V, Acc) -> [{K, V} | Acc] end,
+                                                  [], [Query({range, <<"age_int">>, 30, 40})],
+                                                  State),
+                     ?assertEqual([{<<"k4">>, <<"v">>}, {<<"k2">>, <<"v2">>}],
+                                  lists:reverse(Objects))
+                 end)]
+     end}.
+
+table_per_bucket_test_() ->
+    {ok, CWD} = file:get_cwd(),
+    rmdir:path(filename:join([CWD, "test/wterl-backend"])), %?assertCmd("rm -rf test/wterl-backend"),
+    application:set_env(wterl, data_root, "test/wterl-backend"),
+    {setup,
+     fun() ->
+             application:start(lager),
+             {ok, State} = start(43, [{table_per_bucket, true}]),
+             State
+     end,
+     fun(State) ->
+             ok = stop(State),
+             application:stop(lager)
+     end,
+     fun(State0) ->
+             [?_test(
+                 begin
+                     State = lists:foldl(
+                               fun({B, K}, S) ->
+                                       {ok, S1} = put(B, K, [{add, <<"f_bin">>, K}], <<"v">>, S),
+                                       S1
+                               end, State0,
+                               [{<<"b1">>, <<"k1">>}, {<<"b1">>, <<"k2">>}, {<<"b2">>, <<"k1">>}]),
+                     ?assertNotEqual(object_table(<<"b1">>, State),
+                                     object_table(<<"b2">>, State)),
+                     ?assertMatch({ok, <<"v">>, _}, get(<<"b2">>, <<"k1">>, State)),
+                     ?assertMatch({error, not_found, _}, get(<<"b3">>, <<"k1">>, State)),
+                     {ok, Buckets} = fold_buckets(fun(B, Acc) -> [B | Acc] end, [], [], State),
+                     ?assertEqual([<<"b1">>, <<"b2">>], lists:sort(Buckets)),
+                     {ok, Objects} = fold_objects(fun(B, K, _V, Acc) -> [{B, K} | Acc] end,
+                                                  [], [], State),
+                     ?assertEqual([{<<"b1">>, <<"k1">>}, {<<"b1">>, <<"k2">>}, {<<"b2">>, <<"k1">>}],
+                                  lists:reverse(Objects)),
+                     {ok, State1} = drop_bucket(<<"b1">>, State),
+                     ?assertMatch({error, not_found, _}, get(<<"b1">>, <<"k1">>, State1)),
+                     {ok, Keys} = fold_keys(fun(B, K, Acc) -> [{B, K} | Acc] end, [], [], State1),
+                     ?assertEqual([{<<"b2">>, <<"k1">>}], Keys),
+                     {ok, Indexed} = fold_keys(fun(_B, K, Acc) -> [K | Acc] end, [],
+                                               [{index, <<"b1">>, {eq, <<"f_bin">>, <<"k1">>}}],
+                                               State1),
+                     ?assertEqual([], Indexed),
+                     ?assertMatch([{bucket_table_stats, [_]}],
+                                  [S || {bucket_table_stats, _}=S <- status(State1)]),
+                     %% The tables were written with table_per_bucket.
+                     ?assertEqual({error, {layout_mismatch, table_per_bucket}}, start(43, []))
+                 end)]
+     end}.
+
+hashtree_test_() ->
+    {ok, CWD} = file:get_cwd(),
+    rmdir:path(filename:join([CWD, "test/wterl-backend"])), %?assertCmd("rm -rf test/wterl-backend"),
+    application:set_env(wterl, data_root, "test/wterl-backend"),
+    {setup,
+     fun() ->
+             application:start(lager),
+             {ok, State} = start(44, [{hashtree, true}, {hashtree_segments, 256},
+                                      {hashtree_width, 16}]),
+             State
+     end,
+     fun(State) ->
+             ok = stop(State),
+             application:stop(lager)
+     end,
+     fun(State) ->
+             KeyHashes =
+                 fun() ->
+                         {ok, Root} = hashtree_bucket(1, 0, State),
+                         lists:sort(
+                           lists:append(
+                             [begin
+                                  {ok, KHs} = hashtree_key_hashes(R * 16 + S, State),
+                                  [K || {K, _} <- KHs]
+                              end || {R, _} <- Root,
+                                     {S, _} <- element(2, hashtree_bucket(2, R, State))]))
+                 end,
+             [?_test(
+                 begin
+                     [?assertMatch({ok, _}, put(B, K, [{add, <<"f_bin">>, K}], <<"v">>, State))
+                      || {B, K} <- [{<<"b1">>, <<"k1">>}, {<<"b1">>, <<"k2">>}, {<<"b2">>, <<"k1">>}]],
+                     ?assertEqual([{<<"b1">>, <<"k1">>}, {<<"b1">>, <<"k2">>}, {<<"b2">>, <<"k1">>}],
+                                  KeyHashes()),
+                     ?assertMatch({ok, _}, delete(<<"b1">>, <<"k2">>, [], State)),
+                     {ok, _} = drop_bucket(<<"b2">>, State),
+                     ?assertEqual([{<<"b1">>, <<"k1">>}], KeyHashes())
+                 end)]
+     end}.
+
 -endif.
@@ -24,16 +24,27 @@
 -export([connection_open/2,
          connection_open/3,
          connection_close/1,
+         connection_stats/1,
+         stats/1,
+         stats/2,
+         stats/3,
          cursor_close/1,
          cursor_insert/3,
          cursor_next/1,
          cursor_next_key/1,
          cursor_next_value/1,
+         cursor_batch/5,
+         cursor_next_batch/3,
+         cursor_next_key_batch/3,
+         cursor_next_value_batch/3,
          cursor_open/2,
          cursor_open/3,
          cursor_prev/1,
          cursor_prev_key/1,
          cursor_prev_value/1,
+         cursor_prev_batch/3,
+         cursor_prev_key_batch/3,
+         cursor_prev_value_batch/3,
          cursor_remove/2,
          cursor_reset/1,
          cursor_search/2,
@@ -48,24 +59,71 @@
          delete/3,
          drop/2,
          drop/3,
+         drop_deferred/2,
          get/3,
          put/4,
+         put/5,
+         put_new/4,
+         merge/4,
+         set_merge_operator/3,
+         modify/4,
+         append/4,
+         compare_and_swap/5,
          rename/3,
          rename/4,
          salvage/2,
          salvage/3,
+         snapshot/1,
+         snapshot_release/1,
+         snapshot_info/1,
+         snapshot_cursor_open/2,
+         snapshot_get/3,
+         session_close/1,
+         session_delete/3,
+         session_get/3,
+         session_open/1,
+         session_open/2,
+         session_put/4,
+         ttl_enable/2,
+         hashtree_enable/2,
+         hashtree_enable/3,
+         hashtree_rebuild/2,
+         hashtree_bucket/4,
+         hashtree_key_hashes/3,
          truncate/2,
          truncate/3,
          truncate/4,
          truncate/5,
+         txn_abort/1,
+         txn_abort/2,
+         txn_begin/1,
+         txn_begin/2,
+         txn_commit/1,
+         txn_commit/2,
          upgrade/2,
          upgrade/3,
          verify/2,
          verify/3,
+         write_batch/2,
          config_value/3,
          priv_dir/0,
          fold_keys/3,
-         fold/3]).
+         fold/3,
+         fold_range/6,
+         parallel_fold/6,
+         aggregate/4,
+         index_join/6,
+         distinct_elements/5,
+         is_empty/2,
+         stream_range/4,
+         stream_ack/2,
+         stream_close/1,
+         export_table/3,
+         import_open/2,
+         import_chunk/2,
+         sext_encode/1,
+         sext_prefix/1,
+         sext_decode/1]).
 
 -export([set_event_handler_pid/1]).
 
@@ -81,10 +139,34 @@
 -type config_list() :: [{atom(), any()}].
 -opaque connection() :: reference().
 -opaque cursor() :: reference().
+-opaque session() :: reference().
+-opaque stream() :: {reference(), reference()}.
+-opaque snapshot() :: reference().
 -type key() :: binary().
 -type value() :: binary().
-
--export_type([connection/0, cursor/0]).
+-type key_format() :: raw | sext | object.
+-type batch_op() :: {put, string(), key(), value()} | {delete, string(), key()}.
+
+-export_type([connection/0, cursor/0, session/0, stream/0, snapshot/0]).
+
+%% Connection options handled by wterl itself rather than WiredTiger:
+%%   zero_copy_threshold - values of at least this many bytes are returned
+%%       from get/3 as binaries referencing WiredTiger's cache rather than
+%%       copies; each such binary holds a session and cursor until it is
+%%       garbage collected, and connection_close/1 returns ebusy until
+%%       they all are (0, the default, disables this).  What it saves
+%%       hasn't been measured yet, see tools/wterl-b_b-large.config.
+%%   ttl_reap_interval - seconds between passes of the expired key reaper
+%%       (default 60).
+%%   ttl_reap_batch - expired keys removed per reaper transaction (default
+%%       1000).
+%%   merge_compact_interval - seconds between background compactions of
+%%       merge operands (default 60).
+%%   session_cache_max - idle sessions, with their cursors, kept for reuse
+%%       (default 1024); keep it well under session_max, an open that runs
+%%       out of sessions first closes the idle ones.
+-define(WTERL_CONN_OPTIONS, [zero_copy_threshold, ttl_reap_interval, ttl_reap_batch,
+                             merge_compact_interval, session_cache_max]).
 
 -on_load(init/0).
 
@@ -114,18 +196,27 @@ connection_open(HomeDir, ConnectionConfig, SessionConfig) ->
                              end
                      end, PrivFiles),
     SoPaths = lists:map(fun(Elem) -> filename:join([PrivDir, Elem]) end, SoFiles),
-    conn_open(HomeDir, [{extensions, SoPaths}] ++ ConnectionConfig, SessionConfig).
-
--spec conn_open(string(), config_list(), config_list()) -> {ok, connection()} | {error, term()}.
-conn_open(HomeDir, ConnectionConfig, SessionConfig) ->
-    ?ASYNC_NIF_CALL(fun conn_open_nif/4, [HomeDir,
+    {WterlConfig, WTConfig} =
+        lists:partition(fun({Key, _}) -> lists:member(Key, ?WTERL_CONN_OPTIONS);
+                           (_) -> false
+                        end, ConnectionConfig),
+    conn_open(HomeDir, [{extensions, SoPaths}] ++ WTConfig, SessionConfig, WterlConfig).
+
+-spec conn_open(string(), config_list(), config_list(), config_list()) -> {ok, connection()} | {error, term()}.
+conn_open(HomeDir, ConnectionConfig, SessionConfig, WterlConfig) ->
+    ?ASYNC_NIF_CALL(fun conn_open_nif/5, [HomeDir,
                                           config_to_bin(ConnectionConfig),
-                                          config_to_bin(SessionConfig)]).
+                                          config_to_bin(SessionConfig),
+                                          WterlConfig]).
 
--spec conn_open_nif(reference(), string(), config(), config()) -> {ok, connection()} | {error, term()}.
-conn_open_nif(_AsyncRef, _HomeDir, _ConnectionConfig, _SessionConfig) ->
+-spec conn_open_nif(reference(), string(), config(), config(), config_list()) -> {ok, connection()} | {error, term()}.
+conn_open_nif(_AsyncRef, _HomeDir, _ConnectionConfig, _SessionConfig, _WterlConfig) ->
     ?nif_stub.
 
+%% @doc Close a connection.  While binaries returned from get/3 without a
+%% copy (see zero_copy_threshold) are still referenced this returns
+%% {error, {ebusy, _}} and the connection stays open; drop them and let
+%% them be garbage collected, then close again.
 -spec connection_close(connection()) -> ok | {error, term()}.
 connection_close(ConnRef) ->
     ?ASYNC_NIF_CALL(fun conn_close_nif/2, [ConnRef]).
@@ -134,6 +225,52 @@ connection_close(ConnRef) ->
 conn_close_nif(_AsyncRef, _ConnRef) ->
     ?nif_stub.
 
+%% @doc wterl's own counters for a connection: the size of its cache of
+%% sessions and cursors, cache hits, misses (each a session opened) and
+%% evictions, the cursors opened, closed, garbage collected and still
+%% open, values pinned and tables waiting for a deferred drop.
+-spec connection_stats(connection()) -> {ok, [{atom(), non_neg_integer()}]} | {error, term()}.
+connection_stats(ConnRef) ->
+    ?ASYNC_NIF_CALL(fun conn_stats_nif/2, [ConnRef]).
+
+-spec conn_stats_nif(reference(), connection()) -> {ok, [{atom(), non_neg_integer()}]} | {error, term()}.
+conn_stats_nif(_AsyncRef, _ConnRef) ->
+    ?nif_stub.
+
+-type stat() :: {binary(), integer()}.
+
+%% The statistics read by stats/3 with the fast option: cache pressure and
+%% eviction, LSM merges and their backlog, and checkpoints.
+-define(FAST_STATS, [<<"cache:">>, <<"LSM:">>, <<"transaction: transaction checkpoint">>]).
+
+%% @doc WiredTiger's statistics for the connection, or a table, as
+%% {Description, Value} in WiredTiger's order, e.g. {<<"cache: bytes
+%% currently in the cache">>, 1048576}.  The connection must be opened with
+%% statistics enabled.  Options are `fast', to read only the statistics
+%% that are cheap to gather and by default only those in ?FAST_STATS, so
+%% that they can be scraped every few seconds, and `{only, Prefixes}' to
+%% return the statistics whose descriptions start with one of Prefixes.
+-spec stats(connection()) -> {ok, [stat()]} | {error, term()}.
+-spec stats(connection(), string()) -> {ok, [stat()]} | {error, term()}.
+-spec stats(connection(), string(), [fast | {only, [binary()]}]) -> {ok, [stat()]} | {error, term()}.
+stats(Ref) ->
+    stats(Ref, "", []).
+stats(Ref, Uri) ->
+    stats(Ref, Uri, []).
+stats(Ref, Uri, Options) ->
+    Fast = proplists:get_bool(fast, Options),
+    Only =
+        case proplists:get_value(only, Options) of
+            undefined when Fast -> ?FAST_STATS;
+            undefined -> [];
+            Prefixes -> Prefixes
+        end,
+    ?ASYNC_NIF_CALL(fun stats_nif/5, [Ref, Uri, Fast, Only]).
+
+-spec stats_nif(reference(), connection(), string(), boolean(), [binary()]) -> {ok, [stat()]} | {error, term()}.
+stats_nif(_AsyncRef, _Ref, _Uri, _Fast, _Prefixes) ->
+    ?nif_stub.
+
 -spec create(connection(), string()) -> ok | {error, term()}.
 -spec create(connection(), string(), config_list()) -> ok | {error, term()}.
 create(Ref, Name) ->
@@ -156,6 +293,20 @@ drop(Ref, Name, Config) ->
 drop_nif(_AsyncRef, _Ref, _Name, _Config) ->
     ?nif_stub.
 
+%% @doc Drop a table in the background and return at once.  Operations
+%% that open the table fail with enoent from now on.  The connection's
+%% janitor truncates the table, so its space comes back even while
+%% cursors still open on it hold up the drop, then drops it, retrying
+%% with backoff.  create/3 of the same table first finishes the drop or,
+%% while cursors still hold it up, empties the table and keeps it.
+-spec drop_deferred(connection(), string()) -> ok | {error, term()}.
+drop_deferred(Ref, Name) ->
+    ?ASYNC_NIF_CALL(fun drop_deferred_nif/3, [Ref, Name]).
+
+-spec drop_deferred_nif(reference(), connection(), string()) -> ok | {error, term()}.
+drop_deferred_nif(_AsyncRef, _Ref, _Name) ->
+    ?nif_stub.
+
 -spec delete(connection(), string(), key()) -> ok | {error, term()}.
 delete(Ref, Table, Key) ->
     ?ASYNC_NIF_CALL(fun delete_nif/4, [Ref, Table, Key]).
@@ -173,11 +324,205 @@ get_nif(_AsyncRef, _Ref, _Table, _Key) ->
     ?nif_stub.
 
 -spec put(connection(), string(), key(), value()) -> ok | {error, term()}.
+-spec put(connection(), string(), key(), value(), config_list()) -> ok | {error, term()}.
 put(Ref, Table, Key, Value) ->
-    ?ASYNC_NIF_CALL(fun put_nif/5, [Ref, Table, Key, Value]).
+    put(Ref, Table, Key, Value, []).
+
+%% @doc Store Value under Key.  With the option {ttl, Seconds} the key
+%% expires after that many seconds, see ttl_enable/2.  On a TTL enabled
+%% table a put without a ttl makes the key permanent again.
+put(Ref, Table, Key, Value, Options) ->
+    TTL = proplists:get_value(ttl, Options, 0),
+    ?ASYNC_NIF_CALL(fun put_nif/6, [Ref, Table, Key, Value, TTL]).
+
+-spec put_nif(reference(), connection(), string(), key(), value(), non_neg_integer()) -> ok | {error, term()}.
+put_nif(_AsyncRef, _Ref, _Table, _Key, _Value, _TTL) ->
+    ?nif_stub.
+
+%% @doc Register a merge operator for a table, one of:
+%%   add    - values and operands are <<N:64/signed>>, merge/4 adds to N
+%%   max    - as add, but the result is the largest operand
+%%   append - operands are binaries appended to the value
+%% A table may have a merge operator or TTLs, not both.  put/4, put_new/4,
+%% write_batch/2, compare_and_swap/5 and delete/3 replace the value and
+%% its pending operands, and see the value with its operands folded in, as
+%% get/3 does.  Writes which can't (cursors, explicit sessions, modify/4,
+%% append/4 and import_chunk/2) return {error, {enotsup, _}}.  truncate/2-5
+%% and drop remove the keys' operands too.  The operator is saved with the
+%% table and registered again when the connection is next opened, so
+%% operands merged before a restart are still folded in by get.
+-spec set_merge_operator(connection(), string(), add | max | append) -> ok | {error, term()}.
+set_merge_operator(Ref, Table, Operator) ->
+    ?ASYNC_NIF_CALL(fun set_merge_operator_nif/4, [Ref, Table, Operator]).
+
+-spec set_merge_operator_nif(reference(), connection(), string(), add | max | append) -> ok | {error, term()}.
+set_merge_operator_nif(_AsyncRef, _Ref, _Table, _Operator) ->
+    ?nif_stub.
+
+%% @doc Merge Operand into the value under Key without reading it, an
+%% integer for add and max tables or a binary for append.  Operands are
+%% folded in by get/3 and compacted in the background.
+-spec merge(connection(), string(), key(), integer() | binary()) -> ok | {error, term()}.
+merge(Ref, Table, Key, Operand) ->
+    ?ASYNC_NIF_CALL(fun merge_nif/5, [Ref, Table, Key, Operand]).
+
+-spec merge_nif(reference(), connection(), string(), key(), integer() | binary()) -> ok | {error, term()}.
+merge_nif(_AsyncRef, _Ref, _Table, _Key, _Operand) ->
+    ?nif_stub.
+
+%% @doc Enable key expiry on a table.  Expired keys read as not_found, and
+%% cursors, folds and streams on the table skip them, until they are
+%% removed in the background by a reaper thread, which runs every
+%% ttl_reap_interval seconds and deletes ttl_reap_batch keys per
+%% transaction (both connection options).  Expiry applies to keys written
+%% with put/5, any other write of a key (put/4, put_new/4, write_batch/2,
+%% compare_and_swap/5, modify/4, append/4) makes it permanent, and to
+%% those an expired key is missing.  Writes which can't keep the expiry
+%% times (cursors, explicit sessions, and import_chunk/2 other than into
+%% an empty table) return {error, {enotsup, _}}.  truncate/2-5 and drop
+%% remove the keys' expiry times too.  Snapshot cursors see the table as
+%% it was, expired keys included.  The setting is remembered, it is
+%% enabled again when the connection is next opened.
+-spec ttl_enable(connection(), string()) -> ok | {error, term()}.
+ttl_enable(Ref, Table) ->
+    ?ASYNC_NIF_CALL(fun ttl_enable_nif/3, [Ref, Table]).
+
+-spec ttl_enable_nif(reference(), connection(), string()) -> ok | {error, term()}.
+ttl_enable_nif(_AsyncRef, _Ref, _Table) ->
+    ?nif_stub.
+
+-define(HASHTREE_SEGMENTS, 1048576).
+-define(HASHTREE_WIDTH, 1024).
+
+%% @doc Keep a hashtree of a table, for active anti-entropy, in its
+%% companion table "table:<name>-aae".  Each key hashes (with its value)
+%% into one of a number of segments and the NIF keeps each segment's hash
+%% up to date as put/4,5, put_new/4, delete/3 and write_batch/2 change
+%% the table, so comparing trees never folds the objects through Erlang.
+%% truncate/4,5 removes a range a key at a time so its hashes go too, and
+%% dropping the table drops its hashtree.  Writes which
+%% can't keep the hashes (cursors, explicit sessions, modify/4, append/4
+%% and compare_and_swap/5) return {error, {enotsup, _}} on such tables.
+%% Options:
+%%   {segments, N}   number of segments, a power of the width (1048576)
+%%   {width, N}      children of each node of the tree (1024)
+%% Returns {ok, Built} where Built is false when the table has keys that
+%% aren't hashed yet.  The hashtree is remembered, it is enabled again
+%% when the connection is next opened.  Keys and values are hashed with
+%% wterl's own 64-bit hash, not the SHA-1 of riak_core's hashtree, so the
+%% trees are only comparable with other wterl hashtrees.
+-spec hashtree_enable(connection(), string()) -> {ok, boolean()} | {error, term()}.
+-spec hashtree_enable(connection(), string(), config_list()) -> {ok, boolean()} | {error, term()}.
+hashtree_enable(Ref, Table) ->
+    hashtree_enable(Ref, Table, []).
+hashtree_enable(Ref, Table, Options) ->
+    ?ASYNC_NIF_CALL(fun hashtree_enable_nif/5,
+                    [Ref, Table,
+                     proplists:get_value(segments, Options, ?HASHTREE_SEGMENTS),
+                     proplists:get_value(width, Options, ?HASHTREE_WIDTH)]).
+
+-spec hashtree_enable_nif(reference(), connection(), string(), pos_integer(), pos_integer()) ->
+                                 {ok, boolean()} | {error, term()}.
+hashtree_enable_nif(_AsyncRef, _Ref, _Table, _Segments, _Width) ->
+    ?nif_stub.
+
+%% @doc Hash every key of a table with a hashtree, and forget the hashes
+%% of keys no longer there, in small transactions alongside other writes.
+-spec hashtree_rebuild(connection(), string()) -> ok | {error, term()}.
+hashtree_rebuild(Ref, Table) ->
+    ?ASYNC_NIF_CALL(fun hashtree_rebuild_nif/3, [Ref, Table]).
+
+-spec hashtree_rebuild_nif(reference(), connection(), string()) -> ok | {error, term()}.
+hashtree_rebuild_nif(_AsyncRef, _Ref, _Table) ->
+    ?nif_stub.
+
+%% @doc Return the hashes of the children of node Bucket at Level of a
+%% table's hashtree that have any keys under them, as
+%% hashtree:get_bucket/3.  Level 1 is the root (Bucket 0), the children at
+%% the last level are segments.
+-spec hashtree_bucket(connection(), string(), pos_integer(), non_neg_integer()) ->
+                             {ok, [{non_neg_integer(), non_neg_integer()}]} | {error, term()}.
+hashtree_bucket(Ref, Table, Level, Bucket) ->
+    ?ASYNC_NIF_CALL(fun hashtree_bucket_nif/5, [Ref, Table, Level, Bucket]).
+
+-spec hashtree_bucket_nif(reference(), connection(), string(), pos_integer(), non_neg_integer()) ->
+                                 {ok, [{non_neg_integer(), non_neg_integer()}]} | {error, term()}.
+hashtree_bucket_nif(_AsyncRef, _Ref, _Table, _Level, _Bucket) ->
+    ?nif_stub.
+
+%% @doc Return the hash of each key in a segment of a table's hashtree.
+-spec hashtree_key_hashes(connection(), string(), non_neg_integer()) ->
+                                 {ok, [{key(), non_neg_integer()}]} | {error, term()}.
+hashtree_key_hashes(Ref, Table, Segment) ->
+    ?ASYNC_NIF_CALL(fun hashtree_key_hashes_nif/4, [Ref, Table, Segment]).
+
+-spec hashtree_key_hashes_nif(reference(), connection(), string(), non_neg_integer()) ->
+                                     {ok, [{key(), non_neg_integer()}]} | {error, term()}.
+hashtree_key_hashes_nif(_AsyncRef, _Ref, _Table, _Segment) ->
+    ?nif_stub.
+
+%% @doc Store Value under Key only if Key is not already present.
+-spec put_new(connection(), string(), key(), value()) -> ok | duplicate_key | {error, term()}.
+put_new(Ref, Table, Key, Value) ->
+    ?ASYNC_NIF_CALL(fun put_new_nif/5, [Ref, Table, Key, Value]).
+
+-spec put_new_nif(reference(), connection(), string(), key(), value()) -> ok | duplicate_key | {error, term()}.
+put_new_nif(_AsyncRef, _Ref, _Table, _Key, _Value) ->
+    ?nif_stub.
+
+%% @doc Change part of the value stored under Key, each {Offset, Size, Data}
+%% replaces Size bytes at Offset with Data (writing past the end pads the
+%% value with zeros).  Changes are applied in order and only they, not the
+%% whole value, cross into the NIF.  Changes that would make the value
+%% larger than 4GB are {error, {einval, _}}.
+-spec modify(connection(), string(), key(), [{non_neg_integer(), non_neg_integer(), binary()}]) ->
+                    ok | not_found | {error, term()}.
+modify(Ref, Table, Key, Changes) ->
+    ?ASYNC_NIF_CALL(fun modify_nif/5, [Ref, Table, Key, Changes]).
+
+-spec modify_nif(reference(), connection(), string(), key(), [{non_neg_integer(), non_neg_integer(), binary()}]) ->
+                        ok | not_found | {error, term()}.
+modify_nif(_AsyncRef, _Ref, _Table, _Key, _Changes) ->
+    ?nif_stub.
+
+%% @doc Append Data to the value stored under Key, or store Data if there
+%% is no such key.
+-spec append(connection(), string(), key(), binary()) -> ok | {error, term()}.
+append(Ref, Table, Key, Data) ->
+    ?ASYNC_NIF_CALL(fun append_nif/5, [Ref, Table, Key, Data]).
 
--spec put_nif(reference(), connection(), string(), key(), value()) -> ok | {error, term()}.
-put_nif(_AsyncRef, _Ref, _Table, _Key, _Value) ->
+-spec append_nif(reference(), connection(), string(), key(), binary()) -> ok | {error, term()}.
+append_nif(_AsyncRef, _Ref, _Table, _Key, _Data) ->
+    ?nif_stub.
+
+%% @doc Atomically replace the value under Key with New (or delete it) when
+%% the current value matches Expected.  Expected is the value itself,
+%% not_found when the key must be absent, or {hash, erlang:crc32(Value)} to
+%% avoid sending a large value back down.  On a mismatch the current value
+%% (or not_found) is returned.  A swap racing another write to Key is
+%% checked again against the value that write left.
+-spec compare_and_swap(connection(), string(), key(),
+                       value() | not_found | {hash, non_neg_integer()},
+                       value() | delete) ->
+                              ok | {error, {mismatch, value() | not_found}} | {error, term()}.
+compare_and_swap(Ref, Table, Key, Expected, New) ->
+    ?ASYNC_NIF_CALL(fun compare_and_swap_nif/6, [Ref, Table, Key, Expected, New]).
+
+-spec compare_and_swap_nif(reference(), connection(), string(), key(), term(), value() | delete) ->
+                                  ok | {error, {mismatch, value() | not_found}} | {error, term()}.
+compare_and_swap_nif(_AsyncRef, _Ref, _Table, _Key, _Expected, _New) ->
+    ?nif_stub.
+
+%% @doc Apply a list of puts and deletes, across one or more tables, in a
+%% single transaction.  Either every operation is applied or none are.
+-spec write_batch(connection(), [batch_op()]) -> ok | {error, term()}.
+write_batch(_Ref, []) ->
+    ok;
+write_batch(Ref, Ops) ->
+    ?ASYNC_NIF_CALL(fun write_batch_nif/3, [Ref, Ops]).
+
+-spec write_batch_nif(reference(), connection(), [batch_op()]) -> ok | {error, term()}.
+write_batch_nif(_AsyncRef, _Ref, _Ops) ->
     ?nif_stub.
 
 -spec rename(connection(), string(), string()) -> ok | {error, term()}.
@@ -252,6 +597,142 @@ verify(Ref, Name, Config) ->
 verify_nif(_AsyncRef, _Ref, _Name, _Config) ->
     ?nif_stub.
 
+%% @doc Take a snapshot of the connection's current state.  Cursors and
+%% gets opened against the snapshot, from any process, read the state as of
+%% this moment while writes continue.  WiredTiger keeps the history the
+%% snapshot needs until it is released (or garbage collected), so release
+%% it when done.  Needs a WiredTiger with named snapshots (2.6 to 3.x).
+-spec snapshot(connection()) -> {ok, snapshot()} | {error, term()}.
+snapshot(Ref) ->
+    ?ASYNC_NIF_CALL(fun snapshot_create_nif/2, [Ref]).
+
+-spec snapshot_create_nif(reference(), connection()) -> {ok, snapshot()} | {error, term()}.
+snapshot_create_nif(_AsyncRef, _Ref) ->
+    ?nif_stub.
+
+-spec snapshot_release(snapshot()) -> ok | {error, term()}.
+snapshot_release(Snapshot) ->
+    ?ASYNC_NIF_CALL(fun snapshot_release_nif/2, [Snapshot]).
+
+-spec snapshot_release_nif(reference(), snapshot()) -> ok | {error, term()}.
+snapshot_release_nif(_AsyncRef, _Snapshot) ->
+    ?nif_stub.
+
+%% @doc The snapshot's age in seconds, whether it has been released and
+%% the range of transaction IDs held by named snapshots (pinned_range), or
+%% unknown when this WiredTiger doesn't report it.  WiredTiger doesn't
+%% count the bytes of history a snapshot holds, the range of transactions
+%% whose updates must be kept is the nearest measure it has.  A snapshot
+%% that is garbage collected without being released is dropped by the
+%% connection's janitor thread shortly after.
+-spec snapshot_info(snapshot()) -> {ok, [{atom(), term()}]} | {error, term()}.
+snapshot_info(Snapshot) ->
+    ?ASYNC_NIF_CALL(fun snapshot_info_nif/2, [Snapshot]).
+
+-spec snapshot_info_nif(reference(), snapshot()) -> {ok, [{atom(), term()}]} | {error, term()}.
+snapshot_info_nif(_AsyncRef, _Snapshot) ->
+    ?nif_stub.
+
+%% @doc Open a cursor that reads the table as of the snapshot, close it
+%% with cursor_close/1 as any other.
+-spec snapshot_cursor_open(snapshot(), string()) -> {ok, cursor()} | {error, term()}.
+snapshot_cursor_open(Snapshot, Table) ->
+    ?ASYNC_NIF_CALL(fun snapshot_cursor_open_nif/3, [Snapshot, Table]).
+
+-spec snapshot_cursor_open_nif(reference(), snapshot(), string()) -> {ok, cursor()} | {error, term()}.
+snapshot_cursor_open_nif(_AsyncRef, _Snapshot, _Table) ->
+    ?nif_stub.
+
+%% @doc Read several keys as of the snapshot in one request.  Returns a
+%% value or not_found for each key, in order.
+-spec snapshot_get(snapshot(), string(), [key()]) -> {ok, [{ok, value()} | not_found]} | {error, term()}.
+snapshot_get(Snapshot, Table, Keys) ->
+    ?ASYNC_NIF_CALL(fun snapshot_get_nif/4, [Snapshot, Table, Keys]).
+
+-spec snapshot_get_nif(reference(), snapshot(), string(), [key()]) ->
+                              {ok, [{ok, value()} | not_found]} | {error, term()}.
+snapshot_get_nif(_AsyncRef, _Snapshot, _Table, _Keys) ->
+    ?nif_stub.
+
+%% @doc Open an explicit session for grouping operations into transactions.
+%% The session belongs to the calling process, only it may use the session
+%% and every operation on it is handled by the same work queue.
+-spec session_open(connection()) -> {ok, session()} | {error, term()}.
+-spec session_open(connection(), config_list()) -> {ok, session()} | {error, term()}.
+session_open(Ref) ->
+    session_open(Ref, []).
+session_open(Ref, Config) ->
+    ?ASYNC_NIF_CALL(fun session_open_nif/3, [Ref, config_to_bin(Config)]).
+
+-spec session_open_nif(reference(), connection(), config()) -> {ok, session()} | {error, term()}.
+session_open_nif(_AsyncRef, _Ref, _Config) ->
+    ?nif_stub.
+
+-spec session_close(session()) -> ok | {error, term()}.
+session_close(Session) ->
+    ?ASYNC_NIF_CALL(fun session_close_nif/2, [Session]).
+
+-spec session_close_nif(reference(), session()) -> ok | {error, term()}.
+session_close_nif(_AsyncRef, _Session) ->
+    ?nif_stub.
+
+-spec session_get(session(), string(), key()) -> {ok, value()} | not_found | {error, term()}.
+session_get(Session, Table, Key) ->
+    ?ASYNC_NIF_CALL(fun session_get_nif/4, [Session, Table, Key]).
+
+-spec session_get_nif(reference(), session(), string(), key()) -> {ok, value()} | not_found | {error, term()}.
+session_get_nif(_AsyncRef, _Session, _Table, _Key) ->
+    ?nif_stub.
+
+-spec session_put(session(), string(), key(), value()) -> ok | {error, term()}.
+session_put(Session, Table, Key, Value) ->
+    ?ASYNC_NIF_CALL(fun session_put_nif/5, [Session, Table, Key, Value]).
+
+-spec session_put_nif(reference(), session(), string(), key(), value()) -> ok | {error, term()}.
+session_put_nif(_AsyncRef, _Session, _Table, _Key, _Value) ->
+    ?nif_stub.
+
+-spec session_delete(session(), string(), key()) -> ok | not_found | {error, term()}.
+session_delete(Session, Table, Key) ->
+    ?ASYNC_NIF_CALL(fun session_delete_nif/4, [Session, Table, Key]).
+
+-spec session_delete_nif(reference(), session(), string(), key()) -> ok | not_found | {error, term()}.
+session_delete_nif(_AsyncRef, _Session, _Table, _Key) ->
+    ?nif_stub.
+
+-spec txn_begin(session()) -> ok | {error, term()}.
+-spec txn_begin(session(), config_list()) -> ok | {error, term()}.
+txn_begin(Session) ->
+    txn_begin(Session, []).
+txn_begin(Session, Config) ->
+    ?ASYNC_NIF_CALL(fun txn_begin_nif/3, [Session, config_to_bin(Config)]).
+
+-spec txn_begin_nif(reference(), session(), config()) -> ok | {error, term()}.
+txn_begin_nif(_AsyncRef, _Session, _Config) ->
+    ?nif_stub.
+
+-spec txn_commit(session()) -> ok | {error, term()}.
+-spec txn_commit(session(), config_list()) -> ok | {error, term()}.
+txn_commit(Session) ->
+    txn_commit(Session, []).
+txn_commit(Session, Config) ->
+    ?ASYNC_NIF_CALL(fun txn_commit_nif/3, [Session, config_to_bin(Config)]).
+
+-spec txn_commit_nif(reference(), session(), config()) -> ok | {error, term()}.
+txn_commit_nif(_AsyncRef, _Session, _Config) ->
+    ?nif_stub.
+
+-spec txn_abort(session()) -> ok | {error, term()}.
+-spec txn_abort(session(), config_list()) -> ok | {error, term()}.
+txn_abort(Session) ->
+    txn_abort(Session, []).
+txn_abort(Session, Config) ->
+    ?ASYNC_NIF_CALL(fun txn_abort_nif/3, [Session, config_to_bin(Config)]).
+
+-spec txn_abort_nif(reference(), session(), config()) -> ok | {error, term()}.
+txn_abort_nif(_AsyncRef, _Session, _Config) ->
+    ?nif_stub.
+
 -spec cursor_open(connection(), string()) -> {ok, cursor()} | {error, term()}.
 -spec cursor_open(connection(), string(), config_list()) -> {ok, cursor()} | {error, term()}.
 cursor_open(Ref, Table) ->
@@ -374,25 +855,444 @@ cursor_remove(Cursor, Key) ->
 cursor_remove_nif(_AsyncRef, _Cursor, _Key) ->
     ?nif_stub.
 
+%% @doc Step the cursor up to MaxCount times, stopping early once MaxBytes
+%% of keys and values have been read, and return what was found in one
+%% message.  {done, Items} means the end of the table was reached and the
+%% cursor has been reset.
+-type batch_result(Item) :: {ok, [Item]} | {done, [Item]} | {error, term()}.
+
+-spec cursor_next_batch(cursor(), pos_integer(), pos_integer()) -> batch_result({key(), value()}).
+cursor_next_batch(Cursor, MaxCount, MaxBytes) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7, [Cursor, next, kv, MaxCount, MaxBytes, raw]).
+
+-spec cursor_next_key_batch(cursor(), pos_integer(), pos_integer()) -> batch_result(key()).
+cursor_next_key_batch(Cursor, MaxCount, MaxBytes) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7, [Cursor, next, key, MaxCount, MaxBytes, raw]).
+
+-spec cursor_next_value_batch(cursor(), pos_integer(), pos_integer()) -> batch_result(value()).
+cursor_next_value_batch(Cursor, MaxCount, MaxBytes) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7, [Cursor, next, value, MaxCount, MaxBytes, raw]).
+
+-spec cursor_prev_batch(cursor(), pos_integer(), pos_integer()) -> batch_result({key(), value()}).
+cursor_prev_batch(Cursor, MaxCount, MaxBytes) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7, [Cursor, prev, kv, MaxCount, MaxBytes, raw]).
+
+-spec cursor_prev_key_batch(cursor(), pos_integer(), pos_integer()) -> batch_result(key()).
+cursor_prev_key_batch(Cursor, MaxCount, MaxBytes) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7, [Cursor, prev, key, MaxCount, MaxBytes, raw]).
+
+-spec cursor_prev_value_batch(cursor(), pos_integer(), pos_integer()) -> batch_result(value()).
+cursor_prev_value_batch(Cursor, MaxCount, MaxBytes) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7, [Cursor, prev, value, MaxCount, MaxBytes, raw]).
+
+%% @doc As the other batch functions, with the options {items, kv | key |
+%% value} (default kv) and {key_format, Format} (default raw).  A key
+%% format of sext returns keys decoded by the NIF (see sext_decode/1) and
+%% object also returns Riak object keys {o, Bucket, Key} as {Bucket, Key};
+%% keys it can't decode are returned as binaries.
+-spec cursor_batch(cursor(), next | prev, pos_integer(), pos_integer(), config_list()) ->
+                          batch_result(term()).
+cursor_batch(Cursor, Direction, MaxCount, MaxBytes, Options) ->
+    ?ASYNC_NIF_CALL(fun cursor_batch_nif/7,
+                    [Cursor, Direction, proplists:get_value(items, Options, kv),
+                     MaxCount, MaxBytes, proplists:get_value(key_format, Options, raw)]).
+
+-spec cursor_batch_nif(reference(), cursor(), next | prev, kv | key | value,
+                       pos_integer(), pos_integer(), key_format()) -> batch_result(term()).
+cursor_batch_nif(_AsyncRef, _Cursor, _Direction, _What, _MaxCount, _MaxBytes, _KeyFormat) ->
+    ?nif_stub.
+
+-define(FOLD_BATCH_COUNT, 1000).
+-define(FOLD_BATCH_BYTES, 4194304).
+
 -type fold_keys_fun() :: fun((Key::binary(), any()) -> any()).
 
 -spec fold_keys(cursor(), fold_keys_fun(), any()) -> any().
 fold_keys(Cursor, Fun, Acc0) ->
-    fold_keys(Cursor, Fun, Acc0, cursor_next_key(Cursor)).
-fold_keys(_Cursor, _Fun, Acc, not_found) ->
-    Acc;
-fold_keys(Cursor, Fun, Acc, {ok, Key}) ->
-    fold_keys(Cursor, Fun, Fun(Key, Acc), cursor_next_key(Cursor)).
+    fold_batches(fun() -> cursor_next_key_batch(Cursor, ?FOLD_BATCH_COUNT, ?FOLD_BATCH_BYTES) end,
+                 Fun, Acc0).
 
 -type fold_fun() :: fun(({Key::binary(), Value::binary()}, any()) -> any()).
 
 -spec fold(cursor(), fold_fun(), any()) -> any().
 fold(Cursor, Fun, Acc0) ->
-    fold(Cursor, Fun, Acc0, cursor_next(Cursor)).
-fold(_Cursor, _Fun, Acc, not_found) ->
+    fold_batches(fun() -> cursor_next_batch(Cursor, ?FOLD_BATCH_COUNT, ?FOLD_BATCH_BYTES) end,
+                 Fun, Acc0).
+
+fold_batches(Next, Fun, Acc) ->
+    case Next() of
+        {ok, Items} ->
+            fold_batches(Next, Fun, lists:foldl(Fun, Acc, Items));
+        {done, Items} ->
+            lists:foldl(Fun, Acc, Items)
+    end.
+
+-type range_start() :: first | key().
+-type range_end() :: last | key() | {before, key()} | {prefix, binary()}.
+-type filter() :: all
+                | {prefix, binary()}
+                | {range, key(), key()}
+                | {key_size, non_neg_integer(), non_neg_integer()}
+                | {value_size, non_neg_integer(), non_neg_integer()}
+                | {element, pos_integer(), eq | ne | lt | le | gt | ge, binary()}
+                | {'and', [filter()]}
+                | {'or', [filter()]}
+                | {'not', filter()}.
+
+%% @doc Stream the records from Start (the first key at or after it) to End
+%% (inclusive, or exclusive when {before, Key}, or while keys share a
+%% prefix) to the calling process in
+%% chunks.  Each chunk arrives as {wterl_stream, Ref, {data, Items}} and
+%% the last as {wterl_stream, Ref, {done, Items}}, or {wterl_stream, Ref,
+%% {error, Reason}}, where Ref is element(1, Stream).  Every chunk uses one
+%% credit and the producer stops when out of credit, grant more with
+%% stream_ack/2.  Options:
+%%   {credits, N}       chunks to send before waiting for an ack (default 2)
+%%   {batch_count, N}   maximum records per chunk (default 1000)
+%%   {batch_bytes, N}   maximum bytes of keys and values per chunk (4MB)
+%%   {items, kv | key | value | chunk}  what each item is (default kv,
+%%                      {Key, Value}), chunk sends each chunk's records
+%%                      as one binary in place of Items, see export_table/3
+%%   {compress, none | snappy}  compress chunks of items chunk (default none)
+%%   {key_format, raw | sext | object}  how keys are sent, see cursor_batch/5
+%%   {filter, Filter}   only send records that match Filter (default all),
+%%                      evaluated by the NIF as it reads the range
+%%   {close_cursor, true | false}  close the cursor when the stream is
+%%                      done or closed (default false)
+%% A filter is a key prefix, an inclusive key range, bounds on the sizes
+%% of keys or values, a comparison of element N of a sext encoded tuple
+%% key with a sext encoded term, or 'and', 'or' and 'not' of filters.
+%% Keys that aren't tuples never match an element filter.  A tuple key
+%% with a float, bignum, pid, port, ref or bitstring at or before element
+%% N can't be walked by the NIF, and ends the stream with {error, badarg}.
+%% The stream has the cursor until it is done or closed, other operations
+%% on the cursor (cursor_close/1 included) return {error, {ebusy, _}}.
+-spec stream_range(cursor(), range_start(), range_end(), config_list()) -> {ok, stream()} | {error, term()}.
+stream_range(Cursor, Start, End, Options) ->
+    Ref = make_ref(),
+    Args = [Cursor, Ref, Start, End,
+            proplists:get_value(items, Options, kv),
+            proplists:get_value(credits, Options, 2),
+            proplists:get_value(batch_count, Options, ?FOLD_BATCH_COUNT),
+            proplists:get_value(batch_bytes, Options, ?FOLD_BATCH_BYTES),
+            proplists:get_value(filter, Options, all),
+            proplists:get_value(key_format, Options, raw),
+            proplists:get_value(compress, Options, none),
+            proplists:get_value(close_cursor, Options, false)],
+    case ?ASYNC_NIF_CALL(fun stream_range_nif/13, Args) of
+        {ok, Handle} ->
+            {ok, {Ref, Handle}};
+        Error ->
+            Error
+    end.
+
+-spec stream_range_nif(reference(), cursor(), reference(), range_start(), range_end(),
+                       kv | key | value | chunk, non_neg_integer(), pos_integer(), pos_integer(),
+                       filter(), key_format(), none | snappy, boolean()) ->
+                              {ok, reference()} | {error, term()}.
+stream_range_nif(_AsyncRef, _Cursor, _Ref, _Start, _End, _Items, _Credits, _Count, _Bytes, _Filter,
+                 _KeyFormat, _Compress, _CloseCursor) ->
+    ?nif_stub.
+
+-spec stream_ack(stream(), pos_integer()) -> ok.
+stream_ack({_Ref, Handle}, Credits) ->
+    ?ASYNC_NIF_CALL(fun stream_ack_nif/3, [Handle, Credits]).
+
+-spec stream_ack_nif(reference(), reference(), pos_integer()) -> ok.
+stream_ack_nif(_AsyncRef, _Handle, _Credits) ->
+    ?nif_stub.
+
+%% @doc Stop a stream and discard any chunks already sent.  Waits for a
+%% chunk being read to be sent, so none arrive after this returns and the
+%% cursor can be closed or used again.
+-spec stream_close(stream()) -> ok.
+stream_close({Ref, Handle}) ->
+    ok = ?ASYNC_NIF_CALL(fun stream_close_nif/2, [Handle]),
+    flush_stream(Ref).
+
+-spec stream_close_nif(reference(), reference()) -> ok.
+stream_close_nif(_AsyncRef, _Handle) ->
+    ?nif_stub.
+
+flush_stream(Ref) ->
+    receive
+        {wterl_stream, Ref, _} ->
+            flush_stream(Ref)
+    after 0 ->
+            ok
+    end.
+
+-define(EXPORT_BATCH_COUNT, 100000).
+
+%% @doc Stream a whole table to the calling process as chunks, to be
+%% loaded into another table with import_chunk/2, for moving a table (say
+%% a vnode's data in handoff) in a few large messages rather than one per
+%% record.  Each chunk is a binary <<Format:8, Count:32, Records/binary>>
+%% holding up to 4MB of records <<KeySize:32, Key, ValueSize:32, Value>>
+%% in key order, snappy compressed unless Options has {compress, none}.
+%% Options are as stream_range/4, apart from items, and the stream is
+%% driven the same way.  The table's cursor is closed when the stream is
+%% done or closed with stream_close/1.
+-spec export_table(connection(), string(), config_list()) -> {ok, stream()} | {error, term()}.
+export_table(ConnRef, Table, Options) ->
+    case cursor_open(ConnRef, Table, [{raw, true}]) of
+        {ok, Cursor} ->
+            case stream_range(Cursor, first, last,
+                              [{items, chunk}, {close_cursor, true}] ++ Options ++
+                                  [{compress, snappy},
+                                   {batch_count, ?EXPORT_BATCH_COUNT},
+                                   {batch_bytes, ?FOLD_BATCH_BYTES}]) of
+                {ok, Stream} ->
+                    {ok, Stream};
+                Error ->
+                    cursor_close(Cursor),
+                    Error
+            end;
+        Error ->
+            Error
+    end.
+
+%% @doc Open a cursor to load chunks from export_table/3 into Table with
+%% import_chunk/2.  A new, empty table is loaded with a bulk cursor, which
+%% writes the table's pages directly, otherwise (or when the table is in
+%% use, or keeps a hashtree) the records are inserted as usual,
+%% overwriting existing ones, which a TTL enabled table refuses.  The load is complete once the cursor is
+%% closed with cursor_close/1.
+-spec import_open(connection(), string()) -> {ok, cursor()} | {error, term()}.
+import_open(ConnRef, Table) ->
+    case cursor_open(ConnRef, Table, [{raw, true}, {bulk, true}]) of
+        {ok, Cursor} ->
+            {ok, Cursor};
+        %% Not empty (einval), in use (ebusy) or keeping a hashtree (enotsup).
+        {error, {Reason, _}} when Reason =:= einval; Reason =:= ebusy; Reason =:= enotsup ->
+            cursor_open(ConnRef, Table, [{raw, true}, {overwrite, true}]);
+        Error ->
+            Error
+    end.
+
+%% @doc Insert the records of a chunk from export_table/3, returning how
+%% many there were.  Chunks must be imported in the order they were sent.
+-spec import_chunk(cursor(), binary()) -> {ok, non_neg_integer()} | {error, term()}.
+import_chunk(Cursor, Chunk) ->
+    ?ASYNC_NIF_CALL(fun cursor_import_nif/3, [Cursor, Chunk]).
+
+-spec cursor_import_nif(reference(), cursor(), binary()) -> {ok, non_neg_integer()} | {error, term()}.
+cursor_import_nif(_AsyncRef, _Cursor, _Chunk) ->
+    ?nif_stub.
+
+%% @doc Fold over a range using stream_range/4, acknowledging each chunk
+%% before folding it so the next is read while this one is processed.
+-spec fold_range(cursor(), range_start(), range_end(), fold_fun() | fold_keys_fun(), any(), config_list()) ->
+                        any() | {error, term()}.
+fold_range(Cursor, Start, End, Fun, Acc0, Options) ->
+    case stream_range(Cursor, Start, End, Options) of
+        {ok, Stream} ->
+            try
+                fold_stream(Stream, Fun, Acc0)
+            catch
+                Class:Reason ->
+                    stream_close(Stream),
+                    erlang:raise(Class, Reason, erlang:get_stacktrace())
+            end;
+        Error ->
+            Error
+    end.
+
+fold_stream({Ref, _Handle}=Stream, Fun, Acc) ->
+    receive
+        {wterl_stream, Ref, {data, Items}} ->
+            ok = stream_ack(Stream, 1),
+            fold_stream(Stream, Fun, lists:foldl(Fun, Acc, Items));
+        {wterl_stream, Ref, {done, Items}} ->
+            lists:foldl(Fun, Acc, Items);
+        {wterl_stream, Ref, {error, _}=Error} ->
+            Error
+    end.
+
+-type aggregate() :: count | key_bytes | value_bytes | min_key | max_key.
+
+%% @doc Compute aggregates over a table, or a range of it, in the NIF
+%% without reading the records into Erlang.  Range is all, {Start, End} or
+%% {Start, End, Filter} (see stream_range/4).  Returns the aggregates in
+%% the order asked for, min_key and max_key are not_found when nothing
+%% matches.  The first and last keys of a range alone are found by seeking,
+%% the others scan the range, as does any aggregate of a table with expiry
+%% enabled, whose expired records are skipped.  Merge operands aren't
+%% applied.
+-spec aggregate(connection(), string(), all | {range_start(), range_end()} | {range_start(), range_end(), filter()},
+                [aggregate()]) -> {ok, [{aggregate(), non_neg_integer() | key() | not_found}]} | {error, term()}.
+aggregate(Ref, Table, all, Aggregates) ->
+    aggregate(Ref, Table, {first, last, all}, Aggregates);
+aggregate(Ref, Table, {Start, End}, Aggregates) ->
+    aggregate(Ref, Table, {Start, End, all}, Aggregates);
+aggregate(Ref, Table, {Start, End, Filter}, Aggregates) ->
+    ?ASYNC_NIF_CALL(fun aggregate_nif/7, [Ref, Table, Start, End, Filter, Aggregates]).
+
+-spec aggregate_nif(reference(), connection(), string(), range_start(), range_end(), filter(), [aggregate()]) ->
+                           {ok, [{aggregate(), non_neg_integer() | key() | not_found}]} | {error, term()}.
+aggregate_nif(_AsyncRef, _Ref, _Table, _Start, _End, _Filter, _Aggregates) ->
+    ?nif_stub.
+
+%% @doc Read the objects an index refers to in one call.  The values of
+%% IndexTable are keys in ObjectTable: the entries from Start to End are
+%% walked and each object looked up on the same session and snapshot,
+%% skipping entries whose object is gone.  Returns {IndexKey, ObjectKey,
+%% Object} items, and a continuation (the index key to start from next)
+%% when max_count (default 1000) or max_bytes (default 4MB) cut it short.
+-spec index_join(connection(), string(), string(), range_start(), range_end(), config_list()) ->
+                        {done, [{key(), key(), value()}]} | {more, [{key(), key(), value()}], key()} |
+                        {error, term()}.
+index_join(Ref, IndexTable, ObjectTable, Start, End, Options) ->
+    ?ASYNC_NIF_CALL(fun index_join_nif/8,
+                    [Ref, IndexTable, ObjectTable, Start, End,
+                     proplists:get_value(max_count, Options, ?FOLD_BATCH_COUNT),
+                     proplists:get_value(max_bytes, Options, ?FOLD_BATCH_BYTES)]).
+
+-spec index_join_nif(reference(), connection(), string(), string(), range_start(), range_end(),
+                     pos_integer(), pos_integer()) ->
+                            {done, [{key(), key(), value()}]} | {more, [{key(), key(), value()}], key()} |
+                            {error, term()}.
+index_join_nif(_AsyncRef, _Ref, _IndexTable, _ObjectTable, _Start, _End, _MaxCount, _MaxBytes) ->
+    ?nif_stub.
+
+%% @doc The distinct values of element N of the sext encoded tuples that
+%% are the keys from Start to End, as their sext encodings in key order,
+%% e.g. the buckets of a table of {o, Bucket, Key}.  The range is
+%% skip-scanned in the NIF: one seek past each value's keys rather than a
+%% read of every key.  Keys that aren't tuples are skipped, a tuple with
+%% an element the NIF can't walk at or before N (see stream_range/4) is
+%% {error, badarg}.
+-spec distinct_elements(connection(), string(), range_start(), range_end(), pos_integer()) ->
+                               {ok, [binary()]} | {error, term()}.
+distinct_elements(Ref, Table, Start, End, N) ->
+    ?ASYNC_NIF_CALL(fun distinct_elements_nif/6, [Ref, Table, Start, End, N]).
+
+-spec distinct_elements_nif(reference(), connection(), string(), range_start(), range_end(),
+                            pos_integer()) -> {ok, [binary()]} | {error, term()}.
+distinct_elements_nif(_AsyncRef, _Ref, _Table, _Start, _End, _N) ->
+    ?nif_stub.
+
+%% @doc Is the table empty?  One seek on a cached cursor, or a scan to the
+%% first key that hasn't expired when the table has expiry enabled.
+-spec is_empty(connection(), string()) -> boolean() | {error, term()}.
+is_empty(Ref, Table) ->
+    case aggregate(Ref, Table, all, [min_key]) of
+        {ok, [{min_key, not_found}]} ->
+            true;
+        {ok, _} ->
+            false;
+        Error ->
+            Error
+    end.
+
+-define(PARALLEL_FOLD_SAMPLES, 16).
+
+%% @doc Fold over a whole table in Parallelism key ranges at once.  The
+%% ranges are split at keys sampled with a next_random cursor, and each is
+%% folded with fold_range/6 from Acc0 in its own process on its own cursor
+%% (and so its own session and worker).  Returns the partial results for
+%% the caller to merge, in key order or, with {ordered, false}, in the
+%% order the ranges finish.  Options are passed on to fold_range/6.
+%% Tables that can't be sampled (e.g. LSM trees) are folded as one range.
+-spec parallel_fold(connection(), string(), pos_integer(), fold_fun() | fold_keys_fun(), any(), config_list()) ->
+                           {ok, [any()]} | {error, term()}.
+parallel_fold(ConnRef, Uri, Parallelism, Fun, Acc0, Options)
+  when is_integer(Parallelism), Parallelism > 0 ->
+    Ranges = split_ranges(first, split_points(ConnRef, Uri, Parallelism)),
+    Workers = [spawn_monitor(fun() ->
+                                     exit({parallel_fold, parallel_fold_range(ConnRef, Uri, Range,
+                                                                              Fun, Acc0, Options)})
+                             end) || Range <- Ranges],
+    case proplists:get_value(ordered, Options, true) of
+        true ->
+            collect_ordered(Workers, []);
+        false ->
+            collect_unordered(Workers, [])
+    end.
+
+split_points(ConnRef, Uri, Parallelism) ->
+    case cursor_open(ConnRef, Uri, [{raw, true}, {next_random, true}]) of
+        {ok, Cursor} ->
+            Samples = sample_keys(Cursor, Parallelism * ?PARALLEL_FOLD_SAMPLES, []),
+            cursor_close(Cursor),
+            Sorted = lists:usort(Samples),
+            Step = length(Sorted) / Parallelism,
+            lists:usort([lists:nth(trunc(N * Step) + 1, Sorted)
+                         || Sorted =/= [], N <- lists:seq(1, Parallelism - 1)]);
+        {error, _} ->
+            []
+    end.
+
+sample_keys(_Cursor, 0, Acc) ->
     Acc;
-fold(Cursor, Fun, Acc, {ok, Key, Value}) ->
-    fold(Cursor, Fun, Fun({Key, Value}, Acc), cursor_next(Cursor)).
+sample_keys(Cursor, N, Acc) ->
+    case cursor_next_key(Cursor) of
+        {ok, Key} ->
+            sample_keys(Cursor, N - 1, [Key | Acc]);
+        _ ->
+            Acc
+    end.
+
+split_ranges(Start, []) ->
+    [{Start, last}];
+split_ranges(Start, [Split | Rest]) ->
+    [{Start, {before, Split}} | split_ranges(Split, Rest)].
+
+parallel_fold_range(ConnRef, Uri, {Start, End}, Fun, Acc0, Options) ->
+    case cursor_open(ConnRef, Uri) of
+        {ok, Cursor} ->
+            try
+                fold_range(Cursor, Start, End, Fun, Acc0, Options)
+            after
+                cursor_close(Cursor)
+            end;
+        Error ->
+            Error
+    end.
+
+collect_ordered([], Acc) ->
+    {ok, lists:reverse(Acc)};
+collect_ordered([{Pid, MRef} | Rest]=Workers, Acc) ->
+    receive
+        {'DOWN', MRef, process, Pid, {parallel_fold, Result}} ->
+            collect_ordered(Rest, [Result | Acc]);
+        {'DOWN', MRef, process, Pid, Reason} ->
+            kill_workers(Workers),
+            {error, Reason}
+    end.
+
+collect_unordered(Workers, Acc) ->
+    collect_unordered(Workers, Acc, []).
+
+%% Monitors that aren't ours are set aside and put back once we're done.
+collect_unordered([], Acc, Others) ->
+    [self() ! Msg || Msg <- lists:reverse(Others)],
+    {ok, lists:reverse(Acc)};
+collect_unordered(Workers, Acc, Others) ->
+    receive
+        {'DOWN', MRef, process, Pid, Reason}=Msg ->
+            case lists:member({Pid, MRef}, Workers) of
+                false ->
+                    collect_unordered(Workers, Acc, [Msg | Others]);
+                true ->
+                    Rest = lists:delete({Pid, MRef}, Workers),
+                    case Reason of
+                        {parallel_fold, Result} ->
+                            collect_unordered(Rest, [Result | Acc], Others);
+                        _ ->
+                            kill_workers(Rest),
+                            [self() ! Other || Other <- lists:reverse(Others)],
+                            {error, Reason}
+                    end
+            end
+    end.
+
+kill_workers(Workers) ->
+    [begin
+         erlang:demonitor(MRef, [flush]),
+         exit(Pid, kill)
+     end || {Pid, MRef} <- Workers],
+    ok.
 
 priv_dir() ->
     case code:priv_dir(?MODULE) of
@@ -459,6 +1359,7 @@ config_to_bin([{Key, Value} | Rest], Acc) ->
      {bloom_hash_count, integer},
      {bloom_newest, bool},
      {bloom_oldest, bool},
+     {bulk, bool},
      {cache_size, string},
      {checkpoint, config},
      {checkpoint_sync, bool},
@@ -489,12 +1390,14 @@ config_to_bin([{Key, Value} | Rest], Acc) ->
      {merge_threads, integer},
      {multiprocess, bool},
      {name, string},
+     {next_random, bool},
      {overwrite, bool},
      {prefix_compression, bool},
      {raw, bool},
      {session_max, integer},
      {statistics, list},
      {statistics_log, config},
+     {sync, bool},
      {target, {list, quoted}},
      {to, string},
      {transaction_sync, string},
@@ -519,6 +1422,25 @@ config_to_bin([{Key, Value} | Rest], Acc) ->
     end.
 
 
+%% @doc sext:encode/1 in the NIF for tuples of binaries, atoms and integers
+%% from 0 to 2^31-1 (such as Riak's object and index keys), badarg for
+%% other terms.
+-spec sext_encode(term()) -> binary().
+sext_encode(_Term) ->
+    ?nif_stub.
+
+%% @doc sext:prefix/1 in the NIF, the encoding of a pattern up to its first
+%% wildcard ('_' or '$N'), for the same terms as sext_encode/1.
+-spec sext_prefix(term()) -> binary().
+sext_prefix(_Pattern) ->
+    ?nif_stub.
+
+%% @doc sext:decode/1 in the NIF for what sext_encode/1 produces, badarg
+%% for anything else.
+-spec sext_decode(binary()) -> term().
+sext_decode(_Bin) ->
+    ?nif_stub.
+
 -spec set_event_handler_pid(pid()) -> ok.
 set_event_handler_pid(Pid)
   when is_pid(Pid) ->
@@ -595,6 +1517,491 @@ insert_delete_test() ->
     ?assertMatch(not_found,  get(ConnRef, "table:test", <<"a">>)),
     ok = connection_close(ConnRef).
 
+write_batch_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, create(ConnRef, "table:other")),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    ?assertMatch(ok, write_batch(ConnRef, [{put, "table:test", <<"b">>, <<"banana">>},
+                                           {put, "table:other", <<"b">>, <<"index">>},
+                                           {delete, "table:test", <<"a">>},
+                                           {delete, "table:test", <<"z">>}])),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch({ok, <<"banana">>}, get(ConnRef, "table:test", <<"b">>)),
+    ?assertMatch({ok, <<"index">>}, get(ConnRef, "table:other", <<"b">>)),
+    ?assertError(badarg, write_batch(ConnRef, [{put, "table:test", <<"c">>, <<"cherry">>},
+                                               {put, "table:test", <<>>, <<"bad">>}])),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"c">>)),
+    ?assertMatch(ok, write_batch(ConnRef, [])),
+    ok = connection_close(ConnRef).
+
+transaction_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    {ok, Session} = session_open(ConnRef, [{isolation, "snapshot"}]),
+    ?assertMatch(ok, txn_begin(Session)),
+    ?assertMatch(ok, session_put(Session, "table:test", <<"a">>, <<"apple">>)),
+    ?assertMatch({ok, <<"apple">>}, session_get(Session, "table:test", <<"a">>)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch(ok, txn_abort(Session)),
+    ?assertMatch(not_found, session_get(Session, "table:test", <<"a">>)),
+    ?assertMatch(ok, txn_begin(Session, [{isolation, "snapshot"}])),
+    ?assertMatch(ok, session_put(Session, "table:test", <<"b">>, <<"banana">>)),
+    ?assertMatch(ok, txn_commit(Session)),
+    ?assertMatch({ok, <<"banana">>}, get(ConnRef, "table:test", <<"b">>)),
+    Self = self(),
+    spawn(fun() -> Self ! {other, catch session_get(Session, "table:test", <<"b">>)} end),
+    receive {other, Other} -> ?assertMatch({'EXIT', {badarg, _}}, Other) end,
+    ?assertMatch(ok, session_close(Session)),
+    ok = connection_close(ConnRef).
+
+conditional_write_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, put_new(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    ?assertMatch(duplicate_key, put_new(ConnRef, "table:test", <<"a">>, <<"apricot">>)),
+    ?assertMatch({ok, <<"apple">>}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch({error, {mismatch, <<"apple">>}},
+                 compare_and_swap(ConnRef, "table:test", <<"a">>, <<"pear">>, <<"x">>)),
+    ?assertMatch(ok, compare_and_swap(ConnRef, "table:test", <<"a">>, <<"apple">>, <<"avocado">>)),
+    ?assertMatch(ok, compare_and_swap(ConnRef, "table:test", <<"a">>,
+                                      {hash, erlang:crc32(<<"avocado">>)}, <<"acai">>)),
+    ?assertMatch({ok, <<"acai">>}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch({error, {mismatch, not_found}},
+                 compare_and_swap(ConnRef, "table:test", <<"b">>, <<"banana">>, <<"x">>)),
+    ?assertMatch(ok, compare_and_swap(ConnRef, "table:test", <<"b">>, not_found, <<"banana">>)),
+    ?assertMatch(ok, compare_and_swap(ConnRef, "table:test", <<"b">>, <<"banana">>, delete)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"b">>)),
+    ok = connection_close(ConnRef).
+
+modify_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, append(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    ?assertMatch(ok, append(ConnRef, "table:test", <<"a">>, <<" pie">>)),
+    ?assertMatch({ok, <<"apple pie">>}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch(ok, modify(ConnRef, "table:test", <<"a">>, [{0, 5, <<"cherry">>},
+                                                             {11, 0, <<"s">>}])),
+    ?assertMatch({ok, <<"cherry pies">>}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch(ok, modify(ConnRef, "table:test", <<"a">>, [{13, 0, <<"!">>}])),
+    ?assertMatch({ok, <<"cherry pies", 0, 0, "!">>}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch(not_found, modify(ConnRef, "table:test", <<"b">>, [{0, 0, <<"x">>}])),
+    ?assertMatch({error, {einval, _}},
+                 modify(ConnRef, "table:test", <<"a">>, [{16#ffffffffffffffff, 0, <<"x">>}])),
+    ?assertMatch({ok, <<"cherry pies", 0, 0, "!">>}, get(ConnRef, "table:test", <<"a">>)),
+    ok = connection_close(ConnRef).
+
+ttl_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR, [{create,true},{ttl_reap_interval,1}]),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch({error, {einval, _}}, put(ConnRef, "table:test", <<"a">>, <<"apple">>, [{ttl, 1}])),
+    ?assertMatch(ok, ttl_enable(ConnRef, "table:test")),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apple">>, [{ttl, 1}])),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"b">>, <<"banana">>, [{ttl, 1}])),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"b">>, <<"banana">>)),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"c">>, <<"cherry">>, [{ttl, 3600}])),
+    ?assertMatch({ok, <<"apple">>}, get(ConnRef, "table:test", <<"a">>)),
+    timer:sleep(3000),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch({ok, <<"banana">>}, get(ConnRef, "table:test", <<"b">>)),
+    ?assertMatch({ok, <<"cherry">>}, get(ConnRef, "table:test", <<"c">>)),
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertMatch({ok, <<"b">>, <<"banana">>}, cursor_next(Cursor)),
+    ok = cursor_close(Cursor),
+    ?assertMatch(ok, delete(ConnRef, "table:test", <<"c">>)),
+    {ok, TTLCursor} = cursor_open(ConnRef, "table:test-ttl"),
+    ?assertMatch(not_found, cursor_next(TTLCursor)),
+    ok = cursor_close(TTLCursor),
+    %% There is no limit on the tables with TTLs.
+    Tables = ["table:t" ++ integer_to_list(I) || I <- lists:seq(1, 40)],
+    [?assertMatch(ok, create(ConnRef, T)) || T <- Tables],
+    [?assertMatch(ok, ttl_enable(ConnRef, T)) || T <- Tables],
+    ?assertMatch(ok, put(ConnRef, lists:last(Tables), <<"a">>, <<"apple">>, [{ttl, 3600}])),
+    ok = connection_close(ConnRef).
+
+ttl_reads_test() ->
+    %% Expired keys the reaper hasn't removed yet are skipped by cursors,
+    %% folds and streams.
+    ConnRef = open_test_conn(?TEST_DATA_DIR, [{create,true},{ttl_reap_interval,3600}]),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, ttl_enable(ConnRef, "table:test")),
+    [?assertMatch(ok, put(ConnRef, "table:test", K, V, Opts)) ||
+        {K, V, Opts} <- [{<<"a">>, <<"apple">>, [{ttl, 1}]},
+                         {<<"b">>, <<"banana">>, []},
+                         {<<"c">>, <<"cherry">>, [{ttl, 1}]},
+                         {<<"d">>, <<"date">>, []}]],
+    timer:sleep(2000),
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertMatch({ok, <<"b">>, <<"banana">>}, cursor_next(Cursor)),
+    ?assertMatch({ok, <<"d">>, <<"date">>}, cursor_next(Cursor)),
+    ?assertMatch(not_found, cursor_next(Cursor)),
+    ?assertMatch(not_found, cursor_search(Cursor, <<"c">>)),
+    ?assertEqual([<<"d">>, <<"b">>], fold_keys(Cursor, fun(K, Acc) -> [K | Acc] end, [])),
+    ?assertEqual([<<"d">>, <<"b">>],
+                 fold_range(Cursor, first, last, fun({K, _V}, Acc) -> [K | Acc] end, [], [])),
+    ok = cursor_close(Cursor),
+    ?assertMatch({ok, [{count, 2}, {min_key, <<"b">>}, {max_key, <<"d">>}]},
+                 aggregate(ConnRef, "table:test", all, [count, min_key, max_key])),
+    ?assertMatch({ok, [{min_key, <<"b">>}]},
+                 aggregate(ConnRef, "table:test", {<<"a">>, last}, [min_key])),
+    ?assertMatch({ok, [{min_key, not_found}]},
+                 aggregate(ConnRef, "table:test", {<<"c">>, {before, <<"d">>}}, [min_key])),
+    ?assertNot(is_empty(ConnRef, "table:test")),
+    %% An expired key is missing to the writes which look for it.
+    ?assertMatch({error, {mismatch, not_found}},
+                 compare_and_swap(ConnRef, "table:test", <<"a">>, <<"apple">>, <<"apricot">>)),
+    ?assertMatch(not_found, modify(ConnRef, "table:test", <<"a">>, [{0, 1, <<"A">>}])),
+    ?assertMatch(ok, put_new(ConnRef, "table:test", <<"c">>, <<"currant">>)),
+    ?assertMatch({ok, <<"currant">>}, get(ConnRef, "table:test", <<"c">>)),
+    ok = connection_close(ConnRef),
+    %% Expiry is still enabled after reopening the connection.
+    {ok, CWD} = file:get_cwd(),
+    {ok, ConnRef2} = connection_open(filename:join([CWD, ?TEST_DATA_DIR]), [{create, true}]),
+    ?assertMatch(ok, put(ConnRef2, "table:test", <<"e">>, <<"elderberry">>, [{ttl, 3600}])),
+    ?assertMatch(not_found, get(ConnRef2, "table:test", <<"a">>)),
+    ok = connection_close(ConnRef2).
+
+ttl_writes_test() ->
+    %% Each write replaces the key's expiry time, so the reaper leaves keys
+    %% written again without a TTL alone.
+    ConnRef = open_test_conn(?TEST_DATA_DIR, [{create,true},{ttl_reap_interval,1}]),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, ttl_enable(ConnRef, "table:test")),
+    [?assertMatch(ok, put(ConnRef, "table:test", K, <<"old">>, [{ttl, 1}])) ||
+        K <- [<<"a">>, <<"b">>, <<"c">>, <<"d">>, <<"e">>]],
+    ?assertMatch(ok, write_batch(ConnRef, [{put, "table:test", <<"a">>, <<"apple">>}])),
+    ?assertMatch(ok, compare_and_swap(ConnRef, "table:test", <<"b">>, <<"old">>, <<"banana">>)),
+    ?assertMatch(ok, append(ConnRef, "table:test", <<"c">>, <<"!">>)),
+    ?assertMatch(ok, modify(ConnRef, "table:test", <<"d">>, [{0, 3, <<"new">>}])),
+    timer:sleep(3000),
+    ?assertMatch({ok, <<"apple">>}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch({ok, <<"banana">>}, get(ConnRef, "table:test", <<"b">>)),
+    ?assertMatch({ok, <<"old!">>}, get(ConnRef, "table:test", <<"c">>)),
+    ?assertMatch({ok, <<"new">>}, get(ConnRef, "table:test", <<"d">>)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"e">>)),
+    %% Writes which would leave the expiry times behind are refused.
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertMatch({error, {enotsup, _}}, cursor_insert(Cursor, <<"f">>, <<"fig">>)),
+    ok = cursor_close(Cursor),
+    %% Truncating the table removes its expiry times.
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"g">>, <<"grape">>, [{ttl, 3600}])),
+    ?assertMatch(ok, truncate(ConnRef, "table:test")),
+    {ok, TTLCursor} = cursor_open(ConnRef, "table:test-ttl"),
+    ?assertMatch(not_found, cursor_next(TTLCursor)),
+    ok = cursor_close(TTLCursor),
+    %% Dropping it drops them.
+    ?assertMatch(ok, drop(ConnRef, "table:test")),
+    ?assertMatch({error, {enoent, _}}, cursor_open(ConnRef, "table:test-ttl")),
+    ok = connection_close(ConnRef).
+
+hashtree_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    ?assertError(badarg, hashtree_enable(ConnRef, "table:test", [{segments, 100}, {width, 16}])),
+    ?assertMatch({ok, false}, hashtree_enable(ConnRef, "table:test", [{segments, 256}, {width, 16}])),
+    ?assertMatch({ok, []}, hashtree_bucket(ConnRef, "table:test", 1, 0)),
+    ?assertMatch(ok, hashtree_rebuild(ConnRef, "table:test")),
+    {ok, [{_, RootA}]} = hashtree_bucket(ConnRef, "table:test", 1, 0),
+    [?assertMatch(ok, put(ConnRef, "table:test", K, V)) ||
+        {K, V} <- [{<<"b">>, <<"banana">>}, {<<"c">>, <<"cherry">>}]],
+    ?assertMatch(ok, write_batch(ConnRef, [{put, "table:test", <<"d">>, <<"date">>},
+                                           {delete, "table:test", <<"c">>}])),
+    ?assertMatch(ok, delete(ConnRef, "table:test", <<"b">>)),
+    ?assertMatch(ok, delete(ConnRef, "table:test", <<"d">>)),
+    %% Back to just "a", the hashes are back where they were.
+    ?assertMatch({ok, [{_, RootA}]}, hashtree_bucket(ConnRef, "table:test", 1, 0)),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"e">>, <<"elderberry">>)),
+    Segments = [{R * 16 + S, H} || {R, _} <- element(2, hashtree_bucket(ConnRef, "table:test", 1, 0)),
+                                   {S, H} <- element(2, hashtree_bucket(ConnRef, "table:test", 2, R))],
+    KeyHashes = lists:append([element(2, hashtree_key_hashes(ConnRef, "table:test", S))
+                              || {S, _} <- Segments]),
+    ?assertEqual([<<"a">>, <<"e">>], lists:sort([K || {K, _} <- KeyHashes])),
+    %% A segment's hash is the exclusive or of its keys'.
+    [?assertEqual(H, lists:foldl(fun({_, KH}, X) -> X bxor KH end, 0,
+                                 element(2, hashtree_key_hashes(ConnRef, "table:test", S))))
+     || {S, H} <- Segments],
+    %% A rebuild finds the same hashes.
+    {ok, Root} = hashtree_bucket(ConnRef, "table:test", 1, 0),
+    ?assertMatch(ok, hashtree_rebuild(ConnRef, "table:test")),
+    ?assertEqual({ok, Root}, hashtree_bucket(ConnRef, "table:test", 1, 0)),
+    %% Writes which would leave the hashtree behind are refused.
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertMatch({error, {enotsup, _}}, cursor_insert(Cursor, <<"f">>, <<"fig">>)),
+    ok = cursor_close(Cursor),
+    ?assertMatch({error, {enotsup, _}},
+                 compare_and_swap(ConnRef, "table:test", <<"a">>, <<"apple">>, delete)),
+    %% Truncating a range removes its keys' hashes.
+    ?assertMatch(ok, truncate(ConnRef, "table:test", <<"b">>, <<"z">>)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"e">>)),
+    ?assertMatch({ok, [{_, RootA}]}, hashtree_bucket(ConnRef, "table:test", 1, 0)),
+    ?assertMatch({error, {einval, _}}, hashtree_bucket(ConnRef, "table:test", 3, 0)),
+    ?assertMatch({error, {einval, _}}, ttl_enable(ConnRef, "table:test")),
+    ok = connection_close(ConnRef),
+    %% The hashtree is enabled again when the connection is reopened.
+    {ok, CWD} = file:get_cwd(),
+    {ok, ConnRef2} = connection_open(filename:join([CWD, ?TEST_DATA_DIR]), [{create, true}]),
+    ?assertMatch(ok, put(ConnRef2, "table:test", <<"g">>, <<"grape">>)),
+    ?assertNotMatch({ok, [{_, RootA}]}, hashtree_bucket(ConnRef2, "table:test", 1, 0)),
+    ?assertMatch(ok, delete(ConnRef2, "table:test", <<"g">>)),
+    ?assertMatch({ok, [{_, RootA}]}, hashtree_bucket(ConnRef2, "table:test", 1, 0)),
+    ?assertMatch(ok, put_new(ConnRef2, "table:test", <<"g">>, <<"grape">>)),
+    ?assertMatch(duplicate_key, put_new(ConnRef2, "table:test", <<"g">>, <<"guava">>)),
+    ?assertMatch(ok, delete(ConnRef2, "table:test", <<"g">>)),
+    ?assertMatch({ok, [{_, RootA}]}, hashtree_bucket(ConnRef2, "table:test", 1, 0)),
+    %% Dropping the table drops its hashtree.
+    ?assertMatch(ok, drop(ConnRef2, "table:test")),
+    ?assertMatch({error, {enoent, _}}, cursor_open(ConnRef2, "table:test-aae")),
+    ok = connection_close(ConnRef2).
+
+index_join_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ?assertMatch(ok, create(ConnRef, "table:objects")),
+    ?assertMatch(ok, create(ConnRef, "table:colour")),
+    [?assertMatch(ok, put(ConnRef, "table:objects", K, V)) ||
+        {K, V} <- [{<<"1">>, <<"apple">>}, {<<"2">>, <<"banana">>}, {<<"3">>, <<"cherry">>}]],
+    [?assertMatch(ok, put(ConnRef, "table:colour", I, K)) ||
+        {I, K} <- [{<<"red/1">>, <<"1">>}, {<<"red/3">>, <<"3">>}, {<<"red/4">>, <<"4">>},
+                   {<<"yellow/2">>, <<"2">>}]],
+    ?assertMatch({more, [{<<"red/1">>, <<"1">>, <<"apple">>}], <<"red/3">>},
+                 index_join(ConnRef, "table:colour", "table:objects", <<"red/">>, {prefix, <<"red/">>},
+                            [{max_count, 1}])),
+    ?assertMatch({done, [{<<"red/3">>, <<"3">>, <<"cherry">>}]},
+                 index_join(ConnRef, "table:colour", "table:objects", <<"red/3">>, {prefix, <<"red/">>}, [])),
+    ok = connection_close(ConnRef).
+
+drop_deferred_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertMatch(ok, drop_deferred(ConnRef, "table:test")),
+    ?assertMatch({error, {enoent, _}}, get(ConnRef, "table:test", <<"a">>)),
+    ?assertMatch({ok, [{drops_pending, 1}]}, pending_drops(ConnRef)),
+    %% The open cursor holds up the drop until it is closed.
+    ?assertMatch(ok, cursor_close(Cursor)),
+    WaitForDrop = fun(_, 0) -> timeout;
+                     (Wait, N) ->
+                          case pending_drops(ConnRef) of
+                              {ok, [{drops_pending, 0}]} -> ok;
+                              _ -> timer:sleep(500), Wait(Wait, N - 1)
+                          end
+                  end,
+    ?assertMatch(ok, WaitForDrop(WaitForDrop, 40)),
+    ?assertMatch(ok, create(ConnRef, "table:test")),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"a">>)),
+    %% Made anew while a cursor still holds up the drop, the table is
+    %% emptied and kept.
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"b">>, <<"banana">>)),
+    {ok, Cursor2} = cursor_open(ConnRef, "table:test"),
+    ?assertMatch(ok, drop_deferred(ConnRef, "table:test")),
+    ?assertMatch(ok, create(ConnRef, "table:test")),
+    ?assertMatch({ok, [{drops_pending, 0}]}, pending_drops(ConnRef)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"b">>)),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"c">>, <<"cherry">>)),
+    ?assertMatch({ok, <<"cherry">>}, get(ConnRef, "table:test", <<"c">>)),
+    ?assertMatch(ok, cursor_close(Cursor2)),
+    %% There is no limit on the drops waiting, say those of a backend with
+    %% a table per bucket.
+    Tables = ["table:t" ++ integer_to_list(I) || I <- lists:seq(1, 100)],
+    [?assertMatch(ok, create(ConnRef, T)) || T <- Tables],
+    [?assertMatch(ok, drop_deferred(ConnRef, T)) || T <- Tables],
+    ?assertMatch(ok, WaitForDrop(WaitForDrop, 40)),
+    ok = connection_close(ConnRef).
+
+pending_drops(ConnRef) ->
+    {ok, Stats} = connection_stats(ConnRef),
+    {ok, [lists:keyfind(drops_pending, 1, Stats)]}.
+
+distinct_elements_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    %% Keys are the sext encodings of {I, J} for small integers.
+    Int = fun(I) -> <<10, I:31, 0:1>> end,
+    Pair = fun(I, J) -> <<16, 2:32, (Int(I))/binary, (Int(J))/binary>> end,
+    [?assertMatch(ok, put(ConnRef, "table:test", Pair(I, J), <<"v">>)) ||
+        {I, J} <- [{1, 1}, {1, 2}, {1, 3}, {2, 1}, {4, 1}, {4, 7}]],
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"not a tuple">>, <<"v">>)),
+    ?assertEqual({ok, [Int(1), Int(2), Int(4)]},
+                 distinct_elements(ConnRef, "table:test", first, last, 1)),
+    ?assertEqual({ok, [Int(2), Int(4)]},
+                 distinct_elements(ConnRef, "table:test", Pair(2, 0), {before, Pair(4, 7)}, 1)),
+    ?assertEqual({ok, [Int(1), Int(2), Int(3), Int(1), Int(1), Int(7)]},
+                 distinct_elements(ConnRef, "table:test", first, {prefix, <<16>>}, 2)),
+    %% {1, 1.5}: floats can't be walked, asking for or past one is badarg.
+    ?assertMatch(ok, put(ConnRef, "table:test", <<16, 2:32, (Int(1))/binary, 10, 1:31, 1:1, 128>>,
+                         <<"v">>)),
+    ?assertEqual({ok, [Int(1), Int(2), Int(4)]},
+                 distinct_elements(ConnRef, "table:test", first, last, 1)),
+    ?assertEqual({error, badarg},
+                 distinct_elements(ConnRef, "table:test", first, {prefix, <<16>>}, 2)),
+    Filter = {'not', {element, 2, eq, Int(1)}},
+    ?assertEqual({error, badarg},
+                 aggregate(ConnRef, "table:test", {first, last, Filter}, [count])),
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertEqual({error, badarg},
+                 fold_range(Cursor, first, last, fun(KV, Acc) -> [KV | Acc] end, [],
+                            [{filter, Filter}])),
+    ?assertMatch(ok, cursor_close(Cursor)),
+    ok = connection_close(ConnRef).
+
+sext_test() ->
+    Key = <<16, 3:32, 12, 183, 128, 8, 18, 176, 128, 8, 18, 177, 0, 8>>,
+    ?assertEqual(Key, sext_encode({o, <<"a">>, <<"b">>})),
+    ?assertEqual({o, <<"a">>, <<"b">>}, sext_decode(Key)),
+    ?assertEqual(binary:part(Key, 0, 10), sext_prefix({o, <<"a">>, '_'})),
+    ?assertEqual(<<16, 3:32, 12, 183, 128, 8>>, sext_prefix({o, '$1', <<"b">>})),
+    ?assertEqual(<<>>, sext_prefix('_')),
+    [?assertEqual(T, sext_decode(sext_encode(T))) ||
+        T <- [{i, <<>>, <<"f_bin">>, <<0, 255, 1, 2, 3, 4, 5, 6, 7, 8>>, <<"k">>},
+              {i, <<"b">>, <<"f_int">>, 0, <<"k">>}, {a, {2147483647, b}}, <<1:800>>]],
+    ?assertError(badarg, sext_encode({o, <<"a">>, -1})),
+    ?assertError(badarg, sext_encode([<<"a">>])),
+    ?assertError(badarg, sext_decode(<<Key/binary, 0>>)).
+
+key_format_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ObjectKey = sext_encode({o, <<"a">>, <<"b">>}),
+    IndexKey = sext_encode({i, <<"a">>, <<"f_bin">>, <<"t">>, <<"b">>}),
+    [?assertMatch(ok, put(ConnRef, "table:test", K, <<"v">>)) ||
+        K <- [ObjectKey, IndexKey, <<"raw">>]],
+    {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+    ?assertEqual({done, [{<<"a">>, <<"b">>}, {i, <<"a">>, <<"f_bin">>, <<"t">>, <<"b">>}, <<"raw">>]},
+                 cursor_batch(Cursor, next, 10, 4096, [{items, key}, {key_format, object}])),
+    ?assertEqual([{{o, <<"a">>, <<"b">>}, <<"v">>}],
+                 fold_range(Cursor, first, {prefix, sext_prefix({o, '_', '_'})},
+                            fun(Item, Acc) -> [Item | Acc] end, [], [{key_format, sext}])),
+    ?assertMatch(ok, cursor_close(Cursor)),
+    ok = connection_close(ConnRef).
+
+export_import_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    Records = [{<<I:32>>, binary:copy(<<"v">>, I rem 100)} || I <- lists:seq(1, 5000)],
+    [?assertMatch(ok, put(ConnRef, "table:test", K, V)) || {K, V} <- Records],
+    ?assertMatch(ok, create(ConnRef, "table:copy")),
+    %% Returns the number of chunks and records imported.
+    Import = fun(Import, {Ref, _}=Stream, Cursor, Chunks, Count) ->
+                     receive
+                         {wterl_stream, Ref, {data, Chunk}} ->
+                             ok = stream_ack(Stream, 1),
+                             {ok, N} = import_chunk(Cursor, Chunk),
+                             Import(Import, Stream, Cursor, Chunks + 1, Count + N);
+                         {wterl_stream, Ref, {done, Chunk}} ->
+                             {ok, N} = import_chunk(Cursor, Chunk),
+                             {Chunks + 1, Count + N}
+                     end
+             end,
+    {ok, Stream} = export_table(ConnRef, "table:test", [{batch_count, 1000}]),
+    {ok, Bulk} = import_open(ConnRef, "table:copy"),
+    %% Five full chunks, then an empty one once the end is reached.
+    ?assertEqual({6, 5000}, Import(Import, Stream, Bulk, 0, 0)),
+    ?assertMatch(ok, cursor_close(Bulk)),
+    %% The export closed its cursor when the stream was done.
+    {ok, Stats} = connection_stats(ConnRef),
+    ?assertEqual(0, proplists:get_value(cursors_open, Stats)),
+    {ok, Copy} = cursor_open(ConnRef, "table:copy"),
+    ?assertEqual(Records, lists:reverse(fold(Copy, fun(KV, Acc) -> [KV | Acc] end, []))),
+    ?assertMatch(ok, cursor_close(Copy)),
+    %% The copy isn't empty now, so this import overwrites its records,
+    %% and export_table always streams chunks whatever the items option.
+    {ok, Stream2} = export_table(ConnRef, "table:test", [{compress, none}, {items, kv}]),
+    {ok, Cursor} = import_open(ConnRef, "table:copy"),
+    ?assertEqual({1, 5000}, Import(Import, Stream2, Cursor, 0, 0)),
+    ?assertMatch({error, {einval, _}}, import_chunk(Cursor, <<0, 1:32, 3:32, "ab">>)),
+    ?assertMatch({error, {einval, _}}, import_chunk(Cursor, <<2, 0:32>>)),
+    ?assertMatch(ok, cursor_close(Cursor)),
+    ok = connection_close(ConnRef).
+
+snapshot_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    case snapshot(ConnRef) of
+        {error, {enotsup, _}} ->
+            ok;
+        {ok, Snapshot} ->
+            ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apricot">>)),
+            ?assertMatch(ok, put(ConnRef, "table:test", <<"b">>, <<"banana">>)),
+            ?assertMatch({ok, [{ok, <<"apple">>}, not_found]},
+                         snapshot_get(Snapshot, "table:test", [<<"a">>, <<"b">>])),
+            {ok, Cursor} = snapshot_cursor_open(Snapshot, "table:test"),
+            ?assertMatch({ok, <<"a">>, <<"apple">>}, cursor_next(Cursor)),
+            ?assertMatch(not_found, cursor_next(Cursor)),
+            ?assertMatch(ok, cursor_close(Cursor)),
+            {ok, Info} = snapshot_info(Snapshot),
+            ?assertMatch(false, proplists:get_value(released, Info)),
+            ?assert(lists:keymember(pinned_range, 1, Info)),
+            ?assertMatch(ok, snapshot_release(Snapshot)),
+            ?assertMatch({error, {einval, _}}, snapshot_get(Snapshot, "table:test", [<<"a">>]))
+    end,
+    ok = connection_close(ConnRef).
+
+merge_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch({error, {einval, _}}, merge(ConnRef, "table:test", <<"n">>, 1)),
+    ?assertMatch(ok, set_merge_operator(ConnRef, "table:test", add)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"n">>)),
+    [?assertMatch(ok, merge(ConnRef, "table:test", <<"n">>, X)) || X <- lists:seq(1, 40)],
+    ?assertMatch({ok, <<820:64/signed>>}, get(ConnRef, "table:test", <<"n">>)),
+    ?assertMatch(ok, merge(ConnRef, "table:test", <<"n">>, -20)),
+    ?assertMatch({ok, <<800:64/signed>>}, get(ConnRef, "table:test", <<"n">>)),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"n">>, <<10:64/signed>>)),
+    ?assertMatch({ok, <<10:64/signed>>}, get(ConnRef, "table:test", <<"n">>)),
+    ?assertMatch(ok, delete(ConnRef, "table:test", <<"n">>)),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"n">>)),
+    %% Other writes see and replace the operands too.
+    ?assertMatch(ok, merge(ConnRef, "table:test", <<"m">>, 5)),
+    ?assertMatch(duplicate_key, put_new(ConnRef, "table:test", <<"m">>, <<1:64/signed>>)),
+    ?assertMatch({error, {mismatch, <<5:64/signed>>}},
+                 compare_and_swap(ConnRef, "table:test", <<"m">>, not_found, <<1:64/signed>>)),
+    ?assertMatch(ok, compare_and_swap(ConnRef, "table:test", <<"m">>, <<5:64/signed>>,
+                                      <<7:64/signed>>)),
+    ?assertMatch(ok, merge(ConnRef, "table:test", <<"m">>, 1)),
+    ?assertMatch(ok, write_batch(ConnRef, [{put, "table:test", <<"m">>, <<2:64/signed>>}])),
+    ?assertMatch({ok, <<2:64/signed>>}, get(ConnRef, "table:test", <<"m">>)),
+    ?assertMatch({error, {enotsup, _}}, append(ConnRef, "table:test", <<"m">>, <<"x">>)),
+    ?assertMatch(ok, merge(ConnRef, "table:test", <<"o">>, 3)),
+    ?assertMatch(ok, truncate(ConnRef, "table:test")),
+    ?assertMatch(not_found, get(ConnRef, "table:test", <<"o">>)),
+    ?assertMatch(ok, create(ConnRef, "table:log")),
+    ?assertMatch(ok, set_merge_operator(ConnRef, "table:log", append)),
+    ?assertMatch(ok, merge(ConnRef, "table:log", <<"l">>, <<"a">>)),
+    ?assertMatch(ok, merge(ConnRef, "table:log", <<"l">>, <<"b">>)),
+    ?assertMatch({ok, <<"ab">>}, get(ConnRef, "table:log", <<"l">>)),
+    ?assertMatch({error, {einval, _}}, ttl_enable(ConnRef, "table:log")),
+    ?assertMatch(ok, merge(ConnRef, "table:log", <<"l">>, <<"c">>)),
+    ok = connection_close(ConnRef),
+    %% The operator is still registered after reopening the connection.
+    {ok, CWD} = file:get_cwd(),
+    {ok, ConnRef2} = connection_open(filename:join([CWD, ?TEST_DATA_DIR]), [{create, true}]),
+    ?assertMatch({ok, <<"abc">>}, get(ConnRef2, "table:log", <<"l">>)),
+    ?assertMatch(ok, merge(ConnRef2, "table:log", <<"l">>, <<"d">>)),
+    ?assertMatch({ok, <<"abcd">>}, get(ConnRef2, "table:log", <<"l">>)),
+    ok = connection_close(ConnRef2).
+
+zero_copy_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR, [{create,true},{zero_copy_threshold,1024}]),
+    ConnRef = open_test_table(ConnRef),
+    Big = binary:copy(<<"0123456789abcdef">>, 4096),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"big">>, Big)),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"small">>, <<"value">>)),
+    ?assertMatch({ok, <<"value">>}, get(ConnRef, "table:test", <<"small">>)),
+    Self = self(),
+    Holder = spawn(fun() ->
+                           {ok, Value} = get(ConnRef, "table:test", <<"big">>),
+                           Self ! {held, Value =:= Big},
+                           receive release -> ok end
+                   end),
+    receive {held, Same} -> ?assert(Same) end,
+    ?assertMatch({error, {ebusy, _}}, connection_close(ConnRef)),
+    MRef = erlang:monitor(process, Holder),
+    Holder ! release,
+    receive {'DOWN', MRef, process, Holder, _} -> ok end,
+    ok = connection_close(ConnRef).
+
 %% cursor_fold_keys_test() ->
 %%     ConnRef = open_test_conn(?TEST_DATA_DIR),
 %%     ConnRef = open_test_table(ConnRef),
@@ -773,11 +2180,30 @@ cursor_open_close_test() ->
     {ok, Cursor1} = cursor_open(ConnRef, "table:test"),
     ?assertMatch({ok, <<"a">>, <<"apple">>}, cursor_next(Cursor1)),
     ?assertMatch(ok, cursor_close(Cursor1)),
+    ?assertMatch(ok, cursor_close(Cursor1)),
+    ?assertMatch({error, {einval, _}}, cursor_next(Cursor1)),
     {ok, Cursor2} = cursor_open(ConnRef, "table:test"),
     ?assertMatch({ok, <<"g">>, <<"gooseberry">>}, cursor_prev(Cursor2)),
     ?assertMatch(ok, cursor_close(Cursor2)),
+    {ok, Stats} = connection_stats(ConnRef),
+    ?assertMatch(0, proplists:get_value(cursors_open, Stats)),
+    ?assert(proplists:get_value(ctx_cache_hits, Stats) >= 1),
     stop_test_table(ConnRef).
 
+stats_test() ->
+    ConnRef = open_test_conn(?TEST_DATA_DIR, [{create,true},{statistics,["fast"]}]),
+    ConnRef = open_test_table(ConnRef),
+    ?assertMatch(ok, put(ConnRef, "table:test", <<"a">>, <<"apple">>)),
+    {ok, All} = stats(ConnRef),
+    ?assert(length(All) > 0),
+    ?assert(lists:all(fun({Desc, Value}) -> is_binary(Desc) andalso is_integer(Value) end, All)),
+    {ok, Cache} = stats(ConnRef, "", [{only, [<<"cache:">>]}]),
+    ?assert(lists:all(fun({<<"cache:", _/binary>>, _}) -> true; (_) -> false end, Cache)),
+    ?assertMatch({ok, [_|_]}, stats(ConnRef, "table:test")),
+    ?assertMatch({ok, _}, stats(ConnRef, "table:test", [fast])),
+    ?assertMatch({error, _}, stats(ConnRef, "table:missing")),
+    ok = connection_close(ConnRef).
+
 various_cursor_test_() ->
     {setup,
      fun init_test_table/0,
@@ -829,6 +2255,85 @@ various_cursor_test_() ->
                         ?assertMatch(not_found, cursor_next(Cursor)),
                         ?assertMatch(ok, cursor_close(Cursor))
                 end},
+               {"read a cursor in batches, forward and back",
+                fun() ->
+                        {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+                        ?assertMatch({ok, [{<<"a">>, <<"apple">>}, {<<"b">>, <<"banana">>}]},
+                                     cursor_next_batch(Cursor, 2, 1024)),
+                        ?assertMatch({ok, [<<"c">>]}, cursor_next_key_batch(Cursor, 5, 1)),
+                        ?assertMatch({done, [<<"date">>, <<"elephant">>, <<"forest">>, <<"gooseberry">>]},
+                                     cursor_next_value_batch(Cursor, 10, 1024)),
+                        ?assertMatch({ok, [<<"g">>, <<"f">>]}, cursor_prev_key_batch(Cursor, 2, 1024)),
+                        ?assertMatch(ok, cursor_close(Cursor))
+                end},
+               {"fold over a range by streaming it",
+                fun() ->
+                        {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+                        ?assertMatch([<<"e">>, <<"d">>, <<"c">>],
+                                     fold_range(Cursor, <<"bb">>, <<"e">>,
+                                                fun(Key, Acc) -> [Key | Acc] end, [],
+                                                [{items, key}, {batch_count, 1}, {credits, 1}])),
+                        ?assertMatch([{<<"g">>, <<"gooseberry">>}],
+                                     fold_range(Cursor, <<"g">>, last, fun(KV, Acc) -> [KV | Acc] end, [], [])),
+                        ?assertMatch([], fold_range(Cursor, first, {prefix, <<"x">>},
+                                                    fun(KV, Acc) -> [KV | Acc] end, [], [])),
+                        %% A fold that breaks out closes its stream, the
+                        %% cursor is then free to close.
+                        ?assertMatch(found, catch fold_range(Cursor, first, last,
+                                                             fun(_, _) -> throw(found) end, [],
+                                                             [{batch_count, 1}])),
+                        {ok, Stream} = stream_range(Cursor, first, last, [{credits, 0}]),
+                        ?assertMatch({error, {ebusy, _}}, cursor_next(Cursor)),
+                        ?assertMatch({error, {ebusy, _}}, cursor_close(Cursor)),
+                        ?assertMatch(ok, stream_close(Stream)),
+                        ?assertMatch(ok, cursor_close(Cursor))
+                end},
+               {"filter a streamed range",
+                fun() ->
+                        {ok, Cursor} = cursor_open(ConnRef, "table:test"),
+                        KeysFun = fun(Key, Acc) -> [Key | Acc] end,
+                        ?assertMatch([<<"f">>, <<"d">>, <<"c">>, <<"b">>],
+                                     fold_range(Cursor, first, last, KeysFun, [],
+                                                [{items, key},
+                                                 {filter, {'or', [{range, <<"d">>, <<"d">>},
+                                                                  {value_size, 6, 6}]}}])),
+                        ?assertMatch([<<"g">>, <<"e">>],
+                                     fold_range(Cursor, first, last, KeysFun, [],
+                                                [{items, key}, {batch_count, 1},
+                                                 {filter, {'not', {'or', [{prefix, <<"a">>},
+                                                                          {range, <<"d">>, <<"d">>},
+                                                                          {value_size, 6, 6}]}}}])),
+                        ?assertMatch(ok, cursor_close(Cursor))
+                end},
+               {"aggregate a table and ranges of it",
+                fun() ->
+                        ?assertMatch({ok, [{count, 7}, {key_bytes, 7}, {value_bytes, 45},
+                                           {min_key, <<"a">>}, {max_key, <<"g">>}]},
+                                     aggregate(ConnRef, "table:test", all,
+                                               [count, key_bytes, value_bytes, min_key, max_key])),
+                        ?assertMatch({ok, [{max_key, <<"e">>}, {min_key, <<"c">>}]},
+                                     aggregate(ConnRef, "table:test", {<<"bb">>, <<"e">>}, [max_key, min_key])),
+                        ?assertMatch({ok, [{max_key, <<"d">>}]},
+                                     aggregate(ConnRef, "table:test", {first, {before, <<"e">>}}, [max_key])),
+                        ?assertMatch({ok, [{count, 3}, {max_key, <<"f">>}]},
+                                     aggregate(ConnRef, "table:test", {first, last, {value_size, 6, 6}},
+                                               [count, max_key])),
+                        ?assertMatch({ok, [{min_key, not_found}, {max_key, not_found}]},
+                                     aggregate(ConnRef, "table:test", {<<"h">>, {prefix, <<"h">>}},
+                                               [min_key, max_key])),
+                        ?assertMatch(false, is_empty(ConnRef, "table:test"))
+                end},
+               {"fold over a table in parallel ranges",
+                fun() ->
+                        Keys = [<<"a">>, <<"b">>, <<"c">>, <<"d">>, <<"e">>, <<"f">>, <<"g">>],
+                        KeysFun = fun(Key, Acc) -> [Key | Acc] end,
+                        {ok, Ordered} = parallel_fold(ConnRef, "table:test", 3, KeysFun, [],
+                                                      [{items, key}]),
+                        ?assertMatch(Keys, lists:append([lists:reverse(P) || P <- Ordered])),
+                        {ok, Unordered} = parallel_fold(ConnRef, "table:test", 4, KeysFun, [],
+                                                        [{items, key}, {ordered, false}]),
+                        ?assertMatch(Keys, lists:sort(lists:append(Unordered)))
+                end},
                {"fold keys",
                 fun() ->
                         {ok, Cursor} = cursor_open(ConnRef, "table:test"),